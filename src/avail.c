@@ -0,0 +1,170 @@
+#include "avail.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+// f_hash is already uniform, so its first bytes pick the bucket.
+static size_t bucket_of(const unsigned char hash[MD5_DIGEST_LENGTH]) {
+  return (((size_t)hash[0] << 8) | hash[1]) % AVAIL_BUCKETS;
+}
+
+static bool has_bit(const uint8_t *bits, uint32_t i) {
+  return (bits[i / 8] >> (7 - i % 8)) & 0x01;
+}
+
+// Find a file, creating it if <create> is set. Requires the lock.
+static avail_file_t *find_file(avail_t *avail, const unsigned char hash[MD5_DIGEST_LENGTH], bool create) {
+  avail_file_t **head = &avail->buckets[bucket_of(hash)];
+  for (avail_file_t *f = *head; f != NULL; f = f->next) {
+    if (memcmp(f->hash, hash, MD5_DIGEST_LENGTH) == 0) {
+      return f;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  avail_file_t *f = calloc(1, sizeof(avail_file_t));
+  if (f == NULL) {
+    return NULL;
+  }
+  memcpy(f->hash, hash, MD5_DIGEST_LENGTH);
+  f->next = *head;
+  *head = f;
+  return f;
+}
+
+// Find a peer's entry for a file, creating an empty one if needed. Requires the lock.
+static avail_holder_t *find_holder(avail_file_t *f, int peer) {
+  for (avail_holder_t *h = f->holders; h != NULL; h = h->next) {
+    if (h->peer == peer) {
+      return h;
+    }
+  }
+  avail_holder_t *h = calloc(1, sizeof(avail_holder_t));
+  if (h == NULL) {
+    return NULL;
+  }
+  h->peer = peer;
+  h->next = f->holders;
+  f->holders = h;
+  return h;
+}
+
+// Grow a holder's bitfield to at least <count> chunks. Requires the lock.
+static int grow(avail_holder_t *h, uint32_t count) {
+  if (count <= h->count) {
+    return SUCCESS;
+  }
+  size_t old_bytes = (h->count + 7) / 8;
+  size_t new_bytes = ((size_t)count + 7) / 8;
+  if (new_bytes > old_bytes) {
+    uint8_t *bits = realloc(h->bits, new_bytes);
+    if (bits == NULL) {
+      return FAILED;
+    }
+    memset(bits + old_bytes, 0, new_bytes - old_bytes);
+    h->bits = bits;
+  }
+  h->count = count;
+  return SUCCESS;
+}
+
+void init_avail(avail_t *avail) {
+  pthread_mutex_init(&avail->lock, NULL);
+  memset(avail->buckets, 0, sizeof(avail->buckets));
+}
+
+// Replace what <peer> holds of a file.
+int avail_set(avail_t *avail, int peer, const unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t *bits, uint32_t count) {
+  pthread_mutex_lock(&avail->lock);
+  avail_file_t *f = find_file(avail, hash, true);
+  avail_holder_t *h = f != NULL ? find_holder(f, peer) : NULL;
+  int rc = FAILED;
+  if (h != NULL && grow(h, count) == SUCCESS) {
+    memset(h->bits, 0, (h->count + 7) / 8);
+    memcpy(h->bits, bits, ((size_t)count + 7) / 8);
+    rc = SUCCESS;
+  }
+  pthread_mutex_unlock(&avail->lock);
+  return rc;
+}
+
+// Record that <peer> verified <chunk> of a file.
+int avail_add(avail_t *avail, int peer, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk) {
+  if (chunk == UINT32_MAX) {
+    return FAILED;
+  }
+  pthread_mutex_lock(&avail->lock);
+  avail_file_t *f = find_file(avail, hash, true);
+  avail_holder_t *h = f != NULL ? find_holder(f, peer) : NULL;
+  int rc = FAILED;
+  if (h != NULL && grow(h, chunk + 1) == SUCCESS) {
+    h->bits[chunk / 8] |= 0x80 >> (chunk % 8);
+    rc = SUCCESS;
+  }
+  pthread_mutex_unlock(&avail->lock);
+  return rc;
+}
+
+// Forget everything <peer> advertised. Files nobody holds any more are dropped.
+void avail_remove_peer(avail_t *avail, int peer) {
+  pthread_mutex_lock(&avail->lock);
+  for (int b = 0; b < AVAIL_BUCKETS; b++) {
+    for (avail_file_t **fp = &avail->buckets[b]; *fp != NULL;) {
+      avail_file_t *f = *fp;
+      for (avail_holder_t **hp = &f->holders; *hp != NULL;) {
+        avail_holder_t *h = *hp;
+        if (h->peer == peer) {
+          *hp = h->next;
+          free(h->bits);
+          free(h);
+        } else {
+          hp = &h->next;
+        }
+      }
+      if (f->holders == NULL) {
+        *fp = f->next;
+        free(f);
+      } else {
+        fp = &f->next;
+      }
+    }
+  }
+  pthread_mutex_unlock(&avail->lock);
+}
+
+// Write up to <max> peers holding <chunk> of a file to <peers>.
+int avail_holders(avail_t *avail, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, int *peers, int max) {
+  int found = 0;
+  pthread_mutex_lock(&avail->lock);
+  avail_file_t *f = find_file(avail, hash, false);
+  for (avail_holder_t *h = f != NULL ? f->holders : NULL; h != NULL && found < max; h = h->next) {
+    if (chunk < h->count && has_bit(h->bits, chunk)) {
+      peers[found++] = h->peer;
+    }
+  }
+  pthread_mutex_unlock(&avail->lock);
+  return found;
+}
+
+void free_avail(avail_t *avail) {
+  pthread_mutex_lock(&avail->lock);
+  for (int b = 0; b < AVAIL_BUCKETS; b++) {
+    avail_file_t *f = avail->buckets[b];
+    while (f != NULL) {
+      avail_file_t *next_file = f->next;
+      avail_holder_t *h = f->holders;
+      while (h != NULL) {
+        avail_holder_t *next = h->next;
+        free(h->bits);
+        free(h);
+        h = next;
+      }
+      free(f);
+      f = next_file;
+    }
+    avail->buckets[b] = NULL;
+  }
+  pthread_mutex_unlock(&avail->lock);
+}
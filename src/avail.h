@@ -0,0 +1,45 @@
+#pragma once
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <stdint.h>
+
+// Buckets of the availability map, keyed on the start of f_hash.
+#define AVAIL_BUCKETS 1024
+
+// Which chunks one peer holds of a file, one bit per chunk like verified_chunks_t.
+typedef struct avail_holder {
+  int peer;
+  uint32_t count;
+  uint8_t *bits;
+  struct avail_holder *next;
+} avail_holder_t;
+
+typedef struct avail_file {
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  avail_holder_t *holders;
+  struct avail_file *next;
+} avail_file_t;
+
+// What every peer advertised it holds, per file.
+typedef struct {
+  pthread_mutex_t lock;
+  avail_file_t *buckets[AVAIL_BUCKETS];
+} avail_t;
+
+void init_avail(avail_t *avail);
+
+// Replace what <peer> holds of a file with the <count> chunks of <bits>.
+// Returns FAILED if failed and SUCCESS on success.
+int avail_set(avail_t *avail, int peer, const unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t *bits, uint32_t count);
+
+// Record that <peer> verified <chunk> of a file.
+// Returns FAILED if failed and SUCCESS on success.
+int avail_add(avail_t *avail, int peer, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk);
+
+// Forget everything <peer> advertised, e.g. once it disconnected.
+void avail_remove_peer(avail_t *avail, int peer);
+
+// Write up to <max> peers holding <chunk> of a file to <peers>. Returns how many there are.
+int avail_holders(avail_t *avail, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, int *peers, int max);
+
+void free_avail(avail_t *avail);
@@ -0,0 +1,103 @@
+#include "bitset.h"
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+// Create a set of <count> clear bits.
+int init_bitset(bitset_t *set, uint32_t count) {
+  set->count = count;
+  set->bits = calloc(BITSET_BYTES(count) > 0 ? BITSET_BYTES(count) : 1, 1);
+  return set->bits == NULL ? FAILED : SUCCESS;
+}
+
+void free_bitset(bitset_t *set) {
+  free(set->bits);
+  set->bits = NULL;
+  set->count = 0;
+}
+
+void bitset_set(bitset_t *set, uint32_t i) {
+  if (i < set->count) {
+    set->bits[i / 8] |= 0x80 >> (i % 8);
+  }
+}
+
+void bitset_clear(bitset_t *set, uint32_t i) {
+  if (i < set->count) {
+    set->bits[i / 8] &= ~(0x80 >> (i % 8));
+  }
+}
+
+// Set every bit. The unused bits of the last byte stay clear so whole bytes can be counted.
+void bitset_fill(bitset_t *set) {
+  size_t bytes = BITSET_BYTES(set->count);
+  memset(set->bits, 0xFF, bytes);
+  if (set->count % 8 != 0) {
+    set->bits[bytes - 1] = (uint8_t)(0xFF << (8 - set->count % 8));
+  }
+}
+
+bool bitset_test(const bitset_t *set, uint32_t i) {
+  return i < set->count && (set->bits[i / 8] >> (7 - i % 8)) & 0x01;
+}
+
+void bitset_set_atomic(bitset_t *set, uint32_t i) {
+  if (i < set->count) {
+    __atomic_fetch_or(&set->bits[i / 8], (uint8_t)(0x80 >> (i % 8)), __ATOMIC_RELAXED);
+  }
+}
+
+void bitset_clear_atomic(bitset_t *set, uint32_t i) {
+  if (i < set->count) {
+    __atomic_fetch_and(&set->bits[i / 8], (uint8_t)~(0x80 >> (i % 8)), __ATOMIC_RELAXED);
+  }
+}
+
+bool bitset_test_atomic(const bitset_t *set, uint32_t i) {
+  return i < set->count && (__atomic_load_n(&set->bits[i / 8], __ATOMIC_RELAXED) >> (7 - i % 8)) & 0x01;
+}
+
+// Returns the number of set bits, a word at a time.
+uint32_t bitset_popcount(const bitset_t *set) {
+  size_t bytes = BITSET_BYTES(set->count);
+  uint32_t count = 0;
+  size_t i = 0;
+  for (; i + 8 <= bytes; i += 8) {
+    uint64_t word;
+    memcpy(&word, set->bits + i, 8);
+    count += __builtin_popcountll(word);
+  }
+  for (; i < bytes; i++) {
+    count += __builtin_popcount(set->bits[i]);
+  }
+  return count;
+}
+
+bool bitset_full(const bitset_t *set) {
+  return bitset_popcount(set) == set->count;
+}
+
+// Returns the first clear bit at or after <from>. Runs of set bits are skipped a word at a time.
+int64_t bitset_next_missing(const bitset_t *set, uint32_t from) {
+  size_t bytes = BITSET_BYTES(set->count);
+  uint32_t i = from;
+  while (i < set->count) {
+    if (i % 64 == 0 && i / 8 + 8 <= bytes) {
+      uint64_t word;
+      memcpy(&word, set->bits + i / 8, 8);
+      if (word == UINT64_MAX) {
+        i += 64;
+        continue;
+      }
+    }
+    if (i % 8 == 0 && set->bits[i / 8] == 0xFF) {
+      i += 8;
+      continue;
+    }
+    if (!bitset_test(set, i)) {
+      return i;
+    }
+    i++;
+  }
+  return -1;
+}
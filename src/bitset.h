@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A fixed number of bits, packed the way they go on the wire: bit 0 is the most significant bit of byte 0.
+typedef struct {
+  uint32_t count;
+  uint8_t *bits;
+} bitset_t;
+
+// The number of bytes holding <count> bits.
+#define BITSET_BYTES(count) (((size_t)(count) + 7) / 8)
+
+// Create a set of <count> clear bits.
+// Returns FAILED if failed and SUCCESS on success.
+int init_bitset(bitset_t *set, uint32_t count);
+
+void free_bitset(bitset_t *set);
+
+void bitset_set(bitset_t *set, uint32_t i);
+void bitset_clear(bitset_t *set, uint32_t i);
+// Set every bit.
+void bitset_fill(bitset_t *set);
+
+// Returns whether bit <i> is set. Bits past the end are clear.
+bool bitset_test(const bitset_t *set, uint32_t i);
+
+// Set and test bits of a set shared between threads without a lock.
+void bitset_set_atomic(bitset_t *set, uint32_t i);
+void bitset_clear_atomic(bitset_t *set, uint32_t i);
+bool bitset_test_atomic(const bitset_t *set, uint32_t i);
+
+// Returns the number of set bits.
+uint32_t bitset_popcount(const bitset_t *set);
+
+// Returns whether every bit is set.
+bool bitset_full(const bitset_t *set);
+
+// Returns the first clear bit at or after <from>, or -1 if there is none.
+int64_t bitset_next_missing(const bitset_t *set, uint32_t from);
@@ -0,0 +1,109 @@
+#include "catalog.h"
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+static bool under(const tfile_t *t, const catalog_prefix_t *prefix) {
+  return memcmp(t->tdef.f_hash, prefix->bytes, prefix->len) == 0;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+  return memcmp(a, b, MD5_DIGEST_LENGTH);
+}
+
+// Summarize the tfiles under <prefix>.
+void catalog_summarize(htable_t *ht, const catalog_prefix_t *prefix, catalog_summary_t *summary) {
+  memset(summary, 0, sizeof(*summary));
+  summary->prefix = *prefix;
+  // The full hash is a leaf of its own, with nothing below it.
+  if (prefix->len >= MD5_DIGEST_LENGTH) {
+    return;
+  }
+
+  pthread_rwlock_rdlock(&ht->lock);
+  for (size_t i = 0; i < ht->capacity; i++) {
+    tfile_t *t = ht->table[i];
+    if (t == NULL || !under(t, prefix)) {
+      continue;
+    }
+    unsigned char child = t->tdef.f_hash[prefix->len];
+    summary->count[child]++;
+    for (int b = 0; b < MD5_DIGEST_LENGTH; b++) {
+      summary->xor[child][b] ^= t->tdef.f_hash[b];
+    }
+  }
+  pthread_rwlock_unlock(&ht->lock);
+}
+
+// List the hashes of the tfiles under <prefix>.
+int catalog_hashes(htable_t *ht, const catalog_prefix_t *prefix, unsigned char (**hashes)[MD5_DIGEST_LENGTH]) {
+  pthread_rwlock_rdlock(&ht->lock);
+  size_t cap = 16;
+  int count = 0;
+  *hashes = malloc(cap * MD5_DIGEST_LENGTH);
+  for (size_t i = 0; *hashes != NULL && i < ht->capacity; i++) {
+    tfile_t *t = ht->table[i];
+    if (t == NULL || !under(t, prefix)) {
+      continue;
+    }
+    if ((size_t)count == cap) {
+      cap *= 2;
+      unsigned char(*grown)[MD5_DIGEST_LENGTH] = realloc(*hashes, cap * MD5_DIGEST_LENGTH);
+      if (grown == NULL) {
+        free(*hashes);
+        *hashes = NULL;
+        break;
+      }
+      *hashes = grown;
+    }
+    memcpy((*hashes)[count++], t->tdef.f_hash, MD5_DIGEST_LENGTH);
+  }
+  pthread_rwlock_unlock(&ht->lock);
+  return *hashes == NULL ? FAILED : count;
+}
+
+// Find the tfiles under <prefix> which are not among the hashes a peer has.
+int catalog_missing(htable_t *ht, const catalog_prefix_t *prefix, const unsigned char *hashes, int count,
+                    tfile_def_t **missing) {
+  // Sort a copy of the peer's hashes so each of ours is a binary search.
+  unsigned char *sorted = malloc(count * MD5_DIGEST_LENGTH + 1);
+  if (sorted == NULL) {
+    return FAILED;
+  }
+  memcpy(sorted, hashes, count * MD5_DIGEST_LENGTH);
+  qsort(sorted, count, MD5_DIGEST_LENGTH, compare_hashes);
+
+  pthread_rwlock_rdlock(&ht->lock);
+  size_t cap = 16;
+  int found = 0;
+  *missing = malloc(cap * sizeof(tfile_def_t));
+  for (size_t i = 0; *missing != NULL && i < ht->capacity; i++) {
+    tfile_t *t = ht->table[i];
+    if (t == NULL || !under(t, prefix) ||
+        bsearch(t->tdef.f_hash, sorted, count, MD5_DIGEST_LENGTH, compare_hashes) != NULL) {
+      continue;
+    }
+    if ((size_t)found == cap) {
+      cap *= 2;
+      tfile_def_t *grown = realloc(*missing, cap * sizeof(tfile_def_t));
+      if (grown == NULL) {
+        free(*missing);
+        *missing = NULL;
+        break;
+      }
+      *missing = grown;
+    }
+    (*missing)[found++] = t->tdef;
+  }
+  pthread_rwlock_unlock(&ht->lock);
+
+  free(sorted);
+  return *missing == NULL ? FAILED : found;
+}
+
+// The prefix one byte longer than <prefix>, ending in <child>.
+catalog_prefix_t catalog_child(const catalog_prefix_t *prefix, unsigned char child) {
+  catalog_prefix_t c = *prefix;
+  c.bytes[c.len++] = child;
+  return c;
+}
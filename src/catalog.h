@@ -0,0 +1,23 @@
+#pragma once
+#include "file.h"
+#include "wire.h"
+
+// Subtrees holding at most this many tfiles are reconciled by listing their hashes
+// instead of descending further.
+#define CATALOG_LEAF_MAX 64
+
+// Summarize the tfiles under <prefix>.
+void catalog_summarize(htable_t *ht, const catalog_prefix_t *prefix, catalog_summary_t *summary);
+
+// List the hashes of the tfiles under <prefix> into a newly allocated array at <hashes>, which the caller frees.
+// Returns the number of hashes or FAILED.
+int catalog_hashes(htable_t *ht, const catalog_prefix_t *prefix, unsigned char (**hashes)[MD5_DIGEST_LENGTH]);
+
+// Find the tfiles under <prefix> which are not among the <count> <hashes> a peer has.
+// Writes them to a newly allocated array at <missing>, which the caller frees.
+// Returns the number of tfiles or FAILED.
+int catalog_missing(htable_t *ht, const catalog_prefix_t *prefix, const unsigned char *hashes, int count,
+                    tfile_def_t **missing);
+
+// The prefix one byte longer than <prefix>, ending in <child>.
+catalog_prefix_t catalog_child(const catalog_prefix_t *prefix, unsigned char child);
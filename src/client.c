@@ -1,13 +1,27 @@
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <stdbool.h>
+#include <signal.h>
+#include <sys/random.h>
 #include "socket.h"
 #include "file.h"
 #include "message.h"
 #include "client.h"
+#include "reactor.h"
+#include "io.h"
+#include "connpool.h"
+#include "taskpool.h"
+#include "seen.h"
+#include "ratelimit.h"
+#include "catalog.h"
+#include "avail.h"
+#include "sched.h"
+#include "discovery.h"
+#include "transport.h"
 #include "ui.h"
 #include "ui_adapter.h"
 
@@ -23,16 +37,250 @@ peers_t peers = {
 
 // Hash table of the tfiles.
 htable_t ht;
+
+// Address uploaders send chunks back to. Shared by every download.
+struct sockaddr_in data_addr;
+
+// Ids of the chunk requests handled recently, so each is handled once however many paths it arrives on.
+seen_t seen_requests;
+
+// How chunk requests travel through this node.
+request_stats_t request_stats;
+
+// Id of this node, sent as the origin of the tfiles it announces.
+uint64_t node_id;
+
+// Paces how many tfile definitions are gossiped per second.
+bucket_t gossip_bucket;
+
+// How tfile announcements travel through this node.
+gossip_stats_t gossip_stats;
+
+// How much catalog reconciliation costs.
+catalog_stats_t catalog_stats;
+
+// Which chunks every peer advertised it holds.
+avail_t avail;
+
+// How chunk availability is advertised.
+avail_stats_t avail_stats;
+
+// Decides which chunks every download requests, and from whom.
+sched_t sched;
+
+// Bandwidth limits on the blocks we upload, and on those we request.
+shaper_t up_shaper;
+shaper_t down_shaper;
+
+// Blocks waiting for up_shaper to let them go, taken in turns per requester.
+upload_queue_t uploads;
+
+// The ACCEPT_* encodings our block requests accept.
+uint8_t block_encodings = ACCEPT_ZLIB;
+
+// Peers found through LAN discovery.
+discovered_t discovered = {
+    .lock = PTHREAD_MUTEX_INITIALIZER};
+
+// FILE_DATA payloads are streamed into the destination file instead of being buffered.
+reactor_stream_t chunk_stream = {
+    .prefix_size = CHUNK_PAYLOAD_WIRE_SIZE,
+    .begin = chunk_stream_begin,
+    .next = chunk_stream_next,
+    .end = chunk_stream_end};
 // END GLOBALS
 
 // ----Main loop----
 int main(int argc, char **argv)
 {
   init_htable(&ht);
+  init_avail(&avail);
+  node_id = new_request_id();
+  init_bucket(&gossip_bucket, GOSSIP_RATE, GOSSIP_BURST);
+  if (init_seen(&seen_requests, SEEN_REQUESTS_CAPACITY, SEEN_REQUESTS_WINDOW) != SUCCESS)
+  {
+    perror("Memory Allocation error");
+    exit(EXIT_FAILURE);
+  }
 
   // increase peer array
   peers.arr = malloc(peers.capacity * sizeof(peer_fd_t));
 
+  // parse arguments
+  cmd_args_t args = {NULL};
+  parse_args(&args, argc, argv);
+
+  // Select the I/O backend before any socket or file is touched
+  int io_requested = IO_POSIX;
+  if (args.io_p != NULL)
+  {
+    if (strcmp(args.io_p, "uring") == 0)
+    {
+      io_requested = IO_URING;
+    }
+    else if (strcmp(args.io_p, "posix") != 0)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+  int io_selected = io_init(io_requested);
+
+  // Outbound queue limits, given in KiB as <high>[:<low>]
+  size_t queue_high = REACTOR_QUEUE_HIGH;
+  size_t queue_low = REACTOR_QUEUE_LOW;
+  if (args.watermark_p != NULL)
+  {
+    char *end;
+    queue_high = strtoul(args.watermark_p, &end, 10) * 1024;
+    queue_low = queue_high / 4;
+    if (*end == ':')
+      queue_low = strtoul(end + 1, &end, 10) * 1024;
+    if (*end != '\0')
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+  int queue_policy = REACTOR_DROP;
+  if (args.queue_p != NULL)
+  {
+    if (strcmp(args.queue_p, "disconnect") == 0)
+    {
+      queue_policy = REACTOR_DISCONNECT;
+    }
+    else if (strcmp(args.queue_p, "drop") != 0)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (reactor_send_limits(queue_high, queue_low, queue_policy) != SUCCESS)
+  {
+    print_usage(argv);
+    exit(EXIT_FAILURE);
+  }
+
+  // Chunk size of the file we share, given in KiB. Picked from the file size if not given.
+  uint32_t chunk_size = 0;
+  if (args.chunk_p != NULL)
+  {
+    char *end;
+    unsigned long kib = strtoul(args.chunk_p, &end, 10);
+    if (*end != '\0' || kib == 0 || kib > (UINT32_MAX >> 10))
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+    chunk_size = (uint32_t)kib * 1024;
+  }
+
+  // How many block requests may wait on one peer at a time
+  int depth = PIPELINE_DEPTH;
+  if (args.depth_p != NULL)
+  {
+    char *end;
+    long value = strtol(args.depth_p, &end, 10);
+    if (*end != '\0' || value < 1 || value > 1024)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+    depth = (int)value;
+  }
+  init_sched(&sched, BLOCK_SIZE, REQUEST_TIMEOUT_MS, depth, ENDGAME_BLOCKS);
+
+  // Global bandwidth limits in KiB/s, given as <up>[:<down>]. Unlimited if not given or 0.
+  double up_rate = 0;
+  double down_rate = 0;
+  if (args.rate_p != NULL)
+  {
+    char *end;
+    up_rate = strtod(args.rate_p, &end) * 1024;
+    if (*end == ':')
+      down_rate = strtod(end + 1, &end) * 1024;
+    if (*end != '\0' || up_rate < 0 || down_rate < 0)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (init_shaper(&up_shaper, up_rate, 0, 0) != SUCCESS || init_shaper(&down_shaper, down_rate, 0, 0) != SUCCESS)
+  {
+    perror("Memory Allocation error");
+    exit(EXIT_FAILURE);
+  }
+  init_upload_queue(&uploads, UPLOAD_QUEUE_MAX);
+
+  // Encodings blocks may come in: zlib (the default) or none
+  if (args.codec_p != NULL)
+  {
+    if (strcmp(args.codec_p, "none") == 0)
+      block_encodings = 0;
+    else if (strcmp(args.codec_p, "zlib") != 0)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // LAN discovery, given as <neighbors>[:<interface address>]. Off if not given.
+  struct in_addr discovery_iface = {.s_addr = htonl(INADDR_ANY)};
+  if (args.discover_p != NULL)
+  {
+    char *end;
+    long neighbors = strtol(args.discover_p, &end, 10);
+    if ((*end != '\0' && *end != ':') || neighbors < 1 || neighbors > DISCOVERY_MAX_LINKS ||
+        (*end == ':' && inet_pton(AF_INET, end + 1, &discovery_iface) != 1))
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+    discovered.wanted = (int)neighbors;
+  }
+
+  // Algorithm the file we share is hashed with
+  int algorithm = DIGEST_DEFAULT;
+  if (args.digest_p != NULL)
+  {
+    algorithm = digest_parse(args.digest_p);
+    if (algorithm == FAILED)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Transport to nodes on this host: auto (AF_UNIX when they listen there, the default) or tcp
+  if (args.transport_p != NULL)
+  {
+    if (strcmp(args.transport_p, "tcp") == 0)
+      transport_use_local(false);
+    else if (strcmp(args.transport_p, "auto") != 0)
+    {
+      print_usage(argv);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Chunks are sent with sendfile, which cannot suppress SIGPIPE per call
+  signal(SIGPIPE, SIG_IGN);
+
+  // Start the workers which run gossip fan out and downloads
+  if (taskpool_start(TASKPOOL_THREADS) != SUCCESS)
+  {
+    perror("Task pool start failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Start the reactor threads which own every peer socket
+  reactor_stream(FILE_DATA, &chunk_stream);
+  if (reactor_start(REACTOR_THREADS, handle_message, peer_closed) != SUCCESS)
+  {
+    perror("Reactor start failed");
+    exit(EXIT_FAILURE);
+  }
+
   // Create server socket
   unsigned short network_port = 0;
   int server_fd = server_socket_open(&network_port);
@@ -48,16 +296,14 @@ int main(int argc, char **argv)
     perror("listen failed");
     exit(EXIT_FAILURE);
   }
+  // nodes on this host reach the same port over AF_UNIX, or over TCP if it cannot be opened
+  int local_server_fd = transport_listen_local(network_port, 10);
 
   // Address of this client.
   // const char *hostname[45];
   struct sockaddr_in client_addr;
   socklen_t client_addr_len = sizeof(struct sockaddr_in);
 
-  // parse arguments
-  cmd_args_t args = {NULL};
-  parse_args(&args, argc, argv);
-
   // check for extra elements that cannot be identified
   if (optind < argc)
   {
@@ -85,18 +331,18 @@ int main(int argc, char **argv)
     char *host = args.peer_p;
     unsigned short target_port = atoi(args.port_p);
 
-    peer_fd_t host_peer = socket_connect(host, target_port);
+    peer_fd_t host_peer = transport_connect_host(host, target_port);
     if (host_peer == -1)
     {
       perror("Failed to connect");
       exit(EXIT_FAILURE);
     }
 
-    add_peer(&peers, host_peer);
-
-    // read messages using this thread.
-    pthread_t thread;
-    pthread_create(&thread, NULL, readWorker, (void *)&host_peer);
+    if (join_peer(host_peer) != SUCCESS)
+    {
+      perror("Failed to watch peer");
+      exit(EXIT_FAILURE);
+    }
 
     // save self information
     // self_address = get_address_self(host_peer);
@@ -107,20 +353,70 @@ int main(int argc, char **argv)
   {
 
     tfile_def_t new_tfile;
-    generate_tfile(&ht, &new_tfile, args.file_p, args.file_p);
+    if (generate_tfile(&ht, &new_tfile, args.file_p, args.file_p, chunk_size, (uint8_t)algorithm) == -1)
+    {
+      perror("Could not share file");
+      exit(EXIT_FAILURE);
+    }
 
-    pthread_t thread;
-    send_tfile_t *data = malloc(sizeof(send_tfile_t));
-    *data = (send_tfile_t){
-        .sender = NO_SENDER_PEER,
-        .tfile = new_tfile,
-        .peers = &peers};
-    pthread_create(&thread, NULL, share_tfile_to_peers, data);
+    tfile_def_t *announced = malloc(sizeof(tfile_def_t));
+    *announced = new_tfile;
+    gossip_tfiles(NO_SENDER_PEER, announced, 1, (announce_t){.origin = node_id, .hops = 0});
+
+    // peers which connected already only heard about the chunks we held then
+    verified_chunks_t chunks;
+    if (init_bitset(&chunks, new_tfile.num_chunks) == SUCCESS)
+    {
+      bitset_fill(&chunks);
+      pthread_mutex_lock(&peers.lock);
+      for (int i = 0; i < peers.size; i++)
+        send_bitfield(peers.arr[i], new_tfile.f_hash, &chunks);
+      pthread_mutex_unlock(&peers.lock);
+      free_bitset(&chunks);
+    }
   }
 
   // Accept conections from peers
-  pthread_t thread;
-  pthread_create(&thread, NULL, connectWorker, (void *)&server_fd);
+  if (reactor_add_listener(server_fd, accept_peer) != SUCCESS)
+  {
+    perror("Failed to watch server socket");
+    exit(EXIT_FAILURE);
+  }
+  if (local_server_fd != -1 && reactor_add_listener(local_server_fd, accept_peer) != SUCCESS)
+  {
+    perror("Failed to watch local server socket");
+    exit(EXIT_FAILURE);
+  }
+
+  // Open the port chunks are returned to. It lives as long as the node so pooled upload connections stay valid.
+  unsigned short data_port = 0;
+  int data_fd = server_socket_open(&data_port);
+  if (data_fd == -1 || listen(data_fd, 64) || reactor_add_listener(data_fd, accept_chunk_conn) != SUCCESS)
+  {
+    perror("Data socket open failed");
+    exit(EXIT_FAILURE);
+  }
+  int local_data_fd = transport_listen_local(data_port, 64);
+  if (local_data_fd != -1 && reactor_add_listener(local_data_fd, accept_chunk_conn) != SUCCESS)
+  {
+    perror("Local data socket open failed");
+    exit(EXIT_FAILURE);
+  }
+  // credit: https://stackoverflow.com/a/13047959
+  data_addr = (struct sockaddr_in){
+      .sin_family = AF_INET,
+      .sin_port = htons(data_port),
+      .sin_addr.s_addr = INADDR_ANY};
+
+  // Announce ourselves on the LAN once we accept peers
+  if (discovered.wanted > 0 && discovery_start(discovery_iface, node_id, network_port, discovered_node) != SUCCESS)
+  {
+    perror("Discovery start failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Periodic upkeep
+  taskpool_schedule(housekeeping, NULL, HOUSEKEEPING_INTERVAL_MS);
 
   ui_init(ui_input_handler);
 
@@ -132,6 +428,11 @@ int main(int argc, char **argv)
   // Now call the ui_display function with the formatted message
   ui_display("system", message);
 
+  if (io_selected != io_requested)
+  {
+    ui_display("system", "io_uring is not supported by this kernel, using the POSIX backend");
+  }
+
   ui_register_file_list_callback(ui_list_network_files);
 
   ui_run();
@@ -142,93 +443,132 @@ int main(int argc, char **argv)
 }
 
 /**
- * This function shares all tfiles to a single peer.
- * \param args The struct holding all the necessary information for this worker
+ * Sends tfile definitions to one peer, packed into as few TFILE_DEF_BATCH messages as possible.
+ * The frames are queued on the peer's connection, so this never waits for a slow peer.
+ * \param peer The peer to send to
+ * \param tfiles The definitions to send
+ * \param count The number of definitions
+ * \param announce Where the definitions come from
+ * \param bytes If not NULL, the size of the frames sent is added to it
  */
-void *share_tfiles_to_peer(void *args)
+int send_tfile_batches(peer_fd_t peer, tfile_def_t *tfiles, int count, const announce_t *announce, size_t *bytes)
 {
-  send_tfiles_t data = *((send_tfiles_t *)args);
-  pthread_mutex_lock(&data.peers->lock);
-
-  // send all files
-  for (int i = 0; i < data.count; i++)
+  for (int i = 0; i < count;)
   {
+    size_t size;
+    int batch = tfile_batch_fit(tfiles + i, count - i, &size);
+    unsigned char *payload = malloc(size);
+    if (payload == NULL)
+      return FAILED;
 
     // create messag info
     message_info_t info = {
-        .type = TFILE_DEF,
-        .size = sizeof(data.tfile_arr[i])};
+        .type = TFILE_DEF_BATCH,
+        .size = encode_tfile_batch(tfiles + i, batch, announce, payload)};
 
-    // send message to peer with information on the tfile
-    if (send_message(data.peer, &info, (void *)&data.tfile_arr[i]) != 0)
-    {
-      // peer should be removed
-      remove_peer(&peers, data.peer);
-    }
-  }
+    int rc = reactor_send(peer, &info, payload);
+    free(payload);
+    if (rc != SUCCESS)
+      return FAILED;
 
-  pthread_mutex_unlock(&data.peers->lock);
+    if (bytes != NULL)
+      *bytes += MESSAGE_HEADER_SIZE + size;
+    i += batch;
+  }
 
-  return NULL;
+  return SUCCESS;
 }
-/**
- * This function shares a tfile to all peers. If the senderof the pfile is specified, it skips them.
- * \param args The struct holding the t file to be sent to all files as the sender of the tfile who should be skipped and should not revceive the tfile again. Set to 0 to skip
 
+/**
+ * Counts tfile definitions in one of the gossip counters. They are read without a lock.
+ * \param counter The counter to bump
+ * \param count How much to add
  */
-void *share_tfile_to_peers(void *args)
+static void count_gossip(size_t *counter, size_t count)
 {
+  __atomic_fetch_add(counter, count, __ATOMIC_RELAXED);
+}
 
-  send_tfile_t data = *((send_tfile_t *)args);
-
-  // create messag info
-  message_info_t info = {
-      .type = TFILE_DEF,
-      .size = sizeof(data.tfile)};
-
-  // share file with all peers
-  pthread_mutex_lock(&data.peers->lock);
+/**
+ * Starts gossiping tfile definitions to all peers except the one who sent them.
+ * \param sender The peer who sent the definitions, who is skipped. Set to NO_SENDER_PEER to skip no one.
+ * \param tdefs The definitions. Allocated with malloc, freed once they are sent.
+ * \param count The number of definitions
+ * \param announce Where the definitions come from
+ */
+void gossip_tfiles(peer_fd_t sender, tfile_def_t *tdefs, int count, announce_t announce)
+{
+  send_tfiles_t *data = malloc(sizeof(send_tfiles_t));
+  if (data == NULL)
+  {
+    free(tdefs);
+    return;
+  }
+  *data = (send_tfiles_t){
+      .tfile_arr = tdefs,
+      .count = count,
+      .sent = 0,
+      .peer = sender,
+      .peers = &peers,
+      .announce = announce};
+  taskpool_submit(share_tfiles_to_peers, data);
+}
 
-  // store peers to remove and remove them outside of the loop
-  peer_fd_t peers_to_remove[data.peers->size];
-  int peers_to_remove_count = 0;
+/**
+ * This function shares a batch of tfiles to all peers except the one who sent them.
+ * The gossip rate limiter decides how many are sent per run. The rest are sent by a later run once tokens are available,
+ * which smooths out bursts such as a large directory being seeded.
+ * \param args The struct holding the tfiles. Its peer is the sender, who is skipped. Set to NO_SENDER_PEER to skip no one.
+ */
+void share_tfiles_to_peers(void *args)
+{
+  send_tfiles_t *data = args;
+
+  // take a snapshot of the peers so the lock is not held for the whole fan out
+  pthread_mutex_lock(&data->peers->lock);
+  int count = data->peers->size;
+  peer_fd_t *targets = count > 0 ? malloc(count * sizeof(peer_fd_t)) : NULL;
+  if (targets != NULL)
+    memcpy(targets, data->peers->arr, count * sizeof(peer_fd_t));
+  pthread_mutex_unlock(&data->peers->lock);
+
+  // nobody to share with (or no memory to list them), peers which connect later are sent the catalog then
+  if (targets == NULL)
+  {
+    free(data->tfile_arr);
+    free(data);
+    return;
+  }
 
-  // printf("WE ARE SENDING TFILES!!%d\n", data.peers->size);
+  int batch = data->count - data->sent;
+  if (batch > TFILE_BATCH_MAX)
+    batch = TFILE_BATCH_MAX;
+  int granted = bucket_take(&gossip_bucket, batch);
 
-  for (int i = 0; i < data.peers->size; i++)
+  for (int i = 0; granted > 0 && i < count; i++)
   {
     // skip the sender
-    if (data.peers->arr[i] == data.sender)
-    {
+    if (targets[i] == data->peer)
       continue;
-    }
 
-    // send message to peer with information on the tfile
-    if (send_message(data.peers->arr[i], &info, (void *)&data.tfile) != 0)
-    {
-      // remove peer but do it outside of the loop
-      peers_to_remove[peers_to_remove_count++] = i;
-    }
+    if (send_tfile_batches(targets[i], data->tfile_arr + data->sent, granted, &data->announce, NULL) == SUCCESS)
+      count_gossip(&gossip_stats.forwarded, granted);
   }
+  free(targets);
+  if (granted > 0)
+    data->sent += granted;
 
-  remove_peers(peers_to_remove_count, peers_to_remove);
-
-  pthread_mutex_unlock(&data.peers->lock);
-
-  return NULL;
-}
-
-/**
- * Removes peers specified in teh list of peers to remove
- * \param peers_to_remove_count The nubmer of peers to remove
- * \param peers_to_remove Array containing the peers to remove
- */
-void remove_peers(int peers_to_remove_count, peer_fd_t peers_to_remove[peers_to_remove_count])
-{
-  for (int i = 0; i < peers_to_remove_count; i++)
+  // out of tokens, come back once the next batch can go
+  if (data->sent < data->count)
   {
-    remove_peer(&peers, peers_to_remove[i]);
+    int next = data->count - data->sent < TFILE_BATCH_MAX ? data->count - data->sent : TFILE_BATCH_MAX;
+    count_gossip(&gossip_stats.throttled, 1);
+    taskpool_schedule(share_tfiles_to_peers, data, bucket_wait_ms(&gossip_bucket, next));
+    return;
   }
+
+  free(data->tfile_arr);
+  free(data);
 }
 
 /**
@@ -254,9 +594,11 @@ sockdata_t get_address_self(peer_fd_t socket)
     }
     if (info.type == ADDR_SELF)
     {
-      server_addr_len = info.size;
+      unsigned char payload[ADDR_WIRE_SIZE];
+      server_addr_len = sizeof(server_addr);
 
-      if (receive_message(socket, &server_addr, server_addr_len))
+      if (receive_message(socket, payload, sizeof(payload)) ||
+          decode_addr(payload, info.size, &server_addr))
       {
         printf("failed\n");
       }
@@ -298,6 +640,56 @@ void free_args(cmd_args_t args)
     printf("filename: %s\n", args.file_p);
     free(args.file_p);
   }
+  if (args.io_p)
+  {
+    printf("io backend: %s\n", args.io_p);
+    free(args.io_p);
+  }
+  if (args.queue_p)
+  {
+    printf("queue policy: %s\n", args.queue_p);
+    free(args.queue_p);
+  }
+  if (args.watermark_p)
+  {
+    printf("queue watermarks: %s\n", args.watermark_p);
+    free(args.watermark_p);
+  }
+  if (args.chunk_p)
+  {
+    printf("chunk size: %s\n", args.chunk_p);
+    free(args.chunk_p);
+  }
+  if (args.depth_p)
+  {
+    printf("pipeline depth: %s\n", args.depth_p);
+    free(args.depth_p);
+  }
+  if (args.rate_p)
+  {
+    printf("bandwidth limits: %s\n", args.rate_p);
+    free(args.rate_p);
+  }
+  if (args.discover_p)
+  {
+    printf("discovery: %s\n", args.discover_p);
+    free(args.discover_p);
+  }
+  if (args.codec_p)
+  {
+    printf("block encodings: %s\n", args.codec_p);
+    free(args.codec_p);
+  }
+  if (args.transport_p)
+  {
+    printf("local transport: %s\n", args.transport_p);
+    free(args.transport_p);
+  }
+  if (args.digest_p)
+  {
+    printf("hash algorithm: %s\n", args.digest_p);
+    free(args.digest_p);
+  }
 }
 
 /**
@@ -306,7 +698,7 @@ void free_args(cmd_args_t args)
  */
 void print_usage(char **argv)
 {
-  fprintf(stderr, "Usage: %s <-u username> [-p <peer> -n <port number>] [-f file]\n", argv[0]);
+  fprintf(stderr, "Usage: %s <-u username> [-p <peer> -n <port number>] [-f file] [-i posix|uring] [-q drop|disconnect] [-w <high KiB>[:<low KiB>]] [-c <chunk KiB>] [-d <depth>] [-r <up KiB/s>[:<down KiB/s>]] [-D <neighbors>[:<interface address>]] [-z zlib|none] [-t auto|tcp] [-a md5|blake3|xxh64]\n", argv[0]);
 }
 
 /**
@@ -319,10 +711,10 @@ void parse_args(cmd_args_t *args, int argc, char **argv)
 {
   /**
    * User can type the following commands
-   * grinntorrent <-u username> [-p <peer> -n <port number>] [-f file]
+   * grinntorrent <-u username> [-p <peer> -n <port number>] [-f file] [-i posix|uring] [-q drop|disconnect] [-w <high KiB>[:<low KiB>]] [-c <chunk KiB>] [-d <depth>] [-r <up KiB/s>[:<down KiB/s>]] [-D <neighbors>[:<interface address>]] [-z zlib|none] [-t auto|tcp] [-a md5|blake3|xxh64]
    */
   int opt;
-  while ((opt = getopt(argc, argv, ":p:n:f:u:h")) != -1)
+  while ((opt = getopt(argc, argv, ":p:n:f:u:i:q:w:c:d:r:D:z:t:a:h")) != -1)
   {
     switch (opt)
     {
@@ -361,6 +753,86 @@ void parse_args(cmd_args_t *args, int argc, char **argv)
         exit(EXIT_FAILURE);
       }
       break;
+    case 'i':
+      args->io_p = strdup(optarg);
+      if (args->io_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'q':
+      args->queue_p = strdup(optarg);
+      if (args->queue_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'w':
+      args->watermark_p = strdup(optarg);
+      if (args->watermark_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'c':
+      args->chunk_p = strdup(optarg);
+      if (args->chunk_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'd':
+      args->depth_p = strdup(optarg);
+      if (args->depth_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'r':
+      args->rate_p = strdup(optarg);
+      if (args->rate_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'D':
+      args->discover_p = strdup(optarg);
+      if (args->discover_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'z':
+      args->codec_p = strdup(optarg);
+      if (args->codec_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 't':
+      args->transport_p = strdup(optarg);
+      if (args->transport_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'a':
+      args->digest_p = strdup(optarg);
+      if (args->digest_p == NULL)
+      {
+        perror("Memory Allocation error");
+        exit(EXIT_FAILURE);
+      }
+      break;
     case ':':
       print_usage(argv);
       exit(EXIT_FAILURE);
@@ -375,252 +847,1034 @@ void parse_args(cmd_args_t *args, int argc, char **argv)
 }
 
 /**
- * This function is the function called by threads to wait for an incoming connection and creates a new thread to watch it for messages
- * \param args a void star pointer containing the socket of the client
+ * Called by the reactor for every connection accepted on the server socket. The new connection becomes a peer.
+ * \param listen_fd The server socket
+ * \param client_fd The socket of the new peer
  */
-void *connectWorker(void *args)
+void accept_peer(int listen_fd, int client_fd)
 {
-  while (true)
+  // watch peer for messages. This also lets us queue messages to it.
+  if (reactor_add(client_fd) != SUCCESS)
   {
-    // Wait for a client to connect
-    int client_socket_fd = server_socket_accept(*((int *)args));
-    if (client_socket_fd == -1)
-    {
-      // remove that peer
-      remove_peer(&peers, client_socket_fd);
-      continue;
+    close(client_fd);
+    return;
+  }
+
+  add_peer(&peers, client_fd);
+
+  // reconcile our catalogs
+  taskpool_submit(start_catalog_sync, (void *)(intptr_t)client_fd);
+  // tell it which chunks we hold
+  taskpool_submit(send_bitfields, (void *)(intptr_t)client_fd);
+}
+
+/**
+ * Called by the reactor for every connection accepted on a download socket. These only carry chunk data and are not peers.
+ * \param listen_fd The download socket
+ * \param client_fd The socket of the uploading node
+ */
+void accept_chunk_conn(int listen_fd, int client_fd)
+{
+  if (reactor_add(client_fd) != SUCCESS)
+  {
+    close(client_fd);
+  }
+}
+
+/**
+ * Makes a connected socket a peer: its messages are read on the reactor, and it is told our catalog and chunks.
+ * \param peer The socket of the peer
+ * \return FAILED if the reactor could not watch it, in which case the caller closes it, and SUCCESS on success
+ */
+int join_peer(peer_fd_t peer)
+{
+  if (reactor_add(peer) != SUCCESS)
+    return FAILED;
+
+  add_peer(&peers, peer);
+
+  // reconcile our catalogs
+  taskpool_submit(start_catalog_sync, (void *)(intptr_t)peer);
+  // tell it which chunks we hold
+  taskpool_submit(send_bitfields, (void *)(intptr_t)peer);
+  return SUCCESS;
+}
+
+/**
+ * Forgets a peer found through discovery, once its connection closed. Discovery connects to another node
+ * (or the same one) when it hears a beacon next.
+ * \param fd The socket which was closed
+ */
+static void forget_discovered(peer_fd_t fd)
+{
+  pthread_mutex_lock(&discovered.lock);
+  for (int i = 0; i < discovered.count; i++)
+  {
+    if (discovered.fds[i] == fd)
+    {
+      discovered.count--;
+      discovered.node_ids[i] = discovered.node_ids[discovered.count];
+      discovered.fds[i] = discovered.fds[discovered.count];
+      break;
     }
-    // printf("GOT A NEW PEER\n");
+  }
+  pthread_mutex_unlock(&discovered.lock);
+}
+
+/**
+ * Called on the discovery thread for every beacon heard. Connects to the node unless we have enough neighbors
+ * or are connected to it already.
+ * \param addr The address the node accepts peers on
+ * \param id The node id of the node
+ */
+void discovered_node(struct sockaddr_in addr, uint64_t id)
+{
+  // Both nodes hear each other. Only the one with the lower id connects, so they link once.
+  if (id < node_id)
+    return;
+
+  pthread_mutex_lock(&discovered.lock);
+  bool linked = false;
+  for (int i = 0; i < discovered.count && !linked; i++)
+    linked = discovered.node_ids[i] == id;
+  if (linked || discovered.count >= discovered.wanted)
+  {
+    pthread_mutex_unlock(&discovered.lock);
+    return;
+  }
+  // hold the slot while connecting
+  int slot = discovered.count++;
+  discovered.node_ids[slot] = id;
+  discovered.fds[slot] = -1;
+  pthread_mutex_unlock(&discovered.lock);
+
+  peer_fd_t peer = transport_connect(addr, sizeof(addr));
+
+  // the socket is known before the reactor watches it, so a close right away finds it
+  pthread_mutex_lock(&discovered.lock);
+  for (slot = 0; discovered.node_ids[slot] != id; slot++)
+    ;
+  discovered.fds[slot] = peer;
+  if (peer == -1)
+  {
+    discovered.count--;
+    discovered.node_ids[slot] = discovered.node_ids[discovered.count];
+    discovered.fds[slot] = discovered.fds[discovered.count];
+    discovered.failures++;
+  }
+  else
+    discovered.connects++;
+  pthread_mutex_unlock(&discovered.lock);
+
+  if (peer != -1 && join_peer(peer) != SUCCESS)
+  {
+    forget_discovered(peer);
+    close(peer);
+  }
+}
+
+/**
+ * Called by the reactor when a connection closes.
+ * \param fd The socket which was closed
+ */
+void peer_closed(int fd)
+{
+  remove_peer(&peers, fd);
+  forget_discovered(fd);
+  avail_remove_peer(&avail, fd);
+  sched_remove_peer(&sched, fd);
+}
+
+/**
+ * Answers a peer asking for its own address with the address we see it connecting from.
+ * \param fd The socket of the peer
+ */
+void handle_request_addr_self(int fd)
+{
+  struct sockaddr_in server_addr;
+  socklen_t server_addr_len = sizeof(server_addr);
+  if (getpeername(fd, (struct sockaddr *)&server_addr, &server_addr_len))
+  {
+    perror("getpeername failed");
+    return;
+  }
+  // peers on this host connected over AF_UNIX have no address to tell
+  if (server_addr.sin_family != AF_INET)
+    return;
+
+  // return address self
+  unsigned char payload[ADDR_WIRE_SIZE];
+  message_info_t info = {
+      .type = ADDR_SELF,
+      .size = encode_addr(&server_addr, payload)};
+  reactor_send(fd, &info, payload);
+}
+
+/**
+ * Adds tfile definitions received from a peer and gossips the ones which were new to us to the rest of the network.
+ * Known definitions are never passed on, so announcements stop once every node has them, even in a mesh with cycles.
+ * \param fd The socket of the peer who sent the definitions
+ * \param tdefs The definitions. Allocated with malloc, freed once they are handled. Their chunk hashes go to the hash table.
+ * \param count The number of definitions
+ * \param announce Where the definitions come from
+ */
+void receive_tfiles(int fd, tfile_def_t *tdefs, int count, announce_t announce)
+{
+  count_gossip(&gossip_stats.received, count);
 
-    add_peer(&peers, client_socket_fd);
+  // our own announcement came back around a cycle
+  if (announce.origin == node_id)
+  {
+    count_gossip(&gossip_stats.redundant, count);
+    for (int i = 0; i < count; i++)
+      free_tfile_def(&tdefs[i]);
+    free(tdefs);
+    return;
+  }
 
-    // // initialize self from peer
-    // if (!isInitialized(self_address))
-    //   self_address = get_address_self(client_socket_fd);
+  tfile_t **added = malloc(count * sizeof(tfile_t *));
+  if (added == NULL)
+  {
+    for (int i = 0; i < count; i++)
+      free_tfile_def(&tdefs[i]);
+    free(tdefs);
+    return;
+  }
+  add_htable_batch(&ht, tdefs, count, added);
 
-    pthread_t thread;
+  // only pass on the definitions which were new to us, reusing the array
+  int new_count = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (added[i] != NULL)
+      tdefs[new_count++] = tdefs[i];
+  }
+  free(added);
+  count_gossip(&gossip_stats.redundant, count - new_count);
 
-    // send peer all tfiles_describptions
-    send_tfiles_t *files_data = malloc(sizeof(send_tfiles_t));
-    files_data->count = list_tfiles(&ht, &files_data->tfile_arr);
-    files_data->peer = client_socket_fd;
-    files_data->peers = &peers;
-    pthread_create(&thread, NULL, share_tfiles_to_peer, files_data);
+  // travelled far enough
+  if (new_count > 0 && announce.hops >= GOSSIP_MAX_HOPS)
+  {
+    count_gossip(&gossip_stats.hop_limited, new_count);
+    new_count = 0;
+  }
 
-    // watch peer for messages
-    int *fd_ptr = malloc(sizeof(int));
-    *fd_ptr = client_socket_fd;
-    pthread_create(&thread, NULL, readWorker, fd_ptr);
+  if (new_count == 0)
+  {
+    free(tdefs);
+    return;
   }
-  return NULL;
+
+  announce.hops++;
+  gossip_tfiles(fd, tdefs, new_count, announce);
 }
 
 /**
- * This function watches a socket forever until a message is read. That message is then displayed and relayed to all other connected sockets.
- * \param args a void star pointer holding the struct with the client and server fd
+ * Adds a single tfile definition received from a peer. These carry no origin.
+ * \param fd The socket of the peer who sent the definition
+ * \param new_tfile The received definition
  */
-void *readWorker(void *args)
+void handle_tfile_def(int fd, tfile_def_t *new_tfile)
 {
+  tfile_def_t *tdefs = malloc(sizeof(tfile_def_t));
+  if (tdefs == NULL)
+  {
+    free_tfile_def(new_tfile);
+    return;
+  }
+  *tdefs = *new_tfile;
+  receive_tfiles(fd, tdefs, 1, (announce_t){.origin = 0, .hops = 0});
+}
 
-  client_server_t fd_data = *(client_server_t *)args;
-  size_t message_size = 100000;
-  void *data_read = malloc(message_size);
+/**
+ * Handles a batch of tfile definitions received from a peer.
+ * \param fd The socket of the peer who sent the batch
+ * \param data The TFILE_DEF_BATCH payload
+ * \param size The size of the payload
+ */
+void handle_tfile_batch(int fd, void *data, size_t size)
+{
+  tfile_def_t *tdefs = NULL;
+  announce_t announce;
+  int count = decode_tfile_batch(data, size, &tdefs, &announce);
+  if (count <= 0)
+  {
+    if (count == 0)
+      free(tdefs);
+    return;
+  }
+  receive_tfiles(fd, tdefs, count, announce);
+}
 
-  while (true)
+/**
+ * Queues a catalog reconciliation message to a peer and counts what it costs.
+ * \param fd The socket of the peer
+ * \param type The type of the message
+ * \param payload The payload
+ * \param size The size of the payload
+ */
+void send_catalog_message(int fd, message_type_t type, void *payload, size_t size)
+{
+  message_info_t info = {
+      .type = type,
+      .size = size};
+  if (reactor_send(fd, &info, payload) == SUCCESS)
   {
+    __atomic_fetch_add(&catalog_stats.messages, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&catalog_stats.bytes, MESSAGE_HEADER_SIZE + size, __ATOMIC_RELAXED);
+  }
+}
 
-    // get message data
-    message_info_t info;
+/**
+ * Sends a summary of our catalog under a prefix to a peer, which pulls whatever it is missing.
+ * \param fd The socket of the peer
+ * \param prefix The prefix to summarize
+ */
+void send_catalog_summary(int fd, const catalog_prefix_t *prefix)
+{
+  catalog_summary_t summary;
+  catalog_summarize(&ht, prefix, &summary);
+
+  unsigned char payload[CATALOG_SUMMARY_WIRE_SIZE(MD5_DIGEST_LENGTH)];
+  send_catalog_message(fd, CATALOG_SUMMARY, payload, encode_catalog_summary(&summary, payload));
+}
+
+/**
+ * Starts reconciling catalogs with a new peer by sending it the summary of our whole catalog.
+ * Both sides do this, and each pulls what it is missing, so what crosses the wire is proportional to the difference.
+ * \param args The socket of the peer
+ */
+void start_catalog_sync(void *args)
+{
+  int fd = (int)(intptr_t)args;
+  catalog_prefix_t root = {.len = 0};
+  send_catalog_summary(fd, &root);
+}
+
+/**
+ * Compares a peer's catalog summary with ours and asks for the parts which differ.
+ * Small subtrees are settled by listing our hashes, the peer answers with the tfiles we lack. Large ones are summarized again one level down.
+ * \param fd The socket of the peer
+ * \param theirs The peer's summary
+ */
+void handle_catalog_summary(int fd, catalog_summary_t *theirs)
+{
+  catalog_summary_t ours;
+  catalog_summarize(&ht, &theirs->prefix, &ours);
+
+  for (int b = 0; b < CATALOG_FANOUT; b++)
+  {
+    // nothing there we could be missing
+    if (theirs->count[b] == 0 ||
+        (theirs->count[b] == ours.count[b] && memcmp(theirs->xor[b], ours.xor[b], MD5_DIGEST_LENGTH) == 0))
+      continue;
 
-    if (incoming_message_info(fd_data.server_fd, &info) != 0)
+    catalog_prefix_t child = catalog_child(&theirs->prefix, b);
+    if (ours.count[b] <= CATALOG_LEAF_MAX || child.len == MD5_DIGEST_LENGTH)
     {
-      // ERROR
-      remove_peer(&peers, fd_data.client_fd);
-      break;
+      unsigned char(*hashes)[MD5_DIGEST_LENGTH] = NULL;
+      int count = catalog_hashes(&ht, &child, &hashes);
+      if (count == FAILED)
+        continue;
+      unsigned char *payload = malloc(CATALOG_HAVE_WIRE_SIZE(child.len, count));
+      if (payload != NULL)
+        send_catalog_message(fd, CATALOG_HAVE, payload, encode_catalog_have(&child, hashes, count, payload));
+      free(payload);
+      free(hashes);
     }
+    else
+    {
+      unsigned char payload[CATALOG_PREFIX_WIRE_SIZE(MD5_DIGEST_LENGTH)];
+      send_catalog_message(fd, CATALOG_QUERY, payload, encode_catalog_prefix(&child, payload));
+    }
+  }
+}
 
-    // Read data from the client
-    if (receive_message(fd_data.server_fd, data_read, info.size) != 0)
+/**
+ * Sends a peer the tfiles under a prefix which are not among the hashes it listed.
+ * \param fd The socket of the peer
+ * \param prefix The prefix the peer listed
+ * \param hashes The hashes the peer has under the prefix
+ * \param count The number of hashes
+ */
+void handle_catalog_have(int fd, catalog_prefix_t *prefix, const unsigned char *hashes, int count)
+{
+  tfile_def_t *missing = NULL;
+  int found = catalog_missing(&ht, prefix, hashes, count, &missing);
+  if (found > 0)
+  {
+    announce_t announce = {.origin = node_id, .hops = 0};
+    size_t bytes = 0;
+    if (send_tfile_batches(fd, missing, found, &announce, &bytes) == SUCCESS)
     {
-      // ERROR
-      remove_peer(&peers, fd_data.client_fd);
+      __atomic_fetch_add(&catalog_stats.tfiles, found, __ATOMIC_RELAXED);
+      __atomic_fetch_add(&catalog_stats.bytes, bytes, __ATOMIC_RELAXED);
+    }
+  }
+  free(missing);
+}
+
+/**
+ * Handles a catalog reconciliation message on the task pool.
+ * \param args The catalog_message_t, freed once handled
+ */
+void handle_catalog_message(void *args)
+{
+  catalog_message_t *msg = args;
+
+  if (msg->info.type == CATALOG_SUMMARY)
+  {
+    catalog_summary_t *summary = malloc(sizeof(catalog_summary_t));
+    if (summary != NULL && decode_catalog_summary(msg->data, msg->info.size, summary) == SUCCESS)
+      handle_catalog_summary(msg->fd, summary);
+    free(summary);
+  }
+  else if (msg->info.type == CATALOG_QUERY)
+  {
+    catalog_prefix_t prefix;
+    if (decode_catalog_prefix(msg->data, msg->info.size, &prefix) != FAILED)
+      send_catalog_summary(msg->fd, &prefix);
+  }
+  else if (msg->info.type == CATALOG_HAVE)
+  {
+    catalog_prefix_t prefix;
+    const unsigned char *hashes;
+    int count = decode_catalog_have(msg->data, msg->info.size, &prefix, &hashes);
+    if (count != FAILED)
+      handle_catalog_have(msg->fd, &prefix, hashes, count);
+  }
+
+  free(msg);
+}
+
+/**
+ * Tells a peer which chunks of a file we hold.
+ * \param fd The socket of the peer
+ * \param file_hash The hash of the file
+ * \param chunks The chunks we hold
+ */
+int send_bitfield(int fd, unsigned char file_hash[MD5_DIGEST_LENGTH], const verified_chunks_t *chunks)
+{
+  unsigned char *payload = malloc(HAVE_BITFIELD_WIRE_SIZE(chunks->count));
+  if (payload == NULL)
+    return FAILED;
+  message_info_t info = {
+      .type = HAVE_BITFIELD,
+      .size = encode_have_bitfield(file_hash, chunks->bits, chunks->count, payload)};
+  int rc = reactor_send(fd, &info, payload);
+  free(payload);
+  if (rc == SUCCESS)
+    __atomic_fetch_add(&avail_stats.bitfields_sent, 1, __ATOMIC_RELAXED);
+  return rc;
+}
+
+/**
+ * Tells a new peer which chunks we hold of every file we have in storage, so it can ask us for them directly.
+ * \param args The socket of the peer
+ */
+void send_bitfields(void *args)
+{
+  int fd = (int)(intptr_t)args;
+
+  unsigned char(*hashes)[MD5_DIGEST_LENGTH] = NULL;
+  int count = list_local_tfiles(&ht, &hashes);
+  for (int i = 0; i < count; i++)
+  {
+    verified_chunks_t chunks;
+    verify_tfile(&ht, hashes[i], &chunks);
+    int rc = bitset_popcount(&chunks) > 0 ? send_bitfield(fd, hashes[i], &chunks) : SUCCESS;
+    free_bitset(&chunks);
+    if (rc != SUCCESS)
       break;
+  }
+  free(hashes);
+}
+
+/**
+ * Checks a chunk whose last block just arrived and, if it matches its hash, tells every peer we hold it.
+ * Runs on the task pool since it hashes the chunk.
+ * \param args The chunk_payload_t header of the last block, freed once handled
+ */
+void announce_chunk(void *args)
+{
+  chunk_payload_t *hdr = args;
+
+  if (verify_chunk(&ht, hdr->file_hash, hdr->chunk_index))
+  {
+    unsigned char payload[HAVE_CHUNK_WIRE_SIZE];
+    message_info_t info = {
+        .type = HAVE_CHUNK,
+        .size = encode_have_chunk(hdr->file_hash, (uint32_t)hdr->chunk_index, payload)};
+
+    pthread_mutex_lock(&peers.lock);
+    for (int i = 0; i < peers.size; i++)
+    {
+      if (reactor_send(peers.arr[i], &info, payload) == SUCCESS)
+        __atomic_fetch_add(&avail_stats.haves_sent, 1, __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(&peers.lock);
 
-    // Check type of message and handle
-    if (info.type == REQUEST_ADDR_SELF)
+    // the download can ask for more now, or it is done
+    int remaining = sched_done(&sched, hdr->file_hash, (uint32_t)hdr->chunk_index);
+    if (remaining == 0)
     {
-      socklen_t server_addr_len;
-      struct sockaddr_in server_addr;
-      int socket = server_socket_accept_addr(fd_data.server_fd, &server_addr, &server_addr_len);
-      if (socket == -1)
+      unsigned char *file_hash = malloc(MD5_DIGEST_LENGTH);
+      if (file_hash != NULL)
       {
-        perror("accept failed");
-        remove_peer(&peers, fd_data.client_fd);
-        break;
+        memcpy(file_hash, hdr->file_hash, MD5_DIGEST_LENGTH);
+        finish_download(file_hash);
       }
+    }
+    else if (remaining > 0)
+    {
+      wake_download(hdr->file_hash, false, 0);
+    }
+  }
+  else
+  {
+    // some block was bad, fetch the whole chunk again
+    sched_corrupt(&sched, hdr->file_hash, (uint32_t)hdr->chunk_index);
+    wake_download(hdr->file_hash, false, 0);
+  }
+
+  free(hdr);
+}
+
+/**
+ * Records which chunks of a file a peer holds.
+ * \param fd The socket of the peer
+ * \param data The HAVE_BITFIELD payload
+ * \param size The size of the payload
+ */
+void handle_have_bitfield(int fd, void *data, size_t size)
+{
+  unsigned char file_hash[MD5_DIGEST_LENGTH];
+  const uint8_t *bits;
+  int count = decode_have_bitfield(data, size, file_hash, &bits);
+  if (count == FAILED)
+    return;
+
+  __atomic_fetch_add(&avail_stats.bitfields_received, 1, __ATOMIC_RELAXED);
+  avail_set(&avail, fd, file_hash, bits, (uint32_t)count);
+}
+
+/**
+ * Records that a peer verified a chunk of a file.
+ * \param fd The socket of the peer
+ * \param data The HAVE_CHUNK payload
+ * \param size The size of the payload
+ */
+void handle_have_chunk(int fd, void *data, size_t size)
+{
+  unsigned char file_hash[MD5_DIGEST_LENGTH];
+  uint32_t chunk;
+  if (decode_have_chunk(data, size, file_hash, &chunk) == FAILED)
+    return;
+
+  __atomic_fetch_add(&avail_stats.haves_received, 1, __ATOMIC_RELAXED);
+  avail_add(&avail, fd, file_hash, chunk);
+}
+
+/**
+ * Returns a new random request id. Never 0.
+ */
+uint64_t new_request_id()
+{
+  uint64_t id = 0;
+  while (id == 0)
+  {
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+      id = ((uint64_t)rand() << 32) ^ (uint64_t)rand() ^ (uint64_t)time(NULL);
+  }
+  return id;
+}
+
+/**
+ * Bumps one of the request counters. They are read without a lock.
+ * \param counter The counter to bump
+ * \param count How much to add
+ */
+static void count_requests(size_t *counter, size_t count)
+{
+  __atomic_fetch_add(counter, count, __ATOMIC_RELAXED);
+}
 
-      // return address self
-      message_info_t info = {
-          .type = ADDR_SELF,
-          .size = server_addr_len};
-      send_message(socket, &info, &server_addr);
+/**
+ * Sends a requested block back to the requester if we have its chunk, otherwise relays the request to our other peers.
+ * Requests seen before are dropped, and requests are only relayed while their ttl lasts.
+ * \param fd The socket of the peer who sent the request
+ * \param req The chunk request
+ */
+void handle_request_file_data(int fd, chunk_request_t *req)
+{
+  count_requests(&request_stats.received, 1);
+
+  // already handled, it came around a cycle or over a second path
+  if (seen_before(&seen_requests, req->request_id))
+  {
+    count_requests(&request_stats.duplicates, 1);
+    return;
+  }
+
+  // i have the chunk and can return the block. Chunks are verified as they arrive, this runs on the reactor and never hashes
+  if (is_chunk_held(&ht, req->file_hash, req->chunk_index))
+  {
+
+    upload_t up = {
+        .addr = req->return_addr,
+        .addr_len = req->return_addr_len,
+        .chunk = req->chunk_index,
+        .offset = req->offset,
+        .size = req->size,
+        .accepts = req->accepts};
+    memcpy(up.file_hash, req->file_hash, MD5_DIGEST_LENGTH);
+
+    // the limits need to know how big a request for the rest of the chunk is
+    if (up.size == 0)
+    {
+      off_t chunk_offset;
+      tfile_t *tf = search_htable(&ht, req->file_hash);
+      off_t chunk_size = tf != NULL ? chunk_bounds(&tf->tdef, req->chunk_index, &chunk_offset) : -1;
+      if (chunk_size > (off_t)up.offset)
+        up.size = (uint32_t)(chunk_size - up.offset);
     }
-    else if (info.type == TFILE_DEF)
+
+    // sent once the upload limits allow it, taking turns with other requesters
+    bool start;
+    if (upload_push(&uploads, &up, &start) == SUCCESS && start && taskpool_submit(pump_uploads, NULL) != SUCCESS)
+      upload_stop(&uploads);
+  }
+  // this was the last hop
+  else if (req->ttl <= 1)
+  {
+    count_requests(&request_stats.expired, 1);
+  }
+  // cannot send this chunk, relay to my peers
+  else
+  {
+    req->ttl--;
+    unsigned char payload[CHUNK_REQUEST_WIRE_SIZE];
+    message_info_t fwd = {
+        .type = REQUEST_FILE_DATA,
+        .size = encode_chunk_request(req, payload)};
+
+    pthread_mutex_lock(&peers.lock);
+    for (int i = 0; i < peers.size; i++)
     {
 
-      tfile_def_t new_tfile = *(tfile_def_t *)data_read;
+      // skip the sender
+      if (peers.arr[i] == fd)
+        continue;
 
-      // add tfile to self definition
-      add_htable(&ht, new_tfile);
+      if (reactor_send(peers.arr[i], &fwd, payload) == SUCCESS)
+        count_requests(&request_stats.forwarded, 1);
+    }
+    pthread_mutex_unlock(&peers.lock);
+  }
+}
 
-      // share that file with your pers list
-      // run thread to share tfile to all peers
-      pthread_t thread;
-      send_tfile_t *data = malloc(sizeof(send_tfile_t));
-      *data = (send_tfile_t){
-          .sender = fd_data.server_fd,
-          .tfile = new_tfile,
-          .peers = &peers};
-      pthread_create(&thread, NULL, share_tfile_to_peers, data);
+/**
+ * Takes back the queued uploads of a block, which the requester got from someone else.
+ * \param fd The socket of the peer who sent the cancel
+ * \param req The chunk request taken back
+ */
+void handle_cancel_file_data(int fd, chunk_request_t *req)
+{
+  upload_t up = {
+      .addr = req->return_addr,
+      .addr_len = req->return_addr_len,
+      .chunk = req->chunk_index,
+      .offset = req->offset,
+      .size = req->size};
+  memcpy(up.file_hash, req->file_hash, MD5_DIGEST_LENGTH);
+  upload_cancel(&uploads, &up);
+}
+
+/**
+ * Tells the peers asked for endgame copies of a block which arrived that they need not send them.
+ * \param file_hash The file of the block
+ * \param cancels The copies cancelled
+ * \param count How many there are
+ */
+static void send_cancels(const unsigned char file_hash[MD5_DIGEST_LENGTH], const sched_request_t *cancels, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    chunk_request_t req = {
+        .chunk_index = cancels[i].chunk,
+        .offset = cancels[i].offset,
+        .size = cancels[i].size,
+        .return_addr = data_addr,
+        .return_addr_len = sizeof(data_addr)};
+    memcpy(req.file_hash, file_hash, MD5_DIGEST_LENGTH);
+
+    unsigned char payload[CHUNK_REQUEST_WIRE_SIZE];
+    message_info_t info = {
+        .type = CANCEL_FILE_DATA,
+        .size = encode_chunk_request(&req, payload)};
+    reactor_send(cancels[i].peer, &info, payload);
+  }
+}
+
+/**
+ * Sends the queued uploads the upload limits let through, requesters taking turns. Runs on the task pool until
+ * the queue is empty, and comes back later while the limits hold every upload back.
+ * \param args Unused
+ */
+void pump_uploads(void *args)
+{
+  for (int sent = 0; sent < UPLOAD_BATCH; sent++)
+  {
+    long wait_ms;
+    upload_t *up = upload_next(&uploads, &up_shaper, &wait_ms);
+    if (up == NULL)
+    {
+      if (wait_ms > 0 && taskpool_schedule(pump_uploads, NULL, wait_ms) != SUCCESS)
+        upload_stop(&uploads);
+      return;
     }
 
-    else if (info.type == REQUEST_FILE_DATA)
+    // reuse a connection to the requester if one is open
+    int out_fd = pool_acquire(up->addr, up->addr_len);
+    if (out_fd != -1)
     {
-      // LOOK AT FILE CHUNK BEING REQUESTED
-      chunk_request_t req = *(chunk_request_t *)data_read;
+      int rc = send_chunk_message(out_fd, &ht, up->file_hash, up->chunk, up->offset, up->size, up->accepts);
+      pool_release(out_fd, rc == SUCCESS);
+      if (rc == SUCCESS)
+        count_requests(&request_stats.answered, 1);
+    }
+    free(up);
+  }
 
-      verified_chunks_t chunks = verify_tfile(&ht, req.file_hash);
+  // let other tasks run before the next batch
+  if (taskpool_submit(pump_uploads, NULL) != SUCCESS)
+    upload_stop(&uploads);
+}
 
-      // i have the chunk and can return the data
-      if (is_chunk_verified(chunks, req.chunk_index))
-      {
+/**
+ * Called by the reactor once the chunk_payload_t header of a FILE_DATA message has arrived.
+ * Checks the block is wanted and fits the file before its bytes are streamed into it.
+ * \param fd The socket the message is read from
+ * \param info The header of the message
+ * \param prefix The chunk_payload_t header
+ */
+void *chunk_stream_begin(int fd, message_info_t *info, void *prefix)
+{
+  // convert header to readable format
+  chunk_payload_t hdr;
+  decode_chunk_payload(prefix, CHUNK_PAYLOAD_WIRE_SIZE, &hdr);
 
-        int out_fd = socket_connect_addr(req.return_addr,
-                                         req.return_addr_len);
+  // not downloading, or the block arrived from someone else already. Its bytes are dropped as duplicates.
+  if (!sched_wanted(&sched, hdr.file_hash, (uint32_t)hdr.chunk_index, hdr.offset, hdr.size))
+    return NULL;
 
-        if (out_fd != -1)
-        {
+  void *dest = NULL;
 
-          send_chunk_message(out_fd, &ht,
-                             req.file_hash,
-                             req.chunk_index);
-        }
-      }
-      // cannot send this chunk, relay to my peers
-      else
-      {
-        message_info_t fwd = {
-            .type = REQUEST_FILE_DATA,
-            .size = sizeof(chunk_request_t)};
+  // open tfile for write. It stays mapped until the block ends, even if another copy completes the file first
+  off_t chunk_size =
+      hold_tfile(&ht, &dest, hdr.file_hash, hdr.chunk_index);
 
-        pthread_mutex_lock(&peers.lock);
-        for (int i = 0; i < peers.size; i++)
-        {
+  // the block does not fit the chunk, or the message. A compressed block is checked once inflated.
+  bool compressed = info->flags & FLAG_ZLIB;
+  if (chunk_size < 0 || (off_t)hdr.offset + hdr.size > chunk_size ||
+      (!compressed && info->size - CHUNK_PAYLOAD_WIRE_SIZE != hdr.size))
+  {
+    perror("An error occured while reading data. Data corrupted.");
+    if (chunk_size >= 0)
+      release_tfile(&ht, hdr.file_hash);
+    return NULL;
+  }
 
-          // skip mysef
-          if (peers.arr[i] == fd_data.client_fd)
-            continue;
+  chunk_recv_t *ctx = malloc(sizeof(chunk_recv_t));
+  if (ctx == NULL)
+  {
+    release_tfile(&ht, hdr.file_hash);
+    return NULL;
+  }
+  ctx->hdr = hdr;
+  ctx->fd = fd;
+  ctx->dropped = false;
+  ctx->dest = dest;
+  ctx->inflater = compressed ? inflater_new() : NULL;
+  if (compressed && ctx->inflater == NULL)
+  {
+    release_tfile(&ht, hdr.file_hash);
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
 
-          send_message(peers.arr[i], &fwd, &req);
-        }
-        pthread_mutex_unlock(&peers.lock);
-      }
-    }
-    else if (info.type == FILE_DATA)
+/**
+ * Inflates the compressed bytes of a block read so far into the file's mapping.
+ * \param recv The block being received
+ * \return FAILED if the bytes are corrupt, and SUCCESS on success
+ */
+static int inflate_pending(chunk_recv_t *recv)
+{
+  inflater_t *inflater = recv->inflater;
+  if (inflater->pending == 0)
+    return SUCCESS;
+
+  unsigned char *out = recv->dest + recv->hdr.offset + inflater->produced;
+  return inflater_flush(inflater, out, recv->hdr.size - inflater->produced) == FAILED ? FAILED : SUCCESS;
+}
+
+/**
+ * Called by the reactor for every piece of a FILE_DATA block. The piece is read straight into the file's mapping.
+ * \param ctx The chunk_payload_t header of the block being received
+ * \param offset The offset of the piece in the block
+ * \param len The size of the piece
+ */
+void *chunk_stream_next(void *ctx, size_t offset, size_t *len)
+{
+  chunk_recv_t *recv = ctx;
+  chunk_payload_t *hdr = &recv->hdr;
+
+  // The block is still coming, do not request it again. If another copy arrived first in the endgame, this one is
+  // cancelled: the rest of it is read and dropped.
+  if (!sched_touch(&sched, hdr->file_hash, (uint32_t)hdr->chunk_index, hdr->offset, hdr->size, *len))
+  {
+    recv->dropped = true;
+    return NULL;
+  }
+
+  // A compressed piece is read into the inflater, and inflated once the next one is asked for
+  if (recv->inflater != NULL)
+  {
+    if (recv->dropped || inflate_pending(recv) != SUCCESS)
     {
-      // convert header to readable format
-      chunk_payload_t *hdr = (chunk_payload_t *)data_read;
+      recv->dropped = true;
+      return NULL;
+    }
+    if (*len > sizeof(recv->inflater->in))
+      *len = sizeof(recv->inflater->in);
+    recv->inflater->pending = *len;
+    return recv->inflater->in;
+  }
 
-      verified_chunks_t chunks = verify_tfile(&ht, hdr->file_hash);
-      // chunk already downloaded
-      if (is_chunk_verified(chunks, hdr->chunk_index))
-        continue;
+  return recv->dest + hdr->offset + offset;
+}
 
-      // credit: https://linux.die.net/man/3/ntohl
-      uint32_t chunk_size = ntohl(hdr->chunk_size);
-      unsigned char *chunk_data =
-          (unsigned char *)data_read + sizeof(chunk_payload_t);
+/**
+ * Called by the reactor once a FILE_DATA block is fully received, or its connection closed.
+ * Once every block of the chunk is in, the chunk is checked against its hash.
+ * \param ctx The chunk_payload_t header of the block
+ * \param complete Whether every byte of the block arrived
+ */
+void chunk_stream_end(void *ctx, bool complete)
+{
+  chunk_recv_t *recv = ctx;
+  chunk_payload_t *hdr = &recv->hdr;
 
-      void *dest = NULL;
+  // a compressed block only counts once it inflated to its size
+  if (recv->inflater != NULL)
+  {
+    if (complete)
+      complete = !recv->dropped && inflate_pending(recv) == SUCCESS && inflater_finish(recv->inflater, hdr->size);
+    inflater_free(recv->inflater);
+    recv->inflater = NULL;
+  }
+  // nothing more is written, the file may be saved
+  release_tfile(&ht, hdr->file_hash);
+
+  sched_request_t cancels[SCHED_MAX_CANCELS];
+  int cancelled;
+  int rc = sched_arrived(&sched, hdr->file_hash, (uint32_t)hdr->chunk_index, hdr->offset, hdr->size, recv->fd,
+                         complete, cancels, &cancelled);
+  // the other copies of the block are not needed, and may not have left their holders' upload queues yet
+  send_cancels(hdr->file_hash, cancels, cancelled);
+
+  // hashing the chunk is too slow for the reactor
+  if (rc == 1 && taskpool_submit(announce_chunk, ctx) == SUCCESS)
+    return;
+
+  // the pipeline of the peer which sent it has room again
+  if (rc == 0)
+    wake_download(hdr->file_hash, false, 0);
+  free(ctx);
+}
 
-      // open tfile for write
-      off_t expected_size =
-          open_tfile(&ht, &dest, hdr->file_hash, hdr->chunk_index);
+/**
+ * Called by the reactor for every complete message. Checks the type of the message and handles it.
+ * \param fd The socket the message was read from
+ * \param info The header of the message
+ * \param data The payload of the message
+ */
+void handle_message(int fd, message_info_t *info, void *data)
+{
+  if (info->type == REQUEST_ADDR_SELF)
+  {
+    handle_request_addr_self(fd);
+  }
+  else if (info->type == TFILE_DEF)
+  {
+    tfile_def_t tdef;
+    if (decode_tfile_def(data, info->size, &tdef) == SUCCESS)
+      handle_tfile_def(fd, &tdef);
+  }
+  else if (info->type == TFILE_DEF_BATCH)
+  {
+    handle_tfile_batch(fd, data, info->size);
+  }
+  else if (info->type == CATALOG_SUMMARY || info->type == CATALOG_QUERY || info->type == CATALOG_HAVE)
+  {
+    // these scan the whole catalog, so they run on the task pool instead of the reactor
+    catalog_message_t *msg = malloc(sizeof(catalog_message_t) + info->size);
+    if (msg == NULL)
+      return;
+    msg->fd = fd;
+    msg->info = *info;
+    memcpy(msg->data, data, info->size);
+    taskpool_submit(handle_catalog_message, msg);
+  }
+  else if (info->type == HAVE_BITFIELD)
+  {
+    handle_have_bitfield(fd, data, info->size);
+  }
+  else if (info->type == HAVE_CHUNK)
+  {
+    handle_have_chunk(fd, data, info->size);
+  }
+  else if (info->type == REQUEST_FILE_DATA)
+  {
+    chunk_request_t req;
+    if (decode_chunk_request(data, info->size, &req) == SUCCESS)
+      handle_request_file_data(fd, &req);
+  }
+  else if (info->type == CANCEL_FILE_DATA)
+  {
+    chunk_request_t req;
+    if (decode_chunk_request(data, info->size, &req) == SUCCESS)
+      handle_cancel_file_data(fd, &req);
+  }
+}
 
-      // sizes do not match
-      if (expected_size != chunk_size)
-      {
-        perror("An error occured while reading data. Data corrupted.");
-      }
+/**
+ * Sends a block compressed with zlib, unless it does not shrink enough.
+ * \param fd the socket to send it on
+ * \param hdr the header of the block
+ * \param file_fd the file holding the block
+ * \param file_offset where the block starts in the file
+ * \return SUCCESS or FAILED once sent, or SEND_UNCOMPRESSED if the block should be sent as it is
+ */
+static int send_compressed_block(int fd, const chunk_payload_t *hdr, int file_fd, off_t file_offset)
+{
+  // a sample from the start of the block is read first, to skip the rest when it does not compress
+  unsigned char sample[CODEC_SAMPLE];
+  size_t sample_size = hdr->size < CODEC_SAMPLE ? hdr->size : CODEC_SAMPLE;
+  if (io_pread_all(file_fd, sample, sample_size, file_offset) != SUCCESS || !codec_worth(hdr->file_hash, sample, sample_size))
+    return SEND_UNCOMPRESSED;
+
+  unsigned char *raw = malloc(hdr->size);
+  unsigned char *payload = malloc(CHUNK_PAYLOAD_WIRE_SIZE + compressBound(hdr->size));
+  if (raw == NULL || payload == NULL || io_pread_all(file_fd, raw, hdr->size, file_offset) != SUCCESS)
+  {
+    free(raw);
+    free(payload);
+    return SEND_UNCOMPRESSED;
+  }
 
-      memcpy(dest, chunk_data, chunk_size);
-    }
+  long packed = codec_compress(raw, hdr->size, payload + CHUNK_PAYLOAD_WIRE_SIZE);
+  free(raw);
+  if (packed == FAILED)
+  {
+    free(payload);
+    return SEND_UNCOMPRESSED;
   }
 
-  return NULL;
+  encode_chunk_payload(hdr, payload);
+  message_info_t info = {
+      .type = FILE_DATA,
+      .flags = FLAG_ZLIB,
+      .size = CHUNK_PAYLOAD_WIRE_SIZE + packed};
+  int rc = send_message(fd, &info, payload);
+  free(payload);
+  return rc;
 }
 
 /**
- * This fucntion sends a chunk of data over to the peer
+ * This fucntion sends a block of a chunk over to the peer
  * \param fd the file descriptor of the person to send to,
  * \param ht the hash table
  * \param file_hash the hash of the file
- * \param chunk_index the index of the chunk which must be sent
+ * \param chunk_index the index of the chunk the block is in
+ * \param offset where the block starts in the chunk
+ * \param size the size of the block, or 0 for the rest of the chunk
+ * \param accepts the ACCEPT_* encodings the requester can decode the block in
  */
 int send_chunk_message(int fd, htable_t *ht,
                        unsigned char file_hash[MD5_DIGEST_LENGTH],
-                       int chunk_index)
+                       int chunk_index, uint32_t offset, uint32_t size, uint8_t accepts)
 {
-  void *chunk_ptr = NULL;
-  off_t chunk_size = open_tfile(ht, &chunk_ptr, file_hash, chunk_index);
-  if (chunk_size <= 0 || chunk_ptr == NULL)
+  // The block bytes are sent straight from the backing file, so it must be on disk.
+  // Downloads in progress are mapped MAP_SHARED, so the file sees every chunk written so far.
+  int file_fd;
+  off_t chunk_offset;
+  off_t chunk_size = open_tfile_fd(ht, &file_fd, file_hash, chunk_index, &chunk_offset);
+  if (chunk_size <= 0)
   {
+    if (chunk_size == 0)
+      close(file_fd);
     return FAILED;
   }
-
-  // Allocate payload buffer
-  size_t payload_size = sizeof(chunk_payload_t) + chunk_size;
-  unsigned char *payload = malloc(payload_size);
-  if (!payload)
+  if (size == 0 && offset < chunk_size)
+    size = (uint32_t)(chunk_size - offset);
+  if (size == 0 || (off_t)offset + size > chunk_size)
+  {
+    close(file_fd);
     return FAILED;
+  }
 
   // Fill payload header
-  chunk_payload_t *hdr = (chunk_payload_t *)payload;
-  memcpy(hdr->file_hash, file_hash, MD5_DIGEST_LENGTH);
-  hdr->chunk_index = chunk_index;
-  hdr->chunk_size = htonl((uint32_t)chunk_size);
+  chunk_payload_t hdr;
+  memcpy(hdr.file_hash, file_hash, MD5_DIGEST_LENGTH);
+  hdr.chunk_index = chunk_index;
+  hdr.offset = offset;
+  hdr.size = size;
 
-  // Copy chunk bytes
-  memcpy(payload + sizeof(chunk_payload_t),
-         chunk_ptr,
-         chunk_size);
+  unsigned char payload[CHUNK_PAYLOAD_WIRE_SIZE];
+  size_t payload_size = encode_chunk_payload(&hdr, payload);
+
+  // Compress the block if the requester can inflate it and it shrinks enough
+  if (accepts & ACCEPT_ZLIB)
+  {
+    int rc = send_compressed_block(fd, &hdr, file_fd, chunk_offset + offset);
+    if (rc != SEND_UNCOMPRESSED)
+    {
+      close(file_fd);
+      return rc;
+    }
+  }
 
   // Fill message info
   message_info_t info = {
       .type = FILE_DATA,
-      .size = payload_size};
+      .size = payload_size + size};
 
-  int rc = send_message(fd, &info, payload);
+  int rc = send_message_file(fd, &info, payload, payload_size, file_fd, chunk_offset + offset);
+  close(file_fd);
   return rc;
 }
 
 // Add a peer to peers_t
 void add_peer(peers_t *peers, peer_fd_t peer)
 {
+  pthread_mutex_lock(&peers->lock);
   if (peers->size >= peers->capacity)
   {
-    pthread_mutex_lock(&peers->lock);
-    peers->arr = realloc(peers->arr, peers->capacity * 2 * sizeof(peer_fd_t));
-    peers->arr[peers->size++] = peer;
-    pthread_mutex_unlock(&peers->lock);
-  }
-  else
-  {
-    pthread_mutex_lock(&peers->lock);
-    peers->arr[peers->size++] = peer;
-    pthread_mutex_unlock(&peers->lock);
+    peer_fd_t *arr = realloc(peers->arr, peers->capacity * 2 * sizeof(peer_fd_t));
+    if (arr == NULL)
+    {
+      pthread_mutex_unlock(&peers->lock);
+      perror("Memory Allocation error");
+      return;
+    }
+    peers->arr = arr;
+    peers->capacity *= 2;
   }
+  peers->arr[peers->size++] = peer;
+  pthread_mutex_unlock(&peers->lock);
 }
 
 // Remove a peer from peers_t
@@ -641,6 +1895,16 @@ void remove_peer(peers_t *peers, peer_fd_t peer)
   pthread_mutex_unlock(&peers->lock);
 }
 
+/**
+ * Runs periodic upkeep for the whole node, such as closing idle pooled connections. Reschedules itself.
+ * \param args Unused
+ */
+void housekeeping(void *args)
+{
+  pool_expire();
+  taskpool_schedule(housekeeping, NULL, HOUSEKEEPING_INTERVAL_MS);
+}
+
 /**
  * Verifies is self address is initialized
  * \param data THe sock data holding information on my curret address
@@ -651,70 +1915,174 @@ bool isInitialized(sockdata_t data)
 }
 
 /**
- * This function request chunks of data from the network and dowloads the file to the client machine
- *  \param file_hash THe hash of the file whic hshould be downloaded from teh network;
- *
+ * Starts downloading a file from the network. The scheduler decides which blocks to request from whom,
+ * and the download runs again whenever a block arrives or a request times out.
+ *  \param args The hash of the file which should be downloaded from the network. Allocated with malloc, freed once handled.
  */
-void *download_file(unsigned char file_hash[MD5_DIGEST_LENGTH])
+void download_file(void *args)
 {
+  unsigned char *file_hash = args;
 
-  // open temporary port to listen for chunk donwloads.
-  unsigned short temp_port = 0;
-  int server_fd = server_socket_open(&temp_port);
-  if (server_fd == -1)
-    return NULL;
+  verified_chunks_t chunks;
+  if (verify_tfile(&ht, file_hash, &chunks))
+  {
+    free_bitset(&chunks);
+    finish_download(file_hash);
+    return;
+  }
 
-  listen(server_fd, 10);
+  // already being downloaded
+  if (schedule_download(file_hash, &chunks) == SUCCESS)
+    wake_download(file_hash, false, 0);
+  free_bitset(&chunks);
+  free(file_hash);
+}
 
-  // Create thread to listen at this prt for incoming connections
-  pthread_t recv_thread;
-  int *fd_ptr = malloc(sizeof(int));
-  *fd_ptr = server_fd;
-  pthread_create(&recv_thread, NULL, connectWorker, fd_ptr);
+/**
+ * Hands a download to the scheduler along with the chunks already verified.
+ * \param file_hash The hash of the file
+ * \param chunks The verified chunks of the file
+ * \return SUCCESS, or FAILED if the file is unknown or already being downloaded
+ */
+int schedule_download(unsigned char file_hash[MD5_DIGEST_LENGTH], const verified_chunks_t *chunks)
+{
+  tfile_t *tf = search_htable(&ht, file_hash);
+  if (tf == NULL || chunks->bits == NULL)
+    return FAILED;
+  return sched_add(&sched, file_hash, (uint64_t)tf->tdef.size, tf->tdef.chunk_size, chunks->count, chunks->bits);
+}
 
-  // The return address of this temporary port so it can be found
-  // credit: https://stackoverflow.com/a/13047959
-  struct sockaddr_in return_addr = {
-      .sin_family = AF_INET,
-      .sin_port = htons(temp_port),
-      .sin_addr.s_addr = INADDR_ANY};
+/**
+ * Runs a download on the task pool, now or once <delay_ms> milliseconds have passed.
+ * \param file_hash The hash of the file
+ * \param timer Whether this is the timer the scheduler asked for
+ * \param delay_ms How long to wait first
+ */
+void wake_download(unsigned char file_hash[MD5_DIGEST_LENGTH], bool timer, long delay_ms)
+{
+  download_run_t *run = malloc(sizeof(download_run_t));
+  if (run == NULL)
+    return;
+  memcpy(run->file_hash, file_hash, MD5_DIGEST_LENGTH);
+  run->timer = timer;
+
+  int rc = delay_ms > 0 ? taskpool_schedule(run_download, run, delay_ms) : taskpool_submit(run_download, run);
+  if (rc != SUCCESS)
+    free(run);
+}
 
-  while (true)
+/**
+ * Sends the block requests the scheduler picks, to the peer which advertised the chunk or else to every peer.
+ * \param args The download_run_t, freed once handled
+ */
+void run_download(void *args)
+{
+  download_run_t *run = args;
+
+  // Blocks come back to the data port. It is the same for every download, so uploaders can keep their connections to it.
+  struct sockaddr_in return_addr = data_addr;
+
+  // pick no more blocks than the download limits have room for
+  int max = 0;
+  while (max < DOWNLOAD_BATCH &&
+         shaper_wait_ms(&down_shaper, SHAPE_NO_PEER, run->file_hash, (size_t)(max + 1) * BLOCK_SIZE) == 0)
+    max++;
+  long shaped_ms;
+  if (max == 0)
   {
-    // stop if the fie is fully downloaded.
-    verified_chunks_t chunks = verify_tfile(&ht, file_hash);
-    if (chunks == VERIFIED_FILE)
-      break;
+    shaped_ms = shaper_wait_ms(&down_shaper, SHAPE_NO_PEER, run->file_hash, BLOCK_SIZE);
+    wake_download(run->file_hash, run->timer, shaped_ms);
+    free(run);
+    return;
+  }
 
-    for (int i = 0; i < NUM_CHUNKS; i++)
+  sched_request_t picks[DOWNLOAD_BATCH];
+  long wait_ms;
+  int count = sched_next(&sched, &avail, run->file_hash, run->timer, picks, max, &wait_ms);
+  shaped_ms = 0;
+  for (int i = 0; i < count; i++)
+  {
+    // downloads are shaped by pacing requests. A request the limits hold back is withdrawn, and its block picked
+    // later unless an endgame copy is in flight from another peer. Once one is held back, so is the rest of the batch.
+    uint64_t shape_peer = picks[i].peer == SCHED_FLOOD ? SHAPE_NO_PEER : (uint64_t)picks[i].peer;
+    long wait = shaped_ms > 0 ? shaped_ms : shaper_admit(&down_shaper, shape_peer, run->file_hash, picks[i].size);
+    if (wait > 0)
     {
-      // only download incomplete
-      if (!is_chunk_verified(chunks, i))
-      {
-        chunk_request_t req = {
-            .chunk_index = i,
-            .ttl = 5,
-            .return_addr = return_addr,
-            .return_addr_len = sizeof(return_addr)};
-
-        memcpy(req.file_hash, file_hash, MD5_DIGEST_LENGTH);
-
-        message_info_t info = {
-            .type = REQUEST_FILE_DATA,
-            .size = sizeof(chunk_request_t)};
-
-        pthread_mutex_lock(&peers.lock);
-        for (int p = 0; p < peers.size; p++)
-        {
-          send_message(peers.arr[p], &info, &req);
-        }
-        pthread_mutex_unlock(&peers.lock);
-      }
+      sched_withdraw(&sched, run->file_hash, &picks[i]);
+      if (wait > shaped_ms)
+        shaped_ms = wait;
+      continue;
+    }
+
+    // every request is new, so it is not mistaken for the one which timed out
+    chunk_request_t req = {
+        .request_id = new_request_id(),
+        .chunk_index = picks[i].chunk,
+        .offset = picks[i].offset,
+        .size = picks[i].size,
+        .ttl = picks[i].peer == SCHED_FLOOD ? REQUEST_TTL : 1,
+        .accepts = block_encodings,
+        .return_addr = return_addr,
+        .return_addr_len = sizeof(return_addr)};
+
+    memcpy(req.file_hash, run->file_hash, MD5_DIGEST_LENGTH);
+
+    // drop our own request if a peer relays it back to us
+    seen_before(&seen_requests, req.request_id);
+
+    unsigned char payload[CHUNK_REQUEST_WIRE_SIZE];
+    message_info_t info = {
+        .type = REQUEST_FILE_DATA,
+        .size = encode_chunk_request(&req, payload)};
+
+    // the holder answers itself, it must not relay
+    if (picks[i].peer != SCHED_FLOOD)
+    {
+      reactor_send(picks[i].peer, &info, payload);
+      continue;
     }
 
-    // allows the response to arrive
-    sleep(1);
+    pthread_mutex_lock(&peers.lock);
+    for (int p = 0; p < peers.size; p++)
+    {
+      reactor_send(peers.arr[p], &info, payload);
+    }
+    pthread_mutex_unlock(&peers.lock);
+  }
+
+  // there is more to ask for right away, or once the limits allow
+  if (shaped_ms > 0)
+    wake_download(run->file_hash, false, shaped_ms);
+  else if (count == max)
+    wake_download(run->file_hash, false, 0);
+  // come back when the first request times out
+  if (wait_ms >= 0)
+    wake_download(run->file_hash, true, wait_ms);
+
+  free(run);
+}
+
+/**
+ * Saves a downloaded file once every chunk arrived. Chunks are checked again as a whole first, and requested
+ * again if any of them went bad.
+ * \param args The hash of the file. Allocated with malloc, freed once handled.
+ */
+void finish_download(void *args)
+{
+  unsigned char *file_hash = args;
+
+  // only the first caller finishes a download
+  bool scheduled = sched_remove(&sched, file_hash);
+  verified_chunks_t chunks;
+  if (!verify_tfile(&ht, file_hash, &chunks))
+  {
+    if (scheduled && schedule_download(file_hash, &chunks) == SUCCESS)
+      wake_download(file_hash, false, 0);
+    free_bitset(&chunks);
+    free(file_hash);
+    return;
   }
+  free_bitset(&chunks);
 
   // save file to disk
   save_tfile(&ht, file_hash);
@@ -726,6 +2094,5 @@ void *download_file(unsigned char file_hash[MD5_DIGEST_LENGTH])
   // Now call the ui_display function with the formatted message
   ui_display("system", message);
 
-  close(server_fd);
-  return NULL;
+  free(file_hash);
 }
@@ -4,6 +4,14 @@
 #include "socket.h"
 #include "file.h"
 #include "message.h"
+#include "wire.h"
+#include "catalog.h"
+#include "avail.h"
+#include "sched.h"
+#include "shaper.h"
+#include "uploadq.h"
+#include "discovery.h"
+#include "codec.h"
 
 // Socket file descriptor type
 typedef int peer_fd_t;
@@ -24,6 +32,16 @@ typedef struct
     char *port_p;
     char *file_p;
     char *username_p;
+    char *io_p;
+    char *queue_p;
+    char *watermark_p;
+    char *chunk_p;
+    char *depth_p;
+    char *rate_p;
+    char *discover_p;
+    char *codec_p;
+    char *transport_p;
+    char *digest_p;
 
 } cmd_args_t;
 
@@ -33,61 +51,201 @@ typedef struct
     struct sockaddr_in server_addr;
 } sockdata_t;
 
+// Counters describing how chunk requests travel through this node.
 typedef struct
 {
-    tfile_def_t tfile;
-    peer_fd_t sender;
-    peers_t *peers;
-} send_tfile_t;
+    // Requests received from peers.
+    size_t received;
+    // Requests dropped because they were handled before.
+    size_t duplicates;
+    // Requests we could not answer which had no hops left.
+    size_t expired;
+    // Requests relayed, counted once per peer.
+    size_t forwarded;
+    // Requests answered with a chunk.
+    size_t answered;
+} request_stats_t;
 
+// Counters describing how tfile announcements travel through this node. Counted per definition.
 typedef struct
 {
-    tfile_def_t *tfile_arr;
+    // Definitions received from peers.
+    size_t received;
+    // Definitions we already knew, or our own coming back.
+    size_t redundant;
+    // Definitions sent on, counted once per peer.
+    size_t forwarded;
+    // New definitions not sent on because they travelled GOSSIP_MAX_HOPS.
+    size_t hop_limited;
+    // Times gossip was held back by the rate limiter.
+    size_t throttled;
+} gossip_stats_t;
+
+// Counters describing what catalog reconciliation costs.
+typedef struct
+{
+    // Summaries, queries and hash lists sent.
+    size_t messages;
+    // Bytes of those messages and of the tfile definitions sent in reply.
+    size_t bytes;
+    // Tfile definitions sent to peers which were missing them.
+    size_t tfiles;
+} catalog_stats_t;
+
+// Counters describing chunk availability advertisements.
+typedef struct
+{
+    // Bitfields sent to new peers and received from them.
+    size_t bitfields_sent;
+    size_t bitfields_received;
+    // Single chunks announced as they verified, counted once per peer.
+    size_t haves_sent;
+    size_t haves_received;
+} avail_stats_t;
+
+// The most peers connected to through discovery
+#define DISCOVERY_MAX_LINKS 32
+
+// Peers connected to because their discovery beacon was heard.
+typedef struct
+{
+    pthread_mutex_t lock;
+    // How many to connect to. 0 when discovery is off.
+    int wanted;
     int count;
-    peer_fd_t peer;
-    peers_t *peers;
+    // The node ids of the peers, and their sockets (-1 while connecting).
+    uint64_t node_ids[DISCOVERY_MAX_LINKS];
+    peer_fd_t fds[DISCOVERY_MAX_LINKS];
+    // Connections made, and those which failed.
+    size_t connects;
+    size_t failures;
+} discovered_t;
 
-} send_tfiles_t;
+// A FILE_DATA block being received. The header comes first, so the context is handed on as a chunk_payload_t.
+typedef struct
+{
+    chunk_payload_t hdr;
+    // The socket of the peer sending the block.
+    int fd;
+    // Set when the block comes compressed. Its pieces are read into the inflater, then inflated into the file.
+    inflater_t *inflater;
+    // Whether pieces were dropped, so what was inflated is not the whole block.
+    bool dropped;
+    // Where the chunk starts in the file's mapping, held with hold_tfile until the block ends.
+    unsigned char *dest;
+} chunk_recv_t;
 
+// Returned by send_compressed_block when a block does not shrink enough to be worth compressing.
+#define SEND_UNCOMPRESSED 1
+
+// A catalog message handed from the reactor to the task pool.
 typedef struct
 {
-    int server_fd;
-    int client_fd;
-} client_server_t;
+    int fd;
+    message_info_t info;
+    unsigned char data[];
+} catalog_message_t;
 
+// Runs a download on the task pool.
 typedef struct
 {
     unsigned char file_hash[MD5_DIGEST_LENGTH];
-    int chunk_index;
-    struct sockaddr_in return_addr;
-    socklen_t return_addr_len;
-    uint8_t ttl;
-} chunk_request_t;
+    // Whether this is the timer the scheduler armed, rather than a block arriving.
+    bool timer;
+} download_run_t;
 
 typedef struct
 {
-    unsigned char file_hash[MD5_DIGEST_LENGTH];
-    int chunk_index;
-    uint32_t chunk_size;
-} chunk_payload_t;
+    tfile_def_t *tfile_arr;
+    int count;
+    // How many were sent so far, when gossip is paced.
+    int sent;
+    peer_fd_t peer;
+    peers_t *peers;
+    announce_t announce;
+} send_tfiles_t;
 
 #define NO_SENDER_PEER -1
 
+// How often periodic upkeep runs, in milliseconds
+#define HOUSEKEEPING_INTERVAL_MS 1000
+
+// The most hops a chunk request is relayed
+#define REQUEST_TTL 5
+
+// How many chunk request ids are remembered, and for how long (in seconds), to drop repeats
+#define SEEN_REQUESTS_CAPACITY (1 << 16)
+#define SEEN_REQUESTS_WINDOW 30
+
+// The most hops a tfile announcement is relayed
+#define GOSSIP_MAX_HOPS 16
+
+// How many tfile definitions are gossiped per second, and how many can go at once
+#define GOSSIP_RATE 4096
+#define GOSSIP_BURST 8192
+
+// How long a download waits for a requested block to make progress before requesting it again, in milliseconds
+#define REQUEST_TIMEOUT_MS 5000
+
+// Chunks are requested in blocks of this many bytes, which may come from different peers
+#define BLOCK_SIZE (64 * 1024)
+
+// The most block requests in flight to a single peer, unless set with -d
+#define PIPELINE_DEPTH 16
+
+// Once a download has this few blocks outstanding, the blocks in flight are requested from more holders too
+#define ENDGAME_BLOCKS 16
+
+// The most block requests a download sends in one go
+#define DOWNLOAD_BATCH 64
+
+// The most blocks waiting to be uploaded, and how many are sent before the sender lets other tasks run
+#define UPLOAD_QUEUE_MAX 4096
+#define UPLOAD_BATCH 16
+
 // FUNCTION DEFINITONS
 void print_usage(char **argv);
 void parse_args(cmd_args_t *args, int argc, char **argv);
 void free_args(cmd_args_t args);
 sockdata_t get_address_self(peer_fd_t socket);
-void *readWorker(void *args);
-void *connectWorker(void *args);
-void remove_peers(int peers_to_remove_count, peer_fd_t peers_to_remove[peers_to_remove_count]);
-void *share_tfile_to_peers(void *args);
+void accept_peer(int listen_fd, int client_fd);
+void accept_chunk_conn(int listen_fd, int client_fd);
+void peer_closed(int fd);
+void handle_message(int fd, message_info_t *info, void *data);
+void *chunk_stream_begin(int fd, message_info_t *info, void *prefix);
+void *chunk_stream_next(void *ctx, size_t offset, size_t *len);
+void chunk_stream_end(void *ctx, bool complete);
+void share_tfiles_to_peers(void *args);
+int send_tfile_batches(peer_fd_t peer, tfile_def_t *tfiles, int count, const announce_t *announce, size_t *bytes);
+void gossip_tfiles(peer_fd_t sender, tfile_def_t *tdefs, int count, announce_t announce);
+void receive_tfiles(int fd, tfile_def_t *tdefs, int count, announce_t announce);
+void handle_tfile_batch(int fd, void *data, size_t size);
 int send_chunk_message(int fd, htable_t *ht,
                        unsigned char file_hash[MD5_DIGEST_LENGTH],
-                       int chunk_index);
+                       int chunk_index, uint32_t offset, uint32_t size, uint8_t accepts);
+uint64_t new_request_id();
+void send_catalog_message(int fd, message_type_t type, void *payload, size_t size);
+void send_catalog_summary(int fd, const catalog_prefix_t *prefix);
+void start_catalog_sync(void *args);
+int send_bitfield(int fd, unsigned char file_hash[MD5_DIGEST_LENGTH], const verified_chunks_t *chunks);
+void send_bitfields(void *args);
+void announce_chunk(void *args);
+void handle_have_bitfield(int fd, void *data, size_t size);
+void handle_have_chunk(int fd, void *data, size_t size);
+void handle_catalog_summary(int fd, catalog_summary_t *theirs);
+void handle_catalog_have(int fd, catalog_prefix_t *prefix, const unsigned char *hashes, int count);
+void handle_catalog_message(void *args);
+int join_peer(peer_fd_t peer);
+void discovered_node(struct sockaddr_in addr, uint64_t id);
 void remove_peer(peers_t *peers, peer_fd_t peer);
 void add_peer(peers_t *peers, peer_fd_t peer);
 bool isInitialized(sockdata_t data);
-void *download_file(unsigned char file_hash[MD5_DIGEST_LENGTH]);
+void housekeeping(void *args);
+void pump_uploads(void *args);
+void download_file(void *args);
+int schedule_download(unsigned char file_hash[MD5_DIGEST_LENGTH], const verified_chunks_t *chunks);
+void run_download(void *args);
+void wake_download(unsigned char file_hash[MD5_DIGEST_LENGTH], bool timer, long delay_ms);
+void finish_download(void *args);
 
 // END FUNCTION DEFINITIONS
\ No newline at end of file
@@ -0,0 +1,185 @@
+#include "codec.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "message.h"
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static codec_stats_t stats;
+
+// How the samples of a file went lately.
+typedef struct {
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  // Samples in a row which did not shrink, and blocks left to send without sampling.
+  int misses;
+  int skip;
+} file_history_t;
+
+// Requires the lock. Files are replaced round robin once the table is full.
+static file_history_t files[CODEC_MAX_FILES];
+static int file_count = 0;
+static int next_replaced = 0;
+
+// The history of <file>, created if needed. Requires the lock.
+static file_history_t *history_of(const unsigned char file[MD5_DIGEST_LENGTH]) {
+  for (int i = 0; i < file_count; i++) {
+    if (memcmp(files[i].hash, file, MD5_DIGEST_LENGTH) == 0) {
+      return &files[i];
+    }
+  }
+  file_history_t *h;
+  if (file_count < CODEC_MAX_FILES) {
+    h = &files[file_count++];
+  } else {
+    h = &files[next_replaced];
+    next_replaced = (next_replaced + 1) % CODEC_MAX_FILES;
+  }
+  memset(h, 0, sizeof(*h));
+  memcpy(h->hash, file, MD5_DIGEST_LENGTH);
+  return h;
+}
+
+// CPU time of the calling thread, in microseconds.
+static uint64_t cpu_us() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+// Compress <size> bytes at the fast level. Returns the compressed size or FAILED.
+static long deflate_at_level(const unsigned char *src, size_t size, unsigned char *dst, size_t room) {
+  uLongf out = room;
+  if (compress2(dst, &out, src, size, CODEC_LEVEL) != Z_OK) {
+    return FAILED;
+  }
+  return (long)out;
+}
+
+// Returns whether a block is worth compressing.
+bool codec_worth(const unsigned char file[MD5_DIGEST_LENGTH], const unsigned char *sample, size_t size) {
+  pthread_mutex_lock(&stats_lock);
+  file_history_t *h = history_of(file);
+  if (h->skip > 0) {
+    h->skip--;
+    stats.skipped++;
+    stats.unsampled++;
+    pthread_mutex_unlock(&stats_lock);
+    return false;
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  uint64_t start = cpu_us();
+  unsigned char out[CODEC_SAMPLE + CODEC_SAMPLE / 8 + 64];
+  size = size < CODEC_SAMPLE ? size : CODEC_SAMPLE;
+  long sampled = deflate_at_level(sample, size, out, sizeof(out));
+  bool worth = sampled != FAILED && sampled <= size * CODEC_MAX_RATIO;
+
+  pthread_mutex_lock(&stats_lock);
+  stats.pack_us += cpu_us() - start;
+  // the entry may have gone to another file meanwhile, which only costs a sample
+  h = history_of(file);
+  if (worth) {
+    h->misses = 0;
+  } else {
+    stats.skipped++;
+    if (++h->misses >= CODEC_SKIP_AFTER) {
+      h->misses = 0;
+      h->skip = CODEC_SKIP_BLOCKS;
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return worth;
+}
+
+// Compress a block.
+long codec_compress(const unsigned char *src, size_t size, unsigned char *dst) {
+  uint64_t start = cpu_us();
+  long packed = deflate_at_level(src, size, dst, compressBound(size));
+  if (packed != FAILED && packed > size * CODEC_MAX_RATIO) {
+    packed = FAILED;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  stats.pack_us += cpu_us() - start;
+  if (packed == FAILED) {
+    stats.skipped++;
+  } else {
+    stats.packed++;
+    stats.packed_raw += size;
+    stats.packed_wire += packed;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return packed;
+}
+
+// Create an inflater.
+inflater_t *inflater_new() {
+  inflater_t *inflater = calloc(1, sizeof(inflater_t));
+  if (inflater != NULL && inflateInit(&inflater->zs) != Z_OK) {
+    free(inflater);
+    return NULL;
+  }
+  return inflater;
+}
+
+// Inflate the pending bytes.
+long inflater_flush(inflater_t *inflater, unsigned char *out, size_t room) {
+  if (inflater->failed) {
+    return FAILED;
+  }
+  if (inflater->pending == 0) {
+    return 0;
+  }
+  uint64_t start = cpu_us();
+  inflater->zs.next_in = inflater->in;
+  inflater->zs.avail_in = (uInt)inflater->pending;
+  inflater->zs.next_out = out;
+  inflater->zs.avail_out = (uInt)room;
+  int rc = inflate(&inflater->zs, Z_NO_FLUSH);
+  long written = (long)(room - inflater->zs.avail_out);
+
+  // bytes left over mean the block inflates past its size, or goes on after its end
+  if ((rc != Z_OK && rc != Z_STREAM_END) || inflater->zs.avail_in > 0) {
+    inflater->failed = true;
+  }
+  inflater->ended = rc == Z_STREAM_END;
+  inflater->wire += inflater->pending;
+  inflater->produced += written;
+  inflater->pending = 0;
+
+  pthread_mutex_lock(&stats_lock);
+  stats.unpack_us += cpu_us() - start;
+  pthread_mutex_unlock(&stats_lock);
+  return inflater->failed ? FAILED : written;
+}
+
+// Check a block inflated to its size.
+bool inflater_finish(inflater_t *inflater, uint64_t size) {
+  bool ok = !inflater->failed && inflater->ended && inflater->produced == size;
+  pthread_mutex_lock(&stats_lock);
+  if (ok) {
+    stats.unpacked++;
+    stats.unpacked_wire += inflater->wire;
+    stats.unpacked_raw += inflater->produced;
+  } else {
+    stats.corrupt++;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  return ok;
+}
+
+void inflater_free(inflater_t *inflater) {
+  if (inflater != NULL) {
+    inflateEnd(&inflater->zs);
+    free(inflater);
+  }
+}
+
+// Get the compression counters.
+codec_stats_t codec_stats() {
+  pthread_mutex_lock(&stats_lock);
+  codec_stats_t s = stats;
+  pthread_mutex_unlock(&stats_lock);
+  return s;
+}
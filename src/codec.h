@@ -0,0 +1,83 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/md5.h>
+#include <zlib.h>
+
+// The zlib level blocks are compressed at. Level 1 is the fastest, and gets most of the gain on text.
+#define CODEC_LEVEL 1
+
+// Whether a block is worth compressing is decided by compressing this many bytes from its start first.
+#define CODEC_SAMPLE (4 * 1024)
+
+// Blocks are only compressed when their sample shrinks to this share of its size or less, and only sent
+// compressed when the whole block does too.
+#define CODEC_MAX_RATIO 0.9
+
+// Once this many samples of a file in a row did not shrink, the next CODEC_SKIP_BLOCKS blocks of it are sent
+// as they are without sampling. Files already compressed rarely start compressing halfway.
+#define CODEC_SKIP_AFTER 4
+#define CODEC_SKIP_BLOCKS 64
+
+// The most files whose sampling results are remembered.
+#define CODEC_MAX_FILES 64
+
+// The most compressed bytes read at once while inflating a block.
+#define CODEC_PIECE (64 * 1024)
+
+// Counters describing compression, in both directions.
+typedef struct {
+  // Blocks sent compressed, their size and the bytes that went on the wire instead.
+  size_t packed;
+  uint64_t packed_raw;
+  uint64_t packed_wire;
+  // Blocks sent as they are because their sample (or the whole block) did not shrink enough, and how many of
+  // them were not even sampled because their file did not compress lately.
+  size_t skipped;
+  size_t unsampled;
+  // Time spent compressing, samples included, in microseconds.
+  uint64_t pack_us;
+  // Compressed blocks received, the bytes read and the bytes they inflated to, and those which were corrupt.
+  size_t unpacked;
+  uint64_t unpacked_wire;
+  uint64_t unpacked_raw;
+  size_t corrupt;
+  uint64_t unpack_us;
+} codec_stats_t;
+
+// Inflates one compressed block as its bytes arrive.
+typedef struct {
+  z_stream zs;
+  // Compressed bytes read and not inflated yet.
+  unsigned char in[CODEC_PIECE];
+  size_t pending;
+  // Compressed bytes read, and bytes inflated so far.
+  uint64_t wire;
+  uint64_t produced;
+  bool ended;
+  bool failed;
+} inflater_t;
+
+// Returns whether a block of <file> starting with the <size> bytes of <sample> (at most CODEC_SAMPLE) is worth
+// compressing. If not, it is counted as sent as it is.
+bool codec_worth(const unsigned char file[MD5_DIGEST_LENGTH], const unsigned char *sample, size_t size);
+
+// Compress the <size> bytes of <src> into <dst>, which holds compressBound(<size>) bytes.
+// Returns the compressed size, or FAILED if the block did not shrink enough and should be sent as it is.
+long codec_compress(const unsigned char *src, size_t size, unsigned char *dst);
+
+// Create an inflater. Returns NULL if failed.
+inflater_t *inflater_new();
+
+// Inflate the bytes pending in <inflater> into <out>, which has room for <room> bytes.
+// Returns the number of bytes written, or FAILED if the data is corrupt or inflates past <room>.
+long inflater_flush(inflater_t *inflater, unsigned char *out, size_t room);
+
+// Returns whether the block inflated to exactly <size> bytes. Counts it in the stats.
+bool inflater_finish(inflater_t *inflater, uint64_t size);
+
+void inflater_free(inflater_t *inflater);
+
+// Get the compression counters.
+codec_stats_t codec_stats();
@@ -0,0 +1,140 @@
+#include "connpool.h"
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "transport.h"
+
+// A pooled connection, keyed by the address it is connected to.
+typedef struct {
+  int fd;
+  struct sockaddr_in addr;
+  bool in_use;
+  time_t last_used;
+} pool_entry_t;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_entry_t entries[POOL_MAX_CONNS];
+static int entry_count = 0;
+static pool_stats_t stats;
+
+static bool same_addr(struct sockaddr_in *a, struct sockaddr_in *b) {
+  return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Close entry <i> and fill its slot with the last entry. Requires the lock.
+static void drop_entry(int i) {
+  close(entries[i].fd);
+  entries[i] = entries[--entry_count];
+  stats.closes++;
+}
+
+// A connection is dead once the other side closed it. The receiver never writes back,
+// so anything readable means the connection was shut down or reset.
+static bool is_alive(int fd) {
+  char c;
+  ssize_t rc = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Close idle entries which timed out. Requires the lock.
+static void expire_locked(time_t now) {
+  for (int i = 0; i < entry_count;) {
+    if (!entries[i].in_use && now - entries[i].last_used >= POOL_IDLE_TIMEOUT) {
+      drop_entry(i);
+    } else {
+      i++;
+    }
+  }
+}
+
+// Get a connection to <addr>, reusing an idle one if there is one.
+int pool_acquire(struct sockaddr_in addr, socklen_t addr_len) {
+  time_t now = time(NULL);
+  pthread_mutex_lock(&pool_lock);
+  expire_locked(now);
+
+  for (int i = 0; i < entry_count;) {
+    if (entries[i].in_use || !same_addr(&entries[i].addr, &addr)) {
+      i++;
+      continue;
+    }
+    if (!is_alive(entries[i].fd)) {
+      drop_entry(i);
+      continue;
+    }
+    entries[i].in_use = true;
+    stats.reuses++;
+    int fd = entries[i].fd;
+    pthread_mutex_unlock(&pool_lock);
+    return fd;
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  // Nothing to reuse. Connect without holding the lock.
+  int fd = transport_connect(addr, addr_len);
+  if (fd == -1) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&pool_lock);
+  stats.connects++;
+  // Make room by evicting the least recently used idle connection.
+  if (entry_count == POOL_MAX_CONNS) {
+    int lru = -1;
+    for (int i = 0; i < entry_count; i++) {
+      if (!entries[i].in_use && (lru == -1 || entries[i].last_used < entries[lru].last_used)) {
+        lru = i;
+      }
+    }
+    if (lru != -1) {
+      drop_entry(lru);
+    }
+  }
+  // Every pooled connection is busy. This one is closed on release instead of kept.
+  if (entry_count < POOL_MAX_CONNS) {
+    entries[entry_count++] = (pool_entry_t){.fd = fd, .addr = addr, .in_use = true, .last_used = now};
+  }
+  pthread_mutex_unlock(&pool_lock);
+
+  return fd;
+}
+
+// Give a connection back.
+void pool_release(int fd, bool healthy) {
+  pthread_mutex_lock(&pool_lock);
+  for (int i = 0; i < entry_count; i++) {
+    if (entries[i].fd == fd && entries[i].in_use) {
+      if (healthy) {
+        entries[i].in_use = false;
+        entries[i].last_used = time(NULL);
+      } else {
+        drop_entry(i);
+      }
+      pthread_mutex_unlock(&pool_lock);
+      return;
+    }
+  }
+  // Not pooled because the pool was full.
+  close(fd);
+  stats.closes++;
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// Close idle connections which timed out.
+void pool_expire() {
+  pthread_mutex_lock(&pool_lock);
+  expire_locked(time(NULL));
+  pthread_mutex_unlock(&pool_lock);
+}
+
+// Get the pool's counters.
+pool_stats_t pool_stats() {
+  pthread_mutex_lock(&pool_lock);
+  pool_stats_t s = stats;
+  s.open = entry_count;
+  pthread_mutex_unlock(&pool_lock);
+  return s;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// The most connections the pool keeps open, idle or in use.
+#define POOL_MAX_CONNS 32
+
+// Idle connections older than this (in seconds) are closed.
+#define POOL_IDLE_TIMEOUT 30
+
+// Counters describing how well connections are reused.
+typedef struct {
+  // connect() calls made by the pool.
+  size_t connects;
+  // Acquires satisfied by an idle pooled connection.
+  size_t reuses;
+  // Connections closed because they idled out, were evicted, or went bad.
+  size_t closes;
+  // Connections currently open (idle or in use).
+  size_t open;
+} pool_stats_t;
+
+// Get a connection to <addr>, reusing an idle one if there is one.
+// The caller has exclusive use of the connection until pool_release.
+// Returns the socket or -1 if failed.
+int pool_acquire(struct sockaddr_in addr, socklen_t addr_len);
+
+// Give a connection back. If <healthy> is false (e.g. a send failed) it is closed.
+void pool_release(int fd, bool healthy);
+
+// Close idle connections which timed out.
+void pool_expire();
+
+// Get the pool's counters.
+pool_stats_t pool_stats();
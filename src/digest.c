@@ -0,0 +1,516 @@
+#include "digest.h"
+#include <string.h>
+#include "message.h"
+
+// One algorithm. <state> is the union member of digest_t for it.
+struct digest_ops {
+  const char *name;
+  void (*init)(void *state);
+  void (*update)(void *state, const void *data, size_t size);
+  void (*final)(void *state, unsigned char out[DIGEST_LENGTH]);
+  // Hashing in subtrees, for tree algorithms only.
+  void (*init_at)(void *state, uint64_t offset);
+  void (*final_cv)(void *state, unsigned char cv[DIGEST_CV_LENGTH]);
+  void (*merge)(const unsigned char (*cvs)[DIGEST_CV_LENGTH], uint32_t count, unsigned char out[DIGEST_LENGTH]);
+  // The size of the leaves of the tree.
+  uint32_t leaf;
+};
+
+static uint32_t load32_le(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t load64_le(const uint8_t *p) {
+  return (uint64_t)load32_le(p) | (uint64_t)load32_le(p + 4) << 32;
+}
+
+// ----MD5, through OpenSSL----
+
+static void md5_init(void *state) {
+  MD5_Init(state);
+}
+
+static void md5_update(void *state, const void *data, size_t size) {
+  MD5_Update(state, data, size);
+}
+
+static void md5_final(void *state, unsigned char out[DIGEST_LENGTH]) {
+  MD5_Final(out, state);
+}
+
+// ----BLAKE3, portable----
+// Input is split into 1 KiB chunks of 64 byte blocks. Chunks are hashed into chaining values which are merged
+// pairwise into a binary tree, and the root is compressed once more with the ROOT flag for the output.
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define CHUNK_START (1 << 0)
+#define CHUNK_END (1 << 1)
+#define PARENT (1 << 2)
+#define ROOT (1 << 3)
+
+static const uint32_t blake3_iv[8] = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                      0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+
+// The message words each round takes, with the permutation applied between rounds folded in.
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}, {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1}, {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4}, {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static uint32_t rotr32(uint32_t w, int c) {
+  return (w >> c) | (w << (32 - c));
+}
+
+static inline void blake3_g(uint32_t *s, int a, int b, int c, int d, uint32_t x, uint32_t y) {
+  s[a] = s[a] + s[b] + x;
+  s[d] = rotr32(s[d] ^ s[a], 16);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 12);
+  s[a] = s[a] + s[b] + y;
+  s[d] = rotr32(s[d] ^ s[a], 8);
+  s[c] = s[c] + s[d];
+  s[b] = rotr32(s[b] ^ s[c], 7);
+}
+
+// Compress one block into the 16 words of <out>. The first 8 are the chaining value.
+static void blake3_compress(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN], uint8_t block_len,
+                            uint64_t counter, uint8_t flags, uint32_t out[16]) {
+  uint32_t m[16];
+  for (int i = 0; i < 16; i++) {
+    m[i] = load32_le(block + 4 * i);
+  }
+  uint32_t s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                    blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+                    (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags};
+  for (int r = 0; r < 7; r++) {
+    const uint8_t *w = blake3_schedule[r];
+    blake3_g(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);
+    blake3_g(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);
+    blake3_g(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);
+    blake3_g(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);
+    blake3_g(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);
+    blake3_g(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);
+    blake3_g(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);
+    blake3_g(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);
+  }
+  for (int i = 0; i < 8; i++) {
+    out[i] = s[i] ^ s[i + 8];
+    out[i + 8] = s[i + 8] ^ cv[i];
+  }
+}
+
+// BLAKE3_LANES whole chunks are hashed side by side, one in each lane of a vector. The compiler maps the vectors
+// onto whatever SIMD registers the target has (two SSE2 registers each, or one AVX2 register).
+#define BLAKE3_LANES 8
+typedef uint32_t lanes_t __attribute__((vector_size(4 * BLAKE3_LANES)));
+
+// Macros rather than functions, since passing vectors wider than the target's registers by value is not portable.
+#define ROTR_LANES(w, c) (((w) >> (c)) | ((w) << (32 - (c))))
+#define G_LANES(s, a, b, c, d, x, y)      \
+  do {                                    \
+    s[a] = s[a] + s[b] + (x);             \
+    s[d] = ROTR_LANES(s[d] ^ s[a], 16);   \
+    s[c] = s[c] + s[d];                   \
+    s[b] = ROTR_LANES(s[b] ^ s[c], 12);   \
+    s[a] = s[a] + s[b] + (y);             \
+    s[d] = ROTR_LANES(s[d] ^ s[a], 8);    \
+    s[c] = s[c] + s[d];                   \
+    s[b] = ROTR_LANES(s[b] ^ s[c], 7);    \
+  } while (0)
+
+// Hash the BLAKE3_LANES chunks starting at <in>, the first of which is chunk <counter>, into their chaining values.
+static void blake3_hash_lanes(const uint8_t *in, uint64_t counter, uint32_t cvs[BLAKE3_LANES][8]) {
+  lanes_t cv[8];
+  lanes_t counter_lo;
+  lanes_t counter_hi;
+  for (int j = 0; j < BLAKE3_LANES; j++) {
+    counter_lo[j] = (uint32_t)(counter + j);
+    counter_hi[j] = (uint32_t)((counter + j) >> 32);
+  }
+  for (int i = 0; i < 8; i++) {
+    cv[i] = (lanes_t){0} + blake3_iv[i];
+  }
+
+  for (int block = 0; block < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; block++) {
+    lanes_t m[16];
+    for (int i = 0; i < 16; i++) {
+      for (int j = 0; j < BLAKE3_LANES; j++) {
+        m[i][j] = load32_le(in + j * BLAKE3_CHUNK_LEN + block * BLAKE3_BLOCK_LEN + 4 * i);
+      }
+    }
+    uint32_t flags = block == 0 ? CHUNK_START : block == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? CHUNK_END : 0;
+    lanes_t s[16] = {cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                     (lanes_t){0} + blake3_iv[0], (lanes_t){0} + blake3_iv[1],
+                     (lanes_t){0} + blake3_iv[2], (lanes_t){0} + blake3_iv[3],
+                     counter_lo, counter_hi, (lanes_t){0} + BLAKE3_BLOCK_LEN, (lanes_t){0} + flags};
+    for (int r = 0; r < 7; r++) {
+      const uint8_t *w = blake3_schedule[r];
+      G_LANES(s, 0, 4, 8, 12, m[w[0]], m[w[1]]);
+      G_LANES(s, 1, 5, 9, 13, m[w[2]], m[w[3]]);
+      G_LANES(s, 2, 6, 10, 14, m[w[4]], m[w[5]]);
+      G_LANES(s, 3, 7, 11, 15, m[w[6]], m[w[7]]);
+      G_LANES(s, 0, 5, 10, 15, m[w[8]], m[w[9]]);
+      G_LANES(s, 1, 6, 11, 12, m[w[10]], m[w[11]]);
+      G_LANES(s, 2, 7, 8, 13, m[w[12]], m[w[13]]);
+      G_LANES(s, 3, 4, 9, 14, m[w[14]], m[w[15]]);
+    }
+    for (int i = 0; i < 8; i++) {
+      cv[i] = s[i] ^ s[i + 8];
+    }
+  }
+
+  for (int j = 0; j < BLAKE3_LANES; j++) {
+    for (int i = 0; i < 8; i++) {
+      cvs[j][i] = cv[i][j];
+    }
+  }
+}
+
+// The chaining value of the parent of two subtrees.
+static void blake3_parent(const uint32_t left[8], const uint32_t right[8], uint32_t cv[8], uint8_t flags) {
+  uint8_t block[BLAKE3_BLOCK_LEN];
+  for (int i = 0; i < 8; i++) {
+    for (int j = 0; j < 4; j++) {
+      block[4 * i + j] = (uint8_t)(left[i] >> (8 * j));
+      block[32 + 4 * i + j] = (uint8_t)(right[i] >> (8 * j));
+    }
+  }
+  uint32_t out[16];
+  blake3_compress(blake3_iv, block, BLAKE3_BLOCK_LEN, 0, PARENT | flags, out);
+  memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void blake3_start_chunk(blake3_state_t *b, uint64_t counter) {
+  memcpy(b->cv, blake3_iv, sizeof(b->cv));
+  b->chunk_counter = counter;
+  b->block_len = 0;
+  b->blocks_compressed = 0;
+}
+
+static void blake3_init(void *state) {
+  blake3_state_t *b = state;
+  blake3_start_chunk(b, 0);
+  b->stack_len = 0;
+}
+
+// Merge a finished chunk into the tree. A subtree is complete once as many chunks follow it as it holds.
+static void blake3_push_chunk(blake3_state_t *b, const uint32_t cv[8], uint64_t total_chunks) {
+  uint32_t merged[8];
+  memcpy(merged, cv, sizeof(merged));
+  while ((total_chunks & 1) == 0) {
+    b->stack_len--;
+    blake3_parent(b->stack[b->stack_len], merged, merged, 0);
+    total_chunks >>= 1;
+  }
+  memcpy(b->stack[b->stack_len++], merged, sizeof(merged));
+}
+
+static void blake3_update(void *state, const void *data, size_t size) {
+  blake3_state_t *b = state;
+  const uint8_t *in = data;
+  while (size > 0) {
+    // whole chunks are hashed several at a time, as long as the last of the input is left for the root
+    if (b->blocks_compressed == 0 && b->block_len == 0) {
+      while (size > BLAKE3_LANES * BLAKE3_CHUNK_LEN) {
+        uint32_t cvs[BLAKE3_LANES][8];
+        blake3_hash_lanes(in, b->chunk_counter, cvs);
+        for (int j = 0; j < BLAKE3_LANES; j++) {
+          blake3_push_chunk(b, cvs[j], b->chunk_counter + j + 1);
+        }
+        blake3_start_chunk(b, b->chunk_counter + BLAKE3_LANES);
+        in += BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+        size -= BLAKE3_LANES * BLAKE3_CHUNK_LEN;
+      }
+    }
+    // a full chunk is only finished once more input shows it is not the last, which is hashed as the root
+    if (b->blocks_compressed * BLAKE3_BLOCK_LEN + b->block_len == BLAKE3_CHUNK_LEN) {
+      uint32_t out[16];
+      blake3_compress(b->cv, b->block, b->block_len, b->chunk_counter, CHUNK_END, out);
+      blake3_push_chunk(b, out, b->chunk_counter + 1);
+      blake3_start_chunk(b, b->chunk_counter + 1);
+    }
+    // likewise a full block is only compressed once more input follows it
+    if (b->block_len == BLAKE3_BLOCK_LEN) {
+      uint32_t out[16];
+      blake3_compress(b->cv, b->block, BLAKE3_BLOCK_LEN, b->chunk_counter,
+                      b->blocks_compressed == 0 ? CHUNK_START : 0, out);
+      memcpy(b->cv, out, sizeof(b->cv));
+      b->blocks_compressed++;
+      b->block_len = 0;
+    }
+    size_t take = BLAKE3_BLOCK_LEN - b->block_len;
+    take = take < size ? take : size;
+    memcpy(b->block + b->block_len, in, take);
+    b->block_len += take;
+    in += take;
+    size -= take;
+  }
+}
+
+// Compress the last block of the chunk being hashed into its chaining value.
+static void blake3_finish_chunk(blake3_state_t *b, uint8_t flags, uint32_t cv[8]) {
+  memset(b->block + b->block_len, 0, BLAKE3_BLOCK_LEN - b->block_len);
+  flags |= (b->blocks_compressed == 0 ? CHUNK_START : 0) | CHUNK_END;
+  uint32_t words[16];
+  blake3_compress(b->cv, b->block, b->block_len, b->chunk_counter, flags, words);
+  memcpy(cv, words, 8 * sizeof(uint32_t));
+}
+
+static void store_le(const uint32_t *words, unsigned char *out, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    out[i] = (uint8_t)(words[i / 4] >> (8 * (i % 4)));
+  }
+}
+
+static void blake3_final(void *state, unsigned char out[DIGEST_LENGTH]) {
+  blake3_state_t *b = state;
+  // without subtrees the last chunk is the root, else it is merged up the stack and the last parent is
+  uint32_t cv[8];
+  blake3_finish_chunk(b, b->stack_len == 0 ? ROOT : 0, cv);
+  for (int i = b->stack_len - 1; i >= 0; i--) {
+    blake3_parent(b->stack[i], cv, cv, i == 0 ? ROOT : 0);
+  }
+  store_le(cv, out, DIGEST_LENGTH);
+}
+
+// Start hashing the subtree of a larger input starting <offset> bytes in.
+static void blake3_init_at(void *state, uint64_t offset) {
+  blake3_state_t *b = state;
+  blake3_start_chunk(b, offset / BLAKE3_CHUNK_LEN);
+  b->stack_len = 0;
+}
+
+// The chaining value of the subtree, which is not the root.
+static void blake3_final_cv(void *state, unsigned char out[DIGEST_CV_LENGTH]) {
+  blake3_state_t *b = state;
+  uint32_t cv[8];
+  blake3_finish_chunk(b, 0, cv);
+  for (int i = b->stack_len - 1; i >= 0; i--) {
+    blake3_parent(b->stack[i], cv, cv, 0);
+  }
+  store_le(cv, out, DIGEST_CV_LENGTH);
+}
+
+// Merge the chaining values of <count> equal subtrees (but the last, which may be smaller) into the root,
+// the way blake3_update merges chunks.
+static void blake3_merge(const unsigned char (*cvs)[DIGEST_CV_LENGTH], uint32_t count, unsigned char out[DIGEST_LENGTH]) {
+  uint32_t stack[33][8];
+  int stack_len = 0;
+  uint32_t cv[8];
+  for (uint32_t i = 0; i < count; i++) {
+    for (int w = 0; w < 8; w++) {
+      cv[w] = load32_le(cvs[i] + 4 * w);
+    }
+    if (i + 1 == count) {
+      break;
+    }
+    for (uint64_t total = i + 1; (total & 1) == 0; total >>= 1) {
+      stack_len--;
+      blake3_parent(stack[stack_len], cv, cv, 0);
+    }
+    memcpy(stack[stack_len++], cv, sizeof(cv));
+  }
+  for (int i = stack_len - 1; i >= 0; i--) {
+    blake3_parent(stack[i], cv, cv, i == 0 ? ROOT : 0);
+  }
+  store_le(cv, out, DIGEST_LENGTH);
+}
+
+// ----XXH64, twice----
+
+#define XXH_PRIME1 0x9E3779B185EBCA87ull
+#define XXH_PRIME2 0xC2B2AE3D27D4EB4Full
+#define XXH_PRIME3 0x165667B19E3779F9ull
+#define XXH_PRIME4 0x85EBCA77C2B2AE63ull
+#define XXH_PRIME5 0x27D4EB2F165667C5ull
+
+// The seeds of the two halves of the digest.
+static const uint64_t xxh_seeds[2] = {0, 0x9E3779B97F4A7C15ull};
+
+static uint64_t rotl64(uint64_t w, int c) {
+  return (w << c) | (w >> (64 - c));
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * XXH_PRIME2;
+  acc = rotl64(acc, 31);
+  return acc * XXH_PRIME1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_init(void *state) {
+  xxh64_state_t *x = state;
+  for (int h = 0; h < 2; h++) {
+    x->acc[h][0] = xxh_seeds[h] + XXH_PRIME1 + XXH_PRIME2;
+    x->acc[h][1] = xxh_seeds[h] + XXH_PRIME2;
+    x->acc[h][2] = xxh_seeds[h];
+    x->acc[h][3] = xxh_seeds[h] - XXH_PRIME1;
+  }
+  x->stripe_len = 0;
+  x->total = 0;
+}
+
+static void xxh64_stripe(xxh64_state_t *x, const uint8_t *p) {
+  for (int i = 0; i < 4; i++) {
+    uint64_t lane = load64_le(p + 8 * i);
+    x->acc[0][i] = xxh_round(x->acc[0][i], lane);
+    x->acc[1][i] = xxh_round(x->acc[1][i], lane);
+  }
+}
+
+static void xxh64_update(void *state, const void *data, size_t size) {
+  xxh64_state_t *x = state;
+  const uint8_t *in = data;
+  x->total += size;
+  if (x->stripe_len > 0) {
+    size_t take = 32 - x->stripe_len < size ? 32 - x->stripe_len : size;
+    memcpy(x->stripe + x->stripe_len, in, take);
+    x->stripe_len += take;
+    in += take;
+    size -= take;
+    if (x->stripe_len < 32) {
+      return;
+    }
+    xxh64_stripe(x, x->stripe);
+    x->stripe_len = 0;
+  }
+  for (; size >= 32; in += 32, size -= 32) {
+    xxh64_stripe(x, in);
+  }
+  memcpy(x->stripe, in, size);
+  x->stripe_len = size;
+}
+
+static void xxh64_final(void *state, unsigned char out[DIGEST_LENGTH]) {
+  xxh64_state_t *x = state;
+  for (int h = 0; h < 2; h++) {
+    const uint64_t *v = x->acc[h];
+    uint64_t acc;
+    if (x->total >= 32) {
+      acc = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+      for (int i = 0; i < 4; i++) {
+        acc = xxh_merge(acc, v[i]);
+      }
+    } else {
+      acc = xxh_seeds[h] + XXH_PRIME5;
+    }
+    acc += x->total;
+
+    const uint8_t *p = x->stripe;
+    size_t left = x->stripe_len;
+    for (; left >= 8; p += 8, left -= 8) {
+      acc ^= xxh_round(0, load64_le(p));
+      acc = rotl64(acc, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (left >= 4) {
+      acc ^= (uint64_t)load32_le(p) * XXH_PRIME1;
+      acc = rotl64(acc, 23) * XXH_PRIME2 + XXH_PRIME3;
+      p += 4;
+      left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+      acc ^= *p * XXH_PRIME5;
+      acc = rotl64(acc, 11) * XXH_PRIME1;
+    }
+    acc ^= acc >> 33;
+    acc *= XXH_PRIME2;
+    acc ^= acc >> 29;
+    acc *= XXH_PRIME3;
+    acc ^= acc >> 32;
+
+    // big endian, the way XXH64 digests are usually printed
+    for (int i = 0; i < 8; i++) {
+      out[8 * h + i] = (uint8_t)(acc >> (56 - 8 * i));
+    }
+  }
+}
+
+// Indexed by algorithm.
+static const digest_ops_t algorithms[DIGEST_COUNT] = {
+    [DIGEST_MD5] = {"md5", md5_init, md5_update, md5_final},
+    [DIGEST_BLAKE3] = {"blake3", blake3_init, blake3_update, blake3_final, blake3_init_at, blake3_final_cv, blake3_merge,
+                       BLAKE3_CHUNK_LEN},
+    [DIGEST_XXH64] = {"xxh64", xxh64_init, xxh64_update, xxh64_final},
+};
+
+// Start a digest.
+int digest_init(digest_t *d, uint8_t algorithm) {
+  if (!digest_known(algorithm)) {
+    return FAILED;
+  }
+  d->ops = &algorithms[algorithm];
+  d->ops->init(&d->state);
+  return SUCCESS;
+}
+
+void digest_update(digest_t *d, const void *data, size_t size) {
+  d->ops->update(&d->state, data, size);
+}
+
+void digest_final(digest_t *d, unsigned char out[DIGEST_LENGTH]) {
+  d->ops->final(&d->state, out);
+}
+
+// Returns whether chunks of <chunk_size> bytes are whole subtrees of the algorithm's tree.
+bool digest_tree_chunks(uint8_t algorithm, uint32_t chunk_size) {
+  if (!digest_known(algorithm) || algorithms[algorithm].merge == NULL) {
+    return false;
+  }
+  // a power of two number of leaves
+  return chunk_size >= algorithms[algorithm].leaf && chunk_size % algorithms[algorithm].leaf == 0 &&
+         ((chunk_size / algorithms[algorithm].leaf) & (chunk_size / algorithms[algorithm].leaf - 1)) == 0;
+}
+
+// Start the digest of a subtree.
+int digest_init_at(digest_t *d, uint8_t algorithm, uint64_t offset) {
+  if (!digest_known(algorithm) || algorithms[algorithm].init_at == NULL) {
+    return FAILED;
+  }
+  d->ops = &algorithms[algorithm];
+  d->ops->init_at(&d->state, offset);
+  return SUCCESS;
+}
+
+void digest_final_cv(digest_t *d, unsigned char cv[DIGEST_CV_LENGTH]) {
+  d->ops->final_cv(&d->state, cv);
+}
+
+// Derive the digest of a whole input from its subtrees.
+void digest_merge(uint8_t algorithm, const unsigned char (*cvs)[DIGEST_CV_LENGTH], uint32_t count,
+                  unsigned char out[DIGEST_LENGTH]) {
+  algorithms[algorithm].merge(cvs, count, out);
+}
+
+// Digest a buffer at once.
+void digest_once(uint8_t algorithm, const void *data, size_t size, unsigned char out[DIGEST_LENGTH]) {
+  digest_t d;
+  digest_init(&d, algorithm);
+  digest_update(&d, data, size);
+  digest_final(&d, out);
+}
+
+bool digest_known(uint8_t algorithm) {
+  return algorithm < DIGEST_COUNT;
+}
+
+// The name of an algorithm.
+const char *digest_name(uint8_t algorithm) {
+  return digest_known(algorithm) ? algorithms[algorithm].name : "unknown";
+}
+
+// Find an algorithm by name.
+int digest_parse(const char *name) {
+  for (int i = 0; i < DIGEST_COUNT; i++) {
+    if (strcmp(name, algorithms[i].name) == 0) {
+      return i;
+    }
+  }
+  return FAILED;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/md5.h>
+
+// Every algorithm's digests are this long, so file and chunk hashes keep their size on the wire and in the tables
+// keyed on them, whichever algorithm made them.
+#define DIGEST_LENGTH MD5_DIGEST_LENGTH
+
+// The algorithms a tfile may be hashed with, as named in its definition.
+// MD5 is what definitions from older builds were hashed with.
+#define DIGEST_MD5 0
+// BLAKE3, cut to DIGEST_LENGTH bytes. Cryptographic, and much faster than MD5.
+#define DIGEST_BLAKE3 1
+// XXH64 with two seeds, one digest in each half. Not cryptographic: for trusted networks only.
+#define DIGEST_XXH64 2
+#define DIGEST_COUNT 3
+
+// Tree algorithms can hash parts of an input separately, as subtrees, and derive the digest of the whole input
+// from the chaining values of the parts. This is how long the chaining values are.
+#define DIGEST_CV_LENGTH 32
+
+// The algorithm new tfiles are hashed with unless another is chosen.
+#define DIGEST_DEFAULT DIGEST_MD5
+
+// BLAKE3 state: the chunk being hashed, and the chaining values of the subtrees finished so far.
+typedef struct {
+  uint32_t cv[8];
+  uint64_t chunk_counter;
+  uint8_t block[64];
+  uint8_t block_len;
+  uint8_t blocks_compressed;
+  // A 2^64 byte input has at most 54 subtrees waiting to be merged.
+  uint32_t stack[54][8];
+  uint8_t stack_len;
+} blake3_state_t;
+
+// Two XXH64 states over the same input, and the bytes not yet making a full 32 byte stripe.
+typedef struct {
+  uint64_t acc[2][4];
+  uint8_t stripe[32];
+  size_t stripe_len;
+  uint64_t total;
+} xxh64_state_t;
+
+typedef struct digest_ops digest_ops_t;
+
+// A digest being computed.
+typedef struct {
+  const digest_ops_t *ops;
+  union {
+    MD5_CTX md5;
+    blake3_state_t blake3;
+    xxh64_state_t xxh64;
+  } state;
+} digest_t;
+
+// Start a digest with <algorithm>. Returns FAILED if the algorithm is unknown.
+int digest_init(digest_t *d, uint8_t algorithm);
+void digest_update(digest_t *d, const void *data, size_t size);
+void digest_final(digest_t *d, unsigned char out[DIGEST_LENGTH]);
+
+// Digest <size> bytes at once. The algorithm must be known.
+void digest_once(uint8_t algorithm, const void *data, size_t size, unsigned char out[DIGEST_LENGTH]);
+
+// Returns whether chunks of <chunk_size> bytes can be hashed as subtrees with <algorithm>: it is a tree algorithm
+// and the chunks hold a power of two number of its leaves.
+bool digest_tree_chunks(uint8_t algorithm, uint32_t chunk_size);
+
+// Start the digest of a subtree which starts <offset> bytes into the whole input, a multiple of the chunk size
+// digest_tree_chunks accepted. Returns FAILED if <algorithm> is not a tree algorithm.
+int digest_init_at(digest_t *d, uint8_t algorithm, uint64_t offset);
+
+// Finish the digest of a subtree, with its chaining value. The first DIGEST_LENGTH bytes serve as its digest.
+void digest_final_cv(digest_t *d, unsigned char cv[DIGEST_CV_LENGTH]);
+
+// Derive the digest of a whole input from the chaining values of its <count> subtrees, in order, which are all as
+// large but the last. There must be at least two; a single one is the whole input and is digested as such.
+void digest_merge(uint8_t algorithm, const unsigned char (*cvs)[DIGEST_CV_LENGTH], uint32_t count,
+                  unsigned char out[DIGEST_LENGTH]);
+
+// Returns whether <algorithm> is one this build has.
+bool digest_known(uint8_t algorithm);
+
+// The name of an algorithm, as given on the command line.
+const char *digest_name(uint8_t algorithm);
+
+// Returns the algorithm called <name>, or FAILED if there is none.
+int digest_parse(const char *name);
@@ -0,0 +1,157 @@
+#include "discovery.h"
+#include <arpa/inet.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "message.h"
+#include "wire.h"
+
+static int discovery_fd = -1;
+static struct sockaddr_in group_addr;
+static unsigned char beacon[BEACON_WIRE_SIZE];
+static uint64_t self_id;
+static discovery_found_t on_found;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static discovery_stats_t stats;
+
+// Nodes heard before. Only touched by the discovery thread.
+static uint64_t nodes[DISCOVERY_MAX_NODES];
+static int node_count = 0;
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void count(size_t *counter) {
+  pthread_mutex_lock(&stats_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Remember <node_id>. Returns whether it was heard for the first time.
+static bool remember(uint64_t node_id) {
+  for (int i = 0; i < node_count; i++) {
+    if (nodes[i] == node_id) {
+      return false;
+    }
+  }
+  // past the limit the oldest node is forgotten, and only costs an extra beacon if heard again
+  if (node_count == DISCOVERY_MAX_NODES) {
+    memmove(nodes, nodes + 1, (DISCOVERY_MAX_NODES - 1) * sizeof(uint64_t));
+    node_count--;
+  }
+  nodes[node_count++] = node_id;
+  count(&stats.nodes);
+  return true;
+}
+
+static void send_beacon() {
+  if (sendto(discovery_fd, beacon, sizeof(beacon), 0, (struct sockaddr *)&group_addr, sizeof(group_addr)) ==
+      sizeof(beacon)) {
+    count(&stats.sent);
+  }
+}
+
+// Read every datagram waiting. Returns whether a new node was heard.
+static bool receive_beacons() {
+  bool fresh = false;
+  for (;;) {
+    unsigned char buf[64];
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    ssize_t n = recvfrom(discovery_fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+    if (n < 0) {
+      return fresh;
+    }
+    uint64_t node_id;
+    uint16_t port;
+    if (decode_beacon(buf, (size_t)n, &node_id, &port) != SUCCESS) {
+      count(&stats.ignored);
+      continue;
+    }
+    // our own beacon comes back through the loopback
+    if (node_id == self_id) {
+      continue;
+    }
+    count(&stats.heard);
+    fresh |= remember(node_id);
+    // the node accepts peers on the address it sent from, at the port it announced
+    from.sin_port = htons(port);
+    on_found(from, node_id);
+  }
+}
+
+// Send beacons on time and hand every beacon heard to the callback.
+static void *discovery_loop(void *args) {
+  long next = now_ms();
+  for (;;) {
+    long now = now_ms();
+    if (now >= next) {
+      send_beacon();
+      next = now + DISCOVERY_INTERVAL_MS;
+    }
+    struct pollfd pfd = {.fd = discovery_fd, .events = POLLIN};
+    if (poll(&pfd, 1, (int)(next - now_ms() > 0 ? next - now_ms() : 0)) > 0 && receive_beacons()) {
+      next = now_ms();
+    }
+  }
+  return NULL;
+}
+
+// Start sending and listening for beacons.
+int discovery_start(struct in_addr iface, uint64_t node_id, unsigned short port, discovery_found_t found) {
+  discovery_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (discovery_fd == -1) {
+    return FAILED;
+  }
+
+  // every node on the host binds the same port
+  int yes = 1;
+  struct sockaddr_in bind_addr = {
+      .sin_family = AF_INET, .sin_port = htons(DISCOVERY_PORT), .sin_addr.s_addr = htonl(INADDR_ANY)};
+  struct ip_mreq membership = {.imr_interface = iface};
+  inet_pton(AF_INET, DISCOVERY_GROUP, &membership.imr_multiaddr);
+  unsigned char ttl = 1;
+  unsigned char loop = 1;
+  if (setsockopt(discovery_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) ||
+      setsockopt(discovery_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) ||
+      bind(discovery_fd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) ||
+      setsockopt(discovery_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) ||
+      setsockopt(discovery_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) ||
+      setsockopt(discovery_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) ||
+      setsockopt(discovery_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop))) {
+    close(discovery_fd);
+    discovery_fd = -1;
+    return FAILED;
+  }
+
+  group_addr = (struct sockaddr_in){.sin_family = AF_INET, .sin_port = htons(DISCOVERY_PORT),
+                                    .sin_addr = membership.imr_multiaddr};
+  encode_beacon(node_id, port, beacon);
+  self_id = node_id;
+  on_found = found;
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, discovery_loop, NULL)) {
+    close(discovery_fd);
+    discovery_fd = -1;
+    return FAILED;
+  }
+  pthread_detach(thread);
+  return SUCCESS;
+}
+
+// Get discovery's counters.
+discovery_stats_t discovery_stats() {
+  pthread_mutex_lock(&stats_lock);
+  discovery_stats_t s = stats;
+  pthread_mutex_unlock(&stats_lock);
+  return s;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The multicast group and port beacons are sent to. Only nodes on the same subnet hear them.
+#define DISCOVERY_GROUP "239.255.77.77"
+#define DISCOVERY_PORT 47477
+
+// How often a node sends its beacon, in milliseconds. It also sends one as soon as it hears a node it did not
+// know, so the newcomer learns about it right away.
+#define DISCOVERY_INTERVAL_MS 1000
+
+// The most nodes remembered as heard before.
+#define DISCOVERY_MAX_NODES 256
+
+// Called on the discovery thread for every beacon heard from another node, with the address it accepts peers on.
+typedef void (*discovery_found_t)(struct sockaddr_in addr, uint64_t node_id);
+
+// Counters describing discovery.
+typedef struct {
+  // Beacons sent and heard from other nodes.
+  size_t sent;
+  size_t heard;
+  // Datagrams on the discovery port which were not beacons.
+  size_t ignored;
+  // Distinct nodes heard.
+  size_t nodes;
+} discovery_stats_t;
+
+// Start sending beacons for the node <node_id> accepting peers on <port>, and listening for the beacons of others
+// on the interface with address <iface> (INADDR_ANY for the default one, 127.0.0.1 to stay on this host).
+// Returns FAILED if the socket or thread could not be set up and SUCCESS on success.
+int discovery_start(struct in_addr iface, uint64_t node_id, unsigned short port, discovery_found_t found);
+
+// Get discovery's counters.
+discovery_stats_t discovery_stats();
@@ -1,63 +1,319 @@
 #include "file.h"
+#include "io.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <stdio.h>
-#include <openssl/md5.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 
 // The size of the blocks read into a hash from a file.
-#define BLOCK_READ_SIZE 8192
+// Large enough that the io_uring backend splits every block into several reads in flight.
+#define BLOCK_READ_SIZE (1024 * 1024)
+
+// The most threads hashing the chunks of a new tfile, besides the one hashing the whole file. Each has this many
+// chunk sized buffers, so reading runs ahead of hashing by that much.
+#define HASH_THREADS_MAX 8
+#define HASH_SLOTS_PER_THREAD 2
 
 // The size required for a file in bytes.
 #define MIN_SIZE 256
 
-// Complete a hash of a section of a file.
-// hash must be size of MD5_HASH_DIGEST
-// Returns 1 if failed.
-int md5_hash(int fd, off_t offset, off_t size, unsigned char *hash) {
-  // Set offset to desired offset
-  lseek(fd, offset, SEEK_SET);
+// How much hashing verification took.
+static verify_stats_t stats;
+
+// Guards the memory regions of every tfile, and the writers holding them.
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The number of chunk hashers for new tfiles, or 0 for one per core.
+static uint32_t hash_threads = 0;
 
-  // Initialize a MD5
-  MD5_CTX c;
-  MD5_Init(&c);
+// Feed a section of a file into a digest. Returns 1 if failed.
+static int digest_fd(digest_t *c, int fd, off_t offset, off_t size) {
+  char *data_block = malloc(BLOCK_READ_SIZE);
+  if (data_block == NULL) {
+    return 1;
+  }
 
   // Read data in block by block.
-  // Can probably make this code a bit better
-  char data_block[BLOCK_READ_SIZE];
-  ssize_t size_read;
-  int num_of_iterations = size / BLOCK_READ_SIZE;
-  // Skips loop if num_of_iterations = 0.
-  for (int i = 0; i < size / BLOCK_READ_SIZE; i++) {
-    size_read = read(fd, data_block, BLOCK_READ_SIZE);
-    if (size_read != BLOCK_READ_SIZE) {
+  for (off_t done = 0; done < size; done += BLOCK_READ_SIZE) {
+    size_t block = size - done < BLOCK_READ_SIZE ? size - done : BLOCK_READ_SIZE;
+    if (io_pread_all(fd, data_block, block, offset + done) != SUCCESS) {
       perror("Ran into end of file.");
+      free(data_block);
       return 1;
     }
-    MD5_Update(&c, &data_block, BLOCK_READ_SIZE);
+    digest_update(c, data_block, block);
   }
-  // Read the final data
-  size_read = read(fd, data_block, size % BLOCK_READ_SIZE);
-  if (size_read != size % BLOCK_READ_SIZE) {
-    perror("Ran into end of file.");
+  free(data_block);
+  return 0;
+}
+
+// Complete a hash of a section of a file with <algorithm>.
+// hash must be size of DIGEST_LENGTH
+// Returns 1 if failed.
+int digest_file(int fd, uint8_t algorithm, off_t offset, off_t size, unsigned char *hash) {
+  digest_t c;
+  if (digest_init(&c, algorithm) != SUCCESS || digest_fd(&c, fd, offset, size) != 0) {
     return 1;
   }
-  MD5_Update(&c, data_block, size % BLOCK_READ_SIZE);
 
-  // Complete the MD5 Hash.
-  MD5_Final(hash, &c);
+  // Complete the hash.
+  digest_final(&c, hash);
 
   return 0;
 }
 
+// Start the hash of <chunk> of a tfile. The chunks of tree hashed tfiles are subtrees of the whole file's hash.
+// Returns 1 if failed.
+static int start_chunk_digest(const tfile_def_t *tdef, uint32_t chunk, digest_t *c) {
+  if (tfile_tree_hashed(tdef)) {
+    return digest_init_at(c, tdef->algorithm, (uint64_t)chunk * tdef->chunk_size) != SUCCESS;
+  }
+  return digest_init(c, tdef->algorithm) != SUCCESS;
+}
+
+// Finish the hash of a chunk into <cv>: its chaining value for tree hashed tfiles, else only the first
+// DIGEST_LENGTH bytes. Those are the chunk's hash either way.
+static void finish_chunk_digest(const tfile_def_t *tdef, digest_t *c, unsigned char cv[DIGEST_CV_LENGTH]) {
+  if (tfile_tree_hashed(tdef)) {
+    digest_final_cv(c, cv);
+  } else {
+    digest_final(c, cv);
+  }
+}
+
+// A chunk of a new tfile, read once and hashed both on its own and into the whole file's hash.
+typedef struct {
+  unsigned char *data;
+  off_t size;
+  // Hashers still to go over the chunk before the slot can be read into again.
+  int pending;
+} hash_slot_t;
+
+// Hashes a new tfile in one pass over its file. The calling thread reads chunks into a ring of slots in order,
+// one thread folds them into the whole file's hash in order, and the others hash the chunks in any order.
+// Tree hashed tfiles need no folding, as the whole file's hash is derived from the chunks' chaining values.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  tfile_def_t *tdef;
+  // Chunk <i> goes in slots[i % slot_count].
+  hash_slot_t *slots;
+  uint32_t slot_count;
+  // Chunks read, folded into the whole file's hash, and handed to a chunk hasher.
+  uint32_t read;
+  uint32_t folded;
+  uint32_t taken;
+  bool failed;
+  digest_t file_digest;
+  // The chaining value of every chunk, for tree hashed tfiles.
+  unsigned char (*cvs)[DIGEST_CV_LENGTH];
+} hash_pipeline_t;
+
+// Folds every chunk into the whole file's hash as it is read.
+static void *fold_chunks(void *args) {
+  hash_pipeline_t *p = args;
+  pthread_mutex_lock(&p->lock);
+  while (p->folded < p->tdef->num_chunks) {
+    while (p->folded == p->read && !p->failed) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (p->failed) {
+      break;
+    }
+    hash_slot_t *slot = &p->slots[p->folded % p->slot_count];
+    pthread_mutex_unlock(&p->lock);
+    digest_update(&p->file_digest, slot->data, slot->size);
+    pthread_mutex_lock(&p->lock);
+    slot->pending--;
+    p->folded++;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// Hashes chunks as they are read, whichever is next.
+static void *hash_chunks(void *args) {
+  hash_pipeline_t *p = args;
+  pthread_mutex_lock(&p->lock);
+  while (p->taken < p->tdef->num_chunks) {
+    // once every chunk is taken nothing more is read, so there is nothing left to wait for
+    while (p->taken == p->read && p->taken < p->tdef->num_chunks && !p->failed) {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+    if (p->failed || p->taken == p->tdef->num_chunks) {
+      break;
+    }
+    uint32_t chunk = p->taken++;
+    hash_slot_t *slot = &p->slots[chunk % p->slot_count];
+    pthread_mutex_unlock(&p->lock);
+    digest_t c;
+    unsigned char cv[DIGEST_CV_LENGTH];
+    start_chunk_digest(p->tdef, chunk, &c);
+    digest_update(&c, slot->data, slot->size);
+    finish_chunk_digest(p->tdef, &c, cv);
+    memcpy(p->tdef->c_hashes[chunk], cv, DIGEST_LENGTH);
+    if (p->cvs != NULL) {
+      memcpy(p->cvs[chunk], cv, DIGEST_CV_LENGTH);
+    }
+    pthread_mutex_lock(&p->lock);
+    slot->pending--;
+    pthread_cond_broadcast(&p->cond);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// Read the file of a new tfile once, filling in the hash of every chunk and of the whole file.
+// The chunk size, count and c_hashes of <tdef> must be set, and <cvs> must have room for every chunk's chaining
+// value if it is tree hashed. Returns 1 if failed.
+static int hash_tfile(int fd, tfile_def_t *tdef, unsigned char (*cvs)[DIGEST_CV_LENGTH]) {
+  long cores = __atomic_load_n(&hash_threads, __ATOMIC_RELAXED);
+  if (cores == 0) {
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  uint32_t hashers = cores < 1 ? 1 : cores > HASH_THREADS_MAX ? HASH_THREADS_MAX : (uint32_t)cores;
+  if (hashers > tdef->num_chunks) {
+    hashers = tdef->num_chunks;
+  }
+
+  bool tree = tfile_tree_hashed(tdef);
+  hash_pipeline_t p = {.tdef = tdef, .slot_count = hashers * HASH_SLOTS_PER_THREAD, .cvs = tree ? cvs : NULL};
+  p.slots = calloc(p.slot_count, sizeof(hash_slot_t));
+  if (p.slots == NULL) {
+    return 1;
+  }
+  int rc = 0;
+  for (uint32_t i = 0; i < p.slot_count && rc == 0; i++) {
+    p.slots[i].data = malloc(tdef->chunk_size);
+    rc = p.slots[i].data == NULL;
+  }
+  pthread_t threads[HASH_THREADS_MAX + 1];
+  uint32_t started = 0;
+  if (rc == 0) {
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_cond_init(&p.cond, NULL);
+    if (!tree) {
+      digest_init(&p.file_digest, tdef->algorithm);
+      rc = pthread_create(&threads[started++], NULL, fold_chunks, &p) != 0;
+    }
+    for (uint32_t i = 0; i < hashers && rc == 0; i++) {
+      rc = pthread_create(&threads[started++], NULL, hash_chunks, &p) != 0;
+    }
+    if (rc != 0) {
+      started--;
+    }
+  }
+
+  // the kernel reads ahead further on files read front to back
+  posix_fadvise(fd, 0, tdef->size, POSIX_FADV_SEQUENTIAL);
+  for (uint32_t chunk = 0; chunk < tdef->num_chunks && rc == 0; chunk++) {
+    hash_slot_t *slot = &p.slots[chunk % p.slot_count];
+    pthread_mutex_lock(&p.lock);
+    while (slot->pending > 0) {
+      pthread_cond_wait(&p.cond, &p.lock);
+    }
+    pthread_mutex_unlock(&p.lock);
+
+    off_t offset = 0;
+    slot->size = chunk_bounds(tdef, chunk, &offset);
+    if (io_pread_all(fd, slot->data, slot->size, offset) != SUCCESS) {
+      perror("Ran into end of file.");
+      rc = 1;
+      break;
+    }
+    pthread_mutex_lock(&p.lock);
+    slot->pending = tree ? 1 : 2;
+    p.read++;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+  }
+
+  if (started > 0) {
+    pthread_mutex_lock(&p.lock);
+    p.failed = rc != 0;
+    pthread_cond_broadcast(&p.cond);
+    pthread_mutex_unlock(&p.lock);
+    for (uint32_t i = 0; i < started; i++) {
+      pthread_join(threads[i], NULL);
+    }
+    pthread_cond_destroy(&p.cond);
+    pthread_mutex_destroy(&p.lock);
+    if (tree && rc == 0) {
+      digest_merge(tdef->algorithm, cvs, tdef->num_chunks, tdef->f_hash);
+    } else if (!tree) {
+      digest_final(&p.file_digest, tdef->f_hash);
+    }
+  }
+  for (uint32_t i = 0; i < p.slot_count; i++) {
+    free(p.slots[i].data);
+  }
+  free(p.slots);
+  return rc;
+}
+
+// Choose how many threads hash the chunks of new tfiles.
+void set_hash_threads(uint32_t threads) {
+  __atomic_store_n(&hash_threads, threads, __ATOMIC_RELAXED);
+}
+
+// Pick the chunk size of a new tfile of <size> bytes.
+uint32_t pick_chunk_size(off_t size) {
+  uint32_t chunk_size = CHUNK_SIZE_MIN;
+  while (chunk_size < CHUNK_SIZE_MAX && size / chunk_size >= CHUNK_TARGET_COUNT) {
+    chunk_size *= 2;
+  }
+  return chunk_size;
+}
+
+// The number of chunks a file of <size> bytes is split into. Even an empty file has one.
+uint32_t count_chunks(off_t size, uint32_t chunk_size) {
+  if (size <= chunk_size) {
+    return 1;
+  }
+  return (uint32_t)((size + chunk_size - 1) / chunk_size);
+}
+
+// Returns the size of <chunk> of a tfile and sets <offset> to where it starts.
+// Every chunk is chunk_size bytes but the last, which takes the remainder.
+off_t chunk_bounds(const tfile_def_t *tdef, int chunk, off_t *offset) {
+  if (chunk < 0 || (uint32_t)chunk >= tdef->num_chunks) {
+    return -1;
+  }
+  *offset = (off_t)chunk * tdef->chunk_size;
+  off_t size = tdef->size - *offset;
+  return size < tdef->chunk_size ? size : tdef->chunk_size;
+}
+
+// Free the chunk hashes of a definition which is not in the hash table.
+void free_tfile_def(tfile_def_t *tdef) {
+  free(tdef->c_hashes);
+  tdef->c_hashes = NULL;
+}
+
+// Returns whether the chunks of a tfile are hashed as subtrees of the whole file's hash.
+bool tfile_tree_hashed(const tfile_def_t *tdef) {
+  return tdef->num_chunks > 1 && digest_tree_chunks(tdef->algorithm, tdef->chunk_size);
+}
+
+// Keep the chaining values of a new tfile's chunks in its table entry.
+static void keep_cvs(tfile_t *t, unsigned char (*cvs)[DIGEST_CV_LENGTH]) {
+  if (t->cvs != NULL && cvs != NULL) {
+    memcpy(t->cvs, cvs, t->tdef.num_chunks * DIGEST_CV_LENGTH);
+  }
+  free(cvs);
+}
+
 // Generate a completely new tfile based off of an existing file on the clients' computer.
 // The tfile is added to the hash table.
-int generate_tfile(htable_t *htable, tfile_def_t *tdef, char *file_path, char name[NAME_LEN]) {
+int generate_tfile(htable_t *htable, tfile_def_t *tdef, char *file_path, char name[NAME_LEN], uint32_t chunk_size,
+                   uint8_t algorithm) {
   // Open the file.
   int fd = open(file_path, O_RDONLY); // Consider adding O_LARGEFILE, talk to Charlie about this
   if (fd == -1) {
@@ -69,35 +325,66 @@ int generate_tfile(htable_t *htable, tfile_def_t *tdef, char *file_path, char na
 
   if (buf.st_size < MIN_SIZE) {
     perror("File too small");
+    close(fd);
     return -1;
   }
-
-  // Generate the file hash
-  md5_hash(fd, 0, buf.st_size, tdef->f_hash);
-
-  // Check if already in hash table
-  tfile_t *t = search_htable(htable, tdef->f_hash);
-  if (t != NULL) {
-    perror("File already has a torrent file");
+  if (!digest_known(algorithm)) {
+    errno = EINVAL;
+    close(fd);
     return -1;
   }
 
-  // Copy the size
+  // Copy the size and split the file into chunks.
+  tdef->algorithm = algorithm;
   tdef->size = buf.st_size;
+  tdef->chunk_size = chunk_size != 0 ? chunk_size : pick_chunk_size(buf.st_size);
+  tdef->num_chunks = count_chunks(buf.st_size, tdef->chunk_size);
+  if (tdef->num_chunks > MAX_CHUNKS) {
+    perror("Chunk size too small for the file");
+    close(fd);
+    return -1;
+  }
+  tdef->c_hashes = malloc(tdef->num_chunks * MD5_DIGEST_LENGTH);
+  unsigned char (*cvs)[DIGEST_CV_LENGTH] = tfile_tree_hashed(tdef) ? malloc(tdef->num_chunks * DIGEST_CV_LENGTH) : NULL;
+  if (tdef->c_hashes == NULL || (cvs == NULL && tfile_tree_hashed(tdef))) {
+    free_tfile_def(tdef);
+    free(cvs);
+    close(fd);
+    return -1;
+  }
 
-  // Set the chunk size. The very last chunk will vary in size.
-  off_t c_size = buf.st_size / NUM_CHUNKS;
-
-  // Calculate the hashes for each chunk.
-  // We calculate the LAST chunk FIRST because the chunk is not a fixed size.
-  off_t offset = c_size * (NUM_CHUNKS - 1);                   // The start of the chunk.
-  off_t size = buf.st_size - offset;                          // The size of the chunk.
-  md5_hash(fd, offset, size, tdef->c_hashes[NUM_CHUNKS - 1]); // Calculate the hash.
+  // Hash the whole file and every chunk in one pass.
+  if (hash_tfile(fd, tdef, cvs) != 0) {
+    free_tfile_def(tdef);
+    free(cvs);
+    close(fd);
+    return -1;
+  }
 
-  // Loop for the other chunks.
-  for (int i = 0; i < NUM_CHUNKS - 1; i++) {
-    offset = i * c_size;
-    md5_hash(fd, offset, c_size, tdef->c_hashes[i]);
+  // Check if already in hash table. A peer may have told us about the same file, in which case its definition
+  // describes our copy too and we only record where the file is.
+  tfile_t *t = search_htable(htable, tdef->f_hash);
+  if (t != NULL && t->f_location == NULL && t->m_location == NULL) {
+    close(fd);
+    free_tfile_def(tdef);
+    *tdef = t->tdef;
+    t->f_location = strdup(file_path);
+    if (t->f_location == NULL) {
+      free(cvs);
+      return -1;
+    }
+    // the file matched the definition as a whole, so its chunks match too
+    keep_cvs(t, cvs);
+    bitset_fill(&t->verified);
+    __atomic_store_n(&t->complete, true, __ATOMIC_RELEASE);
+    return 0;
+  }
+  if (t != NULL) {
+    perror("File already has a torrent file");
+    free_tfile_def(tdef);
+    free(cvs);
+    close(fd);
+    return -1;
   }
 
   // Close the file.
@@ -108,6 +395,11 @@ int generate_tfile(htable_t *htable, tfile_def_t *tdef, char *file_path, char na
 
   // Add to the htable.
   t = add_htable(htable, *tdef);
+  if (t == NULL) {
+    tdef->c_hashes = NULL;
+    free(cvs);
+    return -1;
+  }
 
   // Set file and memory locations
   int len = strlen(file_path);
@@ -115,6 +407,11 @@ int generate_tfile(htable_t *htable, tfile_def_t *tdef, char *file_path, char na
   strcpy(t->f_location, file_path);
   t->m_location = NULL;
 
+  // The hashes were just made from the file, so nothing needs verifying until it changes.
+  keep_cvs(t, cvs);
+  bitset_fill(&t->verified);
+  t->complete = true;
+
   return 0;
 }
 
@@ -135,33 +432,39 @@ tfile_t *add_tfile(htable_t *ht, tfile_def_t tfile_def) {
 // Generate a list of all the tfiles in the hash table.
 // Returns the number of tfiles reported.
 int list_tfiles(htable_t *ht, tfile_def_t **tf_list) {
-  *tf_list = malloc(ht->size * sizeof(tfile_t));
+  pthread_rwlock_rdlock(&ht->lock);
+  *tf_list = malloc(ht->size * sizeof(tfile_def_t));
   // Loop until we reach the end or there are no more tfiles
   int j = 0;
   for (int i = 0; i < ht->capacity && j < ht->size; i++) {
-    tfile_t *tf = ht->table + i;
-    if (tf->tdef.size > 0) {
+    tfile_t *tf = ht->table[i];
+    if (tf != NULL) {
       memcpy(*tf_list + j, &tf->tdef, sizeof(tfile_def_t));
       j++;
     }
   }
+  pthread_rwlock_unlock(&ht->lock);
   return j;
 }
 
-// Open a tfile in memory to be read or written to.
-// If there is not already a file, the file is created in the working directory.
-// Sets <location> to the beginning of the specified <chunk>.
-// <chunk> starts at 0!! (e.x. 0-7 assuming 8 chunks)
-off_t open_tfile(htable_t *htable, void **location, unsigned char hash[MD5_DIGEST_LENGTH], int chunk) {
-  if (chunk >= NUM_CHUNKS) {
-    return -1;
-  }
-  // Search for the htable that correspons with the hash.
-  tfile_t *tf = search_htable(htable, hash);
-  if (tf == NULL) {
-    return -1;
+// List the hashes of the tfiles which have a file in storage, downloaded or being downloaded.
+// Returns the number of hashes reported.
+int list_local_tfiles(htable_t *ht, unsigned char (**hashes)[MD5_DIGEST_LENGTH]) {
+  pthread_rwlock_rdlock(&ht->lock);
+  *hashes = malloc((ht->size + 1) * MD5_DIGEST_LENGTH);
+  int j = 0;
+  for (int i = 0; *hashes != NULL && i < ht->capacity; i++) {
+    tfile_t *tf = ht->table[i];
+    if (tf != NULL && tf->f_location != NULL) {
+      memcpy((*hashes)[j++], tf->tdef.f_hash, MD5_DIGEST_LENGTH);
+    }
   }
+  pthread_rwlock_unlock(&ht->lock);
+  return j;
+}
 
+// Map the memory region of a tfile if it is not yet. Returns <chunk_size>, or -1 if failed. Requires map_lock.
+static off_t map_locked(tfile_t *tf, off_t chunk_size) {
   // If we dont have a memory-mapped location already, create it.
   if (tf->m_location == NULL) {
     // If we dont have a file already, create it.
@@ -179,37 +482,76 @@ off_t open_tfile(htable_t *htable, void **location, unsigned char hash[MD5_DIGES
     // Converting a signed long to an unsigned long might be a bad idea.
     // It seems to work for now becuse the unsigned long is signed previously.
     void *m_location = mmap(NULL, (size_t)tf->tdef.size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (tf->m_location == MAP_FAILED) {
-      return -1;
-    }
+    close(fd);
     if (m_location == MAP_FAILED) {
       perror("Could not create a memory-mapped location for the file");
       return -1;
     }
     tf->m_location = m_location;
-    close(fd);
   }
+  return chunk_size;
+}
 
-  // Calculate the chunk size.
-  off_t chunk_size = tf->tdef.size / NUM_CHUNKS;
-
-  // Assign <location> to the starting point of the chunk.
-  *location = (chunk * chunk_size) + (char *)tf->m_location;
-
-  // If it's the last chunk, recalculate the chunk size
-  if (chunk == NUM_CHUNKS - 1) {
-    chunk_size = tf->tdef.size - (chunk * chunk_size);
+// Map <chunk> of a tfile and set <location> to its start, counting a writer if <hold>. Returns the size of the chunk.
+static off_t map_tfile(htable_t *htable, void **location, unsigned char hash[MD5_DIGEST_LENGTH], int chunk, bool hold) {
+  // Search for the htable that correspons with the hash.
+  tfile_t *tf = search_htable(htable, hash);
+  if (tf == NULL) {
+    return -1;
+  }
+  off_t offset;
+  off_t chunk_size = chunk_bounds(&tf->tdef, chunk, &offset);
+  if (chunk_size < 0) {
+    return -1;
   }
 
+  pthread_mutex_lock(&map_lock);
+  chunk_size = map_locked(tf, chunk_size);
+  if (chunk_size >= 0) {
+    // Assign <location> to the starting point of the chunk.
+    *location = offset + (char *)tf->m_location;
+    tf->writers += hold;
+  }
+  pthread_mutex_unlock(&map_lock);
   return chunk_size;
 }
 
-// Save a tfile to storage and free the memory region.
-int save_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH]) {
-  tfile_t *tf = search_htable(ht, hash);
-  if (tf == NULL) {
+// Open a tfile in memory to be read or written to.
+// If there is not already a file, the file is created in the working directory.
+// Sets <location> to the beginning of the specified <chunk>.
+// <chunk> starts at 0!! (e.x. 0-7 assuming 8 chunks)
+off_t open_tfile(htable_t *htable, void **location, unsigned char hash[MD5_DIGEST_LENGTH], int chunk) {
+  return map_tfile(htable, location, hash, chunk, false);
+}
+
+// Open a tfile in memory and keep it mapped until released.
+off_t hold_tfile(htable_t *htable, void **location, unsigned char hash[MD5_DIGEST_LENGTH], int chunk) {
+  return map_tfile(htable, location, hash, chunk, true);
+}
+
+// Open the file backing a tfile for reading and find where <chunk> starts in it.
+// Returns the size of the chunk, or -1 if failed. The caller closes <fd>.
+off_t open_tfile_fd(htable_t *htable, int *fd, unsigned char hash[MD5_DIGEST_LENGTH], int chunk, off_t *offset) {
+  tfile_t *tf = search_htable(htable, hash);
+  if (tf == NULL || tf->f_location == NULL) {
+    return -1;
+  }
+  off_t chunk_size = chunk_bounds(&tf->tdef, chunk, offset);
+  if (chunk_size < 0) {
+    return -1;
+  }
+
+  *fd = open(tf->f_location, O_RDONLY);
+  if (*fd == -1) {
+    perror("Could not open file");
     return -1;
   }
+
+  return chunk_size;
+}
+
+// Write the memory region of a tfile to storage and unmap it. Returns -1 if failed. Requires map_lock.
+static int unmap_locked(tfile_t *tf) {
   if (tf->m_location == NULL) {
     return 0;
   }
@@ -229,105 +571,245 @@ int save_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH]) {
   return 0;
 }
 
-// Returns the chunks of a tfile which are verified.
-verified_chunks_t verify_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH]) {
+// Save a tfile to storage and free the memory region.
+int save_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH]) {
   tfile_t *tf = search_htable(ht, hash);
   if (tf == NULL) {
-    return UNVERIFIED_FILE;
+    return -1;
   }
+  pthread_mutex_lock(&map_lock);
+  int rc = 0;
+  if (tf->writers > 0) {
+    // the last writer saves it
+    tf->save_pending = true;
+  } else {
+    rc = unmap_locked(tf);
+  }
+  pthread_mutex_unlock(&map_lock);
+  return rc;
+}
 
-  unsigned char c_hashes[NUM_CHUNKS][MD5_DIGEST_LENGTH];
+// Let go of a held memory region, saving the tfile if it was saved while held.
+void release_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH]) {
+  tfile_t *tf = search_htable(ht, hash);
+  if (tf == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&map_lock);
+  if (--tf->writers == 0 && tf->save_pending) {
+    tf->save_pending = false;
+    unmap_locked(tf);
+  }
+  pthread_mutex_unlock(&map_lock);
+}
 
+// Hash <size> bytes of a tfile from <offset>, from memory if it is loaded and from <fd> if not.
+// Counted in the stats. Returns 1 if failed.
+static int hash_range(tfile_t *tf, int fd, off_t offset, off_t size, unsigned char *hash) {
   if (tf->m_location != NULL) {
-    // Check the entire file hash first
-    unsigned char test_hash[MD5_DIGEST_LENGTH];
-    MD5((unsigned char *)tf->m_location, (size_t)tf->tdef.size, test_hash);
-
-    // Compare the file hash with the specified tfile hash.
-    uint64_t th1 = *(uint64_t *)test_hash;
-    uint64_t th2 = *(((uint64_t *)test_hash) + 1);
-
-    uint64_t fh1 = *(uint64_t *)tf->tdef.f_hash;
-    uint64_t fh2 = *(((uint64_t *)tf->tdef.f_hash) + 1);
+    digest_once(tf->tdef.algorithm, (unsigned char *)tf->m_location + offset, (size_t)size, hash);
+  } else if (digest_file(fd, tf->tdef.algorithm, offset, size, hash) != 0) {
+    return 1;
+  }
+  __atomic_fetch_add(&stats.bytes, (uint64_t)size, __ATOMIC_RELAXED);
+  return 0;
+}
 
-    // If f is fully verified, we can stop here.
-    if (th1 == fh1 && th2 == fh2) {
-      return VERIFIED_FILE;
-    }
+// Hash <chunk> of a tfile into <cv>, from <fd>, or from memory if it is -1. Counted in the stats.
+// Returns 1 if failed.
+static int hash_chunk(tfile_t *tf, int fd, uint32_t chunk, unsigned char cv[DIGEST_CV_LENGTH]) {
+  off_t offset = 0;
+  off_t size = chunk_bounds(&tf->tdef, chunk, &offset);
+  digest_t c;
+  if (size < 0 || start_chunk_digest(&tf->tdef, chunk, &c) != 0) {
+    return 1;
+  }
+  if (fd == -1) {
+    digest_update(&c, (unsigned char *)tf->m_location + offset, (size_t)size);
+  } else if (digest_fd(&c, fd, offset, size) != 0) {
+    return 1;
+  }
+  finish_chunk_digest(&tf->tdef, &c, cv);
+  __atomic_fetch_add(&stats.bytes, (uint64_t)size, __ATOMIC_RELAXED);
+  return 0;
+}
 
-    // Chunk size
-    off_t chunk_size = tf->tdef.size / NUM_CHUNKS;
+// Record that <chunk> of a tfile matched its hash, with its chaining value <cv>.
+static void chunk_verified(tfile_t *tf, uint32_t chunk, const unsigned char cv[DIGEST_CV_LENGTH]) {
+  if (tf->cvs != NULL) {
+    memcpy(tf->cvs[chunk], cv, DIGEST_CV_LENGTH);
+    // verify_tfile reads the chaining values of the chunks it finds verified
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+  }
+  bitset_set_atomic(&tf->verified, chunk);
+}
 
-    // Calculate the hashes for each chunk.
-    // We calculate the LAST chunk FIRST because the chunk is not a fixed size.
-    unsigned char *offset = (unsigned char *)tf->m_location + (chunk_size * (NUM_CHUNKS - 1)); // The start of the chunk.
-    off_t size = tf->tdef.size - (chunk_size * (NUM_CHUNKS - 1));                              // The size of the chunk.
-    MD5(offset, size, c_hashes[NUM_CHUNKS - 1]);                                               // The hash of the last chunk.
+// Open the file of a tfile to be hashed, unless it is loaded in memory. Sets <fd> to -1 then.
+// Returns 1 if there is no file to hash or it does not have the size of the tfile.
+static int open_for_hashing(tfile_t *tf, int *fd) {
+  *fd = -1;
+  if (tf->m_location != NULL) {
+    return 0;
+  }
+  if (tf->f_location == NULL) {
+    return 1;
+  }
+  *fd = open(tf->f_location, O_RDONLY);
+  if (*fd == -1) {
+    perror("Could not open file for verification");
+    return 1;
+  }
+  struct stat buf;
+  if (fstat(*fd, &buf) || buf.st_size != tf->tdef.size) {
+    close(*fd);
+    *fd = -1;
+    return 1;
+  }
+  return 0;
+}
 
-    // Loop for the other chunks.
-    for (int i = 0; i < NUM_CHUNKS - 1; i++) {
-      offset = (unsigned char *)tf->m_location + (chunk_size * i);
-      MD5(offset, chunk_size, c_hashes[i]);
+// Copy which chunks of a tfile are verified into <chunks>, if it is not NULL.
+// Returns whether every chunk is verified.
+static bool copy_verified(tfile_t *tf, verified_chunks_t *chunks) {
+  bool full = true;
+  for (uint32_t i = 0; i < tf->tdef.num_chunks; i++) {
+    bool verified = bitset_test_atomic(&tf->verified, i);
+    full &= verified;
+    if (chunks != NULL && verified) {
+      bitset_set(chunks, i);
+    } else if (chunks != NULL) {
+      bitset_clear(chunks, i);
     }
   }
-  else if (tf->f_location != NULL) {
-    // Open the file.
-    int fd = open(tf->f_location, O_RDONLY);
-    if (fd == -1) {
-      perror("Could not open file for verification");
-      return UNVERIFIED_FILE;
-    }
-    struct stat buf;
-    fstat(fd, &buf);
+  return full;
+}
 
-    // Create a hash for the entire file.
-    unsigned char test_hash[MD5_DIGEST_LENGTH];
-    md5_hash(fd, 0, buf.st_size, test_hash);
+// Hash every chunk of a tfile again, and record which of them match.
+static void rehash_chunks(tfile_t *tf) {
+  int fd;
+  bool readable = open_for_hashing(tf, &fd) == 0;
+  for (uint32_t i = 0; i < tf->tdef.num_chunks; i++) {
+    unsigned char cv[DIGEST_CV_LENGTH];
+    bool ok = readable && hash_chunk(tf, fd, i, cv) == 0 && memcmp(cv, tf->tdef.c_hashes[i], MD5_DIGEST_LENGTH) == 0;
+    __atomic_fetch_add(&stats.chunks, 1, __ATOMIC_RELAXED);
+    if (ok) {
+      chunk_verified(tf, i, cv);
+    } else {
+      __atomic_fetch_add(&stats.bad_chunks, 1, __ATOMIC_RELAXED);
+      bitset_clear_atomic(&tf->verified, i);
+    }
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
 
-    // Compare the file hash with the tfile hash.
-    uint64_t th1 = *(uint64_t *)test_hash;
-    uint64_t th2 = *(((uint64_t *)test_hash) + 1);
+// Returns whether a whole tfile is verified, and which of its chunks are in <chunks>.
+bool verify_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH], verified_chunks_t *chunks) {
+  tfile_t *tf = search_htable(ht, hash);
+  if (chunks != NULL && init_bitset(chunks, tf != NULL ? tf->tdef.num_chunks : 0) != SUCCESS) {
+    return false;
+  }
+  if (tf == NULL) {
+    return false;
+  }
 
-    uint64_t fh1 = *(uint64_t *)tf->tdef.f_hash;
-    uint64_t fh2 = *(((uint64_t *)tf->tdef.f_hash) + 1);
+  if (__atomic_load_n(&tf->complete, __ATOMIC_ACQUIRE)) {
+    if (chunks != NULL) {
+      bitset_fill(chunks);
+    }
+    return true;
+  }
+  // chunks are verified as they arrive, so a file missing some is not complete yet
+  if (!copy_verified(tf, chunks)) {
+    return false;
+  }
 
-    // File is fully verified if the hashes match. We can stop here.
-    if (th1 == fh1 && th2 == fh2) {
-      return VERIFIED_FILE;
+  // Every chunk matched, which leaves the file as a whole.
+  unsigned char test_hash[MD5_DIGEST_LENGTH];
+  if (tf->cvs != NULL) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    digest_merge(tf->tdef.algorithm, tf->cvs, tf->tdef.num_chunks, test_hash);
+  } else {
+    int fd;
+    if (open_for_hashing(tf, &fd) != 0) {
+      return false;
+    }
+    int rc = hash_range(tf, fd, 0, tf->tdef.size, test_hash);
+    if (fd != -1) {
+      close(fd);
     }
+    if (rc != 0) {
+      return false;
+    }
+  }
+  __atomic_fetch_add(&stats.files, 1, __ATOMIC_RELAXED);
+  if (memcmp(test_hash, tf->tdef.f_hash, MD5_DIGEST_LENGTH) == 0) {
+    __atomic_store_n(&tf->complete, true, __ATOMIC_RELEASE);
+    return true;
+  }
 
-    // Iterate through the chunks, verfiying them.
-    unsigned char verified_chunks = UNVERIFIED_FILE;
+  // The file changed since its chunks were verified. Find out which chunks went bad.
+  __atomic_fetch_add(&stats.bad_files, 1, __ATOMIC_RELAXED);
+  rehash_chunks(tf);
+  copy_verified(tf, chunks);
+  return false;
+}
 
-    // Calculate the hashes for each chunk.
-    // We calculate the LAST chunk FIRST because the chunk is not a fixed size.
-    off_t chunk_size = tf->tdef.size / NUM_CHUNKS;        // The chunk size.
-    off_t offset = chunk_size * (NUM_CHUNKS - 1);         // The start of the last chunk.
-    off_t size = tf->tdef.size - offset;                  // The size of the last chunk.
-    md5_hash(fd, offset, size, c_hashes[NUM_CHUNKS - 1]); // Calculate the hash.
+// Forget what was verified of a tfile and verify it from scratch.
+bool recheck_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGTH], verified_chunks_t *chunks) {
+  tfile_t *tf = search_htable(ht, hash);
+  if (tf != NULL) {
+    __atomic_store_n(&tf->complete, false, __ATOMIC_RELEASE);
+    rehash_chunks(tf);
+  }
+  return verify_tfile(ht, hash, chunks);
+}
 
-    // Loop for the other chunks.
-    for (int i = 0; i < NUM_CHUNKS - 1; i++) {
-      offset = i * chunk_size;
-      md5_hash(fd, offset, chunk_size, c_hashes[i]);
-    }
+// Returns whether <chunk> of a tfile matches its hash. Only hashes that chunk, and only until it matched once.
+bool verify_chunk(htable_t *htable, unsigned char hash[MD5_DIGEST_LENGTH], int chunk) {
+  tfile_t *tf = search_htable(htable, hash);
+  if (tf == NULL || chunk < 0) {
+    return false;
   }
-  else {
-    return UNVERIFIED_FILE;
+  if (bitset_test_atomic(&tf->verified, (uint32_t)chunk)) {
+    return true;
   }
 
-  // Compare the hashes.
-  uint64_t t1, t2, c1, c2;
-  unsigned char verified_chunks = UNVERIFIED_FILE;
+  int fd;
+  off_t offset;
+  if (open_tfile_fd(htable, &fd, hash, chunk, &offset) < 0) {
+    return false;
+  }
+
+  unsigned char cv[DIGEST_CV_LENGTH];
+  int rc = hash_chunk(tf, fd, (uint32_t)chunk, cv);
+  close(fd);
 
-  for (int i = 0; i < NUM_CHUNKS; i++) {
-    t1 = *(uint64_t *)c_hashes[i];
-    t2 = *(((uint64_t *)c_hashes[i]) + 1);
-    c1 = *(uint64_t *)tf->tdef.c_hashes[i];
-    c2 = *(((uint64_t *)tf->tdef.c_hashes[i]) + 1);
-    verified_chunks = verified_chunks | ((t1 == c1 && t2 == c2) << (NUM_CHUNKS - 1 - i));
+  __atomic_fetch_add(&stats.chunks, 1, __ATOMIC_RELAXED);
+  if (rc != 0 || memcmp(cv, tf->tdef.c_hashes[chunk], MD5_DIGEST_LENGTH) != 0) {
+    __atomic_fetch_add(&stats.bad_chunks, 1, __ATOMIC_RELAXED);
+    return false;
   }
-  return verified_chunks;
+  chunk_verified(tf, (uint32_t)chunk, cv);
+  return true;
+}
+
+// Returns whether a chunk of a tfile is in storage and was verified.
+bool is_chunk_held(htable_t *htable, unsigned char hash[MD5_DIGEST_LENGTH], int chunk) {
+  tfile_t *tf = search_htable(htable, hash);
+  return tf != NULL && chunk >= 0 && tf->f_location != NULL && bitset_test_atomic(&tf->verified, (uint32_t)chunk);
+}
+
+// Get the verification counters.
+verify_stats_t verify_stats() {
+  verify_stats_t s;
+  s.chunks = __atomic_load_n(&stats.chunks, __ATOMIC_RELAXED);
+  s.bad_chunks = __atomic_load_n(&stats.bad_chunks, __ATOMIC_RELAXED);
+  s.files = __atomic_load_n(&stats.files, __ATOMIC_RELAXED);
+  s.bad_files = __atomic_load_n(&stats.bad_files, __ATOMIC_RELAXED);
+  s.bytes = __atomic_load_n(&stats.bytes, __ATOMIC_RELAXED);
+  return s;
 }
 
 /**
@@ -335,9 +817,6 @@ verified_chunks_t verify_tfile(htable_t *ht, unsigned char hash[MD5_DIGEST_LENGT
  * \param chunks The chunks structure holding information on downloaded chunks
  * \param chunk_index The index of the chunk to be verified
  */
-bool is_chunk_verified(verified_chunks_t chunks, int chunk_index) {
-  if (chunk_index < 0 || chunk_index >= NUM_CHUNKS) {
-    return 0;
-  }
-  return (chunks >> (NUM_CHUNKS - 1 - chunk_index)) & 0x01;
+bool is_chunk_verified(const verified_chunks_t *chunks, int chunk_index) {
+  return chunk_index >= 0 && bitset_test(chunks, (uint32_t)chunk_index);
 }
@@ -4,30 +4,45 @@
 #include <stddef.h>
 #include <sys/stat.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "bitset.h"
+#include "digest.h"
 
-// The number of chunks per file.
-#define NUM_CHUNKS 8
+// Chunk sizes picked for new tfiles. The chunk size is the smallest power of two from CHUNK_SIZE_MIN
+// which splits the file into at most CHUNK_TARGET_COUNT chunks, but never above CHUNK_SIZE_MAX.
+#define CHUNK_SIZE_MIN (256 * 1024)
+#define CHUNK_SIZE_MAX (4 * 1024 * 1024)
+#define CHUNK_TARGET_COUNT 1024
+
+// The most chunks a tfile may have. Bounds what a definition from a peer can make us allocate.
+#define MAX_CHUNKS (1 << 20)
 
 // The permissible length of a name.
 #define NAME_LEN 32
 
-// The value which defines a fully verified file.
-#define VERIFIED_FILE 0xFF
-#define UNVERIFIED_FILE 0x00
-// Holds information on which chunks are verified (match their respective hash).
-typedef uint8_t verified_chunks_t;
+// Holds information on which chunks are verified (match their respective hash). One bit per chunk.
+typedef bitset_t verified_chunks_t;
 
 // Struct which defines a torrent file (tfile). For EXTERNAL use between peers.
+// Once a definition is in the hash table, the table owns its chunk hashes and they live as long as the table.
+// Copies of it (e.g. from list_tfiles) share them and must not free them.
 typedef struct
 {
   // Name of the file
   char name[NAME_LEN];
   // Hash of the entire file
   unsigned char f_hash[MD5_DIGEST_LENGTH];
-  // Hashes of the chunks
-  unsigned char c_hashes[NUM_CHUNKS][MD5_DIGEST_LENGTH];
+  // Size of every chunk in bytes but the last, which takes the remainder
+  uint32_t chunk_size;
+  // Number of chunks
+  uint32_t num_chunks;
+  // Hashes of the chunks, <num_chunks> of them
+  unsigned char (*c_hashes)[MD5_DIGEST_LENGTH];
   // Size of the file in bytes
   off_t size;
+  // The DIGEST_* algorithm of the file and chunk hashes. They are MD5_DIGEST_LENGTH bytes whichever it is.
+  uint8_t algorithm;
 } tfile_def_t;
 
 // Struct which stores the location data of a tfile.
@@ -40,44 +55,123 @@ typedef struct
   char *f_location;
   // Location of the file if it is loaded into memory
   void *m_location;
+  // Writers holding m_location mapped (see hold_tfile), and whether save_tfile was called meanwhile, in which case
+  // the last of them saves the file.
+  int writers;
+  bool save_pending;
+  // Chunks verify_chunk found to match their hash. Bits are only ever set, since a verified chunk is not written
+  // again, except by recheck_tfile.
+  verified_chunks_t verified;
+  // Set once the whole file matched its hash. Until then verify_tfile hashes the whole file when every chunk is
+  // verified, so a complete file is hashed once.
+  bool complete;
+  // The chaining values of the verified chunks of a tree hashed tfile, from which verify_tfile derives the hash of
+  // the whole file instead of reading it again. NULL for other tfiles.
+  unsigned char (*cvs)[DIGEST_CV_LENGTH];
 } tfile_t;
 
+// Counters describing the hashing done to verify files. Updated atomically.
+typedef struct
+{
+  // Chunks hashed, and those which did not match their hash.
+  size_t chunks;
+  size_t bad_chunks;
+  // Whole files hashed, and those which did not match their hash.
+  size_t files;
+  size_t bad_files;
+  // Bytes read into a hash, for chunks and whole files alike.
+  uint64_t bytes;
+} verify_stats_t;
+
 // Hash table for tfiles.
 typedef struct
 {
   size_t capacity;
   size_t size;
-  tfile_t *table;
+  tfile_t **table;
+  // Guards the table itself. The tfiles it points to never move.
+  pthread_rwlock_t lock;
 } htable_t;
 
 /* --- Function Declarations --- */
 // htable.c
 void init_htable(htable_t *);
+void free_htable(htable_t *);
 int resize_htable(htable_t *);
 tfile_t *add_htable(htable_t *, tfile_def_t);
+// Add <count> tfiles, resizing at most once. <added> (if not NULL) receives the new tfile
+// for every definition, or NULL where it was already known. Returns the number added.
+// The table takes the chunk hashes of every definition. Those of definitions it already knew are freed and set to NULL.
+int add_htable_batch(htable_t *, tfile_def_t *, int, tfile_t **);
 tfile_t *search_htable(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH]);
 
 // file.c
 
+// Pick the chunk size of a new tfile of <size> bytes.
+uint32_t pick_chunk_size(off_t size);
+// Set how many threads hash the chunks of new tfiles, at most 8. 0 (the default) is one per core.
+void set_hash_threads(uint32_t threads);
+// The number of chunks a file of <size> bytes is split into.
+uint32_t count_chunks(off_t size, uint32_t chunk_size);
+// Returns the size of <chunk> of a tfile and sets <offset> to where it starts, or -1 if there is no such chunk.
+off_t chunk_bounds(const tfile_def_t *, int chunk, off_t *offset);
+// Free the chunk hashes of a definition which is not in the hash table.
+void free_tfile_def(tfile_def_t *);
+// Returns whether the chunks of a tfile are hashed as subtrees of the whole file's hash, which is then derived from
+// them. Its algorithm must be a tree algorithm and its chunks a size digest_tree_chunks accepts, and there must be
+// more than one. Chunk hashes are the first DIGEST_LENGTH bytes of the chunks' chaining values then.
+bool tfile_tree_hashed(const tfile_def_t *);
+
 // Generate a completely new tfile based off of an existing file on the clients' computer.
+// Chunks are <chunk_size> bytes, or picked with pick_chunk_size if it is 0. The file and its chunks are hashed
+// with <algorithm>, one of the DIGEST_* algorithms.
 // The tfile is added to the hash table.
-int generate_tfile(htable_t *, tfile_def_t *, char *, char name[NAME_LEN]);
-// Add an existing tfile (likely from a peer) to the hash table.
+int generate_tfile(htable_t *, tfile_def_t *, char *, char name[NAME_LEN], uint32_t chunk_size, uint8_t algorithm);
+// Add an existing tfile (likely from a peer) to the hash table. The table takes its chunk hashes, see add_htable_batch.
 tfile_t *add_tfile(htable_t *, tfile_def_t);
 // Generate a list of all the tfiles in the hash table.
 // Returns the number of tfiles reported.
 int list_tfiles(htable_t *, tfile_def_t **);
+// List the hashes of the tfiles which have a file in storage into a newly allocated array, which the caller frees.
+// Returns the number of hashes reported.
+int list_local_tfiles(htable_t *, unsigned char (**)[MD5_DIGEST_LENGTH]);
 
-// Returns the chunks of a tfile which are verified.
-verified_chunks_t verify_tfile(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH]);
+// Returns whether a whole tfile is verified. If <chunks> is not NULL it is created (the caller frees it with
+// free_bitset) and receives the chunks which are verified.
+// Only chunks verify_chunk verified count, and the whole file is only hashed once all of them are, until it matched.
+// Tree hashed tfiles are not read again at all.
+bool verify_tfile(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH], verified_chunks_t *chunks);
+
+// Like verify_tfile, but forgets what was verified and hashes every chunk again first, e.g. after the file
+// changed in storage.
+bool recheck_tfile(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH], verified_chunks_t *chunks);
 
 // Returns if a chunk is verified or not
-bool is_chunk_verified(verified_chunks_t chunks, int chunk_index);
+bool is_chunk_verified(const verified_chunks_t *chunks, int chunk_index);
+
+// Returns whether a single chunk of a tfile matches its hash, without hashing the rest of the file.
+bool verify_chunk(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH], int);
+
+// Returns whether a chunk of a tfile is in storage and was verified, from what verify_chunk recorded. Never hashes,
+// so it is cheap enough for every incoming request.
+bool is_chunk_held(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH], int);
+
+// Get the verification counters.
+verify_stats_t verify_stats();
 
 // Open a tfile in memory to be read or written to.
 // If there is not already a file, the file is created in the working directory.
 // Sets <location> to the beginning of the specified <chunk>.
-// <chunk> starts at 0!! (e.x. 0-7 assuming 8 chunks)
+// <chunk> starts at 0!! (e.x. 0-7 for a tfile of 8 chunks)
 off_t open_tfile(htable_t *, void **, unsigned char hash[MD5_DIGEST_LENGTH], int);
+// Open the file backing a tfile for reading. Sets <offset> to the start of <chunk> in the file.
+// Returns the size of the chunk or -1 if failed. The caller must close <fd>.
+off_t open_tfile_fd(htable_t *, int *fd, unsigned char hash[MD5_DIGEST_LENGTH], int, off_t *offset);
 // Save a tfile to storage and free the memory region.
+// If writers hold the region, it is saved once the last of them releases it.
 int save_tfile(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH]);
+// Like open_tfile, but keeps the memory region mapped until release_tfile, even if the tfile is saved meanwhile.
+// For writers which keep <location> across calls, e.g. blocks streaming in.
+off_t hold_tfile(htable_t *, void **, unsigned char hash[MD5_DIGEST_LENGTH], int);
+// Let go of a memory region held with hold_tfile.
+void release_tfile(htable_t *, unsigned char hash[MD5_DIGEST_LENGTH]);
@@ -1,72 +1,56 @@
 #include "file.h"
+#include "message.h"
 #include <openssl/md5.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 // Starting size of the hash table.
 // Must be power of 2
 #define STARTING_CAPACITY 256
 
-// Initialize hash table.
-void init_htable(htable_t* htable) {
-  htable->capacity = STARTING_CAPACITY;
-  htable->size = 0;
-  htable->table = calloc(sizeof(tfile_t), STARTING_CAPACITY);
-}
+// The table stores pointers, so a tfile_t never moves once added and pointers
+// returned by add_htable and search_htable stay valid across resizes.
 
-// Destroy hash table.
-void free_htable(htable_t* htable) {
-  for (int i = 0; i < htable->capacity; i++) {
-    free((void*)htable->table[i].f_location);
-  }
-  free(htable->table);
+// Index into a table using the first half of the hash.
+static size_t hash_index(const unsigned char hash[MD5_DIGEST_LENGTH], size_t capacity) {
+  uint64_t hash1;
+  memcpy(&hash1, hash, sizeof(hash1));
+  return hash1 & (uint64_t)(capacity - 1);
 }
 
-// Add to hash table.
-tfile_t* add_htable(htable_t* htable, tfile_def_t tdef) {
-  if (htable->capacity < htable->size * 2) {
-    resize_htable(htable);
-  }
-
-  // Find the index using the first half of the hash
-  uint64_t hash1 = *(uint64_t*)tdef.f_hash;
-  uint64_t hash2 = *(((uint64_t*)tdef.f_hash) + 1);
-  size_t index = hash1 & (uint64_t)(htable->capacity - 1);
-
+// Find the slot holding <hash>, or the empty slot where it would go.
+static tfile_t** find_slot(tfile_t** table, size_t capacity, const unsigned char hash[MD5_DIGEST_LENGTH]) {
+  size_t index = hash_index(hash, capacity);
   for (;;) {
-    uint64_t test_hash1 = *(uint64_t*)htable->table[index].tdef.f_hash;
-    uint64_t test_hash2 = *(((uint64_t*)htable->table[index].tdef.f_hash) + 1);
-    if ((!test_hash1) && (!test_hash2)) {
-      htable->table[index].tdef = tdef;
-      htable->size++;
-      return &htable->table[index];
-    } else if (hash1 == test_hash1 && hash2 == test_hash2) {
-      return NULL;
-    }
-
-    if (index >= htable->capacity) {
-      index = 0;
-    } else {
-      index++;
+    tfile_t* t = table[index];
+    if (t == NULL || memcmp(t->tdef.f_hash, hash, MD5_DIGEST_LENGTH) == 0) {
+      return &table[index];
     }
+    index = (index + 1) & (capacity - 1);
   }
 }
 
-// Increase size of hash table.
-int resize_htable(htable_t* htable) {
-  int new_capacity = htable->capacity * 2;
-  tfile_t* new_table = calloc(sizeof(tfile_t), new_capacity);
+// Grow the table until it can hold <size> tfiles at no more than half full.
+// Requires the write lock.
+static int grow_htable(htable_t* htable, size_t size) {
+  size_t new_capacity = htable->capacity;
+  while (new_capacity < size * 2) {
+    new_capacity *= 2;
+  }
+  if (new_capacity == htable->capacity) {
+    return 0;
+  }
+
+  tfile_t** new_table = calloc(new_capacity, sizeof(tfile_t*));
   if (new_table == NULL) {
     return -1;
   }
-
-  for (int i = 0; i < htable->capacity; i++) {
-    uint16_t test_hash = *(uint16_t*)htable->table[i].tdef.f_hash;
-    if (!test_hash) {
-      tfile_t* t = add_htable(htable, htable->table[i].tdef);
-      t->f_location = htable->table[i].f_location;
-      t->m_location = htable->table[i].m_location;
+  for (size_t i = 0; i < htable->capacity; i++) {
+    tfile_t* t = htable->table[i];
+    if (t != NULL) {
+      *find_slot(new_table, new_capacity, t->tdef.f_hash) = t;
     }
   }
 
@@ -77,27 +61,105 @@ int resize_htable(htable_t* htable) {
   return 1;
 }
 
-// Search the htable. Return index.
-// Return NULL if none is found.
-tfile_t* search_htable(htable_t* htable, unsigned char hash[MD5_DIGEST_LENGTH]) {
-  uint64_t hash1 = *(uint64_t*)hash;
-  uint64_t hash2 = *(((uint64_t*)hash) + 1);
+// Insert one tfile, taking its chunk hashes. Returns NULL if it is already in the table, in which case the
+// chunk hashes are freed. Requires the write lock.
+static tfile_t* insert_htable(htable_t* htable, tfile_def_t* tdef) {
+  tfile_t** slot = find_slot(htable->table, htable->capacity, tdef->f_hash);
+  tfile_t* t = *slot == NULL ? calloc(1, sizeof(tfile_t)) : NULL;
+  if (t != NULL && init_bitset(&t->verified, tdef->num_chunks) != SUCCESS) {
+    free(t);
+    t = NULL;
+  }
+  if (t != NULL && tfile_tree_hashed(tdef)) {
+    t->cvs = malloc(tdef->num_chunks * DIGEST_CV_LENGTH);
+    if (t->cvs == NULL) {
+      free_bitset(&t->verified);
+      free(t);
+      t = NULL;
+    }
+  }
+  if (t == NULL) {
+    free_tfile_def(tdef);
+    return NULL;
+  }
+  t->tdef = *tdef;
+  *slot = t;
+  htable->size++;
+  return t;
+}
 
-  size_t index = hash1 & (uint64_t)(htable->capacity - 1);
+// Initialize hash table.
+void init_htable(htable_t* htable) {
+  htable->capacity = STARTING_CAPACITY;
+  htable->size = 0;
+  htable->table = calloc(STARTING_CAPACITY, sizeof(tfile_t*));
+  pthread_rwlock_init(&htable->lock, NULL);
+}
 
-  for (;;) {
-    uint64_t test_hash1 = *(uint64_t*)htable->table[index].tdef.f_hash;
-    uint64_t test_hash2 = *(((uint64_t*)htable->table[index].tdef.f_hash) + 1);
-    if ((!test_hash1) && (!test_hash2)) {
-      return NULL;
-    } else if (hash1 == test_hash1 && hash2 == test_hash2) {
-      return &htable->table[index];
+// Destroy hash table.
+void free_htable(htable_t* htable) {
+  for (size_t i = 0; i < htable->capacity; i++) {
+    if (htable->table[i] != NULL) {
+      free((void*)htable->table[i]->f_location);
+      free_tfile_def(&htable->table[i]->tdef);
+      free_bitset(&htable->table[i]->verified);
+      free(htable->table[i]->cvs);
+      free(htable->table[i]);
     }
+  }
+  free(htable->table);
+  pthread_rwlock_destroy(&htable->lock);
+}
 
-    if (index >= htable->capacity) {
-      index = 0;
+// Add to hash table.
+tfile_t* add_htable(htable_t* htable, tfile_def_t tdef) {
+  pthread_rwlock_wrlock(&htable->lock);
+  tfile_t* t = NULL;
+  if (grow_htable(htable, htable->size + 1) != -1) {
+    t = insert_htable(htable, &tdef);
+  } else {
+    free_tfile_def(&tdef);
+  }
+  pthread_rwlock_unlock(&htable->lock);
+  return t;
+}
+
+// Add many tfiles at once. The table is resized at most once.
+int add_htable_batch(htable_t* htable, tfile_def_t* tdefs, int count, tfile_t** added) {
+  int added_count = 0;
+  pthread_rwlock_wrlock(&htable->lock);
+  bool grown = grow_htable(htable, htable->size + count) != -1;
+  for (int i = 0; i < count; i++) {
+    tfile_t* t = NULL;
+    if (grown) {
+      t = insert_htable(htable, &tdefs[i]);
     } else {
-      index++;
+      free_tfile_def(&tdefs[i]);
+    }
+    if (added != NULL) {
+      added[i] = t;
+    }
+    if (t != NULL) {
+      added_count++;
     }
   }
+  pthread_rwlock_unlock(&htable->lock);
+  return added_count;
+}
+
+// Increase size of hash table.
+int resize_htable(htable_t* htable) {
+  pthread_rwlock_wrlock(&htable->lock);
+  int rc = grow_htable(htable, htable->capacity);
+  pthread_rwlock_unlock(&htable->lock);
+  return rc;
+}
+
+// Search the htable. Return index.
+// Return NULL if none is found.
+tfile_t* search_htable(htable_t* htable, unsigned char hash[MD5_DIGEST_LENGTH]) {
+  pthread_rwlock_rdlock(&htable->lock);
+  tfile_t* t = *find_slot(htable->table, htable->capacity, hash);
+  pthread_rwlock_unlock(&htable->lock);
+  return t;
 }
@@ -0,0 +1,413 @@
+#include "io.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The most segments a single call splits a file transfer into before waiting for some to finish.
+#define MAX_SEGMENTS IO_RING_ENTRIES
+
+// A minimal io_uring, driven through the raw system calls.
+typedef struct {
+  int fd;
+  unsigned entries;
+
+  // Submission queue.
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  // Completion queue.
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_len;
+  void *cq_ptr;
+  size_t cq_len;
+  size_t sqes_len;
+} io_ring_t;
+
+// One outstanding transfer. Advanced in place as the kernel completes it.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t len;
+  off_t offset;
+} segment_t;
+
+static int backend = IO_POSIX;
+
+// Rings are not thread safe, so every thread gets its own, created on first use.
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void ring_free(io_ring_t *r) {
+  if (r->sqes != NULL && r->sqes != MAP_FAILED) {
+    munmap(r->sqes, r->sqes_len);
+  }
+  if (r->cq_ptr != NULL && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) {
+    munmap(r->cq_ptr, r->cq_len);
+  }
+  if (r->sq_ptr != NULL && r->sq_ptr != MAP_FAILED) {
+    munmap(r->sq_ptr, r->sq_len);
+  }
+  if (r->fd != -1) {
+    close(r->fd);
+  }
+  free(r);
+}
+
+static void ring_destructor(void *ring) {
+  ring_free(ring);
+}
+
+static void make_ring_key() {
+  pthread_key_create(&ring_key, ring_destructor);
+}
+
+// Create and map a ring. Returns NULL if the kernel does not support io_uring.
+static io_ring_t *ring_create(unsigned entries) {
+  io_ring_t *r = calloc(1, sizeof(io_ring_t));
+  if (r == NULL) {
+    return NULL;
+  }
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  r->fd = sys_io_uring_setup(entries, &p);
+  if (r->fd == -1) {
+    free(r);
+    return NULL;
+  }
+  r->entries = p.sq_entries;
+
+  r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_len > r->sq_len) {
+      r->sq_len = r->cq_len;
+    }
+    r->cq_len = r->sq_len;
+  }
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ptr == MAP_FAILED) {
+    ring_free(r);
+    return NULL;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ptr = r->sq_ptr;
+  } else {
+    r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ptr == MAP_FAILED) {
+      ring_free(r);
+      return NULL;
+    }
+  }
+  r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    ring_free(r);
+    return NULL;
+  }
+
+  char *sq = r->sq_ptr;
+  r->sq_head = (unsigned *)(sq + p.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+  char *cq = r->cq_ptr;
+  r->cq_head = (unsigned *)(cq + p.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  return r;
+}
+
+// Get this thread's ring, creating it if needed.
+static io_ring_t *thread_ring() {
+  pthread_once(&ring_key_once, make_ring_key);
+  io_ring_t *r = pthread_getspecific(ring_key);
+  if (r == NULL) {
+    r = ring_create(IO_RING_ENTRIES);
+    if (r != NULL) {
+      pthread_setspecific(ring_key, r);
+    }
+  }
+  return r;
+}
+
+// Claim the next submission entry. The caller fills it before ring_submit_wait.
+static struct io_uring_sqe *ring_get_sqe(io_ring_t *r, unsigned queued) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  unsigned tail = *r->sq_tail + queued;
+  if (tail - head >= r->entries) {
+    return NULL;
+  }
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  return sqe;
+}
+
+// Make <queued> filled entries visible to the kernel, submit them and wait for all of them.
+static int ring_submit_wait(io_ring_t *r, unsigned queued) {
+  __atomic_store_n(r->sq_tail, *r->sq_tail + queued, __ATOMIC_RELEASE);
+  unsigned to_submit = queued;
+  while (true) {
+    unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+    if (to_submit == 0 && ready >= queued) {
+      return SUCCESS;
+    }
+    unsigned min_complete = ready >= queued ? 0 : queued - ready;
+    int rc = sys_io_uring_enter(r->fd, to_submit, min_complete, IORING_ENTER_GETEVENTS);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return FAILED;
+    }
+    // The kernel may consume fewer entries than asked. Submit the rest on the next pass.
+    to_submit -= (unsigned)rc < to_submit ? (unsigned)rc : to_submit;
+  }
+}
+
+// Pop a completion. Returns false if there are none.
+static bool ring_reap(io_ring_t *r, uint64_t *user_data, int *res) {
+  unsigned head = *r->cq_head;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+  *user_data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Wait for a non-blocking socket to become ready.
+static void wait_socket(int fd, short events) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  poll(&pfd, 1, -1);
+}
+
+// Run file reads through the ring. Every segment is submitted in one batch so
+// they are all in flight together. Short transfers are resubmitted until complete.
+static int ring_file_io(io_ring_t *r, int opcode, segment_t *segs, int count) {
+  int remaining = count;
+  while (remaining > 0) {
+    unsigned queued = 0;
+    for (int i = 0; i < count; i++) {
+      if (segs[i].len == 0) {
+        continue;
+      }
+      struct io_uring_sqe *sqe = ring_get_sqe(r, queued);
+      if (sqe == NULL) {
+        break;
+      }
+      sqe->opcode = opcode;
+      sqe->fd = segs[i].fd;
+      sqe->addr = (uint64_t)(uintptr_t)segs[i].buf;
+      sqe->len = segs[i].len;
+      sqe->off = segs[i].offset;
+      sqe->user_data = i;
+      queued++;
+    }
+    if (ring_submit_wait(r, queued) != SUCCESS) {
+      return FAILED;
+    }
+
+    uint64_t i;
+    int res;
+    int rc = SUCCESS;
+    while (ring_reap(r, &i, &res)) {
+      if (res == -EINTR || res == -EAGAIN) {
+        continue;
+      }
+      // Errors and unexpected end of file
+      if (res <= 0) {
+        rc = FAILED;
+        continue;
+      }
+      segs[i].buf += res;
+      segs[i].len -= res;
+      segs[i].offset += res;
+      if (segs[i].len == 0) {
+        remaining--;
+      }
+    }
+    if (rc != SUCCESS) {
+      return FAILED;
+    }
+  }
+  return SUCCESS;
+}
+
+// Split a file transfer into segments and run them through the ring.
+static int ring_file_all(io_ring_t *r, int opcode, int fd, char *buf, size_t len, off_t offset) {
+  segment_t segs[MAX_SEGMENTS];
+  while (len > 0) {
+    int count = 0;
+    while (len > 0 && count < MAX_SEGMENTS) {
+      size_t seg_len = len < IO_SEGMENT_SIZE ? len : IO_SEGMENT_SIZE;
+      segs[count++] = (segment_t){.fd = fd, .buf = buf, .len = seg_len, .offset = offset};
+      buf += seg_len;
+      offset += seg_len;
+      len -= seg_len;
+    }
+    if (ring_file_io(r, opcode, segs, count) != SUCCESS) {
+      return FAILED;
+    }
+  }
+  return SUCCESS;
+}
+
+// Select the I/O backend.
+int io_init(int requested) {
+  backend = IO_POSIX;
+  if (requested == IO_URING) {
+    // Probe with a ring for this thread. Other threads create theirs on first use.
+    if (thread_ring() != NULL) {
+      backend = IO_URING;
+    }
+  }
+  return backend;
+}
+
+// Returns the backend in use.
+int io_backend() {
+  return backend;
+}
+
+// Send every byte of <iov> over a socket.
+// Both backends send with sendmsg, the header and payload in one call. A message has to be sent before the next one,
+// so a ring would only hold one entry at a time and add a wait for its completion.
+int io_send_all(int fd, struct iovec *iov, int iovcnt) {
+  struct msghdr msg;
+  while (iovcnt > 0) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    // Sockets owned by the reactor are non-blocking. Wait until there is room again.
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      wait_socket(fd, POLLOUT);
+      continue;
+    }
+    if (rc <= 0) {
+      return FAILED;
+    }
+
+    // Skip whatever was sent and send the rest.
+    size_t sent = rc;
+    while (iovcnt > 0 && sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
+  }
+  return SUCCESS;
+}
+
+// Send <len> bytes of a file over a socket. Both backends use sendfile, which moves the
+// page cache pages to the socket in the kernel.
+int io_sendfile_all(int sock_fd, int file_fd, off_t offset, size_t len) {
+  while (len > 0) {
+    ssize_t rc = sendfile(sock_fd, file_fd, &offset, len);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      wait_socket(sock_fd, POLLOUT);
+      continue;
+    }
+    // Errors, and the file being shorter than expected
+    if (rc <= 0) {
+      return FAILED;
+    }
+    len -= rc;
+  }
+  return SUCCESS;
+}
+
+// Receive exactly <len> bytes from a socket. Like sends, receives do not go through the ring.
+int io_recv_all(int fd, void *buf, size_t len) {
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    // Try to read the entire remaining message
+    ssize_t rc = read(fd, (char *)buf + bytes_read, len - bytes_read);
+    if (rc < 0) {
+      rc = -errno;
+    }
+
+    if (rc == -EINTR) {
+      continue;
+    }
+    if (rc == -EAGAIN || rc == -EWOULDBLOCK) {
+      wait_socket(fd, POLLIN);
+      continue;
+    }
+    // Did the read fail? If so, return an error
+    if (rc <= 0) {
+      return FAILED;
+    }
+
+    // Update the number of bytes read
+    bytes_read += rc;
+  }
+  return SUCCESS;
+}
+
+// Read exactly <len> bytes of a file starting at <offset>.
+int io_pread_all(int fd, void *buf, size_t len, off_t offset) {
+  io_ring_t *r = backend == IO_URING ? thread_ring() : NULL;
+  if (r != NULL) {
+    return ring_file_all(r, IORING_OP_READ, fd, buf, len, offset);
+  }
+
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t rc = pread(fd, (char *)buf + bytes_read, len - bytes_read, offset + bytes_read);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return FAILED;
+    }
+    bytes_read += rc;
+  }
+  return SUCCESS;
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "message.h"
+
+// I/O backends which can be selected at startup. IO_URING reads files through a ring per thread, many segments
+// in flight at once. Sockets are written and read with plain system calls on both.
+#define IO_POSIX 0
+#define IO_URING 1
+
+// The number of submission queue entries in each thread's ring.
+#define IO_RING_ENTRIES 64
+
+// The size of each read or write submitted to the ring. Larger transfers are split into
+// this many bytes per entry and submitted together so they are in flight at the same time.
+#define IO_SEGMENT_SIZE (128 * 1024)
+
+// Select the I/O backend. Falls back to IO_POSIX when the kernel lacks io_uring.
+// Returns the backend in use.
+int io_init(int backend);
+
+// Returns the backend in use.
+int io_backend();
+
+// Send every byte of <iov> over a socket. Waits if the socket is non-blocking and full.
+// Returns FAILED if failed and SUCCESS on success.
+int io_send_all(int fd, struct iovec *iov, int iovcnt);
+
+// Send <len> bytes of a file starting at <offset> over a socket without copying them through userspace.
+// Returns FAILED if failed and SUCCESS on success.
+int io_sendfile_all(int sock_fd, int file_fd, off_t offset, size_t len);
+
+// Receive exactly <len> bytes from a socket.
+// Returns FAILED if failed and SUCCESS on success.
+int io_recv_all(int fd, void *buf, size_t len);
+
+// Read exactly <len> bytes of a file starting at <offset>.
+// Returns FAILED if failed (including end of file) and SUCCESS on success.
+int io_pread_all(int fd, void *buf, size_t len, off_t offset);
@@ -2,32 +2,68 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include "io.h"
+
+// Serialize a message header.
+int encode_message_info(const message_info_t *info, unsigned char buf[MESSAGE_HEADER_SIZE]) {
+  if (info->size > MAX_PAYLOAD_SIZE) {
+    return FAILED;
+  }
+  buf[0] = WIRE_VERSION;
+  buf[1] = info->type;
+  buf[2] = info->flags >> 8;
+  buf[3] = info->flags;
+  buf[4] = info->size >> 24;
+  buf[5] = info->size >> 16;
+  buf[6] = info->size >> 8;
+  buf[7] = info->size;
+  return SUCCESS;
+}
+
+// Parse a message header.
+int decode_message_info(const unsigned char buf[MESSAGE_HEADER_SIZE], message_info_t *info) {
+  // Older builds sent a raw struct whose first byte is the type, so they are rejected here too.
+  if (buf[0] != WIRE_VERSION) {
+    return FAILED;
+  }
+  info->type = buf[1];
+  info->flags = (uint16_t)buf[2] << 8 | buf[3];
+  info->size = (size_t)buf[4] << 24 | (size_t)buf[5] << 16 | (size_t)buf[6] << 8 | buf[7];
+  return SUCCESS;
+}
 
 // Send a message over the network.
 // Modified to include a message tag.
 int send_message(int fd, message_info_t *info, void *data) {
-  size_t s = sizeof(message_info_t);
-  if (write(fd, info, sizeof(message_info_t)) != sizeof(message_info_t)) {
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  if (encode_message_info(info, header) != SUCCESS) {
     return FAILED;
   }
 
-  if (data != NULL) {
-    size_t bytes_written = 0;
-    while (bytes_written < info->size) {
-      // Try to write the entire message
-      ssize_t rc = write(fd, data + bytes_written, info->size - bytes_written);
+  // The header and payload are handed to the I/O backend together.
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = MESSAGE_HEADER_SIZE},
+      {.iov_base = data, .iov_len = data != NULL ? info->size : 0}};
 
-      // Did the write fail? If so, return an error
-      if (rc <= 0) {
-        return FAILED;
-      }
+  return io_send_all(fd, iov, data != NULL ? 2 : 1);
+}
 
-      // If there was no error, write returned the number of bytes written
-      bytes_written += rc;
-    }
+// Send a message with a payload which is partly in memory and partly in a file.
+// Only the header and <data> pass through userspace.
+int send_message_file(int fd, message_info_t *info, void *data, size_t data_size, int file_fd, off_t offset) {
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  if (data_size > info->size || encode_message_info(info, header) != SUCCESS) {
+    return FAILED;
   }
+  struct iovec iov[2] = {
+      {.iov_base = header, .iov_len = MESSAGE_HEADER_SIZE},
+      {.iov_base = data, .iov_len = data_size}};
 
-  return SUCCESS;
+  if (io_send_all(fd, iov, data != NULL ? 2 : 1) != SUCCESS) {
+    return FAILED;
+  }
+
+  return io_sendfile_all(fd, file_fd, offset, info->size - data_size);
 }
 
 // Recieve a message and store it in a location in memory.
@@ -36,11 +72,15 @@ int receive_message(int fd, void *data, size_t size) {
   if (data == NULL) {
     size = 0;
   }
+  unsigned char header[MESSAGE_HEADER_SIZE];
   message_info_t info;
-  if (read(fd, &info, sizeof(message_info_t)) != sizeof(message_info_t)) {
+  if (io_recv_all(fd, header, MESSAGE_HEADER_SIZE) != SUCCESS) {
     // Reading failed. Return an error
     return FAILED;
   }
+  if (decode_message_info(header, &info) != SUCCESS) {
+    return FAILED;
+  }
 
   // If size is larger than the message, truncate
   if (size > info.size) {
@@ -48,29 +88,24 @@ int receive_message(int fd, void *data, size_t size) {
   }
 
   // Try to read the message. Loop until the entire message has been read.
-  size_t bytes_read = 0;
-  while (bytes_read < size) {
-    // Try to read the entire remaining message
-    ssize_t rc = read(fd, data + bytes_read, size - bytes_read);
-
-    // Did the read fail? If so, return an error
-    if (rc <= 0) {
-      return FAILED;
-    }
-
-    // Update the number of bytes read
-    bytes_read += rc;
+  if (io_recv_all(fd, data, size) != SUCCESS) {
+    return FAILED;
   }
+  size_t bytes_read = size;
 
   // If there is extra data to read, discard it.
   ssize_t extra_data = info.size - bytes_read;
   if (extra_data) {
     ssize_t bytes_discarded = 0;
-    while (bytes_discarded <= extra_data) {
+    while (bytes_discarded < extra_data) {
       // The MSG_TRUNC flag causes the received bytes of data to be discarded,
       // rather than passed back in a caller-supplied buffer. (For TCP ONLY)
       // https://man7.org/linux/man-pages/man7/tcp.7.html
-      bytes_discarded += recv(fd, NULL, extra_data - bytes_discarded, MSG_TRUNC);
+      ssize_t rc = recv(fd, NULL, extra_data - bytes_discarded, MSG_TRUNC);
+      if (rc <= 0) {
+        return FAILED;
+      }
+      bytes_discarded += rc;
     }
   }
 
@@ -80,10 +115,10 @@ int receive_message(int fd, void *data, size_t size) {
 // Peek at the incoming message's info.
 // USE BEFORE BLINDLY COPYING ALL THE DATA!
 int incoming_message_info(int fd, message_info_t *info) {
-  size_t s = sizeof(message_info_t);
-  ssize_t result = recv(fd, info, sizeof(message_info_t), MSG_PEEK);
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  ssize_t result = recv(fd, header, MESSAGE_HEADER_SIZE, MSG_PEEK);
 
-  if (result != sizeof(message_info_t)) {
+  if (result != MESSAGE_HEADER_SIZE) {
     if (result == 0) {
       // Connection closed by peer
       printf("Connection closed by peer\n");
@@ -95,5 +130,5 @@ int incoming_message_info(int fd, message_info_t *info) {
     return FAILED;
   }
 
-  return SUCCESS;
+  return decode_message_info(header, info);
 }
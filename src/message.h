@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdint.h>
 #include <sys/socket.h>
 // Unused for now...
 #define MAX_MESSAGE_LENGTH 2048
@@ -10,21 +11,63 @@
 #define TFILE_DEF         0xC
 #define ADDR_SELF         0xD
 #define REQUEST_ADDR_SELF 0xE
+#define TFILE_DEF_BATCH   0xF
+#define CATALOG_SUMMARY   0x10
+#define CATALOG_QUERY     0x11
+#define CATALOG_HAVE      0x12
+#define HAVE_BITFIELD     0x13
+#define HAVE_CHUNK        0x14
+#define CANCEL_FILE_DATA  0x15
 typedef unsigned char message_type_t;
 
+// Version of the wire format. Frames carrying any other version are rejected.
+// Bumped whenever a payload layout changes other than by appending fields, which older decoders skip:
+// 1 the first versioned format
+// 2 chunk requests start with a request id
+// 3 tfile definitions carry their chunk size and count ahead of the chunk hashes, batches carry where they were
+//   first announced and every batch record is prefixed with its size
+// 4 chunk requests and FILE_DATA headers name a block by its offset and size in the chunk
+#define WIRE_VERSION 4
+
+// Size of a frame header on the wire:
+// version (1 byte), type (1 byte), flags (2 bytes), payload size (4 bytes). Big endian.
+#define MESSAGE_HEADER_SIZE 8
+
+// The largest payload a frame can describe.
+#define MAX_PAYLOAD_SIZE UINT32_MAX
+
+// Frame flags.
+// The block of a FILE_DATA frame, after its header, is compressed with zlib. Only sent to requesters accepting it.
+#define FLAG_ZLIB 0x0001
+
 typedef struct {
   message_type_t type;
+  // Reserved for extensions. Receivers ignore flags they do not know.
+  uint16_t flags;
   size_t size;
 } message_info_t;
 
 #define FAILED -1
 #define SUCCESS 0
 
+// Serialize a message header into <buf>.
+// Returns FAILED if the payload is too large to describe.
+int encode_message_info(const message_info_t* info, unsigned char buf[MESSAGE_HEADER_SIZE]);
+
+// Parse a message header from <buf>.
+// Returns FAILED if the frame has a different wire version.
+int decode_message_info(const unsigned char buf[MESSAGE_HEADER_SIZE], message_info_t* info);
+
 // Send a message over a socket.
 // Message type, size, and data are sent in that order.
 // Returns FAILED if failed and SUCCESS on success.
 int send_message(int fd, message_info_t* info, void* data);
 
+// Send a message whose payload is <data> followed by the rest of <info->size> taken
+// from <file_fd> starting at <offset>. The file bytes are copied by the kernel.
+// Returns FAILED if failed and SUCCESS on success.
+int send_message_file(int fd, message_info_t* info, void* data, size_t data_size, int file_fd, off_t offset);
+
 // Recieve a message.
 // Return message type or FAILED if failed.
 // Data is written to <data>
@@ -0,0 +1,126 @@
+#include "peerscore.h"
+#include <stdlib.h>
+#include <string.h>
+
+static double moving_average(double average, double sample, bool first) {
+  return first ? sample : average + (sample - average) / SCORE_WEIGHT;
+}
+
+// Returns whether <entry> holds anything measured.
+static bool measured(const peer_score_t *entry) {
+  return entry->blocks > 0 || entry->failures > 0 || entry->rtt_ms > 0;
+}
+
+// The entry of <peer>, created if needed. Returns NULL if the peer is not a socket or the allocation failed.
+static peer_score_t *entry_of(score_table_t *table, int peer) {
+  if (peer < 0) {
+    return NULL;
+  }
+  if (peer >= table->size) {
+    int size = table->size > 0 ? table->size : 64;
+    while (size <= peer) {
+      size *= 2;
+    }
+    peer_score_t *peers = realloc(table->peers, size * sizeof(peer_score_t));
+    if (peers == NULL) {
+      return NULL;
+    }
+    memset(peers + table->size, 0, (size - table->size) * sizeof(peer_score_t));
+    for (int i = table->size; i < size; i++) {
+      peers[i].peer = i;
+    }
+    table->peers = peers;
+    table->size = size;
+  }
+  return &table->peers[peer];
+}
+
+void init_scores(score_table_t *table) {
+  memset(table, 0, sizeof(*table));
+}
+
+// Record the time to the first byte of a block.
+void score_first_byte(score_table_t *table, int peer, long rtt_ms) {
+  peer_score_t *e = entry_of(table, peer);
+  if (e != NULL) {
+    e->rtt_ms = moving_average(e->rtt_ms, rtt_ms > 0 ? rtt_ms : 0.1, e->rtt_ms == 0);
+  }
+}
+
+// Record that a peer delivered a block.
+void score_delivered(score_table_t *table, int peer, size_t bytes, long requested, long now) {
+  peer_score_t *e = entry_of(table, peer);
+  if (e == NULL) {
+    return;
+  }
+  // pipelined blocks wait for the ones before them, which is not the peer being slow
+  long start = requested > e->last_done ? requested : e->last_done;
+  long elapsed = now - start > 0 ? now - start : 1;
+  e->throughput = moving_average(e->throughput, bytes * 1000.0 / elapsed, e->throughput == 0);
+  e->failure_rate = moving_average(e->failure_rate, 0, false);
+  e->bytes += bytes;
+  e->blocks++;
+  e->last_done = now;
+  if (e->throughput > table->best_throughput) {
+    table->best_throughput = e->throughput;
+  }
+}
+
+// Record that a request to a peer failed.
+void score_failed(score_table_t *table, int peer) {
+  peer_score_t *e = entry_of(table, peer);
+  if (e != NULL) {
+    e->failure_rate = moving_average(e->failure_rate, 1, false);
+    e->failures++;
+  }
+}
+
+// Forget a peer.
+void score_forget(score_table_t *table, int peer) {
+  if (peer < 0 || peer >= table->size) {
+    return;
+  }
+  memset(&table->peers[peer], 0, sizeof(peer_score_t));
+  table->peers[peer].peer = peer;
+  table->best_throughput = 0;
+  for (int i = 0; i < table->size; i++) {
+    if (table->peers[i].throughput > table->best_throughput) {
+      table->best_throughput = table->peers[i].throughput;
+    }
+  }
+}
+
+// The expected time of a new block from a peer.
+double score_cost(const score_table_t *table, int peer, int load, uint32_t block_size) {
+  const peer_score_t *e = peer >= 0 && peer < table->size ? &table->peers[peer] : NULL;
+  double throughput = e != NULL && e->throughput > 0 ? e->throughput : table->best_throughput;
+  // nothing measured at all, fall back on the load
+  if (throughput <= 0) {
+    return load + 1;
+  }
+  double cost = (e != NULL ? e->rtt_ms : 0) + (load + 1) * (double)block_size * 1000 / throughput;
+  double failure_rate = e != NULL ? e->failure_rate : 0;
+  return cost / (failure_rate < 0.9 ? 1 - failure_rate : 0.1);
+}
+
+// Returns whether a peer fails too often.
+bool score_flaky(const score_table_t *table, int peer) {
+  return peer >= 0 && peer < table->size && table->peers[peer].failure_rate > SCORE_FLAKY;
+}
+
+// List the peers which were measured.
+int score_list(const score_table_t *table, peer_score_t *scores, int max) {
+  int count = 0;
+  for (int i = 0; i < table->size && count < max; i++) {
+    if (measured(&table->peers[i])) {
+      scores[count++] = table->peers[i];
+    }
+  }
+  return count;
+}
+
+void free_scores(score_table_t *table) {
+  free(table->peers);
+  table->peers = NULL;
+  table->size = 0;
+}
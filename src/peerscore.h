@@ -0,0 +1,63 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Moving averages weigh a new sample by 1/SCORE_WEIGHT.
+#define SCORE_WEIGHT 8
+
+// Peers which failed more than this share of their requests lately are only asked once no other holder is left.
+#define SCORE_FLAKY 0.5
+
+// How one peer served the blocks requested from it.
+typedef struct {
+  int peer;
+  // Moving averages of the bytes per second it delivers while busy, of the milliseconds from a request to its
+  // first byte, and of the share of requests which failed. Throughput and RTT are 0 until measured.
+  double throughput;
+  double rtt_ms;
+  double failure_rate;
+  // Totals.
+  uint64_t bytes;
+  size_t blocks;
+  size_t failures;
+  // When the last block from it arrived, in milliseconds of the monotonic clock.
+  long last_done;
+  // Blocks in flight to it. Only set when listed by the scheduler.
+  int in_flight;
+} peer_score_t;
+
+// The scores of every peer, indexed by the peer's socket. Not thread safe, its owner locks it.
+typedef struct {
+  peer_score_t *peers;
+  int size;
+  // The best throughput measured, assumed of peers not measured yet so they get a chance.
+  double best_throughput;
+} score_table_t;
+
+void init_scores(score_table_t *table);
+
+// Record that the first byte of a block requested from an idle <peer> arrived <rtt_ms> after the request.
+void score_first_byte(score_table_t *table, int peer, long rtt_ms);
+
+// Record that <peer> delivered a <bytes> byte block requested at <requested>, completing at <now>.
+// The block is timed from when the peer could start on it, after the block before it.
+void score_delivered(score_table_t *table, int peer, size_t bytes, long requested, long now);
+
+// Record that a request to <peer> failed: it timed out, or the chunk it sent was corrupt.
+void score_failed(score_table_t *table, int peer);
+
+// Forget <peer>, e.g. once it disconnected, since its socket may go to another peer.
+void score_forget(score_table_t *table, int peer);
+
+// The milliseconds a new <block_size> byte block is expected to take from <peer> with <load> blocks in flight,
+// stretched by how often it fails. Lower is better.
+double score_cost(const score_table_t *table, int peer, int load, uint32_t block_size);
+
+// Returns whether <peer> fails too often to be asked while other holders are left.
+bool score_flaky(const score_table_t *table, int peer);
+
+// Write up to <max> scores of peers which were measured to <scores>. Returns how many there are.
+int score_list(const score_table_t *table, peer_score_t *scores, int max);
+
+void free_scores(score_table_t *table);
@@ -0,0 +1,80 @@
+#include "ratelimit.h"
+
+// Add the tokens earned since the last refill. Requires the lock.
+static void refill(bucket_t *bucket) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - bucket->last.tv_sec) + (now.tv_nsec - bucket->last.tv_nsec) / 1e9;
+  bucket->last = now;
+  bucket->tokens += elapsed * bucket->rate;
+  if (bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+}
+
+// Create a bucket which starts full.
+void init_bucket(bucket_t *bucket, double rate, double burst) {
+  pthread_mutex_init(&bucket->lock, NULL);
+  bucket->rate = rate;
+  bucket->burst = burst < 1 ? 1 : burst;
+  bucket->tokens = bucket->burst;
+  clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+// Take up to <want> tokens.
+size_t bucket_take(bucket_t *bucket, size_t want) {
+  if (bucket->rate <= 0) {
+    return want;
+  }
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  size_t taken = bucket->tokens < want ? (size_t)bucket->tokens : want;
+  bucket->tokens -= taken;
+  pthread_mutex_unlock(&bucket->lock);
+  return taken;
+}
+
+// Returns how many milliseconds until <n> tokens are available.
+long bucket_wait_ms(bucket_t *bucket, size_t n) {
+  if (bucket->rate <= 0) {
+    return 0;
+  }
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  double need = n < bucket->burst ? n : bucket->burst;
+  long wait = bucket->tokens >= need ? 0 : (long)((need - bucket->tokens) * 1000 / bucket->rate) + 1;
+  pthread_mutex_unlock(&bucket->lock);
+  return wait;
+}
+
+// Take <n> tokens even if fewer are left.
+void bucket_debit(bucket_t *bucket, size_t n) {
+  if (bucket->rate <= 0) {
+    return;
+  }
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  bucket->tokens -= n;
+  pthread_mutex_unlock(&bucket->lock);
+}
+
+// Change the rate and burst of a bucket.
+void bucket_set_rate(bucket_t *bucket, double rate, double burst) {
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  // an unlimited bucket did not keep count, so it starts full
+  if (bucket->rate <= 0) {
+    bucket->tokens = burst;
+  }
+  bucket->rate = rate;
+  bucket->burst = burst < 1 ? 1 : burst;
+  if (bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+  pthread_mutex_unlock(&bucket->lock);
+}
+
+// Release the bucket's lock.
+void free_bucket(bucket_t *bucket) {
+  pthread_mutex_destroy(&bucket->lock);
+}
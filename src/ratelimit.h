@@ -0,0 +1,33 @@
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+// A token bucket. Tokens accumulate at <rate> per second up to <burst>, and every unit of work takes one.
+typedef struct {
+  pthread_mutex_t lock;
+  // Tokens per second. 0 means unlimited.
+  double rate;
+  double burst;
+  double tokens;
+  struct timespec last;
+} bucket_t;
+
+// Create a bucket which starts full. A <rate> of 0 never limits.
+void init_bucket(bucket_t *bucket, double rate, double burst);
+
+// Take up to <want> tokens. Returns how many were taken, which may be 0.
+size_t bucket_take(bucket_t *bucket, size_t want);
+
+// Returns how many milliseconds until <n> tokens (at most the burst) are available. 0 if they already are.
+long bucket_wait_ms(bucket_t *bucket, size_t n);
+
+// Take <n> tokens even if fewer are left. The bucket goes into debt, which is paid off before tokens are
+// available again, so work larger than the burst is still limited to the rate on average.
+void bucket_debit(bucket_t *bucket, size_t n);
+
+// Change the rate and burst of a bucket. Tokens above the new burst are dropped.
+void bucket_set_rate(bucket_t *bucket, double rate, double burst);
+
+// Release the bucket's lock.
+void free_bucket(bucket_t *bucket);
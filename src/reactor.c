@@ -0,0 +1,735 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// The number of events handled per epoll_wait call.
+#define MAX_EVENTS 64
+
+// The parts of a message, read in this order.
+#define PHASE_HEADER 0
+#define PHASE_BODY   1
+#define PHASE_STREAM 2
+
+// The most queued messages written by a single sendmsg call.
+#define MAX_IOV 16
+
+// Commands sent to a reactor thread from other threads.
+#define CMD_ADD    1
+#define CMD_REMOVE 2
+#define CMD_WRITE  3
+
+// A message waiting to be written, header included.
+typedef struct out_msg {
+  struct out_msg *next;
+  size_t len;
+  size_t sent;
+  unsigned char bytes[];
+} out_msg_t;
+
+// The outbound queue of a socket. Any thread may append to it, it is drained by whichever
+// thread finds the socket writable: the sender while the queue is empty, the owning reactor thread after that.
+typedef struct {
+  pthread_mutex_t lock;
+  // Whether the socket is a reactor connection which can be sent to.
+  bool open;
+  // Bumped every time the fd is added, from 1. Commands carry it, so those meant for an earlier connection on a
+  // reused fd do not touch the new one.
+  uint32_t generation;
+  // Whether the owning thread was asked to write the rest once the socket drains.
+  bool want_write;
+  // Set when the queue reaches the high watermark, cleared when it drains to the low one.
+  bool congested;
+  size_t bytes;
+  out_msg_t *head;
+  out_msg_t *tail;
+} send_queue_t;
+
+// A connection owned by a reactor thread.
+typedef struct conn {
+  int fd;
+  // Set for listening sockets only.
+  reactor_accept_t on_accept;
+  // The generation of its queue when it was added. 0 for listening sockets.
+  uint32_t generation;
+
+  // Which part of the message is being read.
+  int phase;
+
+  // Header of the message being read and how much of it has arrived.
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  size_t hdr_read;
+  message_info_t info;
+
+  // Buffered payload of the message being read (or the prefix of a streamed one).
+  unsigned char *data;
+  size_t data_want;
+  size_t data_read;
+  size_t data_cap;
+
+  // Streamed payload, past the prefix.
+  reactor_stream_t *stream;
+  void *stream_ctx;
+  size_t stream_read;
+  // Whether streamed bytes the handler does not want can be discarded with MSG_TRUNC, which only TCP supports.
+  bool truncates;
+
+  struct conn *next;
+} conn_t;
+
+typedef struct cmd {
+  int type;
+  int fd;
+  reactor_accept_t on_accept;
+  // The generation of the connection meant, or 0 for whichever is on the fd.
+  uint32_t generation;
+  struct cmd *next;
+} cmd_t;
+
+typedef struct {
+  pthread_t thread;
+  int epfd;
+  // Eventfd used to wake the thread when commands are queued.
+  int wake_fd;
+  pthread_mutex_t lock;
+  // Pending commands, oldest first.
+  cmd_t *cmds;
+  cmd_t *cmds_tail;
+  // Every connection owned by this thread.
+  conn_t *conns;
+  // Connections closed during the current batch of events. Freed once the batch is done.
+  conn_t *dead;
+  // Where discarded bytes are read to on connections which cannot truncate, REACTOR_STREAM_PIECE bytes.
+  unsigned char *scratch;
+} reactor_thread_t;
+
+static reactor_thread_t *threads = NULL;
+static int thread_count = 0;
+static reactor_handler_t message_handler = NULL;
+static reactor_close_t close_handler = NULL;
+static reactor_stream_t *streams[256];
+
+// Outbound queues indexed by fd. A queue is created the first time its fd is added and reused after that.
+static send_queue_t **queues = NULL;
+static int queue_limit = 0;
+static pthread_mutex_t queues_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t queue_high = REACTOR_QUEUE_HIGH;
+static size_t queue_low = REACTOR_QUEUE_LOW;
+static int queue_policy = REACTOR_DROP;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static reactor_send_stats_t send_stats;
+
+// A socket always belongs to the same thread, so other threads can find it by fd alone.
+static reactor_thread_t *owner(int fd) {
+  return &threads[fd % thread_count];
+}
+
+static int set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    return FAILED;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ? FAILED : SUCCESS;
+}
+
+static void add_stat(size_t *counter, ssize_t delta) {
+  pthread_mutex_lock(&stats_lock);
+  *counter += delta;
+  pthread_mutex_unlock(&stats_lock);
+}
+
+static send_queue_t *find_queue(int fd) {
+  if (fd < 0 || fd >= queue_limit) {
+    return NULL;
+  }
+  return __atomic_load_n(&queues[fd], __ATOMIC_ACQUIRE);
+}
+
+static send_queue_t *create_queue(int fd) {
+  send_queue_t *q = find_queue(fd);
+  if (q != NULL || fd < 0 || fd >= queue_limit) {
+    return q;
+  }
+  pthread_mutex_lock(&queues_lock);
+  q = queues[fd];
+  if (q == NULL) {
+    q = calloc(1, sizeof(send_queue_t));
+    if (q != NULL) {
+      pthread_mutex_init(&q->lock, NULL);
+      __atomic_store_n(&queues[fd], q, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&queues_lock);
+  return q;
+}
+
+// Drop everything still queued and refuse new messages. Requires the queue's lock.
+static void clear_queue(send_queue_t *q) {
+  while (q->head != NULL) {
+    out_msg_t *m = q->head;
+    q->head = m->next;
+    free(m);
+  }
+  q->tail = NULL;
+  add_stat(&send_stats.queued, -(ssize_t)q->bytes);
+  q->bytes = 0;
+  q->open = false;
+  q->want_write = false;
+  q->congested = false;
+}
+
+// Write as much of the queue as the socket takes without blocking. Requires the queue's lock.
+// Returns FAILED if the connection is broken.
+static int flush_queue(int fd, send_queue_t *q) {
+  while (q->head != NULL) {
+    struct iovec iov[MAX_IOV];
+    int iovcnt = 0;
+    for (out_msg_t *m = q->head; m != NULL && iovcnt < MAX_IOV; m = m->next) {
+      iov[iovcnt].iov_base = m->bytes + m->sent;
+      iov[iovcnt].iov_len = m->len - m->sent;
+      iovcnt++;
+    }
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? SUCCESS : FAILED;
+    }
+
+    q->bytes -= rc;
+    add_stat(&send_stats.queued, -rc);
+    while (rc > 0) {
+      out_msg_t *m = q->head;
+      size_t n = m->len - m->sent < (size_t)rc ? m->len - m->sent : (size_t)rc;
+      m->sent += n;
+      rc -= n;
+      if (m->sent == m->len) {
+        q->head = m->next;
+        free(m);
+      }
+    }
+    if (q->head == NULL) {
+      q->tail = NULL;
+    }
+  }
+  return SUCCESS;
+}
+
+// Queue a command for the thread owning <fd> and wake it.
+static int post(int type, int fd, reactor_accept_t on_accept, uint32_t generation) {
+  if (thread_count == 0) {
+    return FAILED;
+  }
+  cmd_t *cmd = malloc(sizeof(cmd_t));
+  if (cmd == NULL) {
+    return FAILED;
+  }
+  *cmd = (cmd_t){.type = type, .fd = fd, .on_accept = on_accept, .generation = generation, .next = NULL};
+
+  reactor_thread_t *rt = owner(fd);
+  pthread_mutex_lock(&rt->lock);
+  if (rt->cmds_tail != NULL) {
+    rt->cmds_tail->next = cmd;
+  } else {
+    rt->cmds = cmd;
+  }
+  rt->cmds_tail = cmd;
+  pthread_mutex_unlock(&rt->lock);
+
+  uint64_t one = 1;
+  if (write(rt->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+    perror("Could not wake reactor");
+    return FAILED;
+  }
+  return SUCCESS;
+}
+
+static void add_conn(reactor_thread_t *rt, int fd, reactor_accept_t on_accept, uint32_t generation) {
+  conn_t *c = calloc(1, sizeof(conn_t));
+  if (c == NULL) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  c->on_accept = on_accept;
+  c->generation = generation;
+  int domain;
+  socklen_t domain_len = sizeof(domain);
+  c->truncates = getsockopt(fd, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) == 0 &&
+                 (domain == AF_INET || domain == AF_INET6);
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+  if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+    perror("Could not watch socket");
+    close(fd);
+    free(c);
+    return;
+  }
+  c->next = rt->conns;
+  rt->conns = c;
+}
+
+// Unlink and close a connection. Peers are reported to the close handler.
+static void close_conn(reactor_thread_t *rt, conn_t *c) {
+  for (conn_t **p = &rt->conns; *p != NULL; p = &(*p)->next) {
+    if (*p == c) {
+      *p = c->next;
+      break;
+    }
+  }
+  epoll_ctl(rt->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  send_queue_t *q = find_queue(c->fd);
+  if (c->on_accept == NULL && q != NULL) {
+    pthread_mutex_lock(&q->lock);
+    clear_queue(q);
+    pthread_mutex_unlock(&q->lock);
+  }
+  if (c->phase == PHASE_STREAM && c->stream_ctx != NULL) {
+    c->stream->end(c->stream_ctx, false);
+  }
+  if (c->on_accept == NULL && close_handler != NULL) {
+    close_handler(c->fd);
+  }
+  close(c->fd);
+  // A later event in the same batch may still point at this connection.
+  c->fd = -1;
+  c->next = rt->dead;
+  rt->dead = c;
+}
+
+static void free_dead(reactor_thread_t *rt) {
+  while (rt->dead != NULL) {
+    conn_t *c = rt->dead;
+    rt->dead = c->next;
+    free(c->data);
+    free(c);
+  }
+}
+
+// Find the connection on <fd>, if it is of <generation> (any if 0).
+static conn_t *find_conn(reactor_thread_t *rt, int fd, uint32_t generation) {
+  for (conn_t *c = rt->conns; c != NULL; c = c->next) {
+    if (c->fd == fd) {
+      return generation == 0 || c->generation == generation ? c : NULL;
+    }
+  }
+  return NULL;
+}
+
+// Start or stop waiting for a connection's socket to drain.
+static void watch_writable(reactor_thread_t *rt, conn_t *c, bool writable) {
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0), .data.ptr = c};
+  if (epoll_ctl(rt->epfd, EPOLL_CTL_MOD, c->fd, &ev)) {
+    perror("Could not watch socket");
+  }
+}
+
+static void run_commands(reactor_thread_t *rt) {
+  uint64_t count;
+  if (read(rt->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+    perror("Could not read reactor wakeup");
+  }
+
+  pthread_mutex_lock(&rt->lock);
+  cmd_t *cmds = rt->cmds;
+  rt->cmds = NULL;
+  rt->cmds_tail = NULL;
+  pthread_mutex_unlock(&rt->lock);
+
+  while (cmds != NULL) {
+    cmd_t *cmd = cmds;
+    cmds = cmd->next;
+    if (cmd->type == CMD_ADD) {
+      add_conn(rt, cmd->fd, cmd->on_accept, cmd->generation);
+    } else if (cmd->type == CMD_REMOVE) {
+      conn_t *c = find_conn(rt, cmd->fd, cmd->generation);
+      if (c != NULL) {
+        close_conn(rt, c);
+      }
+    } else if (cmd->type == CMD_WRITE) {
+      // Commands run in order, so the connection was added first. It may have closed since.
+      conn_t *c = find_conn(rt, cmd->fd, cmd->generation);
+      if (c != NULL) {
+        watch_writable(rt, c, true);
+      }
+    }
+    free(cmd);
+  }
+}
+
+// Accept every pending connection on a listening socket.
+static void accept_ready(conn_t *c) {
+  for (;;) {
+    int client_fd = accept4(c->fd, NULL, NULL, SOCK_NONBLOCK);
+    if (client_fd == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("accept failed");
+      }
+      return;
+    }
+    c->on_accept(c->fd, client_fd);
+  }
+}
+
+// Called once a message header has arrived. Decides how much of the payload to buffer.
+static int header_done(conn_t *c) {
+  // A frame we cannot parse leaves the stream out of sync, so the connection has to go.
+  if (decode_message_info(c->header, &c->info) != SUCCESS) {
+    return FAILED;
+  }
+  c->stream = streams[c->info.type];
+  // Too short to carry the prefix. Buffer it like any other message.
+  if (c->stream != NULL && c->info.size < c->stream->prefix_size) {
+    c->stream = NULL;
+  }
+  c->data_want = c->stream != NULL ? c->stream->prefix_size : c->info.size;
+  if (c->data_want > REACTOR_MAX_MESSAGE) {
+    return FAILED;
+  }
+  if (c->data_want > c->data_cap) {
+    unsigned char *data = realloc(c->data, c->data_want);
+    if (data == NULL) {
+      return FAILED;
+    }
+    c->data = data;
+    c->data_cap = c->data_want;
+  }
+  c->data_read = 0;
+  c->phase = PHASE_BODY;
+  return SUCCESS;
+}
+
+// Called once the buffered part of a payload has arrived.
+static void body_done(conn_t *c) {
+  if (c->stream == NULL) {
+    message_handler(c->fd, &c->info, c->data);
+    c->hdr_read = 0;
+    c->phase = PHASE_HEADER;
+    return;
+  }
+  c->stream_ctx = c->stream->begin(c->fd, &c->info, c->data);
+  c->stream_read = 0;
+  c->phase = PHASE_STREAM;
+}
+
+// Read as much as the socket has, dispatching every complete message.
+// Returns FAILED if the connection should be closed.
+static int read_ready(reactor_thread_t *rt, conn_t *c) {
+  for (;;) {
+    ssize_t rc;
+    if (c->phase == PHASE_HEADER) {
+      rc = read(c->fd, c->header + c->hdr_read, MESSAGE_HEADER_SIZE - c->hdr_read);
+    } else if (c->phase == PHASE_BODY) {
+      if (c->data_read == c->data_want) {
+        body_done(c);
+        continue;
+      }
+      rc = read(c->fd, c->data + c->data_read, c->data_want - c->data_read);
+    } else {
+      size_t remaining = c->info.size - c->data_want - c->stream_read;
+      if (remaining == 0) {
+        if (c->stream_ctx != NULL) {
+          c->stream->end(c->stream_ctx, true);
+        }
+        c->hdr_read = 0;
+        c->phase = PHASE_HEADER;
+        continue;
+      }
+      // Never more than one piece per read, so memory use does not depend on the payload size.
+      size_t len = remaining < REACTOR_STREAM_PIECE ? remaining : REACTOR_STREAM_PIECE;
+      void *dest = NULL;
+      if (c->stream_ctx != NULL) {
+        dest = c->stream->next(c->stream_ctx, c->stream_read, &len);
+      }
+      if (dest != NULL) {
+        rc = read(c->fd, dest, len);
+      } else if (c->truncates) {
+        // The handler does not want these bytes. MSG_TRUNC discards them without a buffer (TCP only).
+        rc = recv(c->fd, NULL, len, MSG_TRUNC);
+      } else {
+        // e.g. AF_UNIX, where MSG_TRUNC fails on stream sockets
+        rc = read(c->fd, rt->scratch, len);
+      }
+    }
+
+    if (rc == 0) {
+      return FAILED;
+    }
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? SUCCESS : FAILED;
+    }
+
+    if (c->phase == PHASE_HEADER) {
+      c->hdr_read += rc;
+      if (c->hdr_read == MESSAGE_HEADER_SIZE && header_done(c) != SUCCESS) {
+        return FAILED;
+      }
+    } else if (c->phase == PHASE_BODY) {
+      c->data_read += rc;
+    } else {
+      c->stream_read += rc;
+    }
+  }
+}
+
+// Write queued messages once the socket drained.
+// Returns FAILED if the connection should be closed.
+static int write_ready(reactor_thread_t *rt, conn_t *c) {
+  send_queue_t *q = find_queue(c->fd);
+  if (q == NULL) {
+    return SUCCESS;
+  }
+  pthread_mutex_lock(&q->lock);
+  int rc = flush_queue(c->fd, q);
+  if (rc == SUCCESS && q->head == NULL) {
+    // Senders write directly again.
+    q->want_write = false;
+    watch_writable(rt, c, false);
+  }
+  if (q->congested && q->bytes <= queue_low) {
+    q->congested = false;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return rc;
+}
+
+static void *reactor_loop(void *args) {
+  reactor_thread_t *rt = args;
+  struct epoll_event events[MAX_EVENTS];
+
+  while (true) {
+    int n = epoll_wait(rt->epfd, events, MAX_EVENTS, -1);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait failed");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      conn_t *c = events[i].data.ptr;
+      // The wakeup eventfd is registered without a connection.
+      if (c == NULL) {
+        run_commands(rt);
+      } else if (c->fd == -1) {
+        continue;
+      } else if (c->on_accept != NULL) {
+        accept_ready(c);
+      } else {
+        int rc = SUCCESS;
+        if (events[i].events & EPOLLOUT) {
+          rc = write_ready(rt, c);
+        }
+        if (rc == SUCCESS && (events[i].events & ~EPOLLOUT)) {
+          rc = read_ready(rt, c);
+        }
+        if (rc != SUCCESS) {
+          close_conn(rt, c);
+        }
+      }
+    }
+    free_dead(rt);
+  }
+
+  return NULL;
+}
+
+// Start <num_threads> reactor threads.
+int reactor_start(int num_threads, reactor_handler_t handler, reactor_close_t on_close) {
+  if (num_threads <= 0 || threads != NULL) {
+    return FAILED;
+  }
+  threads = calloc(num_threads, sizeof(reactor_thread_t));
+  if (threads == NULL) {
+    return FAILED;
+  }
+  message_handler = handler;
+  close_handler = on_close;
+
+  // Every fd the process may open can have a queue.
+  struct rlimit limit;
+  queue_limit = 1 << 16;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < (1 << 20)) {
+    queue_limit = limit.rlim_cur;
+  }
+  queues = calloc(queue_limit, sizeof(send_queue_t *));
+  if (queues == NULL) {
+    return FAILED;
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    reactor_thread_t *rt = &threads[i];
+    pthread_mutex_init(&rt->lock, NULL);
+    rt->epfd = epoll_create1(0);
+    rt->wake_fd = eventfd(0, EFD_NONBLOCK);
+    rt->scratch = malloc(REACTOR_STREAM_PIECE);
+    if (rt->epfd == -1 || rt->wake_fd == -1 || rt->scratch == NULL) {
+      perror("Could not create reactor");
+      return FAILED;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->wake_fd, &ev)) {
+      perror("Could not create reactor");
+      return FAILED;
+    }
+  }
+
+  // Only publish the threads once every one of them can receive commands.
+  thread_count = num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&threads[i].thread, NULL, reactor_loop, &threads[i]);
+  }
+
+  return SUCCESS;
+}
+
+// Set the watermarks and overflow policy of every outbound queue.
+int reactor_send_limits(size_t high, size_t low, int policy) {
+  if (high == 0 || low > high || (policy != REACTOR_DROP && policy != REACTOR_DISCONNECT)) {
+    return FAILED;
+  }
+  queue_high = high;
+  queue_low = low;
+  queue_policy = policy;
+  return SUCCESS;
+}
+
+// Stream the payload of every <type> message instead of buffering it.
+void reactor_stream(message_type_t type, reactor_stream_t *stream) {
+  streams[type] = stream;
+}
+
+// Hand a connected socket to its reactor thread.
+int reactor_add(int fd) {
+  send_queue_t *q = create_queue(fd);
+  if (q == NULL || set_nonblocking(fd) != SUCCESS) {
+    return FAILED;
+  }
+  // Open the queue right away so the caller can send before the reactor thread picks the socket up.
+  pthread_mutex_lock(&q->lock);
+  q->open = true;
+  uint32_t generation = ++q->generation;
+  pthread_mutex_unlock(&q->lock);
+
+  if (post(CMD_ADD, fd, NULL, generation) != SUCCESS) {
+    pthread_mutex_lock(&q->lock);
+    clear_queue(q);
+    pthread_mutex_unlock(&q->lock);
+    return FAILED;
+  }
+  return SUCCESS;
+}
+
+// Watch a listening socket.
+int reactor_add_listener(int fd, reactor_accept_t on_accept) {
+  if (on_accept == NULL || set_nonblocking(fd) != SUCCESS) {
+    return FAILED;
+  }
+  return post(CMD_ADD, fd, on_accept, 0);
+}
+
+// Stop watching <fd> and close it.
+int reactor_remove(int fd) {
+  return post(CMD_REMOVE, fd, NULL, 0);
+}
+
+// Queue a message for <fd> without blocking.
+int reactor_send(int fd, message_info_t *info, const void *data) {
+  send_queue_t *q = find_queue(fd);
+  if (q == NULL) {
+    return FAILED;
+  }
+
+  pthread_mutex_lock(&q->lock);
+  if (!q->open) {
+    pthread_mutex_unlock(&q->lock);
+    return FAILED;
+  }
+  if (q->congested) {
+    if (queue_policy == REACTOR_DISCONNECT) {
+      // Refuse everything until the reactor thread closes it. The fd may be reused by then.
+      uint32_t generation = q->generation;
+      clear_queue(q);
+      pthread_mutex_unlock(&q->lock);
+      add_stat(&send_stats.disconnects, 1);
+      post(CMD_REMOVE, fd, NULL, generation);
+    } else {
+      pthread_mutex_unlock(&q->lock);
+      add_stat(&send_stats.drops, 1);
+    }
+    return FAILED;
+  }
+
+  out_msg_t *m = malloc(sizeof(out_msg_t) + MESSAGE_HEADER_SIZE + info->size);
+  if (m == NULL) {
+    pthread_mutex_unlock(&q->lock);
+    return FAILED;
+  }
+  m->next = NULL;
+  m->len = MESSAGE_HEADER_SIZE + info->size;
+  m->sent = 0;
+  encode_message_info(info, m->bytes);
+  if (info->size > 0) {
+    memcpy(m->bytes + MESSAGE_HEADER_SIZE, data, info->size);
+  }
+
+  if (q->tail != NULL) {
+    q->tail->next = m;
+  } else {
+    q->head = m;
+  }
+  q->tail = m;
+  q->bytes += m->len;
+  add_stat(&send_stats.queued, m->len);
+
+  int rc = SUCCESS;
+  // Nothing is waiting ahead of this message, so try to write it right away.
+  if (!q->want_write) {
+    if (flush_queue(fd, q) != SUCCESS) {
+      uint32_t generation = q->generation;
+      clear_queue(q);
+      pthread_mutex_unlock(&q->lock);
+      post(CMD_REMOVE, fd, NULL, generation);
+      return FAILED;
+    }
+    if (q->head != NULL) {
+      q->want_write = true;
+      add_stat(&send_stats.deferred, 1);
+      rc = post(CMD_WRITE, fd, NULL, q->generation);
+    }
+  } else {
+    add_stat(&send_stats.deferred, 1);
+  }
+  if (q->head != NULL && q->bytes >= queue_high) {
+    q->congested = true;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return rc;
+}
+
+// Get the outbound queue counters.
+reactor_send_stats_t reactor_send_stats() {
+  pthread_mutex_lock(&stats_lock);
+  reactor_send_stats_t s = send_stats;
+  pthread_mutex_unlock(&stats_lock);
+  return s;
+}
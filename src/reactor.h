@@ -0,0 +1,93 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include "message.h"
+
+// The default number of reactor threads. Every socket is owned by exactly one of them.
+#define REACTOR_THREADS 2
+
+// The largest message the reactor will buffer before dropping the connection.
+// Large payloads (chunk data) are streamed instead, see reactor_stream.
+#define REACTOR_MAX_MESSAGE (16 << 20)
+
+// The most bytes of a streamed payload read by a single call.
+#define REACTOR_STREAM_PIECE (64 * 1024)
+
+// Default watermarks of each connection's outbound queue, in bytes.
+// Once a queue holds REACTOR_QUEUE_HIGH bytes the overflow policy applies until it drains to REACTOR_QUEUE_LOW.
+#define REACTOR_QUEUE_HIGH (4 << 20)
+#define REACTOR_QUEUE_LOW (1 << 20)
+
+// Overflow policies for a connection whose outbound queue is over its high watermark.
+// Drop new messages until the queue drains.
+#define REACTOR_DROP 0
+// Close the connection.
+#define REACTOR_DISCONNECT 1
+
+// Counters describing the outbound queues.
+typedef struct {
+  // Bytes waiting in every queue right now.
+  size_t queued;
+  // Messages which could not be written right away and waited for the socket to drain.
+  size_t deferred;
+  // Messages dropped by REACTOR_DROP.
+  size_t drops;
+  // Connections closed by REACTOR_DISCONNECT.
+  size_t disconnects;
+} reactor_send_stats_t;
+
+// Called from a reactor thread for every complete message read from <fd>.
+// <data> is only valid until the handler returns.
+typedef void (*reactor_handler_t)(int fd, message_info_t *info, void *data);
+
+// Called from a reactor thread when a connection is closed (after the last message).
+typedef void (*reactor_close_t)(int fd);
+
+// Called from a reactor thread for every connection accepted on a listening socket.
+// The new socket is already non-blocking but is NOT watched until passed to reactor_add.
+typedef void (*reactor_accept_t)(int listen_fd, int client_fd);
+
+// Streams a message's payload into memory chosen by the handler instead of buffering it.
+// All callbacks run on the reactor thread owning the connection.
+typedef struct {
+  // The number of payload bytes buffered and passed to begin before streaming starts.
+  size_t prefix_size;
+  // Called once the prefix has arrived. Returns a context for the rest of the payload, or NULL to discard it
+  // (in which case next and end are not called).
+  void *(*begin)(int fd, message_info_t *info, void *prefix);
+  // Returns where the next (at most) *len bytes of payload, starting <offset> bytes after the prefix,
+  // should be read to. May lower *len. Returns NULL to discard them.
+  void *(*next)(void *ctx, size_t offset, size_t *len);
+  // Called when the payload is complete, or with <complete> false if the connection closed first.
+  void (*end)(void *ctx, bool complete);
+} reactor_stream_t;
+
+// Set the watermarks and overflow policy of every outbound queue. Must be called before reactor_start.
+// Returns FAILED if <high> is 0, <low> is above <high> or the policy is unknown, and SUCCESS on success.
+int reactor_send_limits(size_t high, size_t low, int policy);
+
+// Stream the payload of every <type> message with <stream>. Must be called before reactor_start.
+void reactor_stream(message_type_t type, reactor_stream_t *stream);
+
+// Start <num_threads> reactor threads.
+// Returns FAILED if failed and SUCCESS on success.
+int reactor_start(int num_threads, reactor_handler_t handler, reactor_close_t on_close);
+
+// Make <fd> non-blocking and hand it to a reactor thread, which reads messages from it
+// until the connection closes. The reactor closes the socket.
+int reactor_add(int fd);
+
+// Watch a listening socket. <on_accept> is called for every new connection.
+int reactor_add_listener(int fd, reactor_accept_t on_accept);
+
+// Stop watching <fd> and close it. Meant for sockets the caller is done with (e.g. listeners).
+int reactor_remove(int fd);
+
+// Queue a message for <fd>, which must have been passed to reactor_add. Never blocks: whatever the socket
+// cannot take right away is written by the owning reactor thread once it drains.
+// Messages to the same socket are never interleaved, whichever threads send them.
+// Returns FAILED if the connection is closed or the message was refused by the overflow policy, and SUCCESS on success.
+int reactor_send(int fd, message_info_t *info, const void *data);
+
+// Get the outbound queue counters.
+reactor_send_stats_t reactor_send_stats();
@@ -0,0 +1,637 @@
+#include "sched.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "message.h"
+
+// The most holders of a chunk looked at when picking who to ask.
+#define SCHED_MAX_HOLDERS 32
+
+// A chunk which may be requested, how many peers advertised it, and whether some of it was requested already.
+typedef struct {
+  uint32_t chunk;
+  int holders;
+  bool started;
+} candidate_t;
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Rarest first, and chunks already started before others as rare. Chunks nobody advertised go last, they are
+// flooded anyway.
+static int compare_rarity(const void *a, const void *b) {
+  const candidate_t *x = a;
+  const candidate_t *y = b;
+  if ((x->holders == 0) != (y->holders == 0)) {
+    return x->holders == 0 ? 1 : -1;
+  }
+  if (x->holders != y->holders) {
+    return x->holders < y->holders ? -1 : 1;
+  }
+  if (x->started != y->started) {
+    return x->started ? -1 : 1;
+  }
+  return x->chunk < y->chunk ? -1 : x->chunk > y->chunk;
+}
+
+// Requires the lock.
+static sched_download_t *find_download(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH]) {
+  for (sched_download_t *d = sched->downloads; d != NULL; d = d->next) {
+    if (memcmp(d->hash, hash, MD5_DIGEST_LENGTH) == 0) {
+      return d;
+    }
+  }
+  return NULL;
+}
+
+// The size of <chunk> in bytes. The last chunk takes the remainder of the file.
+static uint64_t chunk_length(const sched_download_t *d, uint32_t chunk) {
+  if (chunk + 1 < d->count) {
+    return d->chunk_size;
+  }
+  return d->size - (uint64_t)d->chunk_size * (d->count - 1);
+}
+
+// The number of blocks <chunk> is split into, at least one.
+static uint32_t block_count(const sched_t *sched, const sched_download_t *d, uint32_t chunk) {
+  uint64_t length = chunk_length(d, chunk);
+  return length == 0 ? 1 : (uint32_t)((length + sched->block_size - 1) / sched->block_size);
+}
+
+// Sets <first> and <end> to the blocks of <chunk> wholly covered by <size> bytes at <offset>.
+static void covered_blocks(const sched_t *sched, const sched_download_t *d, uint32_t chunk, uint32_t offset,
+                           uint32_t size, uint32_t *first, uint32_t *end) {
+  uint64_t stop = (uint64_t)offset + size;
+  *first = (uint32_t)(((uint64_t)offset + sched->block_size - 1) / sched->block_size);
+  *end = stop >= chunk_length(d, chunk) ? block_count(sched, d, chunk) : (uint32_t)(stop / sched->block_size);
+}
+
+// The blocks of <chunk>, allocated on first use. Returns NULL if the allocation failed. Requires the lock.
+static sched_block_t *chunk_blocks(const sched_t *sched, sched_download_t *d, uint32_t chunk) {
+  sched_chunk_t *c = &d->chunks[chunk];
+  if (c->blocks == NULL) {
+    uint32_t count = block_count(sched, d, chunk);
+    c->blocks = calloc(count, sizeof(sched_block_t));
+    for (uint32_t i = 0; c->blocks != NULL && i < count; i++) {
+      c->blocks[i].peers[0] = SCHED_FLOOD;
+    }
+  }
+  return c->blocks;
+}
+
+// The number of requests in flight to <peer>. Requires the lock.
+static int load_of(sched_t *sched, int peer) {
+  return peer >= 0 && peer < sched->peer_load_size ? sched->peer_load[peer] : 0;
+}
+
+// Add <delta> to the requests in flight to <peer>. Requires the lock.
+static int add_load(sched_t *sched, int peer, int delta) {
+  if (peer < 0) {
+    return SUCCESS;
+  }
+  if (peer >= sched->peer_load_size) {
+    int size = sched->peer_load_size > 0 ? sched->peer_load_size : 64;
+    while (size <= peer) {
+      size *= 2;
+    }
+    int *load = realloc(sched->peer_load, size * sizeof(int));
+    if (load == NULL) {
+      return FAILED;
+    }
+    memset(load + sched->peer_load_size, 0, (size - sched->peer_load_size) * sizeof(int));
+    sched->peer_load = load;
+    sched->peer_load_size = size;
+  }
+  sched->peer_load[peer] += delta;
+  return SUCCESS;
+}
+
+// Mark block <b> of <c> as requested from <peer>, whose load is already counted. Requires the lock.
+static void request_block(sched_t *sched, sched_chunk_t *c, sched_block_t *b, int peer, long now) {
+  b->state = BLOCK_IN_FLIGHT;
+  b->copies = 1;
+  b->peers[0] = peer;
+  b->deadline = now + sched->timeout_ms;
+  b->requested = now;
+  b->probe = peer >= 0 && load_of(sched, peer) == 1;
+  c->in_flight++;
+  sched->stats.in_flight++;
+}
+
+// The requests for block <b> of <c> are over, whether they were answered or not. Requires the lock.
+static void release(sched_t *sched, sched_chunk_t *c, sched_block_t *b) {
+  if (b->state == BLOCK_IN_FLIGHT) {
+    b->state = BLOCK_MISSING;
+    for (int i = 0; i < b->copies; i++) {
+      add_load(sched, b->peers[i], -1);
+    }
+    b->copies = 1;
+    c->in_flight--;
+    sched->stats.in_flight--;
+  }
+}
+
+// Whether <peer> was asked for block <b> already.
+static bool asked(const sched_block_t *b, int peer) {
+  for (int i = 0; b != NULL && b->state == BLOCK_IN_FLIGHT && i < b->copies; i++) {
+    if (b->peers[i] == peer) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Give up on the copy of block <b> of <c> requested from <peer>. The copies requested from other peers stay in
+// flight, and the block is only released if there are none. Requires the lock.
+static void drop_copy(sched_t *sched, sched_chunk_t *c, sched_block_t *b, int peer) {
+  if (!asked(b, peer)) {
+    return;
+  }
+  if (b->copies == 1) {
+    release(sched, c, b);
+    return;
+  }
+  // the other peers asked may still answer
+  int k = 0;
+  while (b->peers[k] != peer) {
+    k++;
+  }
+  memmove(&b->peers[k], &b->peers[k + 1], (b->copies - k - 1) * sizeof(int));
+  b->copies--;
+  add_load(sched, peer, -1);
+}
+
+// Give up on every block of <c> in flight. Requires the lock.
+static void release_chunk(sched_t *sched, sched_chunk_t *c, uint32_t count) {
+  for (uint32_t i = 0; c->blocks != NULL && c->in_flight > 0 && i < count; i++) {
+    release(sched, c, &c->blocks[i]);
+  }
+}
+
+// Choose the holder with room in its pipeline expected to deliver a block first, which was not asked for <block> yet
+// (if given). The peer which let the last request time out, and peers failing too often, are avoided unless
+// they are the only ones left. Returns -1 if there is none. Requires the lock.
+static int pick_holder(sched_t *sched, const int *holders, int count, int avoid, const sched_block_t *block) {
+  int best = -1;
+  double best_cost = 0;
+  for (int pass = 0; pass < 2 && best == -1; pass++) {
+    for (int i = 0; i < count; i++) {
+      int load = load_of(sched, holders[i]);
+      if ((pass == 0 && (holders[i] == avoid || score_flaky(&sched->scores, holders[i]))) || load >= sched->depth ||
+          asked(block, holders[i])) {
+        continue;
+      }
+      double cost = score_cost(&sched->scores, holders[i], load, sched->block_size);
+      if (best == -1 || cost < best_cost) {
+        best = holders[i];
+        best_cost = cost;
+      }
+    }
+  }
+  return best;
+}
+
+// Create a scheduler.
+void init_sched(sched_t *sched, uint32_t block_size, long timeout_ms, int depth, uint32_t endgame_blocks) {
+  memset(sched, 0, sizeof(*sched));
+  pthread_mutex_init(&sched->lock, NULL);
+  init_scores(&sched->scores);
+  sched->block_size = block_size;
+  sched->timeout_ms = timeout_ms;
+  sched->depth = depth;
+  sched->endgame_blocks = endgame_blocks;
+}
+
+// Start scheduling a download.
+int sched_add(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint64_t size, uint32_t chunk_size,
+              uint32_t count, const uint8_t *done) {
+  sched_download_t *d = calloc(1, sizeof(sched_download_t));
+  sched_chunk_t *chunks = calloc(count > 0 ? count : 1, sizeof(sched_chunk_t));
+  if (d == NULL || chunks == NULL) {
+    free(d);
+    free(chunks);
+    return FAILED;
+  }
+  memcpy(d->hash, hash, MD5_DIGEST_LENGTH);
+  d->size = size;
+  d->chunk_size = chunk_size;
+  d->count = count;
+  d->chunks = chunks;
+  for (uint32_t i = 0; i < count; i++) {
+    chunks[i].avoid = SCHED_FLOOD;
+    chunks[i].source = SCHED_FLOOD;
+    chunks[i].done = (done[i / 8] >> (7 - i % 8)) & 0x01;
+    if (!chunks[i].done) {
+      d->remaining++;
+      d->outstanding += block_count(sched, d, i);
+    }
+  }
+
+  pthread_mutex_lock(&sched->lock);
+  if (find_download(sched, hash) != NULL) {
+    pthread_mutex_unlock(&sched->lock);
+    free(chunks);
+    free(d);
+    return FAILED;
+  }
+  d->next = sched->downloads;
+  sched->downloads = d;
+  sched->stats.active++;
+  pthread_mutex_unlock(&sched->lock);
+  return SUCCESS;
+}
+
+// Stop scheduling a download.
+bool sched_remove(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH]) {
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t **p = &sched->downloads;
+  while (*p != NULL && memcmp((*p)->hash, hash, MD5_DIGEST_LENGTH) != 0) {
+    p = &(*p)->next;
+  }
+  sched_download_t *d = *p;
+  if (d != NULL) {
+    *p = d->next;
+    for (uint32_t i = 0; i < d->count; i++) {
+      release_chunk(sched, &d->chunks[i], block_count(sched, d, i));
+    }
+    sched->stats.active--;
+  }
+  pthread_mutex_unlock(&sched->lock);
+
+  if (d == NULL) {
+    return false;
+  }
+  for (uint32_t i = 0; i < d->count; i++) {
+    free(d->chunks[i].blocks);
+  }
+  free(d->chunks);
+  free(d);
+  return true;
+}
+
+// Pick up to <max> requests to send now, rarest chunks first.
+int sched_next(sched_t *sched, avail_t *avail, const unsigned char hash[MD5_DIGEST_LENGTH], bool timer,
+               sched_request_t *requests, int max, long *wait_ms) {
+  *wait_ms = -1;
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d == NULL) {
+    pthread_mutex_unlock(&sched->lock);
+    return FAILED;
+  }
+  if (timer) {
+    d->timer_armed = false;
+  }
+
+  // Give up on the blocks which took too long. Their chunks are candidates again.
+  long now = now_ms();
+  candidate_t *candidates = malloc(d->count * sizeof(candidate_t));
+  int count = 0;
+  for (uint32_t i = 0; candidates != NULL && i < d->count; i++) {
+    sched_chunk_t *c = &d->chunks[i];
+    uint32_t blocks = block_count(sched, d, i);
+    for (uint32_t b = 0; c->in_flight > 0 && b < blocks; b++) {
+      if (c->blocks[b].state == BLOCK_IN_FLIGHT && now >= c->blocks[b].deadline) {
+        c->avoid = c->blocks[b].peers[0];
+        for (int k = 0; k < c->blocks[b].copies; k++) {
+          score_failed(&sched->scores, c->blocks[b].peers[k]);
+        }
+        release(sched, c, &c->blocks[b]);
+        sched->stats.timeouts++;
+      }
+    }
+    if (!c->done && c->received + c->in_flight < blocks) {
+      int holders[SCHED_MAX_HOLDERS];
+      candidates[count++] = (candidate_t){.chunk = i,
+                                          .holders = avail_holders(avail, hash, i, holders, SCHED_MAX_HOLDERS),
+                                          .started = c->received + c->in_flight > 0};
+    }
+  }
+  qsort(candidates, count, sizeof(candidate_t), compare_rarity);
+
+  int picked = 0;
+  bool capped = false;
+  for (int i = 0; i < count && picked < max; i++) {
+    uint32_t chunk = candidates[i].chunk;
+    sched_chunk_t *c = &d->chunks[chunk];
+    sched_block_t *blocks = chunk_blocks(sched, d, chunk);
+    if (blocks == NULL) {
+      continue;
+    }
+    uint32_t block_total = block_count(sched, d, chunk);
+    uint64_t length = chunk_length(d, chunk);
+
+    // Nobody advertised the chunk. Flood one request for the first run of missing blocks.
+    if (candidates[i].holders == 0) {
+      uint32_t first = 0;
+      while (blocks[first].state != BLOCK_MISSING) {
+        first++;
+      }
+      uint32_t end = first;
+      while (end < block_total && blocks[end].state == BLOCK_MISSING) {
+        request_block(sched, c, &blocks[end++], SCHED_FLOOD, now);
+      }
+      uint64_t start = (uint64_t)first * sched->block_size;
+      uint64_t stop = (uint64_t)end * sched->block_size;
+      sched->stats.flooded++;
+      requests[picked++] = (sched_request_t){.chunk = chunk,
+                                             .offset = (uint32_t)start,
+                                             .size = (uint32_t)((stop < length ? stop : length) - start),
+                                             .peer = SCHED_FLOOD};
+      continue;
+    }
+
+    // Spread the missing blocks over the holders, least loaded first.
+    int holders[SCHED_MAX_HOLDERS];
+    int found = avail_holders(avail, hash, chunk, holders, SCHED_MAX_HOLDERS);
+    for (uint32_t b = 0; b < block_total && picked < max; b++) {
+      if (blocks[b].state != BLOCK_MISSING) {
+        continue;
+      }
+      int peer = pick_holder(sched, holders, found, c->avoid, NULL);
+      if (peer == -1) {
+        capped = true;
+        break;
+      }
+      if (add_load(sched, peer, 1) != SUCCESS) {
+        break;
+      }
+      request_block(sched, c, &blocks[b], peer, now);
+      sched->stats.targeted++;
+      uint64_t start = (uint64_t)b * sched->block_size;
+      uint64_t size = length - start < sched->block_size ? length - start : sched->block_size;
+      requests[picked++] =
+          (sched_request_t){.chunk = chunk, .offset = (uint32_t)start, .size = (uint32_t)size, .peer = peer};
+    }
+  }
+  free(candidates);
+
+  // The endgame, once every block outstanding is in flight. Ask more holders for them.
+  bool endgame = d->outstanding <= sched->endgame_blocks;
+  uint64_t in_flight = 0;
+  for (uint32_t i = 0; endgame && i < d->count; i++) {
+    in_flight += d->chunks[i].in_flight;
+  }
+  for (uint32_t i = 0; endgame && in_flight == d->outstanding && i < d->count && picked < max; i++) {
+    sched_chunk_t *c = &d->chunks[i];
+    if (c->in_flight == 0) {
+      continue;
+    }
+    int holders[SCHED_MAX_HOLDERS];
+    int found = avail_holders(avail, hash, i, holders, SCHED_MAX_HOLDERS);
+    uint32_t blocks = block_count(sched, d, i);
+    uint64_t length = chunk_length(d, i);
+    for (uint32_t b = 0; b < blocks && picked < max; b++) {
+      sched_block_t *block = &c->blocks[b];
+      // flooded blocks went to everyone already
+      if (block->state != BLOCK_IN_FLIGHT || block->peers[0] == SCHED_FLOOD || block->copies >= SCHED_MAX_COPIES) {
+        continue;
+      }
+      int peer = pick_holder(sched, holders, found, c->avoid, block);
+      if (peer == -1 || add_load(sched, peer, 1) != SUCCESS) {
+        continue;
+      }
+      // copies were requested later than the block's time says, so they are not measured
+      block->peers[block->copies++] = peer;
+      block->probe = false;
+      sched->stats.endgame++;
+      uint64_t start = (uint64_t)b * sched->block_size;
+      uint64_t size = length - start < sched->block_size ? length - start : sched->block_size;
+      requests[picked++] =
+          (sched_request_t){.chunk = i, .offset = (uint32_t)start, .size = (uint32_t)size, .peer = peer};
+    }
+  }
+  if (capped) {
+    sched->stats.capped++;
+  }
+
+  // Run again when the first block in flight times out, or soon if holders were too busy to ask.
+  long due = capped ? now + sched->timeout_ms / 4 : -1;
+  for (uint32_t i = 0; i < d->count; i++) {
+    sched_chunk_t *c = &d->chunks[i];
+    uint32_t blocks = block_count(sched, d, i);
+    for (uint32_t b = 0; c->in_flight > 0 && b < blocks; b++) {
+      if (c->blocks[b].state == BLOCK_IN_FLIGHT && (due == -1 || c->blocks[b].deadline < due)) {
+        due = c->blocks[b].deadline;
+      }
+    }
+  }
+  if (due != -1 && !d->timer_armed) {
+    d->timer_armed = true;
+    *wait_ms = due > now ? due - now : 0;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return picked;
+}
+
+// Returns whether any block in a range is still wanted.
+bool sched_wanted(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                  uint32_t size) {
+  bool wanted = false;
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d != NULL && chunk < d->count && !d->chunks[chunk].done) {
+    sched_block_t *blocks = d->chunks[chunk].blocks;
+    uint32_t first, end;
+    covered_blocks(sched, d, chunk, offset, size, &first, &end);
+    for (uint32_t b = first; b < end && !wanted; b++) {
+      wanted = blocks == NULL || blocks[b].state != BLOCK_RECEIVED;
+    }
+  }
+  if (!wanted) {
+    sched->stats.duplicate_bytes += size;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return wanted;
+}
+
+// Record that a range of a chunk arrived, or broke off.
+int sched_arrived(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                  uint32_t size, int peer, bool complete, sched_request_t *cancels, int *cancelled) {
+  if (cancelled != NULL) {
+    *cancelled = 0;
+  }
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d == NULL || chunk >= d->count) {
+    pthread_mutex_unlock(&sched->lock);
+    return FAILED;
+  }
+  sched_chunk_t *c = &d->chunks[chunk];
+  sched_block_t *blocks = c->done ? NULL : chunk_blocks(sched, d, chunk);
+  uint32_t first, end;
+  covered_blocks(sched, d, chunk, offset, size, &first, &end);
+  bool added = false;
+  long now = now_ms();
+  uint64_t length = chunk_length(d, chunk);
+  for (uint32_t b = first; blocks != NULL && b < end; b++) {
+    // only the copy which broke off is given up on, the others may still arrive
+    if (!complete) {
+      drop_copy(sched, c, &blocks[b], peer);
+      continue;
+    }
+    if (blocks[b].state == BLOCK_RECEIVED) {
+      release(sched, c, &blocks[b]);
+      continue;
+    }
+    int from = peer;
+    uint64_t start = (uint64_t)b * sched->block_size;
+    size_t bytes = length - start < sched->block_size ? length - start : sched->block_size;
+    if (blocks[b].state == BLOCK_IN_FLIGHT && blocks[b].copies == 1 && blocks[b].peers[0] == peer) {
+      score_delivered(&sched->scores, from, bytes, blocks[b].requested, now);
+    }
+    // the other copies still coming are cancelled, so their peers need not send them
+    for (int i = 0; cancels != NULL && blocks[b].state == BLOCK_IN_FLIGHT && i < blocks[b].copies; i++) {
+      if (blocks[b].peers[i] != peer && blocks[b].peers[i] != SCHED_FLOOD && *cancelled < SCHED_MAX_CANCELS) {
+        cancels[(*cancelled)++] = (sched_request_t){
+            .chunk = chunk, .offset = (uint32_t)start, .size = (uint32_t)bytes, .peer = blocks[b].peers[i]};
+      }
+    }
+    release(sched, c, &blocks[b]);
+    blocks[b].state = BLOCK_RECEIVED;
+    d->outstanding--;
+    added = true;
+    if (c->received++ == 0) {
+      c->source = from;
+    } else if (from != c->source && !c->multi_source) {
+      c->multi_source = true;
+      sched->stats.multi_source++;
+    }
+    sched->stats.blocks++;
+  }
+  int verify = added && c->received == block_count(sched, d, chunk);
+  pthread_mutex_unlock(&sched->lock);
+  return verify;
+}
+
+// Take back a request picked by sched_next which was not sent.
+int sched_withdraw(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], const sched_request_t *request) {
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d == NULL || request->chunk >= d->count) {
+    pthread_mutex_unlock(&sched->lock);
+    return FAILED;
+  }
+  sched_chunk_t *c = &d->chunks[request->chunk];
+  sched_block_t *blocks = c->done ? NULL : chunk_blocks(sched, d, request->chunk);
+  uint32_t first, end;
+  covered_blocks(sched, d, request->chunk, request->offset, request->size, &first, &end);
+  for (uint32_t b = first; blocks != NULL && b < end; b++) {
+    drop_copy(sched, c, &blocks[b], request->peer);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return SUCCESS;
+}
+
+// Record that a chunk of a download was verified.
+int sched_done(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk) {
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d == NULL || chunk >= d->count) {
+    pthread_mutex_unlock(&sched->lock);
+    return FAILED;
+  }
+  sched_chunk_t *c = &d->chunks[chunk];
+  release_chunk(sched, c, block_count(sched, d, chunk));
+  free(c->blocks);
+  c->blocks = NULL;
+  if (!c->done) {
+    c->done = true;
+    d->remaining--;
+  }
+  int remaining = (int)d->remaining;
+  pthread_mutex_unlock(&sched->lock);
+  return remaining;
+}
+
+// Record that a chunk did not match its hash.
+void sched_corrupt(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk) {
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d != NULL && chunk < d->count && !d->chunks[chunk].done && d->chunks[chunk].blocks != NULL) {
+    sched_chunk_t *c = &d->chunks[chunk];
+    uint32_t blocks = block_count(sched, d, chunk);
+    release_chunk(sched, c, blocks);
+    for (uint32_t b = 0; b < blocks; b++) {
+      c->blocks[b].state = BLOCK_MISSING;
+    }
+    // the first source is as good a suspect as any
+    score_failed(&sched->scores, c->source);
+    c->avoid = c->source;
+    c->source = SCHED_FLOOD;
+    c->multi_source = false;
+    d->outstanding += c->received;
+    c->received = 0;
+    sched->stats.corrupt++;
+  }
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Record that bytes of some requested blocks arrived.
+bool sched_touch(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                 uint32_t size, size_t piece) {
+  bool wanted = false;
+  pthread_mutex_lock(&sched->lock);
+  sched_download_t *d = find_download(sched, hash);
+  if (d != NULL && chunk < d->count && !d->chunks[chunk].done) {
+    sched_block_t *blocks = d->chunks[chunk].blocks;
+    long now = now_ms();
+    uint32_t first, end;
+    covered_blocks(sched, d, chunk, offset, size, &first, &end);
+    for (uint32_t b = first; b < end; b++) {
+      if (blocks == NULL || blocks[b].state != BLOCK_RECEIVED) {
+        wanted = true;
+      }
+      if (blocks != NULL && blocks[b].state == BLOCK_IN_FLIGHT) {
+        blocks[b].deadline = now + sched->timeout_ms;
+        if (blocks[b].probe) {
+          score_first_byte(&sched->scores, blocks[b].peers[0], now - blocks[b].requested);
+          blocks[b].probe = false;
+        }
+      }
+    }
+  }
+  if (!wanted) {
+    sched->stats.duplicate_bytes += piece;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return wanted;
+}
+
+// Give up on every block in flight to <peer>.
+void sched_remove_peer(sched_t *sched, int peer) {
+  pthread_mutex_lock(&sched->lock);
+  for (sched_download_t *d = sched->downloads; d != NULL; d = d->next) {
+    for (uint32_t i = 0; i < d->count; i++) {
+      sched_chunk_t *c = &d->chunks[i];
+      uint32_t blocks = block_count(sched, d, i);
+      for (uint32_t b = 0; c->in_flight > 0 && b < blocks; b++) {
+        drop_copy(sched, c, &c->blocks[b], peer);
+      }
+    }
+  }
+  score_forget(&sched->scores, peer);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+// Get the scheduler's counters.
+sched_stats_t sched_stats(sched_t *sched) {
+  pthread_mutex_lock(&sched->lock);
+  sched_stats_t s = sched->stats;
+  pthread_mutex_unlock(&sched->lock);
+  return s;
+}
+
+// List the scores of the peers which were measured.
+int sched_scores(sched_t *sched, peer_score_t *scores, int max) {
+  pthread_mutex_lock(&sched->lock);
+  int count = score_list(&sched->scores, scores, max);
+  for (int i = 0; i < count; i++) {
+    scores[i].in_flight = load_of(sched, scores[i].peer);
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return count;
+}
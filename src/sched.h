@@ -0,0 +1,185 @@
+#pragma once
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "avail.h"
+#include "peerscore.h"
+
+// Given as the peer of a request which should be flooded to every peer, because no peer advertised the chunk.
+#define SCHED_FLOOD -1
+
+// A block request the scheduler wants sent: <size> bytes starting <offset> bytes into <chunk>.
+typedef struct {
+  uint32_t chunk;
+  uint32_t offset;
+  uint32_t size;
+  // The peer to ask, or SCHED_FLOOD.
+  int peer;
+} sched_request_t;
+
+// The most peers asked for the same block at once, in the endgame.
+#define SCHED_MAX_COPIES 3
+// The most copies one arrival cancels, for a block of its own.
+#define SCHED_MAX_CANCELS (SCHED_MAX_COPIES - 1)
+
+// Where a block of a chunk stands.
+#define BLOCK_MISSING 0
+#define BLOCK_IN_FLIGHT 1
+#define BLOCK_RECEIVED 2
+
+typedef struct {
+  uint8_t state;
+  // How many peers were asked for the block. More than one only in the endgame.
+  uint8_t copies;
+  // The peers asked, the first one (or SCHED_FLOOD) for the block's original request.
+  int peers[SCHED_MAX_COPIES];
+  // When an in flight request is given up on unless more of the block arrives, in milliseconds of the monotonic clock.
+  long deadline;
+  // When it was requested, and whether its peer had nothing else in flight then, so its first byte measures the RTT.
+  long requested;
+  bool probe;
+} sched_block_t;
+
+// Where a chunk of a download stands. Its blocks are requested on their own, from any holder of the chunk,
+// and the chunk is verified against its hash once every block arrived.
+typedef struct {
+  bool done;
+  uint32_t received;
+  uint32_t in_flight;
+  // The peer which let the last request for the chunk time out. Retries prefer another holder.
+  int avoid;
+  // The peer the first block came from, and whether other blocks came from someone else.
+  int source;
+  bool multi_source;
+  // Allocated when the chunk is first requested, and freed once it is verified. Received blocks are kept
+  // when their peer goes away, so only the rest is asked for again.
+  sched_block_t *blocks;
+} sched_chunk_t;
+
+typedef struct sched_download {
+  unsigned char hash[MD5_DIGEST_LENGTH];
+  uint64_t size;
+  uint32_t chunk_size;
+  uint32_t count;
+  uint32_t remaining;
+  // Blocks not received yet, of every chunk not verified yet.
+  uint64_t outstanding;
+  sched_chunk_t *chunks;
+  // Whether a timer will run the download again, so only one is ever pending.
+  bool timer_armed;
+  struct sched_download *next;
+} sched_download_t;
+
+// Counters describing the scheduler.
+typedef struct {
+  // Downloads in progress.
+  size_t active;
+  // Blocks requested and waiting to arrive right now.
+  size_t in_flight;
+  // Requests handed out, to a single peer and flooded.
+  size_t targeted;
+  size_t flooded;
+  // Blocks given up on because they did not arrive in time.
+  size_t timeouts;
+  // Times blocks were held back because every holder of their chunk had a full pipeline.
+  size_t capped;
+  // Blocks received, chunks whose blocks came from more than one peer, and chunks which failed verification.
+  size_t blocks;
+  size_t multi_source;
+  size_t corrupt;
+  // Extra requests for blocks already in flight, sent in the endgame, and the bytes of copies which arrived
+  // after the block was already in.
+  size_t endgame;
+  size_t duplicate_bytes;
+} sched_stats_t;
+
+// Tracks the block requests of every download, and decides which to send next.
+typedef struct {
+  pthread_mutex_t lock;
+  sched_download_t *downloads;
+  // Blocks in flight per peer, indexed by the peer's socket.
+  int *peer_load;
+  int peer_load_size;
+  uint32_t block_size;
+  long timeout_ms;
+  // The most blocks in flight to one peer.
+  int depth;
+  // Downloads with at most this many blocks outstanding ask several holders for the blocks in flight.
+  uint32_t endgame_blocks;
+  // How every peer served its blocks. Holders which serve them faster are asked first.
+  score_table_t scores;
+  sched_stats_t stats;
+} sched_t;
+
+// Create a scheduler requesting <block_size> byte blocks, giving up on requests which made no progress for
+// <timeout_ms>, and keeping at most <depth> blocks in flight per peer. Once a download has <endgame_blocks> or fewer
+// blocks outstanding, it enters the endgame.
+void init_sched(sched_t *sched, uint32_t block_size, long timeout_ms, int depth, uint32_t endgame_blocks);
+
+// Start scheduling a download of a <size> byte file made of <count> chunks of <chunk_size> bytes, some of which
+// (those in <done>, MSB first) are already verified.
+// Returns FAILED if the file is already being downloaded or failed, and SUCCESS on success.
+int sched_add(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint64_t size, uint32_t chunk_size,
+              uint32_t count, const uint8_t *done);
+
+// Stop scheduling a download. Returns whether it was being scheduled, so only one caller finishes it.
+bool sched_remove(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH]);
+
+// Pick up to <max> requests to send now, rarest chunks first. Blocks of advertised chunks go to the holder expected
+// to deliver them first, given its load and score, so one chunk is fetched from several peers at once. Holders
+// which fail too often are only asked once no other is left. Chunks nobody advertised are flooded,
+// a run of missing blocks per request. Requests which timed out are picked again.
+// In the endgame, when every block left is in flight, they are also asked of up to SCHED_MAX_COPIES holders, so the last blocks do not
+// wait on the slowest peer. The first copy to arrive wins and the others are cancelled.
+// <timer> says whether the caller is the timer armed before. <wait_ms> is set to how long the caller should wait
+// before running again if no block arrives first, or -1 if it should not arm a timer.
+// Returns the number of requests, or FAILED if the file is not being downloaded.
+int sched_next(sched_t *sched, avail_t *avail, const unsigned char hash[MD5_DIGEST_LENGTH], bool timer,
+               sched_request_t *requests, int max, long *wait_ms);
+
+// Returns whether any of the blocks covering <size> bytes at <offset> into <chunk> is still wanted.
+// If not, the bytes are counted as duplicates.
+bool sched_wanted(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                  uint32_t size);
+
+// Record that <size> bytes at <offset> into <chunk> arrived from <peer>, or that its transfer broke off if not
+// <complete>. Blocks which arrived free their slots on every peer they were requested from, which cancels the copies
+// still coming in the endgame. Those the other peers should be told about are written to <cancels> (if not NULL),
+// at most SCHED_MAX_CANCELS, and <cancelled> is set to how many. A transfer which broke off only drops <peer>'s copy,
+// as sched_withdraw does, and blocks left with no copy are requested again.
+// Returns 1 if this was the last block the chunk was missing and it should be verified, 0 if not, or FAILED if
+// the file is not being downloaded.
+int sched_arrived(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                  uint32_t size, int peer, bool complete, sched_request_t *cancels, int *cancelled);
+
+// Take back a request picked by sched_next which will not be sent, e.g. because the download limits held it back.
+// Only the copy for the request's peer is dropped: in the endgame, the copies requested from other peers stay in
+// flight. Blocks left with no copy are picked again.
+// Returns FAILED if the file is not being downloaded, and SUCCESS on success.
+int sched_withdraw(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], const sched_request_t *request);
+
+// Record that a chunk of a download was verified.
+// Returns the number of chunks still missing, or FAILED if the file is not being downloaded.
+int sched_done(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk);
+
+// Record that a chunk did not match its hash once every block arrived. All of it is requested again.
+void sched_corrupt(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk);
+
+// Record that <piece> bytes of the blocks covering <size> bytes at <offset> into <chunk> arrived, which pushes
+// their deadlines back. Blocks are only given up on once they stall.
+// Returns false, and counts the piece as duplicate bytes, if another copy of every one of the blocks arrived first.
+bool sched_touch(sched_t *sched, const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, uint32_t offset,
+                 uint32_t size, size_t piece);
+
+// Give up on every block in flight to <peer>, e.g. once it disconnected. They are picked again right away unless
+// another peer was asked too, and blocks already received from it are kept. Its score is forgotten.
+void sched_remove_peer(sched_t *sched, int peer);
+
+// Get the scheduler's counters.
+sched_stats_t sched_stats(sched_t *sched);
+
+// Write up to <max> scores of peers which served (or failed) blocks to <scores>, with their blocks in flight.
+// Returns how many there are.
+int sched_scores(sched_t *sched, peer_score_t *scores, int max);
@@ -0,0 +1,91 @@
+#include "seen.h"
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+// Spread sequential or otherwise clustered ids over the table.
+static size_t slot_of(uint64_t id, size_t mask) {
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  return id & mask;
+}
+
+// Returns whether <id> is in <table>, and its slot (or the free slot it belongs in) in <slot>.
+static bool lookup(uint64_t *table, size_t capacity, uint64_t id, size_t *slot) {
+  size_t mask = capacity - 1;
+  size_t i = slot_of(id, mask);
+  while (table[i] != 0) {
+    if (table[i] == id) {
+      *slot = i;
+      return true;
+    }
+    i = (i + 1) & mask;
+  }
+  *slot = i;
+  return false;
+}
+
+// Retire the current generation. Requires the lock.
+static void rotate(seen_t *seen, time_t now) {
+  uint64_t *old = seen->previous;
+  seen->previous = seen->current;
+  memset(old, 0, seen->capacity * sizeof(uint64_t));
+  seen->current = old;
+  seen->count = 0;
+  seen->rotated_at = now;
+}
+
+// Create a set remembering up to <capacity> / 2 ids per <window> seconds.
+int init_seen(seen_t *seen, size_t capacity, int window) {
+  size_t cap = 16;
+  while (cap < capacity) {
+    cap <<= 1;
+  }
+  seen->current = calloc(cap, sizeof(uint64_t));
+  seen->previous = calloc(cap, sizeof(uint64_t));
+  if (seen->current == NULL || seen->previous == NULL) {
+    free(seen->current);
+    free(seen->previous);
+    return FAILED;
+  }
+  pthread_mutex_init(&seen->lock, NULL);
+  seen->capacity = cap;
+  seen->count = 0;
+  seen->window = window;
+  seen->rotated_at = time(NULL);
+  return SUCCESS;
+}
+
+// Add <id> to the set. Returns whether it was already there.
+bool seen_before(seen_t *seen, uint64_t id) {
+  if (id == 0) {
+    return false;
+  }
+  pthread_mutex_lock(&seen->lock);
+  time_t now = time(NULL);
+  if (now - seen->rotated_at >= seen->window) {
+    rotate(seen, now);
+  }
+
+  size_t slot;
+  bool found = lookup(seen->current, seen->capacity, id, &slot) ||
+               lookup(seen->previous, seen->capacity, id, &slot);
+  if (!found) {
+    // Keep probes short. A burst of ids only shortens how long they are remembered.
+    if (seen->count >= seen->capacity / 2) {
+      rotate(seen, now);
+    }
+    lookup(seen->current, seen->capacity, id, &slot);
+    seen->current[slot] = id;
+    seen->count++;
+  }
+  pthread_mutex_unlock(&seen->lock);
+  return found;
+}
+
+void free_seen(seen_t *seen) {
+  free(seen->current);
+  free(seen->previous);
+  pthread_mutex_destroy(&seen->lock);
+}
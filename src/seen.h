@@ -0,0 +1,30 @@
+#pragma once
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// A time-bounded set of message ids used to drop messages which were already handled.
+// Ids live in two generations. The current one is rotated out every <window> seconds (or
+// once half full), and dropped on the rotation after that, so an id is remembered for
+// between one and two windows.
+typedef struct {
+  pthread_mutex_t lock;
+  // Slots per generation, a power of two.
+  size_t capacity;
+  size_t count;
+  uint64_t *current;
+  uint64_t *previous;
+  time_t rotated_at;
+  int window;
+} seen_t;
+
+// Create a set remembering up to <capacity> / 2 ids per <window> seconds.
+// Returns FAILED if failed and SUCCESS on success.
+int init_seen(seen_t *seen, size_t capacity, int window);
+
+// Add <id> to the set. Returns whether it was already there. Id 0 is never considered seen.
+bool seen_before(seen_t *seen, uint64_t id);
+
+void free_seen(seen_t *seen);
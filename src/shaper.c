@@ -0,0 +1,172 @@
+#include "shaper.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "message.h"
+
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// The burst of a bucket limited to <rate> bytes per second.
+static double burst_of(double rate) {
+  double burst = rate * SHAPE_BURST_MS / 1000;
+  return burst < SHAPE_MIN_BURST ? SHAPE_MIN_BURST : burst;
+}
+
+// The bucket of <key> in <scope>, created (or taken from the least recently used key) if there is none.
+// Returns NULL if the scope is unlimited. Requires the lock.
+static bucket_t *keyed_bucket(shaper_t *shaper, int scope, const unsigned char key[MD5_DIGEST_LENGTH], long now) {
+  double rate = shaper->limits[scope];
+  if (rate <= 0) {
+    return NULL;
+  }
+  shape_entry_t *entries = shaper->keyed[scope - 1];
+  int *count = &shaper->keyed_count[scope - 1];
+  int oldest = 0;
+  for (int i = 0; i < *count; i++) {
+    if (memcmp(entries[i].key, key, MD5_DIGEST_LENGTH) == 0) {
+      entries[i].used = now;
+      return &entries[i].bucket;
+    }
+    if (entries[i].used < entries[oldest].used) {
+      oldest = i;
+    }
+  }
+
+  shape_entry_t *e;
+  if (*count < SHAPE_MAX_KEYS) {
+    e = &entries[(*count)++];
+  } else {
+    e = &entries[oldest];
+    free_bucket(&e->bucket);
+  }
+  memcpy(e->key, key, MD5_DIGEST_LENGTH);
+  init_bucket(&e->bucket, rate, burst_of(rate));
+  e->used = now;
+  return &e->bucket;
+}
+
+// Collect the buckets a transfer is counted against into <buckets>. Returns how many there are. Requires the lock.
+static int buckets_of(shaper_t *shaper, uint64_t peer, const unsigned char file[MD5_DIGEST_LENGTH],
+                      bucket_t *buckets[SHAPE_SCOPES], long now) {
+  int count = 0;
+  buckets[count++] = &shaper->global;
+  if (peer != SHAPE_NO_PEER) {
+    unsigned char key[MD5_DIGEST_LENGTH] = {0};
+    memcpy(key, &peer, sizeof(peer));
+    bucket_t *b = keyed_bucket(shaper, SHAPE_PEER, key, now);
+    if (b != NULL) {
+      buckets[count++] = b;
+    }
+  }
+  if (file != NULL) {
+    bucket_t *b = keyed_bucket(shaper, SHAPE_FILE, file, now);
+    if (b != NULL) {
+      buckets[count++] = b;
+    }
+  }
+  return count;
+}
+
+// How long until every one of <buckets> has room for <bytes>.
+static long wait_of(bucket_t **buckets, int count, size_t bytes) {
+  long wait = 0;
+  for (int i = 0; i < count; i++) {
+    long w = bucket_wait_ms(buckets[i], bytes);
+    if (w > wait) {
+      wait = w;
+    }
+  }
+  return wait;
+}
+
+// Create a shaper.
+int init_shaper(shaper_t *shaper, double global, double peer, double file) {
+  memset(shaper, 0, sizeof(*shaper));
+  for (int i = 0; i < SHAPE_SCOPES - 1; i++) {
+    shaper->keyed[i] = calloc(SHAPE_MAX_KEYS, sizeof(shape_entry_t));
+    if (shaper->keyed[i] == NULL) {
+      return FAILED;
+    }
+  }
+  pthread_mutex_init(&shaper->lock, NULL);
+  shaper->limits[SHAPE_GLOBAL] = global;
+  shaper->limits[SHAPE_PEER] = peer;
+  shaper->limits[SHAPE_FILE] = file;
+  init_bucket(&shaper->global, global, burst_of(global));
+  shaper->window_start = now_ms();
+  return SUCCESS;
+}
+
+// Change the limit of a scope.
+void shaper_set_limit(shaper_t *shaper, int scope, double rate) {
+  if (scope < 0 || scope >= SHAPE_SCOPES) {
+    return;
+  }
+  if (rate < 0) {
+    rate = 0;
+  }
+  pthread_mutex_lock(&shaper->lock);
+  shaper->limits[scope] = rate;
+  if (scope == SHAPE_GLOBAL) {
+    bucket_set_rate(&shaper->global, rate, burst_of(rate));
+  } else {
+    for (int i = 0; i < shaper->keyed_count[scope - 1]; i++) {
+      bucket_set_rate(&shaper->keyed[scope - 1][i].bucket, rate, burst_of(rate));
+    }
+  }
+  pthread_mutex_unlock(&shaper->lock);
+}
+
+// Ask to move bytes.
+long shaper_admit(shaper_t *shaper, uint64_t peer, const unsigned char file[MD5_DIGEST_LENGTH], size_t bytes) {
+  pthread_mutex_lock(&shaper->lock);
+  long now = now_ms();
+  bucket_t *buckets[SHAPE_SCOPES];
+  int count = buckets_of(shaper, peer, file, buckets, now);
+  long wait = wait_of(buckets, count, bytes);
+  if (wait > 0) {
+    shaper->stats.throttled++;
+    shaper->stats.throttled_ms += wait;
+  } else {
+    // transfers larger than a bucket's burst go once it is full, and leave it in debt
+    for (int i = 0; i < count; i++) {
+      bucket_debit(buckets[i], bytes);
+    }
+    if (now - shaper->window_start >= 1000) {
+      shaper->last_rate = shaper->window_bytes * 1000.0 / (now - shaper->window_start);
+      shaper->window_start = now;
+      shaper->window_bytes = 0;
+    }
+    shaper->window_bytes += bytes;
+    shaper->stats.bytes += bytes;
+  }
+  pthread_mutex_unlock(&shaper->lock);
+  return wait;
+}
+
+// Look how long until bytes could move.
+long shaper_wait_ms(shaper_t *shaper, uint64_t peer, const unsigned char file[MD5_DIGEST_LENGTH], size_t bytes) {
+  pthread_mutex_lock(&shaper->lock);
+  bucket_t *buckets[SHAPE_SCOPES];
+  int count = buckets_of(shaper, peer, file, buckets, now_ms());
+  long wait = wait_of(buckets, count, bytes);
+  pthread_mutex_unlock(&shaper->lock);
+  return wait;
+}
+
+// Get the shaper's counters.
+shaper_stats_t shaper_stats(shaper_t *shaper) {
+  pthread_mutex_lock(&shaper->lock);
+  shaper_stats_t s = shaper->stats;
+  memcpy(s.limits, shaper->limits, sizeof(s.limits));
+  long elapsed = now_ms() - shaper->window_start;
+  // the window is stale when nothing moved for a while
+  s.rate = elapsed >= 1000 ? shaper->window_bytes * 1000.0 / elapsed : shaper->last_rate;
+  pthread_mutex_unlock(&shaper->lock);
+  return s;
+}
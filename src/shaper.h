@@ -0,0 +1,75 @@
+#pragma once
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "ratelimit.h"
+
+// What a limit applies to: every transfer in one direction, the transfers with one peer, or those of one file.
+#define SHAPE_GLOBAL 0
+#define SHAPE_PEER 1
+#define SHAPE_FILE 2
+#define SHAPE_SCOPES 3
+
+// Buckets hold this many milliseconds worth of their rate, and never less than SHAPE_MIN_BURST bytes.
+#define SHAPE_BURST_MS 250
+#define SHAPE_MIN_BURST (64 * 1024)
+
+// The most peers (and files) a shaper keeps buckets for. The least recently used one is dropped for a new one.
+#define SHAPE_MAX_KEYS 256
+
+// Given as the peer of a transfer not tied to a single peer. Only the global and file limits apply to it.
+#define SHAPE_NO_PEER UINT64_MAX
+
+// The bucket of one peer or file.
+typedef struct {
+  unsigned char key[MD5_DIGEST_LENGTH];
+  bucket_t bucket;
+  // When it was last used, in milliseconds of the monotonic clock.
+  long used;
+} shape_entry_t;
+
+// Counters describing a shaper.
+typedef struct {
+  // Bytes let through in total, and per second lately.
+  uint64_t bytes;
+  double rate;
+  // Times a transfer was held back, and how long they were told to wait in total.
+  size_t throttled;
+  uint64_t throttled_ms;
+  // The limits in bytes per second, 0 where unlimited. Indexed by scope.
+  double limits[SHAPE_SCOPES];
+} shaper_stats_t;
+
+// Token bucket limits on the bytes moved in one direction.
+// A transfer goes ahead once the global bucket, its peer's and its file's all have room for it.
+typedef struct {
+  pthread_mutex_t lock;
+  double limits[SHAPE_SCOPES];
+  bucket_t global;
+  // Buckets of peers and of files, created on first use while their limit is set.
+  shape_entry_t *keyed[SHAPE_SCOPES - 1];
+  int keyed_count[SHAPE_SCOPES - 1];
+  // Bytes let through since <window_start>, to measure the current rate.
+  long window_start;
+  uint64_t window_bytes;
+  double last_rate;
+  shaper_stats_t stats;
+} shaper_t;
+
+// Create a shaper with limits in bytes per second, 0 for unlimited.
+// Returns FAILED if failed and SUCCESS on success.
+int init_shaper(shaper_t *shaper, double global, double peer, double file);
+
+// Change the limit of a scope, in bytes per second, 0 for unlimited. Applies to transfers already going.
+void shaper_set_limit(shaper_t *shaper, int scope, double rate);
+
+// Ask to move <bytes> bytes of <file> (or NULL) with <peer>. Returns 0 if they may go now, in which case they are
+// counted against every limit, or how many milliseconds to wait before asking again.
+long shaper_admit(shaper_t *shaper, uint64_t peer, const unsigned char file[MD5_DIGEST_LENGTH], size_t bytes);
+
+// Like shaper_admit, but only looks. Returns how many milliseconds until <bytes> bytes could go, 0 if they can now.
+long shaper_wait_ms(shaper_t *shaper, uint64_t peer, const unsigned char file[MD5_DIGEST_LENGTH], size_t bytes);
+
+// Get the shaper's counters.
+shaper_stats_t shaper_stats(shaper_t *shaper);
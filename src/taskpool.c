@@ -0,0 +1,323 @@
+#include "taskpool.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+#include "message.h"
+
+typedef struct task {
+  task_fn_t fn;
+  void *arg;
+  // When the task is due. Submitted tasks are due right away.
+  struct timespec due;
+  struct task *prev;
+  struct task *next;
+} task_t;
+
+// A worker and its queue. The worker runs its newest task first, thieves take the oldest.
+typedef struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  task_t *head;
+  task_t *tail;
+} worker_t;
+
+static worker_t *workers = NULL;
+static int worker_count = 0;
+static unsigned int next_worker = 0;
+// The index of the worker running on this thread, -1 on every other thread.
+static __thread int self = -1;
+
+// Guards the timers and the sleeping workers. Only taken to sleep, to wake workers and for timers, so queueing and
+// taking tasks does not contend on it.
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond;
+// Tasks sitting in any worker's queue, and the most there ever were. Updated atomically.
+static size_t ready = 0;
+static size_t max_ready = 0;
+// Workers asleep or about to be. Changed under the idle lock, read atomically by threads deciding to wake one.
+static int sleeping = 0;
+// Scheduled tasks which are not due yet, soonest first.
+static task_t *timers = NULL;
+// When the first timer is due, in nanoseconds of the monotonic clock, so workers only take the idle lock for timers
+// once one is due. Written under the idle lock.
+static long long timers_due = LLONG_MAX;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static taskpool_stats_t stats;
+static double total_wait_ms = 0;
+static double total_run_ms = 0;
+
+static struct timespec now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts;
+}
+
+static double elapsed_ms(struct timespec from, struct timespec to) {
+  return (to.tv_sec - from.tv_sec) * 1e3 + (to.tv_nsec - from.tv_nsec) / 1e6;
+}
+
+static long long nanoseconds(struct timespec ts) {
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool before(struct timespec a, struct timespec b) {
+  return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+}
+
+// Record that the first timer changed. Requires the idle lock.
+static void timers_changed_locked() {
+  __atomic_store_n(&timers_due, timers != NULL ? nanoseconds(timers->due) : LLONG_MAX, __ATOMIC_RELEASE);
+}
+
+// Append <t> to a worker's queue. The caller wakes a worker afterwards.
+static void push(worker_t *w, task_t *t) {
+  pthread_mutex_lock(&w->lock);
+  t->next = NULL;
+  t->prev = w->tail;
+  if (w->tail != NULL) {
+    w->tail->next = t;
+  } else {
+    w->head = t;
+  }
+  w->tail = t;
+  pthread_mutex_unlock(&w->lock);
+
+  // Sequentially consistent, like the sleepers' count, so either a worker about to sleep sees the task or
+  // whoever pushed it sees the worker and wakes it.
+  size_t depth = __atomic_add_fetch(&ready, 1, __ATOMIC_SEQ_CST);
+  size_t max = __atomic_load_n(&max_ready, __ATOMIC_RELAXED);
+  while (depth > max && !__atomic_compare_exchange_n(&max_ready, &max, depth, true, __ATOMIC_RELAXED,
+                                                     __ATOMIC_RELAXED)) {
+  }
+}
+
+// Wake a worker for a task just pushed, if any is asleep.
+static void wake() {
+  if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&idle_cond);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+// Take the newest task of our own queue, or else the oldest task of another worker's.
+static task_t *take(int index) {
+  worker_t *w = &workers[index];
+  pthread_mutex_lock(&w->lock);
+  task_t *t = w->tail;
+  if (t != NULL) {
+    w->tail = t->prev;
+    if (w->tail != NULL) {
+      w->tail->next = NULL;
+    } else {
+      w->head = NULL;
+    }
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  for (int i = 1; t == NULL && i < worker_count; i++) {
+    worker_t *victim = &workers[(index + i) % worker_count];
+    pthread_mutex_lock(&victim->lock);
+    t = victim->head;
+    if (t != NULL) {
+      victim->head = t->next;
+      if (victim->head != NULL) {
+        victim->head->prev = NULL;
+      } else {
+        victim->tail = NULL;
+      }
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (t != NULL) {
+      pthread_mutex_lock(&stats_lock);
+      stats.steals++;
+      pthread_mutex_unlock(&stats_lock);
+    }
+  }
+
+  if (t != NULL) {
+    __atomic_sub_fetch(&ready, 1, __ATOMIC_SEQ_CST);
+  }
+  return t;
+}
+
+// Move the timers which are due to our own queue. Requires the idle lock.
+static void release_timers_locked(int index) {
+  struct timespec t_now = now();
+  while (timers != NULL && !before(t_now, timers->due)) {
+    task_t *t = timers;
+    timers = t->next;
+    push(&workers[index], t);
+    pthread_cond_signal(&idle_cond);
+  }
+  timers_changed_locked();
+}
+
+static void run(task_t *t) {
+  struct timespec start = now();
+  t->fn(t->arg);
+  struct timespec end = now();
+
+  double wait_ms = elapsed_ms(t->due, start);
+  pthread_mutex_lock(&stats_lock);
+  stats.completed++;
+  total_wait_ms += wait_ms;
+  total_run_ms += elapsed_ms(start, end);
+  if (wait_ms > stats.max_wait_ms) {
+    stats.max_wait_ms = wait_ms;
+  }
+  pthread_mutex_unlock(&stats_lock);
+  free(t);
+}
+
+static void *worker_loop(void *args) {
+  self = (int)(size_t)args;
+
+  while (true) {
+    if (nanoseconds(now()) >= __atomic_load_n(&timers_due, __ATOMIC_ACQUIRE)) {
+      pthread_mutex_lock(&idle_lock);
+      release_timers_locked(self);
+      pthread_mutex_unlock(&idle_lock);
+    }
+
+    task_t *t = take(self);
+    if (t != NULL) {
+      run(t);
+      continue;
+    }
+
+    // Nothing to do. Sleep until a task is submitted or the next timer is due.
+    pthread_mutex_lock(&idle_lock);
+    __atomic_add_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ready, __ATOMIC_SEQ_CST) == 0) {
+      if (timers != NULL) {
+        pthread_cond_timedwait(&idle_cond, &idle_lock, &timers->due);
+      } else {
+        pthread_cond_wait(&idle_cond, &idle_lock);
+      }
+    }
+    __atomic_sub_fetch(&sleeping, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&idle_lock);
+  }
+
+  return NULL;
+}
+
+// Start <num_threads> worker threads.
+int taskpool_start(int num_threads) {
+  if (num_threads <= 0 || workers != NULL) {
+    return FAILED;
+  }
+  workers = calloc(num_threads, sizeof(worker_t));
+  if (workers == NULL) {
+    return FAILED;
+  }
+
+  // Timers are measured on the monotonic clock, so waits must be too.
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&idle_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+  worker_count = num_threads;
+  stats.threads = num_threads;
+  for (int i = 0; i < num_threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_loop, (void *)(size_t)i)) {
+      return FAILED;
+    }
+  }
+  return SUCCESS;
+}
+
+static task_t *new_task(task_fn_t fn, void *arg) {
+  if (worker_count == 0) {
+    return NULL;
+  }
+  task_t *t = malloc(sizeof(task_t));
+  if (t == NULL) {
+    return NULL;
+  }
+  *t = (task_t){.fn = fn, .arg = arg, .due = now()};
+
+  pthread_mutex_lock(&stats_lock);
+  stats.submitted++;
+  pthread_mutex_unlock(&stats_lock);
+  return t;
+}
+
+// Run <fn>(<arg>) on a worker thread as soon as one is free.
+int taskpool_submit(task_fn_t fn, void *arg) {
+  task_t *t = new_task(fn, arg);
+  if (t == NULL) {
+    return FAILED;
+  }
+  // Workers keep what they submit, other threads spread tasks over every worker.
+  int index = self;
+  if (index == -1) {
+    index = __atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) % worker_count;
+  }
+  push(&workers[index], t);
+  wake();
+  return SUCCESS;
+}
+
+// Run <fn>(<arg>) on a worker thread once <delay_ms> milliseconds have passed.
+int taskpool_schedule(task_fn_t fn, void *arg, long delay_ms) {
+  task_t *t = new_task(fn, arg);
+  if (t == NULL) {
+    return FAILED;
+  }
+  t->due.tv_sec += delay_ms / 1000;
+  t->due.tv_nsec += (delay_ms % 1000) * 1000000;
+  if (t->due.tv_nsec >= 1000000000) {
+    t->due.tv_sec++;
+    t->due.tv_nsec -= 1000000000;
+  }
+
+  pthread_mutex_lock(&idle_lock);
+  task_t **p = &timers;
+  while (*p != NULL && !before(t->due, (*p)->due)) {
+    p = &(*p)->next;
+  }
+  t->next = *p;
+  *p = t;
+  // A sleeping worker may have to wake up sooner than it planned to.
+  if (timers == t) {
+    timers_changed_locked();
+    pthread_cond_signal(&idle_cond);
+  }
+  pthread_mutex_unlock(&idle_lock);
+  return SUCCESS;
+}
+
+// Get the pool's counters.
+taskpool_stats_t taskpool_stats() {
+  size_t depth = __atomic_load_n(&ready, __ATOMIC_RELAXED);
+  size_t max_depth = __atomic_load_n(&max_ready, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&idle_lock);
+  size_t scheduled = 0;
+  for (task_t *t = timers; t != NULL; t = t->next) {
+    scheduled++;
+  }
+  pthread_mutex_unlock(&idle_lock);
+
+  pthread_mutex_lock(&stats_lock);
+  taskpool_stats_t s = stats;
+  if (s.completed > 0) {
+    s.avg_wait_ms = total_wait_ms / s.completed;
+    s.avg_run_ms = total_run_ms / s.completed;
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  s.depth = depth;
+  s.max_depth = max_depth;
+  s.scheduled = scheduled;
+  return s;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include <stddef.h>
+
+// The default number of worker threads.
+#define TASKPOOL_THREADS 4
+
+// A unit of work. Runs on a worker thread and owns <arg>.
+typedef void (*task_fn_t)(void *arg);
+
+// Counters describing the pool.
+typedef struct {
+  // Worker threads.
+  int threads;
+  // Tasks waiting to run right now, and the most there ever were.
+  size_t depth;
+  size_t max_depth;
+  // Scheduled tasks which are not due yet.
+  size_t scheduled;
+  size_t submitted;
+  size_t completed;
+  // Tasks a worker took from another worker's queue.
+  size_t steals;
+  // Time between a task becoming due and starting to run, in milliseconds.
+  double avg_wait_ms;
+  double max_wait_ms;
+  // Time spent running a task, in milliseconds.
+  double avg_run_ms;
+} taskpool_stats_t;
+
+// Start <num_threads> worker threads.
+// Returns FAILED if failed and SUCCESS on success.
+int taskpool_start(int num_threads);
+
+// Run <fn>(<arg>) on a worker thread as soon as one is free.
+// Tasks submitted from a worker run on that worker unless another one is idle and steals them.
+// Returns FAILED if failed and SUCCESS on success.
+int taskpool_submit(task_fn_t fn, void *arg);
+
+// Run <fn>(<arg>) on a worker thread once <delay_ms> milliseconds have passed.
+// Returns FAILED if failed and SUCCESS on success.
+int taskpool_schedule(task_fn_t fn, void *arg, long delay_ms);
+
+// Get the pool's counters.
+taskpool_stats_t taskpool_stats();
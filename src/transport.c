@@ -0,0 +1,144 @@
+#include "transport.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/un.h>
+#include "socket.h"
+
+static pthread_mutex_t transport_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool use_local = true;
+static transport_stats_t stats;
+
+// Addresses looked up before, and whether they are local. Replaced round robin.
+static struct {
+  in_addr_t ip;
+  bool local;
+} cache[TRANSPORT_CACHE];
+static int cache_count = 0;
+static int next_replaced = 0;
+
+// Fill <addr> with the abstract name of the listener for TCP port <port>. Returns the length of the address.
+static socklen_t local_name(unsigned short port, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // abstract names start with a NUL byte and are not NUL terminated
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, TRANSPORT_LOCAL_NAME, port);
+  return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + len);
+}
+
+static void count(size_t *counter) {
+  pthread_mutex_lock(&transport_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&transport_lock);
+}
+
+// Choose whether connections to this host go over AF_UNIX.
+void transport_use_local(bool enabled) {
+  pthread_mutex_lock(&transport_lock);
+  use_local = enabled;
+  pthread_mutex_unlock(&transport_lock);
+}
+
+// Open the AF_UNIX listener for a port.
+int transport_listen_local(unsigned short port, int backlog) {
+  pthread_mutex_lock(&transport_lock);
+  bool enabled = use_local;
+  pthread_mutex_unlock(&transport_lock);
+  if (!enabled) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct sockaddr_un addr;
+  socklen_t addr_len = local_name(port, &addr);
+  if (bind(fd, (struct sockaddr *)&addr, addr_len) || listen(fd, backlog)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Returns whether an address is one of this host's.
+bool transport_is_local(struct in_addr ip) {
+  // the wildcard address reaches this host, like loopback
+  if (ip.s_addr == htonl(INADDR_ANY) || (ntohl(ip.s_addr) >> 24) == 127) {
+    return true;
+  }
+
+  pthread_mutex_lock(&transport_lock);
+  for (int i = 0; i < cache_count; i++) {
+    if (cache[i].ip == ip.s_addr) {
+      bool local = cache[i].local;
+      pthread_mutex_unlock(&transport_lock);
+      return local;
+    }
+  }
+  pthread_mutex_unlock(&transport_lock);
+
+  // only addresses of this host can be bound to
+  bool local = false;
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd != -1) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr = ip, .sin_port = 0};
+    local = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+  }
+
+  pthread_mutex_lock(&transport_lock);
+  int slot = cache_count < TRANSPORT_CACHE ? cache_count++ : next_replaced++ % TRANSPORT_CACHE;
+  cache[slot].ip = ip.s_addr;
+  cache[slot].local = local;
+  pthread_mutex_unlock(&transport_lock);
+  return local;
+}
+
+// Connect to an address over the cheapest transport.
+int transport_connect(struct sockaddr_in addr, socklen_t addr_len) {
+  pthread_mutex_lock(&transport_lock);
+  bool enabled = use_local;
+  pthread_mutex_unlock(&transport_lock);
+
+  if (enabled && transport_is_local(addr.sin_addr)) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1) {
+      struct sockaddr_un local;
+      socklen_t local_len = local_name(ntohs(addr.sin_port), &local);
+      if (connect(fd, (struct sockaddr *)&local, local_len) == 0) {
+        count(&stats.local);
+        return fd;
+      }
+      close(fd);
+    }
+    // e.g. a node built without local listeners, or started with them off
+    count(&stats.fallbacks);
+  }
+
+  int fd = socket_connect_addr(addr, addr_len);
+  if (fd != -1) {
+    count(&stats.tcp);
+  }
+  return fd;
+}
+
+// Connect to a host by name.
+int transport_connect_host(const char *host, unsigned short port) {
+  struct hostent *server = gethostbyname(host);
+  if (server == NULL) {
+    errno = EHOSTDOWN;
+    return -1;
+  }
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+  memcpy(&addr.sin_addr.s_addr, server->h_addr, server->h_length);
+  return transport_connect(addr, sizeof(addr));
+}
+
+// Get the transport counters.
+transport_stats_t transport_stats() {
+  pthread_mutex_lock(&transport_lock);
+  transport_stats_t s = stats;
+  pthread_mutex_unlock(&transport_lock);
+  return s;
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+// Every TCP listener of a node also listens on an abstract AF_UNIX socket named after its port, so nodes on the
+// same host connect without going through the TCP stack. Abstract names live as long as the socket, and are
+// scoped like TCP ports to the network namespace, so the port names one listener on the host either way.
+#define TRANSPORT_LOCAL_NAME "grintorrent-%hu"
+
+// How many addresses are remembered as local or not.
+#define TRANSPORT_CACHE 16
+
+// Counters describing which transport connections went over.
+typedef struct {
+  // Connections made over AF_UNIX and over TCP.
+  size_t local;
+  size_t tcp;
+  // Local addresses which had no AF_UNIX listener, and were connected to over TCP.
+  size_t fallbacks;
+} transport_stats_t;
+
+// Choose whether connections to this host go over AF_UNIX. They do unless turned off.
+void transport_use_local(bool enabled);
+
+// Open an AF_UNIX socket listening for the connections local nodes make to TCP port <port>.
+// Returns the socket, or -1 if failed (e.g. because local connections are turned off).
+int transport_listen_local(unsigned short port, int backlog);
+
+// Returns whether <ip> is an address of this host.
+bool transport_is_local(struct in_addr ip);
+
+// Connect to <addr>, over AF_UNIX if it is on this host and listens there, and over TCP otherwise.
+// Returns the socket or -1 if failed.
+int transport_connect(struct sockaddr_in addr, socklen_t addr_len);
+
+// Like transport_connect, looking up <host> first.
+int transport_connect_host(const char *host, unsigned short port);
+
+// Get the transport counters.
+transport_stats_t transport_stats();
@@ -1,12 +1,28 @@
 #include "ui.h"
 #include "file.h"
 #include "client.h"
+#include "connpool.h"
+#include "reactor.h"
+#include "taskpool.h"
+#include "transport.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <arpa/inet.h>
 
 extern htable_t ht;
+extern request_stats_t request_stats;
+extern gossip_stats_t gossip_stats;
+extern catalog_stats_t catalog_stats;
+extern avail_stats_t avail_stats;
+extern sched_t sched;
+extern shaper_t up_shaper, down_shaper;
+extern upload_queue_t uploads;
+extern discovered_t discovered;
+
+// The most peers :peers lists
+#define UI_MAX_PEERS 64
 
 /**
  * UI callback: list files available on the network
@@ -39,6 +55,203 @@ int ui_list_network_files(char ***files)
     return count;
 }
 
+/**
+ * Shows the counters of one direction's bandwidth limits in the UI
+ * \param name What the direction is called
+ * \param shaper The limits of the direction
+ */
+static void display_shaper(const char *name, shaper_t *shaper)
+{
+    char line[256];
+    shaper_stats_t s = shaper_stats(shaper);
+    snprintf(line, sizeof(line), "%s shaping: %.1f KiB/s, %llu bytes, %zu throttled (%llu ms), limits %.0f/%.0f/%.0f KiB/s",
+             name, s.rate / 1024, (unsigned long long)s.bytes, s.throttled, (unsigned long long)s.throttled_ms,
+             s.limits[SHAPE_GLOBAL] / 1024, s.limits[SHAPE_PEER] / 1024, s.limits[SHAPE_FILE] / 1024);
+    ui_display("stats", line);
+}
+
+/**
+ * Changes a bandwidth limit, given as "<up|down> <global|peer|file> <KiB/s>"
+ * \param args The arguments of the :rate command
+ */
+static void set_rate(const char *args)
+{
+    char direction[8], scope_name[8];
+    double kib;
+    if (sscanf(args, "%7s %7s %lf", direction, scope_name, &kib) != 3 || kib < 0)
+    {
+        ui_display("system", "Usage: :rate <up|down> <global|peer|file> <KiB/s, 0 for unlimited>");
+        return;
+    }
+
+    shaper_t *shaper = strcmp(direction, "up") == 0 ? &up_shaper : strcmp(direction, "down") == 0 ? &down_shaper : NULL;
+    int scope = strcmp(scope_name, "global") == 0 ? SHAPE_GLOBAL
+                : strcmp(scope_name, "peer") == 0 ? SHAPE_PEER
+                : strcmp(scope_name, "file") == 0 ? SHAPE_FILE
+                                                  : -1;
+    if (shaper == NULL || scope == -1)
+    {
+        ui_display("system", "Usage: :rate <up|down> <global|peer|file> <KiB/s, 0 for unlimited>");
+        return;
+    }
+
+    shaper_set_limit(shaper, scope, kib * 1024);
+    char line[128];
+    snprintf(line, sizeof(line), "%s %s limit set to %.0f KiB/s", direction, scope_name, kib);
+    ui_display("system", line);
+}
+
+/**
+ * Shows the node's counters in the UI
+ */
+void ui_display_stats()
+{
+    char line[256];
+
+    pool_stats_t pool = pool_stats();
+    snprintf(line, sizeof(line), "upload connections: %zu open, %zu connects, %zu reuses, %zu closed",
+             pool.open, pool.connects, pool.reuses, pool.closes);
+    ui_display("stats", line);
+
+    reactor_send_stats_t send = reactor_send_stats();
+    snprintf(line, sizeof(line), "peer send queues: %zu bytes queued, %zu deferred, %zu dropped, %zu disconnects",
+             send.queued, send.deferred, send.drops, send.disconnects);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "chunk requests: %zu received, %zu duplicates dropped, %zu expired, %zu forwarded, %zu answered",
+             request_stats.received, request_stats.duplicates, request_stats.expired, request_stats.forwarded,
+             request_stats.answered);
+    ui_display("stats", line);
+    sched_stats_t downloads = sched_stats(&sched);
+    snprintf(line, sizeof(line), "downloads: %zu active, %zu blocks in flight, %zu targeted, %zu flooded, %zu timed out, %zu capped",
+             downloads.active, downloads.in_flight, downloads.targeted, downloads.flooded, downloads.timeouts,
+             downloads.capped);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "blocks: %zu received, %zu chunks from several peers, %zu chunks failed verification",
+             downloads.blocks, downloads.multi_source, downloads.corrupt);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "endgame: %zu extra requests, %zu duplicate bytes", downloads.endgame,
+             downloads.duplicate_bytes);
+    ui_display("stats", line);
+
+    display_shaper("upload", &up_shaper);
+    display_shaper("download", &down_shaper);
+    upload_stats_t queue = upload_stats(&uploads);
+    snprintf(line, sizeof(line), "upload queue: %zu blocks queued for %zu requesters, %zu dropped, %zu cancelled",
+             queue.queued, queue.flows, queue.dropped, queue.cancelled);
+    ui_display("stats", line);
+
+    pthread_mutex_lock(&discovered.lock);
+    int linked = discovered.count;
+    int wanted = discovered.wanted;
+    size_t connects = discovered.connects;
+    size_t failures = discovered.failures;
+    pthread_mutex_unlock(&discovered.lock);
+    if (wanted > 0)
+    {
+        discovery_stats_t found = discovery_stats();
+        snprintf(line, sizeof(line), "discovery: %zu beacons sent, %zu heard, %zu nodes, %d/%d neighbors, %zu connects, %zu failed",
+                 found.sent, found.heard, found.nodes, linked, wanted, connects, failures);
+        ui_display("stats", line);
+    }
+
+    verify_stats_t verified = verify_stats();
+    snprintf(line, sizeof(line), "verification: %zu chunks hashed (%zu bad), %zu whole files (%zu bad), %.1f MiB read",
+             verified.chunks, verified.bad_chunks, verified.files, verified.bad_files, verified.bytes / 1048576.0);
+    ui_display("stats", line);
+
+    transport_stats_t transport = transport_stats();
+    snprintf(line, sizeof(line), "transport: %zu local connects, %zu tcp connects, %zu local fallbacks",
+             transport.local, transport.tcp, transport.fallbacks);
+    ui_display("stats", line);
+
+    codec_stats_t codec = codec_stats();
+    snprintf(line, sizeof(line), "compression sent: %zu blocks, %llu -> %llu bytes (%.2fx), %zu sent as is (%zu unsampled), %.1f ms cpu",
+             codec.packed, (unsigned long long)codec.packed_raw, (unsigned long long)codec.packed_wire,
+             codec.packed_wire > 0 ? (double)codec.packed_raw / codec.packed_wire : 1.0, codec.skipped,
+             codec.unsampled, codec.pack_us / 1000.0);
+    ui_display("stats", line);
+    snprintf(line, sizeof(line), "compression received: %zu blocks, %llu -> %llu bytes (%.2fx), %zu corrupt, %.1f ms cpu",
+             codec.unpacked, (unsigned long long)codec.unpacked_wire, (unsigned long long)codec.unpacked_raw,
+             codec.unpacked_wire > 0 ? (double)codec.unpacked_raw / codec.unpacked_wire : 1.0, codec.corrupt,
+             codec.unpack_us / 1000.0);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "chunk availability: %zu bitfields sent, %zu received, %zu haves sent, %zu received",
+             avail_stats.bitfields_sent, avail_stats.bitfields_received, avail_stats.haves_sent, avail_stats.haves_received);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "tfile gossip: %zu received, %zu redundant, %zu forwarded, %zu hop limited, %zu throttled",
+             gossip_stats.received, gossip_stats.redundant, gossip_stats.forwarded, gossip_stats.hop_limited,
+             gossip_stats.throttled);
+    ui_display("stats", line);
+
+    snprintf(line, sizeof(line), "catalog sync: %zu messages, %zu bytes, %zu tfiles sent",
+             catalog_stats.messages, catalog_stats.bytes, catalog_stats.tfiles);
+    ui_display("stats", line);
+
+    taskpool_stats_t tasks = taskpool_stats();
+    snprintf(line, sizeof(line), "tasks: %d workers, %zu queued (max %zu), %zu scheduled, %zu done, %zu stolen",
+             tasks.threads, tasks.depth, tasks.max_depth, tasks.scheduled, tasks.completed, tasks.steals);
+    ui_display("stats", line);
+    snprintf(line, sizeof(line), "task latency: %.2f ms avg wait, %.2f ms max wait, %.2f ms avg run",
+             tasks.avg_wait_ms, tasks.max_wait_ms, tasks.avg_run_ms);
+    ui_display("stats", line);
+}
+
+/**
+ * Shows how well every peer served the blocks asked of it, best first by throughput
+ */
+void ui_display_peers()
+{
+    peer_score_t scores[UI_MAX_PEERS];
+    int count = sched_scores(&sched, scores, UI_MAX_PEERS);
+    if (count == 0)
+    {
+        ui_display("peers", "No peer served any blocks yet");
+        return;
+    }
+
+    // the list is short, a selection sort is enough
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = i + 1; j < count; j++)
+        {
+            if (scores[j].throughput > scores[i].throughput)
+            {
+                peer_score_t tmp = scores[i];
+                scores[i] = scores[j];
+                scores[j] = tmp;
+            }
+        }
+    }
+
+    char line[256];
+    for (int i = 0; i < count; i++)
+    {
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        char name[INET_ADDRSTRLEN + 8] = "disconnected";
+        int rc = getpeername(scores[i].peer, (struct sockaddr *)&addr, &addr_len);
+        // peers on this host may be connected over AF_UNIX, which has no address to show
+        if (rc == 0 && addr.sin_family != AF_INET)
+            snprintf(name, sizeof(name), "local");
+        else if (rc == 0)
+        {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+            snprintf(name, sizeof(name), "%s:%d", ip, ntohs(addr.sin_port));
+        }
+        snprintf(line, sizeof(line), "%s: %.1f KiB/s, %.1f ms rtt, %.0f%% failing%s, %zu blocks, %zu failed, %d in flight",
+                 name, scores[i].throughput / 1024, scores[i].rtt_ms, scores[i].failure_rate * 100,
+                 scores[i].failure_rate > SCORE_FLAKY ? " (demoted)" : "", scores[i].blocks,
+                 scores[i].failures, scores[i].in_flight);
+        ui_display("peers", line);
+    }
+}
+
 /**
  * Function that handles user input from teh user to downlaod correct data
  * \param input The input string whic his the name of the file to download
@@ -52,6 +265,22 @@ void ui_input_handler(const char *input)
     {
         ui_exit();
     }
+    if (strcmp(input, ":stats") == 0)
+    {
+        ui_display_stats();
+        return;
+    }
+
+    if (strcmp(input, ":peers") == 0)
+    {
+        ui_display_peers();
+        return;
+    }
+    if (strncmp(input, ":rate ", 6) == 0)
+    {
+        set_rate(input + 6);
+        return;
+    }
 
     tfile_def_t *tfiles = NULL;
     int count = list_tfiles(&ht, &tfiles);
@@ -60,8 +289,7 @@ void ui_input_handler(const char *input)
     {
         if (strcmp(tfiles[i].name, input) == 0) // compare only the raw filename
         {
-            verified_chunks_t status = verify_tfile(&ht, tfiles[i].f_hash);
-            if (status == VERIFIED_FILE)
+            if (verify_tfile(&ht, tfiles[i].f_hash, NULL))
             {
                 ui_display("system", "File already downloaded!");
                 free(tfiles);
@@ -70,13 +298,10 @@ void ui_input_handler(const char *input)
 
             ui_display("system", "Starting download...");
 
-            pthread_t dl;
             unsigned char *hash = malloc(MD5_DIGEST_LENGTH);
             memcpy(hash, tfiles[i].f_hash, MD5_DIGEST_LENGTH);
 
-            pthread_create(&dl, NULL,
-                           (void *(*)(void *))download_file,
-                           hash);
+            taskpool_submit(download_file, hash);
 
             free(tfiles);
             return;
@@ -17,4 +17,14 @@ void ui_input_handler(const char *input);
  */
 int ui_list_network_files(char ***files);
 
+/**
+ * Shows the node's counters (typed as ":stats").
+ */
+void ui_display_stats();
+
+/**
+ * Shows the throughput, RTT and failure rate measured of every peer (typed as ":peers").
+ */
+void ui_display_peers();
+
 #endif // UI_ADAPTER_H
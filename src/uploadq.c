@@ -0,0 +1,188 @@
+#include "uploadq.h"
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+// The requester an upload is for.
+uint64_t upload_key(const struct sockaddr_in *addr) {
+  return ((uint64_t)ntohl(addr->sin_addr.s_addr) << 16) | ntohs(addr->sin_port);
+}
+
+// Create a queue.
+void init_upload_queue(upload_queue_t *queue, size_t max) {
+  memset(queue, 0, sizeof(*queue));
+  pthread_mutex_init(&queue->lock, NULL);
+  queue->max = max;
+}
+
+// Queue a copy of an upload.
+int upload_push(upload_queue_t *queue, const upload_t *upload, bool *start) {
+  *start = false;
+  upload_t *copy = malloc(sizeof(upload_t));
+  if (copy == NULL) {
+    return FAILED;
+  }
+  *copy = *upload;
+  copy->next = NULL;
+  uint64_t key = upload_key(&upload->addr);
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->stats.queued >= queue->max) {
+    queue->stats.dropped++;
+    pthread_mutex_unlock(&queue->lock);
+    free(copy);
+    return FAILED;
+  }
+  upload_flow_t *flow = queue->flows;
+  while (flow != NULL && flow->key != key) {
+    flow = flow->next;
+  }
+  // a new requester waits for its turn behind the others
+  if (flow == NULL) {
+    flow = calloc(1, sizeof(upload_flow_t));
+    if (flow == NULL) {
+      pthread_mutex_unlock(&queue->lock);
+      free(copy);
+      return FAILED;
+    }
+    flow->key = key;
+    if (queue->last != NULL) {
+      queue->last->next = flow;
+    } else {
+      queue->flows = flow;
+    }
+    queue->last = flow;
+    queue->stats.flows++;
+  }
+  if (flow->tail != NULL) {
+    flow->tail->next = copy;
+  } else {
+    flow->head = copy;
+  }
+  flow->tail = copy;
+  queue->stats.queued++;
+  if (!queue->pumping) {
+    queue->pumping = true;
+    *start = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return SUCCESS;
+}
+
+// Take the next upload the shaper lets through.
+upload_t *upload_next(upload_queue_t *queue, shaper_t *shaper, long *wait_ms) {
+  pthread_mutex_lock(&queue->lock);
+  *wait_ms = -1;
+  upload_flow_t *prev = NULL;
+  for (upload_flow_t *flow = queue->flows; flow != NULL; prev = flow, flow = flow->next) {
+    upload_t *up = flow->head;
+    long wait = shaper_admit(shaper, flow->key, up->file_hash, up->size);
+    if (wait > 0) {
+      // held back by its own limits, let the next requester go meanwhile
+      if (*wait_ms == -1 || wait < *wait_ms) {
+        *wait_ms = wait;
+      }
+      continue;
+    }
+
+    flow->head = up->next;
+    if (flow->head == NULL) {
+      flow->tail = NULL;
+    }
+    queue->stats.queued--;
+
+    // the requester's turn is over. It goes to the back, or leaves if it has nothing left.
+    if (prev != NULL) {
+      prev->next = flow->next;
+    } else {
+      queue->flows = flow->next;
+    }
+    if (queue->last == flow) {
+      queue->last = prev;
+    }
+    flow->next = NULL;
+    if (flow->head == NULL) {
+      free(flow);
+      queue->stats.flows--;
+    } else if (queue->last != NULL) {
+      queue->last->next = flow;
+      queue->last = flow;
+    } else {
+      queue->flows = queue->last = flow;
+    }
+
+    *wait_ms = 0;
+    pthread_mutex_unlock(&queue->lock);
+    up->next = NULL;
+    return up;
+  }
+  if (queue->flows == NULL) {
+    queue->pumping = false;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return NULL;
+}
+
+// Take back the queued uploads of a block.
+int upload_cancel(upload_queue_t *queue, const upload_t *upload) {
+  uint64_t key = upload_key(&upload->addr);
+  int removed = 0;
+  pthread_mutex_lock(&queue->lock);
+  upload_flow_t *prev = NULL;
+  upload_flow_t *flow = queue->flows;
+  while (flow != NULL && flow->key != key) {
+    prev = flow;
+    flow = flow->next;
+  }
+  if (flow == NULL) {
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+  }
+  upload_t *last = NULL;
+  for (upload_t **up = &flow->head; *up != NULL;) {
+    upload_t *u = *up;
+    if (memcmp(u->file_hash, upload->file_hash, MD5_DIGEST_LENGTH) == 0 && u->chunk == upload->chunk &&
+        u->offset == upload->offset && u->size == upload->size) {
+      *up = u->next;
+      free(u);
+      removed++;
+    } else {
+      last = u;
+      up = &u->next;
+    }
+  }
+  flow->tail = last;
+  queue->stats.queued -= removed;
+  queue->stats.cancelled += removed;
+
+  // a requester with nothing left leaves the queue
+  if (flow->head == NULL) {
+    if (prev != NULL) {
+      prev->next = flow->next;
+    } else {
+      queue->flows = flow->next;
+    }
+    if (queue->last == flow) {
+      queue->last = prev;
+    }
+    free(flow);
+    queue->stats.flows--;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return removed;
+}
+
+// Record that the pump stopped.
+void upload_stop(upload_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->pumping = false;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Get the queue's counters.
+upload_stats_t upload_stats(upload_queue_t *queue) {
+  pthread_mutex_lock(&queue->lock);
+  upload_stats_t s = queue->stats;
+  pthread_mutex_unlock(&queue->lock);
+  return s;
+}
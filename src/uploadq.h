@@ -0,0 +1,79 @@
+#pragma once
+#include <netinet/in.h>
+#include <openssl/md5.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "shaper.h"
+
+// A block waiting to be uploaded to the node which requested it.
+typedef struct upload {
+  struct sockaddr_in addr;
+  socklen_t addr_len;
+  unsigned char file_hash[MD5_DIGEST_LENGTH];
+  int chunk;
+  uint32_t offset;
+  uint32_t size;
+  // The ACCEPT_* encodings the requester can decode the block in.
+  uint8_t accepts;
+  struct upload *next;
+} upload_t;
+
+// The uploads waiting for one requester, in the order they were requested.
+typedef struct upload_flow {
+  uint64_t key;
+  upload_t *head;
+  upload_t *tail;
+  struct upload_flow *next;
+} upload_flow_t;
+
+// Counters describing the upload queue.
+typedef struct {
+  // Uploads waiting right now, and requesters they are for.
+  size_t queued;
+  size_t flows;
+  // Uploads dropped because the queue was full, and taken back by their requester before their turn.
+  size_t dropped;
+  size_t cancelled;
+} upload_stats_t;
+
+// Uploads waiting for the shaper, queued per requester. Requesters take turns, one upload each, so a node asking
+// for a lot does not starve the others.
+typedef struct {
+  pthread_mutex_t lock;
+  // Requesters with uploads waiting. The head has the next turn.
+  upload_flow_t *flows;
+  upload_flow_t *last;
+  size_t max;
+  // Whether a pump is running or scheduled to drain the queue.
+  bool pumping;
+  upload_stats_t stats;
+} upload_queue_t;
+
+// The requester an upload is for, as given to the shaper.
+uint64_t upload_key(const struct sockaddr_in *addr);
+
+// Create a queue holding at most <max> uploads.
+void init_upload_queue(upload_queue_t *queue, size_t max);
+
+// Queue a copy of <upload>. Sets <start> to whether the caller must start a pump, because none is running.
+// Returns FAILED if the queue is full or failed, and SUCCESS on success.
+int upload_push(upload_queue_t *queue, const upload_t *upload, bool *start);
+
+// Take the next upload the shaper lets through, starting with the requester whose turn it is.
+// Returns it (the caller frees it), or NULL if there is none. Then <wait_ms> is how long until the shaper lets
+// one through, or -1 if the queue is empty, in which case the pump stops.
+upload_t *upload_next(upload_queue_t *queue, shaper_t *shaper, long *wait_ms);
+
+// Take back the uploads of the block <upload> names to its requester which did not have their turn yet, e.g. because
+// the requester got the block from another peer. Returns how many were removed.
+int upload_cancel(upload_queue_t *queue, const upload_t *upload);
+
+// Record that the pump stopped without draining the queue, e.g. because it could not be scheduled.
+// The next upload queued starts a new one.
+void upload_stop(upload_queue_t *queue);
+
+// Get the queue's counters.
+upload_stats_t upload_stats(upload_queue_t *queue);
@@ -0,0 +1,372 @@
+#include "wire.h"
+#include <stdlib.h>
+#include <string.h>
+#include "message.h"
+
+void wire_put_u16(unsigned char *buf, uint16_t value) {
+  buf[0] = value >> 8;
+  buf[1] = value;
+}
+
+void wire_put_u32(unsigned char *buf, uint32_t value) {
+  wire_put_u16(buf, value >> 16);
+  wire_put_u16(buf + 2, value);
+}
+
+void wire_put_u64(unsigned char *buf, uint64_t value) {
+  wire_put_u32(buf, value >> 32);
+  wire_put_u32(buf + 4, value);
+}
+
+uint16_t wire_get_u16(const unsigned char *buf) {
+  return (uint16_t)buf[0] << 8 | buf[1];
+}
+
+uint32_t wire_get_u32(const unsigned char *buf) {
+  return (uint32_t)wire_get_u16(buf) << 16 | wire_get_u16(buf + 2);
+}
+
+uint64_t wire_get_u64(const unsigned char *buf) {
+  return (uint64_t)wire_get_u32(buf) << 32 | wire_get_u32(buf + 4);
+}
+
+// Serialize an IPv4 address and port.
+// Both are already in network order in a sockaddr_in, so they are copied as they are.
+size_t encode_addr(const struct sockaddr_in *addr, unsigned char *buf) {
+  memcpy(buf, &addr->sin_addr.s_addr, 4);
+  memcpy(buf + 4, &addr->sin_port, 2);
+  return ADDR_WIRE_SIZE;
+}
+
+int decode_addr(const unsigned char *buf, size_t size, struct sockaddr_in *addr) {
+  if (size < ADDR_WIRE_SIZE) {
+    return FAILED;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  memcpy(&addr->sin_addr.s_addr, buf, 4);
+  memcpy(&addr->sin_port, buf + 4, 2);
+  return SUCCESS;
+}
+
+// Serialize a tfile definition.
+size_t encode_tfile_def(const tfile_def_t *tdef, unsigned char *buf) {
+  unsigned char *p = buf;
+  memcpy(p, tdef->name, NAME_LEN);
+  p += NAME_LEN;
+  memcpy(p, tdef->f_hash, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  wire_put_u64(p, (uint64_t)tdef->size);
+  p += 8;
+  wire_put_u32(p, tdef->chunk_size);
+  p += 4;
+  wire_put_u32(p, tdef->num_chunks);
+  p += 4;
+  memcpy(p, tdef->c_hashes, (size_t)tdef->num_chunks * MD5_DIGEST_LENGTH);
+  p += (size_t)tdef->num_chunks * MD5_DIGEST_LENGTH;
+  *p++ = tdef->algorithm;
+  return p - buf;
+}
+
+int decode_tfile_def(const unsigned char *buf, size_t size, tfile_def_t *tdef) {
+  if (size < TFILE_DEF_LEGACY_SIZE(0)) {
+    return FAILED;
+  }
+  memset(tdef, 0, sizeof(*tdef));
+  const unsigned char *p = buf;
+  memcpy(tdef->name, p, NAME_LEN);
+  // Names are used as C strings, so never trust the terminator to be there.
+  tdef->name[NAME_LEN - 1] = '\0';
+  p += NAME_LEN;
+  memcpy(tdef->f_hash, p, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  tdef->size = (off_t)wire_get_u64(p);
+  p += 8;
+  tdef->chunk_size = wire_get_u32(p);
+  p += 4;
+  tdef->num_chunks = wire_get_u32(p);
+  p += 4;
+  // The layout must be the one the sender hashed, or chunks would be read from the wrong place.
+  if (tdef->size < 0 || tdef->chunk_size == 0 || tdef->num_chunks > MAX_CHUNKS ||
+      tdef->num_chunks != count_chunks(tdef->size, tdef->chunk_size) ||
+      size < TFILE_DEF_LEGACY_SIZE(tdef->num_chunks)) {
+    return FAILED;
+  }
+  // Hashes made with an algorithm we do not have could never be verified.
+  tdef->algorithm = size >= TFILE_DEF_WIRE_SIZE(tdef->num_chunks) ? p[(size_t)tdef->num_chunks * MD5_DIGEST_LENGTH]
+                                                                  : DIGEST_MD5;
+  if (!digest_known(tdef->algorithm)) {
+    return FAILED;
+  }
+  tdef->c_hashes = malloc((size_t)tdef->num_chunks * MD5_DIGEST_LENGTH);
+  if (tdef->c_hashes == NULL) {
+    return FAILED;
+  }
+  memcpy(tdef->c_hashes, p, (size_t)tdef->num_chunks * MD5_DIGEST_LENGTH);
+  return SUCCESS;
+}
+
+// How many of <count> definitions fit in one batch.
+int tfile_batch_fit(const tfile_def_t *tdefs, int count, size_t *size) {
+  *size = TFILE_BATCH_HEADER_SIZE;
+  int fit = 0;
+  while (fit < count) {
+    size_t record = TFILE_RECORD_HEADER_SIZE + TFILE_DEF_WIRE_SIZE(tdefs[fit].num_chunks);
+    if (fit > 0 && *size + record > TFILE_BATCH_MAX_BYTES) {
+      break;
+    }
+    *size += record;
+    fit++;
+  }
+  return fit;
+}
+
+// Serialize many tfile definitions into one batch.
+size_t encode_tfile_batch(const tfile_def_t *tdefs, int count, const announce_t *announce, unsigned char *buf) {
+  wire_put_u32(buf, (uint32_t)count);
+  wire_put_u64(buf + 4, announce->origin);
+  buf[12] = announce->hops;
+  unsigned char *p = buf + TFILE_BATCH_HEADER_SIZE;
+  for (int i = 0; i < count; i++) {
+    size_t record = encode_tfile_def(&tdefs[i], p + TFILE_RECORD_HEADER_SIZE);
+    wire_put_u32(p, (uint32_t)record);
+    p += TFILE_RECORD_HEADER_SIZE + record;
+  }
+  return p - buf;
+}
+
+// Parse a batch of tfile definitions.
+int decode_tfile_batch(const unsigned char *buf, size_t size, tfile_def_t **tdefs, announce_t *announce) {
+  if (size < TFILE_BATCH_HEADER_SIZE) {
+    return FAILED;
+  }
+  uint32_t count = wire_get_u32(buf);
+  announce->origin = wire_get_u64(buf + 4);
+  announce->hops = buf[12];
+  if (count > (size - TFILE_BATCH_HEADER_SIZE) / (TFILE_RECORD_HEADER_SIZE + TFILE_DEF_LEGACY_SIZE(0))) {
+    return FAILED;
+  }
+
+  *tdefs = malloc(count * sizeof(tfile_def_t));
+  if (*tdefs == NULL && count > 0) {
+    return FAILED;
+  }
+  const unsigned char *p = buf + TFILE_BATCH_HEADER_SIZE;
+  const unsigned char *end = buf + size;
+  for (uint32_t i = 0; i < count; i++) {
+    // Newer builds may send longer records. Step over the fields we do not know.
+    size_t record = end - p >= TFILE_RECORD_HEADER_SIZE ? wire_get_u32(p) : 0;
+    if (end - p < TFILE_RECORD_HEADER_SIZE || record > (size_t)(end - p) - TFILE_RECORD_HEADER_SIZE ||
+        decode_tfile_def(p + TFILE_RECORD_HEADER_SIZE, record, &(*tdefs)[i]) != SUCCESS) {
+      for (uint32_t j = 0; j < i; j++) {
+        free_tfile_def(&(*tdefs)[j]);
+      }
+      free(*tdefs);
+      return FAILED;
+    }
+    p += TFILE_RECORD_HEADER_SIZE + record;
+  }
+  return (int)count;
+}
+
+// Serialize a catalog prefix.
+size_t encode_catalog_prefix(const catalog_prefix_t *prefix, unsigned char *buf) {
+  buf[0] = prefix->len;
+  memcpy(buf + 1, prefix->bytes, prefix->len);
+  return CATALOG_PREFIX_WIRE_SIZE(prefix->len);
+}
+
+// Parse a catalog prefix.
+int decode_catalog_prefix(const unsigned char *buf, size_t size, catalog_prefix_t *prefix) {
+  if (size < 1 || buf[0] > MD5_DIGEST_LENGTH || size < CATALOG_PREFIX_WIRE_SIZE(buf[0])) {
+    return FAILED;
+  }
+  memset(prefix, 0, sizeof(*prefix));
+  prefix->len = buf[0];
+  memcpy(prefix->bytes, buf + 1, prefix->len);
+  return CATALOG_PREFIX_WIRE_SIZE(prefix->len);
+}
+
+// Serialize a catalog summary.
+size_t encode_catalog_summary(const catalog_summary_t *summary, unsigned char *buf) {
+  unsigned char *p = buf + encode_catalog_prefix(&summary->prefix, buf);
+  for (int i = 0; i < CATALOG_FANOUT; i++) {
+    wire_put_u32(p, summary->count[i]);
+    p += 4;
+    memcpy(p, summary->xor[i], MD5_DIGEST_LENGTH);
+    p += MD5_DIGEST_LENGTH;
+  }
+  return p - buf;
+}
+
+// Parse a catalog summary.
+int decode_catalog_summary(const unsigned char *buf, size_t size, catalog_summary_t *summary) {
+  int used = decode_catalog_prefix(buf, size, &summary->prefix);
+  if (used == FAILED || size < CATALOG_SUMMARY_WIRE_SIZE(summary->prefix.len)) {
+    return FAILED;
+  }
+  const unsigned char *p = buf + used;
+  for (int i = 0; i < CATALOG_FANOUT; i++) {
+    summary->count[i] = wire_get_u32(p);
+    p += 4;
+    memcpy(summary->xor[i], p, MD5_DIGEST_LENGTH);
+    p += MD5_DIGEST_LENGTH;
+  }
+  return SUCCESS;
+}
+
+// Serialize the hashes a node has under a prefix.
+size_t encode_catalog_have(const catalog_prefix_t *prefix, const unsigned char (*hashes)[MD5_DIGEST_LENGTH], int count,
+                           unsigned char *buf) {
+  unsigned char *p = buf + encode_catalog_prefix(prefix, buf);
+  wire_put_u32(p, (uint32_t)count);
+  p += 4;
+  memcpy(p, hashes, count * MD5_DIGEST_LENGTH);
+  p += count * MD5_DIGEST_LENGTH;
+  return p - buf;
+}
+
+// Parse the hashes a node has under a prefix.
+int decode_catalog_have(const unsigned char *buf, size_t size, catalog_prefix_t *prefix, const unsigned char **hashes) {
+  int used = decode_catalog_prefix(buf, size, prefix);
+  if (used == FAILED || size < (size_t)used + 4) {
+    return FAILED;
+  }
+  uint32_t count = wire_get_u32(buf + used);
+  if (count > (size - used - 4) / MD5_DIGEST_LENGTH) {
+    return FAILED;
+  }
+  *hashes = buf + used + 4;
+  return (int)count;
+}
+
+// Serialize the chunks of a file a node holds.
+size_t encode_have_bitfield(const unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t *bits, uint32_t count,
+                            unsigned char *buf) {
+  unsigned char *p = buf;
+  memcpy(p, hash, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  wire_put_u32(p, count);
+  p += 4;
+  memcpy(p, bits, (count + 7) / 8);
+  p += (count + 7) / 8;
+  return p - buf;
+}
+
+// Parse the chunks of a file a node holds.
+int decode_have_bitfield(const unsigned char *buf, size_t size, unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t **bits) {
+  if (size < HAVE_BITFIELD_WIRE_SIZE(0)) {
+    return FAILED;
+  }
+  uint32_t count = wire_get_u32(buf + MD5_DIGEST_LENGTH);
+  if (count > INT32_MAX || ((size_t)count + 7) / 8 > size - HAVE_BITFIELD_WIRE_SIZE(0)) {
+    return FAILED;
+  }
+  memcpy(hash, buf, MD5_DIGEST_LENGTH);
+  *bits = buf + HAVE_BITFIELD_WIRE_SIZE(0);
+  return (int)count;
+}
+
+// Serialize a chunk a node just verified.
+size_t encode_have_chunk(const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, unsigned char *buf) {
+  memcpy(buf, hash, MD5_DIGEST_LENGTH);
+  wire_put_u32(buf + MD5_DIGEST_LENGTH, chunk);
+  return HAVE_CHUNK_WIRE_SIZE;
+}
+
+int decode_have_chunk(const unsigned char *buf, size_t size, unsigned char hash[MD5_DIGEST_LENGTH], uint32_t *chunk) {
+  if (size < HAVE_CHUNK_WIRE_SIZE) {
+    return FAILED;
+  }
+  memcpy(hash, buf, MD5_DIGEST_LENGTH);
+  *chunk = wire_get_u32(buf + MD5_DIGEST_LENGTH);
+  return SUCCESS;
+}
+
+// Serialize a discovery beacon.
+size_t encode_beacon(uint64_t node_id, uint16_t port, unsigned char *buf) {
+  wire_put_u32(buf, BEACON_MAGIC);
+  wire_put_u64(buf + 4, node_id);
+  wire_put_u16(buf + 12, port);
+  return BEACON_WIRE_SIZE;
+}
+
+int decode_beacon(const unsigned char *buf, size_t size, uint64_t *node_id, uint16_t *port) {
+  if (size < BEACON_WIRE_SIZE || wire_get_u32(buf) != BEACON_MAGIC) {
+    return FAILED;
+  }
+  *node_id = wire_get_u64(buf + 4);
+  *port = wire_get_u16(buf + 12);
+  return SUCCESS;
+}
+
+// Serialize a chunk request.
+size_t encode_chunk_request(const chunk_request_t *req, unsigned char *buf) {
+  unsigned char *p = buf;
+  wire_put_u64(p, req->request_id);
+  p += 8;
+  memcpy(p, req->file_hash, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  wire_put_u32(p, (uint32_t)req->chunk_index);
+  p += 4;
+  wire_put_u32(p, req->offset);
+  p += 4;
+  wire_put_u32(p, req->size);
+  p += 4;
+  p += encode_addr(&req->return_addr, p);
+  *p++ = req->ttl;
+  *p++ = req->accepts;
+  return p - buf;
+}
+
+int decode_chunk_request(const unsigned char *buf, size_t size, chunk_request_t *req) {
+  if (size < CHUNK_REQUEST_WIRE_SIZE) {
+    return FAILED;
+  }
+  const unsigned char *p = buf;
+  req->request_id = wire_get_u64(p);
+  p += 8;
+  memcpy(req->file_hash, p, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  req->chunk_index = (int)wire_get_u32(p);
+  p += 4;
+  req->offset = wire_get_u32(p);
+  p += 4;
+  req->size = wire_get_u32(p);
+  p += 4;
+  decode_addr(p, ADDR_WIRE_SIZE, &req->return_addr);
+  req->return_addr_len = sizeof(struct sockaddr_in);
+  p += ADDR_WIRE_SIZE;
+  req->ttl = *p++;
+  req->accepts = *p++;
+  return SUCCESS;
+}
+
+// Serialize a chunk payload header.
+size_t encode_chunk_payload(const chunk_payload_t *hdr, unsigned char *buf) {
+  unsigned char *p = buf;
+  memcpy(p, hdr->file_hash, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  wire_put_u32(p, (uint32_t)hdr->chunk_index);
+  p += 4;
+  wire_put_u32(p, hdr->offset);
+  p += 4;
+  wire_put_u32(p, hdr->size);
+  p += 4;
+  return p - buf;
+}
+
+int decode_chunk_payload(const unsigned char *buf, size_t size, chunk_payload_t *hdr) {
+  if (size < CHUNK_PAYLOAD_WIRE_SIZE) {
+    return FAILED;
+  }
+  const unsigned char *p = buf;
+  memcpy(hdr->file_hash, p, MD5_DIGEST_LENGTH);
+  p += MD5_DIGEST_LENGTH;
+  hdr->chunk_index = (int)wire_get_u32(p);
+  p += 4;
+  hdr->offset = wire_get_u32(p);
+  p += 4;
+  hdr->size = wire_get_u32(p);
+  return SUCCESS;
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "file.h"
+
+// Payloads are serialized field by field in big endian, never as raw structs.
+// Decoders accept payloads longer than they expect and ignore the trailing bytes,
+// so newer builds can append extension fields.
+
+// Sizes of the serialized payloads.
+#define ADDR_WIRE_SIZE          (4 + 2)
+// A tfile definition is its name, file hash, size (8 bytes), chunk size (4 bytes) and chunk count (4 bytes)
+// followed by the hash of every chunk and the DIGEST_* algorithm of the hashes (1 byte).
+// Definitions from builds before the algorithm end with the chunk hashes, and are MD5.
+#define TFILE_DEF_WIRE_SIZE(num_chunks) (NAME_LEN + MD5_DIGEST_LENGTH + 8 + 4 + 4 + (size_t)(num_chunks) * MD5_DIGEST_LENGTH + 1)
+#define TFILE_DEF_LEGACY_SIZE(num_chunks) (TFILE_DEF_WIRE_SIZE(num_chunks) - 1)
+// Chunk requests and FILE_DATA headers name a block of a chunk: its offset in the chunk (4 bytes) and size (4 bytes).
+// Requests end with the encodings the requester accepts the block in (1 byte).
+#define CHUNK_REQUEST_WIRE_SIZE (8 + MD5_DIGEST_LENGTH + 4 + 4 + 4 + ADDR_WIRE_SIZE + 1 + 1)
+// CANCEL_FILE_DATA takes back a chunk request, and is serialized like one. Holders match it on the return address
+// and the block, not the request id.
+#define CHUNK_PAYLOAD_WIRE_SIZE (MD5_DIGEST_LENGTH + 4 + 4 + 4)
+
+// A TFILE_DEF_BATCH payload is a count (4 bytes) and an announce_t (origin 8 bytes, hops 1 byte) followed by
+// <count> records. Definitions differ in size with their chunk count, so every record is its size (4 bytes)
+// then a serialized tfile definition.
+#define TFILE_BATCH_HEADER_SIZE (4 + 8 + 1)
+#define TFILE_RECORD_HEADER_SIZE 4
+
+// The largest TFILE_DEF_BATCH payload sent. A definition which does not fit on its own goes in a batch by itself.
+#define TFILE_BATCH_MAX_BYTES (256 * 1024)
+// The most definitions a batch carries, when they all have a single chunk.
+#define TFILE_BATCH_MAX ((TFILE_BATCH_MAX_BYTES - TFILE_BATCH_HEADER_SIZE) / (TFILE_RECORD_HEADER_SIZE + TFILE_DEF_WIRE_SIZE(1)))
+
+// Catalogs are reconciled as a tree keyed on f_hash. Every node of the tree is a prefix of f_hash,
+// and its children are the prefixes one byte longer.
+#define CATALOG_FANOUT 256
+
+// A prefix of f_hash naming a subtree of the catalog. The root has length 0.
+typedef struct
+{
+    uint8_t len;
+    unsigned char bytes[MD5_DIGEST_LENGTH];
+} catalog_prefix_t;
+
+// Digest of the tfiles under a prefix, one entry per child: how many there are and the XOR of their hashes.
+// Two catalogs hold the same tfiles under a child (barring collisions) when both entries match.
+typedef struct
+{
+    catalog_prefix_t prefix;
+    uint32_t count[CATALOG_FANOUT];
+    unsigned char xor[CATALOG_FANOUT][MD5_DIGEST_LENGTH];
+} catalog_summary_t;
+
+// Sizes of the serialized catalog payloads.
+// CATALOG_QUERY is a prefix: its length (1 byte) then its bytes.
+// CATALOG_SUMMARY is a prefix then a count (4 bytes) and a XOR (16 bytes) per child.
+// CATALOG_HAVE is a prefix then a count (4 bytes) and that many hashes.
+#define CATALOG_PREFIX_WIRE_SIZE(len) (1 + (len))
+#define CATALOG_SUMMARY_WIRE_SIZE(len) (CATALOG_PREFIX_WIRE_SIZE(len) + CATALOG_FANOUT * (4 + MD5_DIGEST_LENGTH))
+#define CATALOG_HAVE_WIRE_SIZE(len, count) (CATALOG_PREFIX_WIRE_SIZE(len) + 4 + (count) * MD5_DIGEST_LENGTH)
+
+// Chunk availability. HAVE_BITFIELD is a file hash, a chunk count (4 bytes) and one bit per chunk, the first
+// chunk in the most significant bit like verified_chunks_t. HAVE_CHUNK is a file hash and a chunk index (4 bytes).
+#define HAVE_BITFIELD_WIRE_SIZE(count) (MD5_DIGEST_LENGTH + 4 + ((count) + 7) / 8)
+#define HAVE_CHUNK_WIRE_SIZE (MD5_DIGEST_LENGTH + 4)
+
+// LAN discovery beacons are sent over UDP multicast, outside of the peer connections. A beacon is BEACON_MAGIC
+// (4 bytes), the id of the node (8 bytes) and the port it accepts peers on (2 bytes).
+#define BEACON_MAGIC 0x4752494eu
+#define BEACON_WIRE_SIZE (4 + 8 + 2)
+
+// Where a batch of gossiped tfile definitions comes from.
+typedef struct
+{
+    // Id of the node which announced the definitions first. 0 if unknown.
+    uint64_t origin;
+    // How many times the batch was relayed on its way here.
+    uint8_t hops;
+} announce_t;
+
+// A request for a block of a chunk, sent to a holder or flooded through the network until a holder answers.
+typedef struct
+{
+    // Random id of this request. Every node handles a given request once.
+    uint64_t request_id;
+    unsigned char file_hash[MD5_DIGEST_LENGTH];
+    int chunk_index;
+    // The block: <size> bytes starting <offset> bytes into the chunk. A size of 0 asks for the rest of the chunk.
+    uint32_t offset;
+    uint32_t size;
+    struct sockaddr_in return_addr;
+    socklen_t return_addr_len;
+    // Hops the request may still be relayed.
+    uint8_t ttl;
+    // The ACCEPT_* encodings the requester can decode the block in. Holders pick one, or send it as it is.
+    uint8_t accepts;
+} chunk_request_t;
+
+// Encodings of FILE_DATA blocks, as a bit mask.
+#define ACCEPT_ZLIB 0x01
+
+// The header in front of the block bytes of a FILE_DATA message.
+typedef struct
+{
+    unsigned char file_hash[MD5_DIGEST_LENGTH];
+    int chunk_index;
+    // Where the block starts in the chunk, and its size.
+    uint32_t offset;
+    uint32_t size;
+} chunk_payload_t;
+
+// Big endian integer helpers.
+void wire_put_u16(unsigned char *buf, uint16_t value);
+void wire_put_u32(unsigned char *buf, uint32_t value);
+void wire_put_u64(unsigned char *buf, uint64_t value);
+uint16_t wire_get_u16(const unsigned char *buf);
+uint32_t wire_get_u32(const unsigned char *buf);
+uint64_t wire_get_u64(const unsigned char *buf);
+
+// Serialize an IPv4 address and port. Returns the number of bytes written.
+size_t encode_addr(const struct sockaddr_in *addr, unsigned char *buf);
+// Returns FAILED if <size> is too small.
+int decode_addr(const unsigned char *buf, size_t size, struct sockaddr_in *addr);
+
+// Serialize a tfile definition. <buf> must hold TFILE_DEF_WIRE_SIZE(num_chunks) bytes.
+// Returns the number of bytes written.
+size_t encode_tfile_def(const tfile_def_t *tdef, unsigned char *buf);
+// Allocates the chunk hashes, which the caller frees with free_tfile_def (or hands to the hash table).
+// Returns FAILED if <size> is too small or the chunk layout does not match the size.
+int decode_tfile_def(const unsigned char *buf, size_t size, tfile_def_t *tdef);
+
+// How many of <count> definitions fit in one batch, at least one. Sets <size> to the size of that batch.
+int tfile_batch_fit(const tfile_def_t *tdefs, int count, size_t *size);
+// Serialize tfile definitions into one batch. <buf> must hold the size tfile_batch_fit gives.
+// Returns the number of bytes written.
+size_t encode_tfile_batch(const tfile_def_t *tdefs, int count, const announce_t *announce, unsigned char *buf);
+// Parse a batch into a newly allocated array at <tdefs>, and where it came from into <announce>.
+// The caller frees the array, and the chunk hashes of every definition not handed to the hash table.
+// Returns the number of definitions or FAILED if the payload is malformed.
+int decode_tfile_batch(const unsigned char *buf, size_t size, tfile_def_t **tdefs, announce_t *announce);
+
+// Serialize a catalog prefix (a CATALOG_QUERY payload). Returns the number of bytes written.
+size_t encode_catalog_prefix(const catalog_prefix_t *prefix, unsigned char *buf);
+// Returns the number of bytes read, or FAILED if the payload is malformed.
+int decode_catalog_prefix(const unsigned char *buf, size_t size, catalog_prefix_t *prefix);
+
+// Serialize a catalog summary. <buf> must hold CATALOG_SUMMARY_WIRE_SIZE(prefix length) bytes.
+// Returns the number of bytes written.
+size_t encode_catalog_summary(const catalog_summary_t *summary, unsigned char *buf);
+// Returns FAILED if the payload is malformed.
+int decode_catalog_summary(const unsigned char *buf, size_t size, catalog_summary_t *summary);
+
+// Serialize the <count> hashes a node has under a prefix. <buf> must hold CATALOG_HAVE_WIRE_SIZE bytes.
+// Returns the number of bytes written.
+size_t encode_catalog_have(const catalog_prefix_t *prefix, const unsigned char (*hashes)[MD5_DIGEST_LENGTH], int count,
+                           unsigned char *buf);
+// Points <hashes> into <buf>. Returns the number of hashes or FAILED if the payload is malformed.
+int decode_catalog_have(const unsigned char *buf, size_t size, catalog_prefix_t *prefix, const unsigned char **hashes);
+
+// Serialize the chunks of a file a node holds. <bits> holds (<count> + 7) / 8 bytes and <buf>
+// HAVE_BITFIELD_WIRE_SIZE(<count>) bytes. Returns the number of bytes written.
+size_t encode_have_bitfield(const unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t *bits, uint32_t count,
+                            unsigned char *buf);
+// Points <bits> into <buf>. Returns the number of chunks or FAILED if the payload is malformed.
+int decode_have_bitfield(const unsigned char *buf, size_t size, unsigned char hash[MD5_DIGEST_LENGTH], const uint8_t **bits);
+
+// Serialize a chunk a node just verified. Returns the number of bytes written.
+size_t encode_have_chunk(const unsigned char hash[MD5_DIGEST_LENGTH], uint32_t chunk, unsigned char *buf);
+// Returns FAILED if <size> is too small.
+int decode_have_chunk(const unsigned char *buf, size_t size, unsigned char hash[MD5_DIGEST_LENGTH], uint32_t *chunk);
+
+// Serialize a discovery beacon. Returns the number of bytes written.
+size_t encode_beacon(uint64_t node_id, uint16_t port, unsigned char *buf);
+// Returns FAILED if <size> is too small or the datagram is not a beacon.
+int decode_beacon(const unsigned char *buf, size_t size, uint64_t *node_id, uint16_t *port);
+
+// Serialize a chunk request. Returns the number of bytes written.
+size_t encode_chunk_request(const chunk_request_t *req, unsigned char *buf);
+// Returns FAILED if <size> is too small.
+int decode_chunk_request(const unsigned char *buf, size_t size, chunk_request_t *req);
+
+// Serialize a chunk payload header. Returns the number of bytes written.
+size_t encode_chunk_payload(const chunk_payload_t *hdr, unsigned char *buf);
+// Returns FAILED if <size> is too small.
+int decode_chunk_payload(const unsigned char *buf, size_t size, chunk_payload_t *hdr);
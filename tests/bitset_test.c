@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "../src/bitset.h"
+#include "../src/message.h"
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+int main() {
+  // chunk bitsets
+  bitset_t set;
+  check("bitset created", init_bitset(&set, 70) == SUCCESS && bitset_popcount(&set) == 0);
+  bitset_set(&set, 0);
+  bitset_set(&set, 9);
+  check("bitset wire order", set.bits[0] == 0x80 && set.bits[1] == 0x40);
+  check("bitset next missing", bitset_next_missing(&set, 0) == 1 && bitset_next_missing(&set, 9) == 10);
+  bitset_fill(&set);
+  check("bitset full", bitset_full(&set) && bitset_popcount(&set) == 70 && bitset_next_missing(&set, 0) == -1);
+  bitset_clear(&set, 69);
+  check("bitset last missing", !bitset_full(&set) && bitset_next_missing(&set, 3) == 69);
+  free_bitset(&set);
+
+  // the atomic variants see the same bits
+  check("bitset of one chunk", init_bitset(&set, 1) == SUCCESS && !bitset_full(&set));
+  bitset_set_atomic(&set, 0);
+  check("bitset set atomically", bitset_test(&set, 0) && bitset_test_atomic(&set, 0) && bitset_full(&set));
+  bitset_clear_atomic(&set, 0);
+  check("bitset cleared atomically", !bitset_test(&set, 0) && bitset_next_missing(&set, 0) == 0);
+  free_bitset(&set);
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/codec.h"
+#include "../src/message.h"
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+int main() {
+  // compressed blocks, of a file of their own
+  unsigned char fhash[MD5_DIGEST_LENGTH];
+  memset(fhash, 0x5A, MD5_DIGEST_LENGTH);
+  static unsigned char text[65536], packed[65536 + 1024], unpacked[65536];
+  for (size_t i = 0; i < sizeof(text); i++) {
+    text[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+  }
+  long packed_size = codec_compress(text, sizeof(text), packed);
+  check("text worth compressing", codec_worth(fhash, text, sizeof(text)));
+  check("text compresses", packed_size > 0 && packed_size < (long)sizeof(text) / 10);
+  inflater_t* inflater = inflater_new();
+  size_t half = packed_size / 2;
+  memcpy(inflater->in, packed, half);
+  inflater->pending = half;
+  long first = inflater_flush(inflater, unpacked, sizeof(unpacked));
+  memcpy(inflater->in, packed + half, packed_size - half);
+  inflater->pending = packed_size - half;
+  long second = first >= 0 ? inflater_flush(inflater, unpacked + first, sizeof(unpacked) - first) : FAILED;
+  check("block inflates in pieces", second >= 0 && inflater_finish(inflater, sizeof(text)) &&
+                                        memcmp(unpacked, text, sizeof(text)) == 0);
+  inflater_free(inflater);
+  inflater = inflater_new();
+  memcpy(inflater->in, packed, packed_size);
+  inflater->pending = packed_size;
+  check("oversized block rejected", inflater_flush(inflater, unpacked, sizeof(unpacked) / 2) == FAILED);
+  inflater_free(inflater);
+  srand(7);
+  for (size_t i = 0; i < sizeof(text); i++) {
+    text[i] = rand();
+  }
+  check("random sample not worth compressing", !codec_worth(fhash, text, sizeof(text)));
+  check("random block sent as it is", codec_compress(text, sizeof(text), packed) == FAILED);
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/digest.h"
+#include "../src/message.h"
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Formats a digest as hex into <hex>, which holds 2 * DIGEST_LENGTH + 1 characters.
+const char* to_hex(const unsigned char* digest, char* hex) {
+  for (int i = 0; i < DIGEST_LENGTH; i++) {
+    sprintf(hex + 2 * i, "%02x", digest[i]);
+  }
+  return hex;
+}
+
+int main() {
+  // digests, against the reference implementations
+  unsigned char digest[DIGEST_LENGTH];
+  char hex[2 * DIGEST_LENGTH + 1];
+  digest_once(DIGEST_MD5, "abc", 3, digest);
+  check("md5 digest", memcmp(to_hex(digest, hex), "900150983cd24fb0d6963f7d28e17f72", 32) == 0);
+  digest_once(DIGEST_BLAKE3, "", 0, digest);
+  check("blake3 empty digest", memcmp(to_hex(digest, hex), "af1349b9f5f9a1a6a0404dea36dcc949", 32) == 0);
+  digest_once(DIGEST_XXH64, "abc", 3, digest);
+  check("xxh64 digest", memcmp(to_hex(digest, hex), "44bc2cf5ad770999", 16) == 0);
+
+  // inputs spanning several BLAKE3 chunks, hashed at once and in pieces of odd sizes
+  size_t long_size = 100000;
+  unsigned char* input = malloc(long_size);
+  for (size_t i = 0; i < long_size; i++) {
+    input[i] = i % 251;
+  }
+  digest_once(DIGEST_BLAKE3, input, long_size, digest);
+  check("blake3 long digest", memcmp(to_hex(digest, hex), "d93c23eedaf165a7e0be908ba86f1a7a", 32) == 0);
+  for (int alg = 0; alg < DIGEST_COUNT; alg++) {
+    unsigned char whole[DIGEST_LENGTH];
+    digest_once(alg, input, long_size, whole);
+    digest_t d;
+    digest_init(&d, alg);
+    for (size_t done = 0; done < long_size; done += 1000 + 7) {
+      digest_update(&d, input + done, long_size - done < 1007 ? long_size - done : 1007);
+    }
+    digest_final(&d, digest);
+    check(digest_name(alg), memcmp(whole, digest, DIGEST_LENGTH) == 0);
+  }
+
+  // the same input as subtrees of 32 KiB, merged into the digest of the whole
+  check("blake3 tree chunks", digest_tree_chunks(DIGEST_BLAKE3, 32 * 1024) && !digest_tree_chunks(DIGEST_BLAKE3, 48 * 1024) &&
+                                  !digest_tree_chunks(DIGEST_MD5, 32 * 1024));
+  unsigned char cvs[4][DIGEST_CV_LENGTH];
+  for (int i = 0; i < 4; i++) {
+    size_t offset = (size_t)i * 32 * 1024;
+    digest_t d;
+    digest_init_at(&d, DIGEST_BLAKE3, offset);
+    digest_update(&d, input + offset, long_size - offset < 32 * 1024 ? long_size - offset : 32 * 1024);
+    digest_final_cv(&d, cvs[i]);
+  }
+  digest_merge(DIGEST_BLAKE3, cvs, 4, digest);
+  check("blake3 merged digest", memcmp(to_hex(digest, hex), "d93c23eedaf165a7e0be908ba86f1a7a", 32) == 0);
+  free(input);
+  check("digest names", digest_parse("blake3") == DIGEST_BLAKE3 && digest_parse("sha1") == FAILED);
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}
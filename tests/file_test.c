@@ -1,12 +1,31 @@
 #include "../src/file.h"
 #include <openssl/md5.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 void print_hash(unsigned char hash[MD5_DIGEST_LENGTH]) {
   for (int i = 0; i < MD5_DIGEST_LENGTH; i++) {
     printf("%02x", hash[i]);
   }
 }
 
+// Generate a tfile of the sample with <threads> chunk hashers into <tdef>, with its own copy of the chunk hashes.
+bool hash_sample(uint32_t threads, uint8_t algorithm, tfile_def_t* tdef) {
+  htable_t alone;
+  init_htable(&alone);
+  set_hash_threads(threads);
+  char name[NAME_LEN] = "Hashers";
+  bool made = generate_tfile(&alone, tdef, "./tests/sample.txt", name, 16 * 1024, algorithm) == 0;
+  if (made) {
+    size_t size = tdef->num_chunks * MD5_DIGEST_LENGTH;
+    tdef->c_hashes = malloc(size);
+    memcpy(tdef->c_hashes, search_htable(&alone, tdef->f_hash)->tdef.c_hashes, size);
+  } else {
+    tdef->c_hashes = NULL;
+  }
+  free_htable(&alone);
+  return made;
+}
 
 int main() {
   htable_t ht;
@@ -15,18 +34,19 @@ int main() {
   // Creating a new tfile using a new file you already have ownership of.
   // Will return NULL if the hash is already in the table, or if it fails.
   tfile_def_t tf;
-  if (-1 == generate_tfile(&ht, &tf, "./tests/sample.txt", "Test for file setup")) {
+  if (-1 == generate_tfile(&ht, &tf, "./tests/sample.txt", "Test for file setup", 16 * 1024, DIGEST_MD5)) {
     printf("generating tfile failed");
   }
 
   // Print the information generated about the tfile.
   printf("%s\n", tf.name);
   printf("File size: %ld\n", tf.size);
+  printf("Chunks: %u of %u bytes\n", tf.num_chunks, tf.chunk_size);
   printf("File Hash: ");
   print_hash(tf.f_hash);
   printf("\n");
   printf("Chunk Hashes:\n");
-  for (int i = 0; i < NUM_CHUNKS; i++) {
+  for (int i = 0; i < tf.num_chunks; i++) {
     print_hash(tf.c_hashes[i]);
     printf("\n");
   }
@@ -45,26 +65,57 @@ int main() {
   }
 
   char c = *(char*)next_location;
-  printf("Verification result: %x\n", verify_tfile(&ht, tf.f_hash));
+  // verify_tfile fills in which chunks are good.
+  verified_chunks_t verified;
+  bool ok = verify_tfile(&ht, tf.f_hash, &verified);
+  printf("Verification result: %x (%u chunks)\n", ok, bitset_popcount(&verified));
+  free_bitset(&verified);
   *(char*)next_location = 'A';
   printf("Changed starting character of chunk %d to %c\n", next_chunk, *(char*)next_location);
-  printf("Verification result after edit: %x\n", verify_tfile(&ht, tf.f_hash));
+  // verify_tfile remembers the file was verified, only recheck_tfile hashes it again.
+  ok = verify_tfile(&ht, tf.f_hash, &verified);
+  printf("Cached result after edit: %x (%u chunks)\n", ok, bitset_popcount(&verified));
+  free_bitset(&verified);
+  ok = recheck_tfile(&ht, tf.f_hash, &verified);
+  printf("Verification result after edit: %x (%u chunks, chunk %d %s)\n", ok, bitset_popcount(&verified), next_chunk,
+         is_chunk_verified(&verified, next_chunk) ? "verified" : "bad");
+  free_bitset(&verified);
   *(char*)next_location = c;
   save_tfile(&ht, tf.f_hash);
 
   tfile_t* t = search_htable(&ht, tf.f_hash);
 
+  // Several chunk hashers, as on a machine with more cores, hash the same as one. Repeated, since hashers left
+  // waiting once every chunk is taken only hang some of the time.
+  for (uint8_t alg = 0; alg < DIGEST_COUNT; alg++) {
+    tfile_def_t one;
+    bool same = hash_sample(1, alg, &one);
+    for (int round = 0; round < 50 && same; round++) {
+      tfile_def_t several;
+      same = hash_sample(6, alg, &several) && memcmp(one.f_hash, several.f_hash, MD5_DIGEST_LENGTH) == 0 &&
+             memcmp(one.c_hashes, several.c_hashes, one.num_chunks * MD5_DIGEST_LENGTH) == 0;
+      free_tfile_def(&several);
+    }
+    free_tfile_def(&one);
+    printf("%s with several hashers: %s\n", digest_name(alg), same ? "same hashes" : "different hashes");
+  }
+  set_hash_threads(0);
+
 
 
   // Now test adding a tfile_def to the hash table.
   printf("\n");
 
+  // The hash table takes ownership of c_hashes.
   tfile_def_t tdef = {
     .name = "Empty file test",
     .f_hash = "0123456789abcde",
-    .c_hashes = {"qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg", "qwertyuiopasdfg"},
+    .chunk_size = CHUNK_SIZE_MIN,
+    .num_chunks = 1,
+    .c_hashes = malloc(MD5_DIGEST_LENGTH),
     .size = 1024
   };
+  memcpy(tdef.c_hashes[0], "qwertyuiopasdfg", MD5_DIGEST_LENGTH);
 
   unsigned char hash[MD5_DIGEST_LENGTH] = "0123456789abcde";
   tfile_t* tfd = add_tfile(&ht, tdef);
@@ -75,11 +126,11 @@ int main() {
   print_hash(tfd->tdef.f_hash);
   printf("\n");
   printf("Chunk Hashes:\n");
-  for (int i = 0; i < NUM_CHUNKS; i++) {
+  for (int i = 0; i < tfd->tdef.num_chunks; i++) {
     print_hash(tfd->tdef.c_hashes[i]);
     printf("\n");
   }
-  printf("Verification result: %02x\n", verify_tfile(&ht, hash));
+  printf("Verification result: %02x\n", verify_tfile(&ht, hash, NULL));
   printf("\n");
 
   // Testing the list_tfiles
@@ -93,7 +144,7 @@ int main() {
     print_hash(tfile_list[i].f_hash);
     printf("\n");
     printf("Chunk Hashes:\n");
-    for (int j = 0; j < NUM_CHUNKS; j++) {
+    for (int j = 0; j < tfile_list[i].num_chunks; j++) {
       print_hash(tfile_list[i].c_hashes[j]);
       printf("\n");
     }
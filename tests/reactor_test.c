@@ -0,0 +1,118 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/message.h"
+#include "../src/reactor.h"
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// What the reactor reported, guarded by lock.
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+int handled_fd = -1;
+int closed_fd = -1;
+
+void handle(int fd, message_info_t* info, void* data) {
+  pthread_mutex_lock(&lock);
+  handled_fd = fd;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+void on_close(int fd) {
+  pthread_mutex_lock(&lock);
+  closed_fd = fd;
+  pthread_cond_broadcast(&changed);
+  pthread_mutex_unlock(&lock);
+}
+
+// FILE_DATA payloads are streamed, and every one of them discarded.
+void* discard_begin(int fd, message_info_t* info, void* prefix) {
+  return NULL;
+}
+
+reactor_stream_t discard = {.prefix_size = 8, .begin = discard_begin};
+
+void write_message(int fd, message_type_t type, size_t size) {
+  message_info_t info = {.type = type, .size = size};
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  encode_message_info(&info, header);
+  write(fd, header, sizeof(header));
+  unsigned char* payload = calloc(1, size);
+  for (size_t done = 0; done < size;) {
+    ssize_t rc = write(fd, payload + done, size - done);
+    if (rc <= 0) {
+      break;
+    }
+    done += rc;
+  }
+  free(payload);
+}
+
+// Send a block the reactor discards over <ours>, then a message it hands over. Returns whether the second
+// message arrived on the reactor's side, <theirs>, without the connection closing.
+int drop_then_deliver(int ours, int theirs) {
+  pthread_mutex_lock(&lock);
+  handled_fd = -1;
+  closed_fd = -1;
+  pthread_mutex_unlock(&lock);
+  reactor_add(theirs);
+
+  write_message(ours, FILE_DATA, 3 * REACTOR_STREAM_PIECE + 100);
+  write_message(ours, ADDR_SELF, 4);
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += 5;
+  pthread_mutex_lock(&lock);
+  while (handled_fd != theirs && closed_fd != theirs) {
+    if (pthread_cond_timedwait(&changed, &lock, &deadline) != 0) {
+      break;
+    }
+  }
+  int ok = handled_fd == theirs && closed_fd != theirs;
+  pthread_mutex_unlock(&lock);
+  return ok;
+}
+
+int main() {
+  // a closed connection fails the check instead of killing the test
+  signal(SIGPIPE, SIG_IGN);
+  reactor_stream(FILE_DATA, &discard);
+  check("reactor starts", reactor_start(1, handle, on_close) == SUCCESS);
+
+  // Nodes on the same host talk over AF_UNIX, which cannot truncate.
+  int pair[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  check("dropped block over AF_UNIX", drop_then_deliver(pair[1], pair[0]));
+  close(pair[1]);
+
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t addr_len = sizeof(addr);
+  bind(listener, (struct sockaddr*)&addr, addr_len);
+  listen(listener, 1);
+  getsockname(listener, (struct sockaddr*)&addr, &addr_len);
+  int ours = socket(AF_INET, SOCK_STREAM, 0);
+  connect(ours, (struct sockaddr*)&addr, addr_len);
+  int theirs = accept(listener, NULL, NULL);
+  check("dropped block over TCP", drop_then_deliver(ours, theirs));
+  close(ours);
+  close(listener);
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/message.h"
+#include "../src/sched.h"
+
+#define BLOCK 16384
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+unsigned char hash[MD5_DIGEST_LENGTH] = {1, 2, 3};
+
+// A download of one chunk of <blocks> blocks, which every peer in <peers> advertised.
+void start(sched_t* sched, avail_t* avail, int depth, uint32_t endgame, uint32_t blocks, const int* peers, int count) {
+  init_sched(sched, BLOCK, 10000, depth, endgame);
+  init_avail(avail);
+  uint8_t done[1] = {0};
+  sched_add(sched, hash, (uint64_t)blocks * BLOCK, blocks * BLOCK, 1, done);
+  for (int i = 0; i < count; i++) {
+    avail_add(avail, peers[i], hash, 0);
+  }
+}
+
+int load(sched_t* sched, int peer) {
+  return peer < sched->peer_load_size ? sched->peer_load[peer] : 0;
+}
+
+sched_block_t* block(sched_t* sched, int b) {
+  return &sched->downloads->chunks[0].blocks[b];
+}
+
+int next(sched_t* sched, avail_t* avail, sched_request_t* requests, int max) {
+  long wait_ms;
+  return sched_next(sched, avail, hash, false, requests, max, &wait_ms);
+}
+
+void test_next() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5};
+  start(&sched, &avail, 16, 0, 4, peers, 1);
+  sched_request_t requests[8];
+  int n = next(&sched, &avail, requests, 8);
+  int ok = n == 4;
+  for (int i = 0; ok && i < n; i++) {
+    ok = requests[i].peer == 5 && requests[i].size == BLOCK && requests[i].offset % BLOCK == 0;
+  }
+  check("every block is asked of the holder", ok);
+  check("blocks in flight are not picked again", next(&sched, &avail, requests, 8) == 0);
+  check("blocks in flight count on the holder", load(&sched, 5) == 4 && sched_stats(&sched).in_flight == 4);
+  free_avail(&avail);
+}
+
+void test_depth() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5};
+  start(&sched, &avail, 2, 0, 4, peers, 1);
+  sched_request_t requests[8];
+  check("a holder is asked for at most depth blocks", next(&sched, &avail, requests, 8) == 2);
+  check("held back blocks are counted", sched_stats(&sched).capped > 0);
+  sched_arrived(&sched, hash, 0, requests[0].offset, BLOCK, 5, true, NULL, NULL);
+  check("an arrival makes room for another block", next(&sched, &avail, requests, 8) == 1);
+  free_avail(&avail);
+}
+
+void test_arrived() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5};
+  start(&sched, &avail, 16, 0, 2, peers, 1);
+  sched_request_t requests[8];
+  next(&sched, &avail, requests, 8);
+  check("a block missing from a chunk is wanted", sched_wanted(&sched, hash, 0, 0, BLOCK));
+  check("a chunk with blocks missing is not verified",
+        sched_arrived(&sched, hash, 0, 0, BLOCK, 5, true, NULL, NULL) == 0);
+  check("a block which arrived is not wanted", !sched_wanted(&sched, hash, 0, 0, BLOCK));
+  check("the last block of a chunk has it verified",
+        sched_arrived(&sched, hash, 0, BLOCK, BLOCK, 5, true, NULL, NULL) == 1);
+  check("arrivals free the holder", load(&sched, 5) == 0 && sched_stats(&sched).in_flight == 0);
+
+  unsigned char other[MD5_DIGEST_LENGTH] = {9};
+  check("arrivals of unknown downloads fail",
+        sched_arrived(&sched, other, 0, 0, BLOCK, 5, true, NULL, NULL) == FAILED);
+  free_avail(&avail);
+}
+
+void test_broken() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5};
+  start(&sched, &avail, 16, 0, 1, peers, 1);
+  sched_request_t requests[8];
+  next(&sched, &avail, requests, 8);
+  check("a broken block is not verified", sched_arrived(&sched, hash, 0, 0, BLOCK, 5, false, NULL, NULL) == 0);
+  check("a broken block is missing again", block(&sched, 0)->state == BLOCK_MISSING && load(&sched, 5) == 0);
+  check("a broken block is picked again", next(&sched, &avail, requests, 8) == 1);
+  free_avail(&avail);
+}
+
+void test_withdraw() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5};
+  start(&sched, &avail, 16, 0, 1, peers, 1);
+  sched_request_t requests[8];
+  next(&sched, &avail, requests, 8);
+  check("withdrawing a request succeeds", sched_withdraw(&sched, hash, &requests[0]) == SUCCESS);
+  check("a withdrawn block is missing again", block(&sched, 0)->state == BLOCK_MISSING && load(&sched, 5) == 0);
+  check("a withdrawn block is picked again", next(&sched, &avail, requests, 8) == 1);
+  free_avail(&avail);
+}
+
+void test_endgame() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5, 6, 7};
+  start(&sched, &avail, 16, 8, 1, peers, 3);
+  // every run adds one more copy of the blocks in flight
+  sched_request_t requests[8];
+  int n = 0;
+  for (int picked = 1; picked > 0 && n < 8; n += picked) {
+    picked = next(&sched, &avail, requests + n, 8 - n);
+  }
+  int distinct = n == 3;
+  for (int i = 0; distinct && i < n; i++) {
+    for (int j = i + 1; j < n; j++) {
+      distinct = distinct && requests[i].peer != requests[j].peer;
+    }
+  }
+  check("the endgame asks every holder once", distinct && block(&sched, 0)->copies == 3);
+  check("endgame copies are counted", sched_stats(&sched).endgame == 2);
+
+  // one copy breaking off leaves the others in flight
+  sched_arrived(&sched, hash, 0, 0, BLOCK, 6, false, NULL, NULL);
+  check("a broken copy drops only its peer",
+        block(&sched, 0)->state == BLOCK_IN_FLIGHT && block(&sched, 0)->copies == 2 && load(&sched, 6) == 0 &&
+            load(&sched, 5) == 1 && load(&sched, 7) == 1);
+
+  // so does a withdrawn one
+  sched_request_t withdrawn = {.chunk = 0, .offset = 0, .size = BLOCK, .peer = 7};
+  sched_withdraw(&sched, hash, &withdrawn);
+  check("a withdrawn copy drops only its peer",
+        block(&sched, 0)->state == BLOCK_IN_FLIGHT && block(&sched, 0)->copies == 1 && load(&sched, 7) == 0 &&
+            load(&sched, 5) == 1);
+
+  check("the first copy to arrive has the chunk verified",
+        sched_arrived(&sched, hash, 0, 0, BLOCK, 5, true, NULL, NULL) == 1);
+  check("copies arriving after it are duplicates", !sched_touch(&sched, hash, 0, 0, BLOCK, BLOCK));
+  check("nothing is left in flight", load(&sched, 5) == 0 && sched_stats(&sched).in_flight == 0);
+  free_avail(&avail);
+}
+
+void test_endgame_cancel() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5, 6};
+  start(&sched, &avail, 16, 8, 1, peers, 2);
+  sched_request_t requests[8];
+  next(&sched, &avail, requests, 8);
+  next(&sched, &avail, requests, 8);
+  sched_request_t cancels[SCHED_MAX_CANCELS];
+  int cancelled;
+  sched_arrived(&sched, hash, 0, 0, BLOCK, 6, true, cancels, &cancelled);
+  check("an arrival cancels the other copies", load(&sched, 5) == 0 && load(&sched, 6) == 0);
+  check("the peers of cancelled copies are reported", cancelled == 1 && cancels[0].peer == 5 &&
+                                                          cancels[0].offset == 0 && cancels[0].size == BLOCK);
+  check("an arrival from the last copy asked is verified", block(&sched, 0)->state == BLOCK_RECEIVED);
+  free_avail(&avail);
+}
+
+void test_remove_peer() {
+  sched_t sched;
+  avail_t avail;
+  int peers[] = {5, 6};
+  start(&sched, &avail, 16, 8, 1, peers, 2);
+  sched_request_t requests[8];
+  next(&sched, &avail, requests, 8);
+  next(&sched, &avail, requests, 8);
+  sched_remove_peer(&sched, 5);
+  check("a peer going away drops only its copy",
+        block(&sched, 0)->state == BLOCK_IN_FLIGHT && block(&sched, 0)->copies == 1 && load(&sched, 6) == 1);
+  sched_remove_peer(&sched, 6);
+  check("the last copy going away has the block missing", block(&sched, 0)->state == BLOCK_MISSING);
+  free_avail(&avail);
+}
+
+int main() {
+  test_next();
+  test_depth();
+  test_arrived();
+  test_broken();
+  test_withdraw();
+  test_endgame();
+  test_endgame_cancel();
+  test_remove_peer();
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/message.h"
+#include "../src/wire.h"
+
+int failures = 0;
+
+void check(const char* name, int ok) {
+  printf("%s: %s\n", ok ? "OK  " : "FAIL", name);
+  if (!ok) {
+    failures++;
+  }
+}
+
+// Compares every field, and the chunk hashes behind the pointer.
+int same_tdef(const tfile_def_t* a, const tfile_def_t* b) {
+  return strcmp(a->name, b->name) == 0 && memcmp(a->f_hash, b->f_hash, MD5_DIGEST_LENGTH) == 0 && a->size == b->size &&
+         a->chunk_size == b->chunk_size && a->num_chunks == b->num_chunks && a->algorithm == b->algorithm &&
+         memcmp(a->c_hashes, b->c_hashes, (size_t)a->num_chunks * MD5_DIGEST_LENGTH) == 0;
+}
+
+int main() {
+  // Message headers are 8 bytes, big endian, and carry the wire version.
+  message_info_t info = {.type = FILE_DATA, .flags = 0x0102, .size = 0x0A0B0C0D};
+  unsigned char header[MESSAGE_HEADER_SIZE];
+  encode_message_info(&info, header);
+  unsigned char expected[MESSAGE_HEADER_SIZE] = {WIRE_VERSION, FILE_DATA, 0x01, 0x02, 0x0A, 0x0B, 0x0C, 0x0D};
+  check("header layout", memcmp(header, expected, MESSAGE_HEADER_SIZE) == 0);
+
+  message_info_t decoded;
+  check("header decodes", decode_message_info(header, &decoded) == SUCCESS);
+  check("header round trip", decoded.type == info.type && decoded.flags == info.flags && decoded.size == info.size);
+
+  header[0] = WIRE_VERSION + 1;
+  check("other versions rejected", decode_message_info(header, &decoded) == FAILED);
+  for (int version = 1; version < WIRE_VERSION; version++) {
+    header[0] = version;
+    check("older version rejected", decode_message_info(header, &decoded) == FAILED);
+  }
+
+  // Old builds sent a raw struct that starts with the type byte.
+  header[0] = TFILE_DEF;
+  check("raw struct headers rejected", decode_message_info(header, &decoded) == FAILED);
+
+  // tfile definitions
+  unsigned char c_hashes[4][MD5_DIGEST_LENGTH];
+  for (int i = 0; i < 4; i++) {
+    memset(c_hashes[i], i, MD5_DIGEST_LENGTH);
+  }
+  tfile_def_t tdef = {.name = "sample.txt", .size = 1000000, .chunk_size = 262144, .num_chunks = 4, .c_hashes = c_hashes,
+                      .algorithm = DIGEST_BLAKE3};
+  memset(tdef.f_hash, 0xAB, MD5_DIGEST_LENGTH);
+  unsigned char tbuf[TFILE_DEF_WIRE_SIZE(4) + 4];
+  check("tfile size", encode_tfile_def(&tdef, tbuf) == TFILE_DEF_WIRE_SIZE(4));
+  tfile_def_t tdec;
+  check("tfile decodes", decode_tfile_def(tbuf, TFILE_DEF_WIRE_SIZE(4), &tdec) == SUCCESS);
+  check("tfile round trip", same_tdef(&tdec, &tdef));
+  free_tfile_def(&tdec);
+  check("tfile short payload rejected", decode_tfile_def(tbuf, TFILE_DEF_LEGACY_SIZE(4) - 1, &tdec) == FAILED);
+  check("tfile without algorithm decodes",
+        decode_tfile_def(tbuf, TFILE_DEF_LEGACY_SIZE(4), &tdec) == SUCCESS && tdec.algorithm == DIGEST_MD5);
+  free_tfile_def(&tdec);
+  tbuf[TFILE_DEF_LEGACY_SIZE(4)] = DIGEST_COUNT;
+  check("tfile unknown algorithm rejected", decode_tfile_def(tbuf, TFILE_DEF_WIRE_SIZE(4), &tdec) == FAILED);
+  encode_tfile_def(&tdef, tbuf);
+  check("tfile extension fields ignored", decode_tfile_def(tbuf, sizeof(tbuf), &tdec) == SUCCESS);
+  free_tfile_def(&tdec);
+  tdef.num_chunks = 3;
+  encode_tfile_def(&tdef, tbuf);
+  check("tfile bad chunk layout rejected", decode_tfile_def(tbuf, sizeof(tbuf), &tdec) == FAILED);
+  tdef.num_chunks = 4;
+
+  // tfile batches, whose records differ in size
+  tfile_def_t batch[3] = {tdef, tdef, tdef};
+  batch[1].f_hash[0] = 1;
+  batch[1].size = 1000;
+  batch[1].num_chunks = 1;
+  batch[2].f_hash[0] = 2;
+  size_t bsize;
+  check("batch fits", tfile_batch_fit(batch, 3, &bsize) == 3 &&
+                          bsize == TFILE_BATCH_HEADER_SIZE + 3 * TFILE_RECORD_HEADER_SIZE + 2 * TFILE_DEF_WIRE_SIZE(4) + TFILE_DEF_WIRE_SIZE(1));
+  unsigned char* bbuf = malloc(bsize);
+  announce_t announce = {.origin = 0xFEEDFACECAFEBEEFULL, .hops = 3};
+  check("batch size", encode_tfile_batch(batch, 3, &announce, bbuf) == bsize);
+  tfile_def_t* bdec = NULL;
+  announce_t adec;
+  check("batch decodes", decode_tfile_batch(bbuf, bsize, &bdec, &adec) == 3);
+  check("batch round trip", same_tdef(&bdec[0], &batch[0]) && same_tdef(&bdec[1], &batch[1]) && same_tdef(&bdec[2], &batch[2]));
+  check("batch origin round trip", adec.origin == announce.origin && adec.hops == 3);
+  for (int i = 0; i < 3; i++) {
+    free_tfile_def(&bdec[i]);
+  }
+  free(bdec);
+  check("truncated batch rejected", decode_tfile_batch(bbuf, bsize - 1, &bdec, &adec) == FAILED);
+  free(bbuf);
+
+  // a definition too big for a batch still goes, on its own
+  tfile_def_t big = tdef;
+  big.num_chunks = TFILE_BATCH_MAX_BYTES / MD5_DIGEST_LENGTH;
+  tfile_def_t pair[2] = {big, tdef};
+  check("oversized definition sent alone", tfile_batch_fit(pair, 2, &bsize) == 1);
+
+  // chunk requests
+  chunk_request_t req = {.request_id = 0x0123456789ABCDEFULL, .chunk_index = 5, .offset = 65536, .size = 16384, .ttl = 3,
+                         .accepts = ACCEPT_ZLIB};
+  memset(req.file_hash, 0xCD, MD5_DIGEST_LENGTH);
+  req.return_addr.sin_family = AF_INET;
+  req.return_addr.sin_port = htons(4242);
+  req.return_addr.sin_addr.s_addr = htonl(0x7F000001);
+  unsigned char rbuf[CHUNK_REQUEST_WIRE_SIZE];
+  check("request size", encode_chunk_request(&req, rbuf) == CHUNK_REQUEST_WIRE_SIZE);
+  chunk_request_t rdec;
+  check("request decodes", decode_chunk_request(rbuf, sizeof(rbuf), &rdec) == SUCCESS);
+  check("request round trip",
+        memcmp(rdec.file_hash, req.file_hash, MD5_DIGEST_LENGTH) == 0 && rdec.chunk_index == 5 && rdec.ttl == 3 &&
+            rdec.accepts == ACCEPT_ZLIB &&
+            rdec.offset == 65536 && rdec.size == 16384 &&
+            rdec.request_id == req.request_id &&
+            rdec.return_addr.sin_port == htons(4242) && rdec.return_addr.sin_addr.s_addr == htonl(0x7F000001));
+
+  // catalog summaries and hash lists
+  static catalog_summary_t summary, sdec;
+  summary.prefix = (catalog_prefix_t){.len = 2, .bytes = {0xAB, 0xCD}};
+  summary.count[7] = 42;
+  memset(summary.xor[7], 0x5A, MD5_DIGEST_LENGTH);
+  static unsigned char sbuf[CATALOG_SUMMARY_WIRE_SIZE(2)];
+  check("summary size", encode_catalog_summary(&summary, sbuf) == sizeof(sbuf));
+  check("summary decodes", decode_catalog_summary(sbuf, sizeof(sbuf), &sdec) == SUCCESS);
+  check("summary round trip", memcmp(&sdec, &summary, sizeof(summary)) == 0);
+  check("truncated summary rejected", decode_catalog_summary(sbuf, sizeof(sbuf) - 1, &sdec) == FAILED);
+
+  unsigned char have[2][MD5_DIGEST_LENGTH];
+  memset(have, 0x11, sizeof(have));
+  unsigned char hbuf[CATALOG_HAVE_WIRE_SIZE(2, 2)];
+  check("have size", encode_catalog_have(&summary.prefix, have, 2, hbuf) == sizeof(hbuf));
+  catalog_prefix_t hprefix;
+  const unsigned char* hdec;
+  check("have decodes", decode_catalog_have(hbuf, sizeof(hbuf), &hprefix, &hdec) == 2);
+  check("have round trip", hprefix.len == 2 && hprefix.bytes[1] == 0xCD && memcmp(hdec, have, sizeof(have)) == 0);
+  check("oversized prefix rejected", decode_catalog_prefix((unsigned char[]){MD5_DIGEST_LENGTH + 1}, 1, &hprefix) == FAILED);
+
+  // chunk availability
+  unsigned char fhash[MD5_DIGEST_LENGTH];
+  memset(fhash, 0x5A, MD5_DIGEST_LENGTH);
+  uint8_t bits[2] = {0xA0, 0x80};
+  unsigned char abuf[HAVE_BITFIELD_WIRE_SIZE(9)];
+  check("bitfield size", encode_have_bitfield(fhash, bits, 9, abuf) == sizeof(abuf));
+  unsigned char adec_hash[MD5_DIGEST_LENGTH];
+  const uint8_t* abits;
+  check("bitfield decodes", decode_have_bitfield(abuf, sizeof(abuf), adec_hash, &abits) == 9);
+  check("bitfield round trip", memcmp(adec_hash, fhash, MD5_DIGEST_LENGTH) == 0 && memcmp(abits, bits, 2) == 0);
+  check("truncated bitfield rejected", decode_have_bitfield(abuf, sizeof(abuf) - 1, adec_hash, &abits) == FAILED);
+  unsigned char cbuf[HAVE_CHUNK_WIRE_SIZE];
+  uint32_t cdec;
+  check("have chunk size", encode_have_chunk(fhash, 6, cbuf) == HAVE_CHUNK_WIRE_SIZE);
+  check("have chunk round trip", decode_have_chunk(cbuf, sizeof(cbuf), adec_hash, &cdec) == SUCCESS && cdec == 6);
+
+  // discovery beacons
+  unsigned char beacon[BEACON_WIRE_SIZE];
+  uint64_t beacon_id;
+  uint16_t beacon_port;
+  check("beacon size", encode_beacon(0x0102030405060708ull, 4242, beacon) == BEACON_WIRE_SIZE);
+  check("beacon round trip", decode_beacon(beacon, sizeof(beacon), &beacon_id, &beacon_port) == SUCCESS &&
+                                 beacon_id == 0x0102030405060708ull && beacon_port == 4242);
+  check("truncated beacon rejected", decode_beacon(beacon, sizeof(beacon) - 1, &beacon_id, &beacon_port) == FAILED);
+  beacon[0] ^= 0xff;
+  check("foreign datagram rejected", decode_beacon(beacon, sizeof(beacon), &beacon_id, &beacon_port) == FAILED);
+
+  // chunk payload headers
+  chunk_payload_t hdr = {.chunk_index = 7, .offset = 3 * 65536, .size = 1000000};
+  memset(hdr.file_hash, 0xEF, MD5_DIGEST_LENGTH);
+  unsigned char pbuf[CHUNK_PAYLOAD_WIRE_SIZE];
+  check("payload size", encode_chunk_payload(&hdr, pbuf) == CHUNK_PAYLOAD_WIRE_SIZE);
+  chunk_payload_t pdec;
+  check("payload decodes", decode_chunk_payload(pbuf, sizeof(pbuf), &pdec) == SUCCESS);
+  check("payload round trip", memcmp(&pdec, &hdr, sizeof(hdr)) == 0);
+
+  printf("%d failures\n", failures);
+  return failures != 0;
+}